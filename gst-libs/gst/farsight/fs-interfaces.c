@@ -313,6 +313,88 @@ fs_interfaces_get_local_ips (gboolean include_loopback)
 
 #endif /* HAVE_GETIFADDRS */
 
+/**
+ * fs_interfaces_get_local_ips6:
+ * @include_loopback: Include any loopback devices
+ *
+ * Get a list of local ipv6 interface addresses. Global addresses come first,
+ * then unique local addresses. Link-local addresses are never returned since
+ * they are useless without a scope.
+ *
+ * Returns: a newly-allocated #GList of strings. The caller must free it.
+ */
+
+#ifdef HAVE_GETIFADDRS
+
+GList *
+fs_interfaces_get_local_ips6 (gboolean include_loopback)
+{
+  GList *ips = NULL;
+  struct sockaddr_in6 *sa;
+  struct ifaddrs *ifa, *results;
+  gchar *loopback = NULL;
+  gchar buf[INET6_ADDRSTRLEN];
+
+
+  if (getifaddrs (&results) < 0)
+      return NULL;
+
+  for (ifa = results; ifa; ifa = ifa->ifa_next)
+  {
+    /* no ip address from interface that is down */
+    if ((ifa->ifa_flags & IFF_UP) == 0)
+      continue;
+
+    if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET6)
+      continue;
+
+    sa = (struct sockaddr_in6 *) ifa->ifa_addr;
+
+    if (IN6_IS_ADDR_LINKLOCAL (&sa->sin6_addr) ||
+        IN6_IS_ADDR_V4MAPPED (&sa->sin6_addr))
+      continue;
+
+    if (!inet_ntop (AF_INET6, &sa->sin6_addr, buf, sizeof (buf)))
+      continue;
+
+    GST_DEBUG ("Interface:  %s", ifa->ifa_name);
+    GST_DEBUG ("IP Address: %s", buf);
+    if ((ifa->ifa_flags & IFF_LOOPBACK) == IFF_LOOPBACK)
+    {
+      if (include_loopback && !loopback)
+        loopback = g_strdup (buf);
+      else
+        GST_DEBUG ("Ignoring loopback interface");
+    }
+    else
+    {
+      /* fc00::/7 unique local addresses are the v6 private addresses */
+      if ((sa->sin6_addr.s6_addr[0] & 0xfe) == 0xfc)
+        ips = g_list_append (ips, g_strdup (buf));
+      else
+        ips = g_list_prepend (ips, g_strdup (buf));
+    }
+  }
+
+  freeifaddrs (results);
+
+  if (loopback)
+    ips = g_list_append (ips, loopback);
+
+  return ips;
+}
+
+#else /* ! HAVE_GETIFADDRS */
+
+GList *
+fs_interfaces_get_local_ips6 (gboolean include_loopback)
+{
+  GST_DEBUG ("Listing the IPv6 addresses needs getifaddrs()");
+  return NULL;
+}
+
+#endif /* HAVE_GETIFADDRS */
+
 
 /**
  * fs_interfaces_get_ip_for_interface:
@@ -520,6 +602,12 @@ win32_get_ip_for_interface (IF_INDEX idx)
   return ret;
 }
 
+GList * fs_interfaces_get_local_ips6 (gboolean include_loopback)
+{
+  /* GetIpAddrTable() only knows about IPv4 */
+  return NULL;
+}
+
 gchar * fs_interfaces_get_ip_for_interface (gchar *interface_name)
 {
   ULONG size = 0;
@@ -28,6 +28,7 @@ G_BEGIN_DECLS
 
 gchar * fs_interfaces_get_ip_for_interface (gchar *interface_name);
 GList * fs_interfaces_get_local_ips (gboolean include_loopback);
+GList * fs_interfaces_get_local_ips6 (gboolean include_loopback);
 GList * fs_interfaces_get_local_interfaces (void);
 
 G_END_DECLS
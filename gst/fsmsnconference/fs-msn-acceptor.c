@@ -0,0 +1,505 @@
+/*
+ * Farsight2 - Farsight MSN Acceptor
+ *
+ * fs-msn-acceptor.c - Listening sockets shared by the MSN streams
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The acceptor keeps one listening socket per port for the whole life of the
+ * conference, every stream that wants that port shares it. Accepted
+ * connections are not tied to a stream until the peer has sent its
+ * recipientid and sessionid, they are then handed to the stream that
+ * registered these ids once the handshake has completed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs-msn-acceptor.h"
+
+#include "fs-msn-conference.h"
+#include "fs-msn-handshake.h"
+
+#include <gst/gst.h>
+#include <gst/farsight/fs-conference-iface.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define GST_CAT_DEFAULT fsmsnconference_debug
+
+typedef struct
+{
+  gint fd;
+  guint16 port;
+  guint watch;
+} Listener;
+
+typedef struct
+{
+  guint recipientid;
+  guint sessionid;
+  guint handshake_timeout;
+  FsMsnAcceptorFunc func;
+  gpointer user_data;
+} Recipient;
+
+struct _FsMsnAcceptor
+{
+  FsMsnReactor *reactor;
+
+  /* Recursive so that the callbacks can add and remove recipients */
+  GStaticRecMutex mutex;
+  gboolean closing;
+
+  /* port -> Listener */
+  GHashTable *listeners;
+  /* The port used by streams that don't ask for one, 0 if none yet */
+  guint16 default_port;
+
+  /* Used for the handshakes while no recipient is registered */
+  guint handshake_timeout;
+
+  /* Recipient -> Recipient */
+  GHashTable *recipients;
+
+  GList *handshakes;
+};
+
+static guint
+recipient_hash (gconstpointer key)
+{
+  const Recipient *recipient = key;
+
+  return recipient->recipientid * 31 + recipient->sessionid;
+}
+
+static gboolean
+recipient_equal (gconstpointer a, gconstpointer b)
+{
+  const Recipient *recipient_a = a;
+  const Recipient *recipient_b = b;
+
+  return recipient_a->recipientid == recipient_b->recipientid &&
+    recipient_a->sessionid == recipient_b->sessionid;
+}
+
+static void
+recipient_free (gpointer data)
+{
+  g_slice_free (Recipient, data);
+}
+
+static Recipient *
+fs_msn_acceptor_lookup_locked (FsMsnAcceptor *self, guint recipientid,
+                               guint sessionid)
+{
+  Recipient key;
+
+  key.recipientid = recipientid;
+  key.sessionid = sessionid;
+
+  return g_hash_table_lookup (self->recipients, &key);
+}
+
+static void
+max_handshake_timeout (gpointer key, gpointer value, gpointer user_data)
+{
+  Recipient *recipient = value;
+  guint *timeout = user_data;
+
+  *timeout = MAX (*timeout, recipient->handshake_timeout);
+}
+
+/*
+ * The ids are only known after the peer sent them, so give every incoming
+ * connection the longest handshake timeout of the registered recipients
+ */
+static guint
+fs_msn_acceptor_get_handshake_timeout_locked (FsMsnAcceptor *self)
+{
+  guint timeout = 0;
+
+  g_hash_table_foreach (self->recipients, max_handshake_timeout, &timeout);
+
+  return timeout ? timeout : self->handshake_timeout;
+}
+
+static gboolean
+fs_msn_acceptor_auth_cb (FsMsnHandshake *handshake,
+                         guint recipientid,
+                         guint sessionid,
+                         gpointer user_data)
+{
+  FsMsnAcceptor *self = user_data;
+  gboolean known;
+
+  g_static_rec_mutex_lock (&self->mutex);
+  known = (fs_msn_acceptor_lookup_locked (self, recipientid, sessionid) !=
+           NULL);
+  g_static_rec_mutex_unlock (&self->mutex);
+
+  return known;
+}
+
+static void
+fs_msn_acceptor_handshake_done (FsMsnHandshake *handshake,
+                                gboolean success,
+                                gpointer user_data)
+{
+  FsMsnAcceptor *self = user_data;
+  Recipient *recipient;
+
+  g_static_rec_mutex_lock (&self->mutex);
+
+  /* Once closing, the handshakes belong to fs_msn_acceptor_free() */
+  if (self->closing || !g_list_find (self->handshakes, handshake))
+    {
+      g_static_rec_mutex_unlock (&self->mutex);
+      return;
+    }
+
+  self->handshakes = g_list_remove (self->handshakes, handshake);
+
+  /* The stream may have gone away during the handshake */
+  if (success)
+    {
+      recipient = fs_msn_acceptor_lookup_locked (self,
+          fs_msn_handshake_get_recipientid (handshake),
+          fs_msn_handshake_get_sessionid (handshake));
+
+      /* The stream can not remove itself while we hold the mutex */
+      if (recipient && recipient->func (fs_msn_handshake_get_fd (handshake),
+                                        recipient->user_data))
+        fs_msn_handshake_steal_fd (handshake);
+    }
+
+  fs_msn_handshake_free (handshake);
+
+  g_static_rec_mutex_unlock (&self->mutex);
+}
+
+static gboolean
+fs_msn_acceptor_accept_cb (gint listen_fd, GIOCondition cond, gpointer data)
+{
+  FsMsnAcceptor *self = data;
+  struct sockaddr_in in;
+  socklen_t n;
+  gint fd;
+
+  g_static_rec_mutex_lock (&self->mutex);
+
+  if (self->closing)
+    {
+      g_static_rec_mutex_unlock (&self->mutex);
+      return TRUE;
+    }
+
+  if (!(cond & G_IO_IN))
+    {
+      GST_WARNING ("Error condition %d on listening socket %d", cond,
+                   listen_fd);
+      g_static_rec_mutex_unlock (&self->mutex);
+      return TRUE;
+    }
+
+  /* The listening socket is non-blocking, take all pending connections */
+  for (;;)
+    {
+      n = sizeof (in);
+      fd = accept (listen_fd, (struct sockaddr *) &in, &n);
+      if (fd < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            GST_WARNING ("Error while running accept(): %s",
+                         g_strerror (errno));
+          break;
+        }
+
+      GST_DEBUG ("Accepted connection from %s:%d on fd %d",
+                 inet_ntoa (in.sin_addr), ntohs (in.sin_port), fd);
+
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+      self->handshakes = g_list_prepend (self->handshakes,
+          fs_msn_handshake_new_incoming (self->reactor, fd,
+              fs_msn_acceptor_get_handshake_timeout_locked (self),
+              fs_msn_acceptor_auth_cb, fs_msn_acceptor_handshake_done,
+              self));
+    }
+
+  g_static_rec_mutex_unlock (&self->mutex);
+
+  return TRUE;
+}
+
+static Listener *
+fs_msn_acceptor_open_listener_locked (FsMsnAcceptor *self, guint16 port,
+                                      GError **error)
+{
+  Listener *listener;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof (addr);
+  gint one = 1;
+  gint fd;
+
+  if ((fd = socket (PF_INET, SOCK_STREAM, 0)) < 0)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
+                   "Could not create listening socket: %s",
+                   g_strerror (errno));
+      return NULL;
+    }
+
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+  /* Don't let connections from a previous conference in TIME_WAIT prevent us
+   * from listening on the same port again. */
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_ANY);
+  addr.sin_port = htons (port);
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
+                   "Could not bind to port %u: %s", port, g_strerror (errno));
+      close (fd);
+      return NULL;
+    }
+
+  if (listen (fd, SOMAXCONN) < 0)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
+                   "Could not listen on port %u: %s", port,
+                   g_strerror (errno));
+      close (fd);
+      return NULL;
+    }
+
+  if (getsockname (fd, (struct sockaddr *) &addr, &addr_len) < 0)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
+                   "Could not get the listening port: %s", g_strerror (errno));
+      close (fd);
+      return NULL;
+    }
+
+  listener = g_slice_new0 (Listener);
+  listener->fd = fd;
+  listener->port = ntohs (addr.sin_port);
+  listener->watch = fs_msn_reactor_add_watch (self->reactor, fd,
+                    G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                    fs_msn_acceptor_accept_cb, self);
+
+  g_hash_table_insert (self->listeners, GUINT_TO_POINTER (listener->port),
+                       listener);
+
+  GST_DEBUG ("Listening on port %u", listener->port);
+
+  return listener;
+}
+
+/**
+ * fs_msn_acceptor_new:
+ * @reactor: The #FsMsnReactor that drives the sockets
+ * @handshake_timeout: the time in seconds allowed for the handshake of the
+ *  incoming connections while no recipient is registered
+ *
+ * Creates a new acceptor, it doesn't listen on any port until
+ * fs_msn_acceptor_listen() is called.
+ *
+ * Returns: a new #FsMsnAcceptor
+ */
+FsMsnAcceptor *
+fs_msn_acceptor_new (FsMsnReactor *reactor, guint handshake_timeout)
+{
+  FsMsnAcceptor *self = g_slice_new0 (FsMsnAcceptor);
+
+  self->reactor = reactor;
+  self->handshake_timeout = handshake_timeout;
+  g_static_rec_mutex_init (&self->mutex);
+  self->listeners = g_hash_table_new (g_direct_hash, g_direct_equal);
+  self->recipients = g_hash_table_new_full (recipient_hash, recipient_equal,
+                                            NULL, recipient_free);
+
+  return self;
+}
+
+static void
+close_listener (gpointer key, gpointer value, gpointer user_data)
+{
+  FsMsnAcceptor *self = user_data;
+  Listener *listener = value;
+
+  fs_msn_reactor_remove (self->reactor, listener->watch);
+  close (listener->fd);
+  g_slice_free (Listener, listener);
+}
+
+/**
+ * fs_msn_acceptor_free:
+ * @acceptor: a #FsMsnAcceptor
+ *
+ * Closes the listening sockets and the connections that are still being
+ * authenticated. Must not be called from the reactor thread.
+ */
+void
+fs_msn_acceptor_free (FsMsnAcceptor *acceptor)
+{
+  GList *handshakes, *item;
+
+  g_static_rec_mutex_lock (&acceptor->mutex);
+  acceptor->closing = TRUE;
+  handshakes = acceptor->handshakes;
+  acceptor->handshakes = NULL;
+  g_static_rec_mutex_unlock (&acceptor->mutex);
+
+  /* Removing the watches waits for the callbacks, which take the mutex */
+  g_hash_table_foreach (acceptor->listeners, close_listener, acceptor);
+  g_hash_table_destroy (acceptor->listeners);
+
+  for (item = handshakes; item; item = g_list_next (item))
+    fs_msn_handshake_free (item->data);
+  g_list_free (handshakes);
+
+  g_hash_table_destroy (acceptor->recipients);
+  g_static_rec_mutex_free (&acceptor->mutex);
+
+  g_slice_free (FsMsnAcceptor, acceptor);
+}
+
+/**
+ * fs_msn_acceptor_listen:
+ * @acceptor: a #FsMsnAcceptor
+ * @port: the port to listen on, or 0 for the port shared by all the streams
+ *  that don't need a specific one
+ * @error: location of a #GError, or NULL if no error occured
+ *
+ * Makes sure that the acceptor listens on @port. The sockets stay open until
+ * the acceptor is freed.
+ *
+ * Returns: the port listened on, 0 on error
+ */
+guint16
+fs_msn_acceptor_listen (FsMsnAcceptor *acceptor,
+                        guint16 port,
+                        GError **error)
+{
+  Listener *listener = NULL;
+  guint16 ret = 0;
+
+  g_static_rec_mutex_lock (&acceptor->mutex);
+
+  if (!port)
+    port = acceptor->default_port;
+
+  if (port)
+    listener = g_hash_table_lookup (acceptor->listeners,
+                                    GUINT_TO_POINTER (port));
+
+  if (!listener)
+    listener = fs_msn_acceptor_open_listener_locked (acceptor, port, error);
+
+  if (listener)
+    {
+      if (!acceptor->default_port)
+        acceptor->default_port = listener->port;
+      ret = listener->port;
+    }
+
+  g_static_rec_mutex_unlock (&acceptor->mutex);
+
+  return ret;
+}
+
+/**
+ * fs_msn_acceptor_add_recipient:
+ * @acceptor: a #FsMsnAcceptor
+ * @recipientid: the recipient id the peer will send
+ * @sessionid: the session id the peer will send
+ * @handshake_timeout: the time in seconds the peer is allowed to take to
+ *  authenticate
+ * @func: called from the reactor thread with the authenticated connection
+ * @user_data: passed to @func
+ *
+ * Registers the ids of a stream, connections to any of the listening ports
+ * that authenticate with them are handed to @func. As the ids are not known
+ * before the handshake, incoming connections get the longest
+ * @handshake_timeout of all the registered recipients.
+ */
+void
+fs_msn_acceptor_add_recipient (FsMsnAcceptor *acceptor,
+                               guint recipientid,
+                               guint sessionid,
+                               guint handshake_timeout,
+                               FsMsnAcceptorFunc func,
+                               gpointer user_data)
+{
+  Recipient *recipient = g_slice_new (Recipient);
+
+  recipient->recipientid = recipientid;
+  recipient->sessionid = sessionid;
+  recipient->handshake_timeout = handshake_timeout;
+  recipient->func = func;
+  recipient->user_data = user_data;
+
+  g_static_rec_mutex_lock (&acceptor->mutex);
+  if (fs_msn_acceptor_lookup_locked (acceptor, recipientid, sessionid))
+    GST_WARNING ("Recipientid %u and sessionid %u are already in use",
+                 recipientid, sessionid);
+  g_hash_table_replace (acceptor->recipients, recipient, recipient);
+  g_static_rec_mutex_unlock (&acceptor->mutex);
+}
+
+/**
+ * fs_msn_acceptor_remove_recipient:
+ * @acceptor: a #FsMsnAcceptor
+ * @recipientid: the recipient id passed to fs_msn_acceptor_add_recipient()
+ * @sessionid: the session id passed to fs_msn_acceptor_add_recipient()
+ * @user_data: the user data passed to fs_msn_acceptor_add_recipient()
+ *
+ * Unregisters the ids of a stream. Once this returns, its callback is not
+ * running and will not be called anymore, so this must not be called with a
+ * lock held that the callback takes.
+ */
+void
+fs_msn_acceptor_remove_recipient (FsMsnAcceptor *acceptor,
+                                  guint recipientid,
+                                  guint sessionid,
+                                  gpointer user_data)
+{
+  Recipient *recipient;
+
+  g_static_rec_mutex_lock (&acceptor->mutex);
+  recipient = fs_msn_acceptor_lookup_locked (acceptor, recipientid,
+                                             sessionid);
+  if (recipient && recipient->user_data == user_data)
+    g_hash_table_remove (acceptor->recipients, recipient);
+  g_static_rec_mutex_unlock (&acceptor->mutex);
+}
@@ -0,0 +1,63 @@
+/*
+ * Farsight2 - Farsight MSN Acceptor
+ *
+ * fs-msn-acceptor.h - Listening sockets shared by the MSN streams
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_MSN_ACCEPTOR_H__
+#define __FS_MSN_ACCEPTOR_H__
+
+#include <glib.h>
+
+#include "fs-msn-reactor.h"
+
+G_BEGIN_DECLS
+
+/* Private declaration */
+typedef struct _FsMsnAcceptor FsMsnAcceptor;
+
+/*
+ * Called from the reactor thread with an authenticated connection, return
+ * FALSE to refuse it, the acceptor then closes it.
+ */
+typedef gboolean (*FsMsnAcceptorFunc) (gint fd,
+                                       gpointer user_data);
+
+FsMsnAcceptor *fs_msn_acceptor_new (FsMsnReactor *reactor,
+                                    guint handshake_timeout);
+
+void fs_msn_acceptor_free (FsMsnAcceptor *acceptor);
+
+guint16 fs_msn_acceptor_listen (FsMsnAcceptor *acceptor,
+                                guint16 port,
+                                GError **error);
+
+void fs_msn_acceptor_add_recipient (FsMsnAcceptor *acceptor,
+                                    guint recipientid,
+                                    guint sessionid,
+                                    guint handshake_timeout,
+                                    FsMsnAcceptorFunc func,
+                                    gpointer user_data);
+
+void fs_msn_acceptor_remove_recipient (FsMsnAcceptor *acceptor,
+                                       guint recipientid,
+                                       guint sessionid,
+                                       gpointer user_data);
+
+G_END_DECLS
+
+#endif /* __FS_MSN_ACCEPTOR_H__ */
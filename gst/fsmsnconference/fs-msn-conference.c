@@ -36,6 +36,8 @@
 #include "fs-msn-session.h"
 #include "fs-msn-stream.h"
 #include "fs-msn-participant.h"
+#include "fs-msn-reactor.h"
+#include "fs-msn-acceptor.h"
 
 #include <string.h>
 
@@ -90,6 +92,9 @@ struct _FsMsnConferencePrivate
     GList *sessions;
     guint max_session_id;
     GList *participants;
+    /* Created on first use, shared by all the streams */
+    FsMsnReactor *reactor;
+    FsMsnAcceptor *acceptor;
   };
 
 static void fs_msn_conference_do_init (GType type);
@@ -176,6 +181,13 @@ fs_msn_conference_dispose (GObject * object)
 static void
 fs_msn_conference_finalize (GObject * object)
 {
+  FsMsnConference *self = FS_MSN_CONFERENCE (object);
+
+  /* The streams hold a reference, so none of them is left */
+  if (self->priv->acceptor)
+    fs_msn_acceptor_free (self->priv->acceptor);
+  if (self->priv->reactor)
+    fs_msn_reactor_free (self->priv->reactor);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -278,6 +290,62 @@ fs_msn_conference_set_property (GObject *object,
 }
 
 
+/**
+ * fs_msn_conference_get_reactor
+ * @self: The #FsMsnConference
+ * @error: location of a #GError, or NULL if no error occured
+ *
+ * Gets the #FsMsnReactor that drives the sockets of all the streams of this
+ * conference, it is created on the first call.
+ *
+ * Return value: The #FsMsnReactor (owned by the conference) or NULL on error
+ */
+FsMsnReactor *
+fs_msn_conference_get_reactor (FsMsnConference *self, GError **error)
+{
+  FsMsnReactor *reactor;
+
+  GST_OBJECT_LOCK (self);
+  if (!self->priv->reactor)
+    self->priv->reactor = fs_msn_reactor_new (error);
+  reactor = self->priv->reactor;
+  GST_OBJECT_UNLOCK (self);
+
+  return reactor;
+}
+
+/**
+ * fs_msn_conference_get_acceptor
+ * @self: The #FsMsnConference
+ * @handshake_timeout: the handshake timeout of the acceptor if it is created,
+ *  see fs_msn_acceptor_new()
+ * @error: location of a #GError, or NULL if no error occured
+ *
+ * Gets the #FsMsnAcceptor that owns the listening sockets of this conference,
+ * it is created on the first call.
+ *
+ * Return value: The #FsMsnAcceptor (owned by the conference) or NULL on error
+ */
+FsMsnAcceptor *
+fs_msn_conference_get_acceptor (FsMsnConference *self,
+                                guint handshake_timeout,
+                                GError **error)
+{
+  FsMsnReactor *reactor = fs_msn_conference_get_reactor (self, error);
+  FsMsnAcceptor *acceptor;
+
+  if (!reactor)
+    return NULL;
+
+  GST_OBJECT_LOCK (self);
+  if (!self->priv->acceptor)
+    self->priv->acceptor = fs_msn_acceptor_new (reactor, handshake_timeout);
+  acceptor = self->priv->acceptor;
+  GST_OBJECT_UNLOCK (self);
+
+  return acceptor;
+}
+
 /**
  * fs_msn_conference_get_session_by_id_locked
  * @self: The #FsMsnConference
@@ -27,6 +27,9 @@
 
 #include <gst/farsight/fs-base-conference.h>
 
+#include "fs-msn-reactor.h"
+#include "fs-msn-acceptor.h"
+
 G_BEGIN_DECLS
 
 #define FS_TYPE_MSN_CONFERENCE \
@@ -62,6 +65,13 @@ struct _FsMsnConferenceClass
 
 GType fs_msn_conference_get_type (void);
 
+FsMsnReactor *fs_msn_conference_get_reactor (FsMsnConference *self,
+                                             GError **error);
+
+FsMsnAcceptor *fs_msn_conference_get_acceptor (FsMsnConference *self,
+                                               guint handshake_timeout,
+                                               GError **error);
+
 
 GST_DEBUG_CATEGORY_EXTERN (fsmsnconference_debug);
 
@@ -0,0 +1,1060 @@
+/*
+ * Farsight2 - Farsight MSN Frame Sink
+ *
+ * fs-msn-frame-sink.c - Sink writing MSN webcam frames to a socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:element-fsmsnframesink
+ * @short_description: Writes MSN webcam frames to a socket
+ *
+ * Writes the frames produced by mimenc to a connected socket. mimenc pushes
+ * the frame header and the frame payload as two buffers, they are kept
+ * together and written with a single writev() call so that they don't go
+ * out as separate small segments.
+ *
+ * The socket is used in non-blocking mode and the streaming thread never
+ * waits for it. What the socket can not take yet is queued, up to
+ * #FsMsnFrameSink:max-queued-bytes. When #FsMsnFrameSink:reactor is set, the
+ * queue is written from the reactor thread as soon as the socket accepts more
+ * data, otherwise it is written along with the next frame.
+ * When the queue is full, the new frame is dropped as a whole, keyframes are
+ * allowed to use twice that space. After a drop, the following frames are
+ * dropped until the next keyframe, as they can not be decoded anyway. For
+ * the same reason, nothing is sent before the first keyframe.
+ *
+ * When #FsMsnFrameSink:ignore-errors is set, a socket error is only posted as
+ * a warning and the following frames are dropped, so that a sink in one
+ * branch of a tee never stops the others.
+ *
+ * #FsMsnFrameSink:backlog-latency estimates how long the data that is
+ * waiting, in the queue and in the kernel send buffer, will take to reach
+ * the peer at the rate the peer has been acknowledging data. While it is over
+ * #FsMsnFrameSink:max-latency, the frames are dropped as if the queue was
+ * full, so a late peer only loses frames of its own.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "fs-msn-frame-sink.h"
+#include "fs-msn-frame-src.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#if !defined (SIOCOUTQ) && defined (TIOCOUTQ)
+#define SIOCOUTQ TIOCOUTQ
+#endif
+
+GST_DEBUG_CATEGORY_STATIC (fs_msn_frame_sink_debug);
+#define GST_CAT_DEFAULT fs_msn_frame_sink_debug
+
+#define DEFAULT_FD -1
+#define DEFAULT_MAX_QUEUED_BYTES (128 * 1024)
+#define DEFAULT_IGNORE_ERRORS FALSE
+#define DEFAULT_MAX_LATENCY 0
+
+/* How long we try to get the queued frames out on EOS, in milliseconds */
+#define EOS_FLUSH_TIMEOUT 1000
+
+/* Each frame uses at most two iovecs */
+#define MAX_IOV 64
+
+/* How often the send rate is sampled */
+#define RATE_PERIOD (100 * GST_MSECOND)
+
+/* Reported when there is a backlog but nothing was ever acknowledged */
+#define MAX_BACKLOG_LATENCY (60 * GST_SECOND)
+
+/* props */
+enum
+{
+  PROP_0,
+  PROP_FD,
+  PROP_REACTOR,
+  PROP_MAX_QUEUED_BYTES,
+  PROP_IGNORE_ERRORS,
+  PROP_MAX_LATENCY,
+  PROP_QUEUED_BYTES,
+  PROP_STALL_TIME,
+  PROP_BYTES_SENT,
+  PROP_FRAMES_SENT,
+  PROP_FRAMES_DROPPED,
+  PROP_WRITE_CALLS,
+  PROP_SEND_RATE,
+  PROP_BACKLOG_LATENCY
+};
+
+typedef struct
+{
+  GstBuffer *buffers[2];
+  guint n_buffers;
+  guint size;
+} QueuedFrame;
+
+static GstStaticPadTemplate fs_msn_frame_sink_template =
+  GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+
+#define _do_init(bla) \
+    GST_DEBUG_CATEGORY_INIT (fs_msn_frame_sink_debug, "fsmsnframesink", 0, \
+        "fsmsnframesink element");
+
+GST_BOILERPLATE_FULL (FsMsnFrameSink, fs_msn_frame_sink, GstBaseSink,
+  GST_TYPE_BASE_SINK, _do_init);
+
+
+static void fs_msn_frame_sink_finalize (GObject *object);
+static void fs_msn_frame_sink_set_property (GObject *object,
+    guint prop_id, const GValue *value, GParamSpec *pspec);
+static void fs_msn_frame_sink_get_property (GObject *object,
+    guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean fs_msn_frame_sink_start (GstBaseSink *bsink);
+static gboolean fs_msn_frame_sink_stop (GstBaseSink *bsink);
+static gboolean fs_msn_frame_sink_unlock (GstBaseSink *bsink);
+static gboolean fs_msn_frame_sink_unlock_stop (GstBaseSink *bsink);
+static gboolean fs_msn_frame_sink_event (GstBaseSink *bsink,
+    GstEvent *event);
+static GstFlowReturn fs_msn_frame_sink_render (GstBaseSink *bsink,
+    GstBuffer *buffer);
+
+static gboolean fs_msn_frame_sink_writable_cb (gint fd,
+    GIOCondition condition, gpointer user_data);
+
+
+static void
+fs_msn_frame_sink_base_init (gpointer g_class)
+{
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "Farsight MSN webcam frame sink",
+      "Sink/Network",
+      "Writes MSN webcam frames to a socket without blocking",
+      "Farsight developers");
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&fs_msn_frame_sink_template));
+}
+
+static void
+fs_msn_frame_sink_class_init (FsMsnFrameSinkClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstBaseSinkClass *gstbasesink_class = GST_BASE_SINK_CLASS (klass);
+
+  gobject_class->finalize = fs_msn_frame_sink_finalize;
+  gobject_class->set_property = fs_msn_frame_sink_set_property;
+  gobject_class->get_property = fs_msn_frame_sink_get_property;
+
+  gstbasesink_class->start = GST_DEBUG_FUNCPTR (fs_msn_frame_sink_start);
+  gstbasesink_class->stop = GST_DEBUG_FUNCPTR (fs_msn_frame_sink_stop);
+  gstbasesink_class->unlock = GST_DEBUG_FUNCPTR (fs_msn_frame_sink_unlock);
+  gstbasesink_class->unlock_stop =
+    GST_DEBUG_FUNCPTR (fs_msn_frame_sink_unlock_stop);
+  gstbasesink_class->event = GST_DEBUG_FUNCPTR (fs_msn_frame_sink_event);
+  gstbasesink_class->render = GST_DEBUG_FUNCPTR (fs_msn_frame_sink_render);
+
+  g_object_class_install_property (gobject_class,
+      PROP_FD,
+      g_param_spec_int ("fd",
+          "File descriptor",
+          "The connected socket to write the frames to",
+          -1, G_MAXINT, DEFAULT_FD,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_REACTOR,
+      g_param_spec_pointer ("reactor",
+          "Reactor",
+          "The FsMsnReactor that writes the queued frames when the socket"
+          " becomes writable, set it before starting the element",
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_MAX_QUEUED_BYTES,
+      g_param_spec_uint ("max-queued-bytes",
+          "Maximum queued bytes",
+          "Frames are dropped when more than this many bytes are waiting"
+          " for the socket",
+          0, G_MAXUINT, DEFAULT_MAX_QUEUED_BYTES,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_IGNORE_ERRORS,
+      g_param_spec_boolean ("ignore-errors",
+          "Ignore errors",
+          "Post socket errors as warnings and drop the following frames"
+          " instead of stopping the data flow",
+          DEFAULT_IGNORE_ERRORS,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_MAX_LATENCY,
+      g_param_spec_uint64 ("max-latency",
+          "Maximum latency",
+          "Frames are dropped until the next keyframe while the backlog"
+          " takes more than this many nanoseconds to reach the peer"
+          " (0 to disable)",
+          0, G_MAXUINT64, DEFAULT_MAX_LATENCY,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_QUEUED_BYTES,
+      g_param_spec_uint ("queued-bytes",
+          "Queued bytes",
+          "Number of bytes waiting for the socket to accept them",
+          0, G_MAXUINT, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_STALL_TIME,
+      g_param_spec_uint64 ("stall-time",
+          "Stall time",
+          "Total time in nanoseconds during which the socket could not"
+          " accept all the queued data",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_BYTES_SENT,
+      g_param_spec_uint64 ("bytes-sent",
+          "Bytes sent",
+          "Number of bytes written to the socket since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_FRAMES_SENT,
+      g_param_spec_uint64 ("frames-sent",
+          "Frames sent",
+          "Number of frames completely written since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_FRAMES_DROPPED,
+      g_param_spec_uint64 ("frames-dropped",
+          "Frames dropped",
+          "Number of frames dropped because the socket could not keep up",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_WRITE_CALLS,
+      g_param_spec_uint64 ("write-calls",
+          "Write calls",
+          "Number of writev() system calls made since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_SEND_RATE,
+      g_param_spec_uint64 ("send-rate",
+          "Send rate",
+          "Estimated rate at which the peer receives data, in bytes per second",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_BACKLOG_LATENCY,
+      g_param_spec_uint64 ("backlog-latency",
+          "Backlog latency",
+          "Estimated time in nanoseconds before the data written now reaches"
+          " the peer",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+}
+
+static void
+fs_msn_frame_sink_init (FsMsnFrameSink *self, FsMsnFrameSinkClass *g_class)
+{
+  self->fd = DEFAULT_FD;
+  self->max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+  self->ignore_errors = DEFAULT_IGNORE_ERRORS;
+  self->max_latency = DEFAULT_MAX_LATENCY;
+  self->control_sock[0] = -1;
+  self->control_sock[1] = -1;
+  self->watch_fd = -1;
+  self->queue_mutex = g_mutex_new ();
+  self->stall_start = GST_CLOCK_TIME_NONE;
+  g_queue_init (&self->queue);
+
+  gst_base_sink_set_sync (GST_BASE_SINK (self), FALSE);
+  g_object_set (self, "async", FALSE, NULL);
+}
+
+static void
+fs_msn_frame_sink_finalize (GObject *object)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (object);
+
+  g_mutex_free (self->queue_mutex);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+fs_msn_frame_sink_set_property (GObject *object,
+    guint prop_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (object);
+
+  switch (prop_id)
+    {
+      case PROP_FD:
+        GST_OBJECT_LOCK (self);
+        self->fd = g_value_get_int (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+      case PROP_REACTOR:
+        GST_OBJECT_LOCK (self);
+        self->reactor = g_value_get_pointer (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+      case PROP_MAX_QUEUED_BYTES:
+        GST_OBJECT_LOCK (self);
+        self->max_queued_bytes = g_value_get_uint (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+      case PROP_IGNORE_ERRORS:
+        GST_OBJECT_LOCK (self);
+        self->ignore_errors = g_value_get_boolean (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+      case PROP_MAX_LATENCY:
+        GST_OBJECT_LOCK (self);
+        self->max_latency = g_value_get_uint64 (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+fs_msn_frame_sink_get_property (GObject *object,
+    guint prop_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+    {
+      case PROP_FD:
+        g_value_set_int (value, self->fd);
+        break;
+      case PROP_REACTOR:
+        g_value_set_pointer (value, self->reactor);
+        break;
+      case PROP_MAX_QUEUED_BYTES:
+        g_value_set_uint (value, self->max_queued_bytes);
+        break;
+      case PROP_IGNORE_ERRORS:
+        g_value_set_boolean (value, self->ignore_errors);
+        break;
+      case PROP_MAX_LATENCY:
+        g_value_set_uint64 (value, self->max_latency);
+        break;
+      case PROP_QUEUED_BYTES:
+        g_value_set_uint (value, self->queued_bytes);
+        break;
+      case PROP_STALL_TIME:
+        g_value_set_uint64 (value, self->stall_time);
+        break;
+      case PROP_BYTES_SENT:
+        g_value_set_uint64 (value, self->bytes_sent);
+        break;
+      case PROP_FRAMES_SENT:
+        g_value_set_uint64 (value, self->frames_sent);
+        break;
+      case PROP_FRAMES_DROPPED:
+        g_value_set_uint64 (value, self->frames_dropped);
+        break;
+      case PROP_WRITE_CALLS:
+        g_value_set_uint64 (value, self->write_calls);
+        break;
+      case PROP_SEND_RATE:
+        g_value_set_uint64 (value, self->send_rate);
+        break;
+      case PROP_BACKLOG_LATENCY:
+        g_value_set_uint64 (value, self->backlog_latency);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static void
+queued_frame_free (QueuedFrame *frame)
+{
+  guint i;
+
+  for (i = 0; i < frame->n_buffers; i++)
+    gst_buffer_unref (frame->buffers[i]);
+  g_slice_free (QueuedFrame, frame);
+}
+
+/*
+ * Only wait for the socket to be writable while something is queued, the
+ * queue lock must be held
+ */
+static void
+fs_msn_frame_sink_update_watch (FsMsnFrameSink *self)
+{
+  if (self->watch_id)
+    fs_msn_reactor_set_watch_condition (self->reactor, self->watch_id,
+        g_queue_is_empty (&self->queue) ? 0 : G_IO_OUT);
+}
+
+/*
+ * Drops the queued frames, a frame that was partially written is kept unless
+ * @all is set, as dropping it would corrupt the stream
+ */
+static void
+fs_msn_frame_sink_clear (FsMsnFrameSink *self, gboolean all)
+{
+  QueuedFrame *partial = NULL;
+  QueuedFrame *frame;
+
+  if (!all && self->head_offset)
+    partial = g_queue_pop_head (&self->queue);
+  else
+    self->head_offset = 0;
+
+  while ((frame = g_queue_pop_head (&self->queue)))
+    queued_frame_free (frame);
+
+  if (partial)
+    g_queue_push_head (&self->queue, partial);
+  else
+    self->stall_start = GST_CLOCK_TIME_NONE;
+
+  if (self->pending_header)
+    gst_buffer_unref (self->pending_header);
+  self->pending_header = NULL;
+
+  GST_OBJECT_LOCK (self);
+  self->queued_bytes = partial ? partial->size - self->head_offset : 0;
+  GST_OBJECT_UNLOCK (self);
+
+  fs_msn_frame_sink_update_watch (self);
+}
+
+static gboolean
+fs_msn_frame_sink_start (GstBaseSink *bsink)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (bsink);
+
+  if (self->fd < 0)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, (NULL),
+          ("No socket was set on the \"fd\" property"));
+      return FALSE;
+    }
+
+  if (fcntl (self->fd, F_SETFL, fcntl (self->fd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, (NULL),
+          ("Could not make the socket non-blocking: %s", g_strerror (errno)));
+      return FALSE;
+    }
+
+  if (pipe (self->control_sock) < 0)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, (NULL),
+          ("Could not create control pipe: %s", g_strerror (errno)));
+      return FALSE;
+    }
+  fcntl (self->control_sock[0], F_SETFL, O_NONBLOCK);
+  fcntl (self->control_sock[1], F_SETFL, O_NONBLOCK);
+
+  GST_OBJECT_LOCK (self);
+  self->stall_time = 0;
+  self->bytes_sent = 0;
+  self->frames_sent = 0;
+  self->frames_dropped = 0;
+  self->write_calls = 0;
+  self->send_rate = 0;
+  self->rate_time = GST_CLOCK_TIME_NONE;
+  self->rate_delivered = 0;
+  self->backlog_latency = 0;
+  GST_OBJECT_UNLOCK (self);
+
+  self->wait_keyframe = TRUE;
+  self->failed = FALSE;
+  self->write_error = FALSE;
+
+  if (self->reactor)
+    {
+      self->watch_fd = dup (self->fd);
+      if (self->watch_fd >= 0)
+        self->watch_id = fs_msn_reactor_add_watch (self->reactor,
+            self->watch_fd, 0, fs_msn_frame_sink_writable_cb, self);
+
+      if (!self->watch_id)
+        GST_WARNING_OBJECT (self, "Could not watch the socket, the queue"
+            " will only be written along with the next frame");
+    }
+
+  return TRUE;
+}
+
+static gboolean
+fs_msn_frame_sink_stop (GstBaseSink *bsink)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (bsink);
+  guint watch_id;
+
+  g_mutex_lock (self->queue_mutex);
+  watch_id = self->watch_id;
+  self->watch_id = 0;
+  g_mutex_unlock (self->queue_mutex);
+
+  /* Waits for a running callback, which takes the queue lock */
+  if (watch_id)
+    fs_msn_reactor_remove (self->reactor, watch_id);
+  if (self->watch_fd >= 0)
+    close (self->watch_fd);
+  self->watch_fd = -1;
+
+  g_mutex_lock (self->queue_mutex);
+  fs_msn_frame_sink_clear (self, TRUE);
+  g_mutex_unlock (self->queue_mutex);
+
+  if (self->control_sock[0] >= 0)
+    close (self->control_sock[0]);
+  if (self->control_sock[1] >= 0)
+    close (self->control_sock[1]);
+  self->control_sock[0] = -1;
+  self->control_sock[1] = -1;
+
+  return TRUE;
+}
+
+static gboolean
+fs_msn_frame_sink_unlock (GstBaseSink *bsink)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (bsink);
+  const gchar c = 'x';
+
+  if (write (self->control_sock[1], &c, 1) < 0 && errno != EAGAIN)
+    GST_WARNING_OBJECT (self, "Could not wake up the streaming thread: %s",
+        g_strerror (errno));
+
+  return TRUE;
+}
+
+static gboolean
+fs_msn_frame_sink_unlock_stop (GstBaseSink *bsink)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (bsink);
+  gchar buf[16];
+
+  while (read (self->control_sock[0], buf, sizeof (buf)) > 0);
+
+  return TRUE;
+}
+
+static void
+fs_msn_frame_sink_set_cork (FsMsnFrameSink *self, gboolean cork)
+{
+#ifdef TCP_CORK
+  gint val = cork;
+
+  if (setsockopt (self->fd, IPPROTO_TCP, TCP_CORK, &val, sizeof (val)) < 0)
+    GST_DEBUG_OBJECT (self, "Could not set TCP_CORK to %d: %s", val,
+        g_strerror (errno));
+#endif
+}
+
+static void
+fs_msn_frame_sink_stall_end (FsMsnFrameSink *self)
+{
+  if (!GST_CLOCK_TIME_IS_VALID (self->stall_start))
+    return;
+
+  GST_OBJECT_LOCK (self);
+  self->stall_time += gst_util_get_timestamp () - self->stall_start;
+  GST_OBJECT_UNLOCK (self);
+
+  self->stall_start = GST_CLOCK_TIME_NONE;
+}
+
+/*
+ * Writes as much of the queue as the socket accepts without blocking
+ */
+static GstFlowReturn
+fs_msn_frame_sink_flush (FsMsnFrameSink *self)
+{
+  gboolean corked = FALSE;
+  gboolean ignore_errors;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  while (!g_queue_is_empty (&self->queue))
+    {
+      struct iovec iov[MAX_IOV];
+      guint n_iov = 0;
+      gsize to_write = 0;
+      guint skip = self->head_offset;
+      gssize written;
+      GList *item;
+
+      for (item = self->queue.head;
+           item && n_iov + 2 <= MAX_IOV;
+           item = g_list_next (item))
+        {
+          QueuedFrame *frame = item->data;
+          guint i;
+
+          for (i = 0; i < frame->n_buffers; i++)
+            {
+              GstBuffer *buf = frame->buffers[i];
+
+              if (skip >= GST_BUFFER_SIZE (buf))
+                {
+                  skip -= GST_BUFFER_SIZE (buf);
+                  continue;
+                }
+
+              iov[n_iov].iov_base = GST_BUFFER_DATA (buf) + skip;
+              iov[n_iov].iov_len = GST_BUFFER_SIZE (buf) - skip;
+              to_write += iov[n_iov].iov_len;
+              n_iov++;
+              skip = 0;
+            }
+        }
+
+      /* More than one writev() is needed, don't let the tail of this one go
+       * out as a small segment */
+      if (item && !corked)
+        {
+          fs_msn_frame_sink_set_cork (self, TRUE);
+          corked = TRUE;
+        }
+
+      do {
+        written = writev (self->fd, iov, n_iov);
+      } while (written < 0 && errno == EINTR);
+
+      GST_OBJECT_LOCK (self);
+      self->write_calls++;
+      GST_OBJECT_UNLOCK (self);
+
+      if (written < 0)
+        {
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+              if (!GST_CLOCK_TIME_IS_VALID (self->stall_start))
+                self->stall_start = gst_util_get_timestamp ();
+              break;
+            }
+
+          GST_OBJECT_LOCK (self);
+          ignore_errors = self->ignore_errors;
+          GST_OBJECT_UNLOCK (self);
+
+          if (ignore_errors)
+            {
+              GST_ELEMENT_WARNING (self, RESOURCE, WRITE, (NULL),
+                  ("writev() failed: %s", g_strerror (errno)));
+              self->failed = TRUE;
+              fs_msn_frame_sink_clear (self, TRUE);
+              break;
+            }
+
+          GST_ELEMENT_ERROR (self, RESOURCE, WRITE, (NULL),
+              ("writev() failed: %s", g_strerror (errno)));
+          ret = GST_FLOW_ERROR;
+          break;
+        }
+
+      GST_OBJECT_LOCK (self);
+      self->bytes_sent += written;
+      self->queued_bytes -= written;
+      GST_OBJECT_UNLOCK (self);
+
+      self->head_offset += written;
+      while (!g_queue_is_empty (&self->queue))
+        {
+          QueuedFrame *frame = g_queue_peek_head (&self->queue);
+
+          if (self->head_offset < frame->size)
+            break;
+
+          self->head_offset -= frame->size;
+          queued_frame_free (g_queue_pop_head (&self->queue));
+
+          GST_OBJECT_LOCK (self);
+          self->frames_sent++;
+          GST_OBJECT_UNLOCK (self);
+        }
+
+      /* The socket buffer is full */
+      if ((gsize) written < to_write)
+        {
+          if (!GST_CLOCK_TIME_IS_VALID (self->stall_start))
+            self->stall_start = gst_util_get_timestamp ();
+          break;
+        }
+    }
+
+  if (corked)
+    fs_msn_frame_sink_set_cork (self, FALSE);
+
+  if (g_queue_is_empty (&self->queue))
+    fs_msn_frame_sink_stall_end (self);
+
+  if (ret == GST_FLOW_OK)
+    fs_msn_frame_sink_update_watch (self);
+
+  return ret;
+}
+
+/*
+ * Updates the send rate and backlog latency estimates, the data that left the
+ * queue but is still in the kernel send buffer counts as backlog.
+ */
+static void
+fs_msn_frame_sink_update_latency (FsMsnFrameSink *self)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+  guint64 delivered;
+  guint64 backlog;
+  gint outq = 0;
+
+#ifdef SIOCOUTQ
+  if (ioctl (self->fd, SIOCOUTQ, &outq) < 0)
+    outq = 0;
+#endif
+
+  GST_OBJECT_LOCK (self);
+
+  delivered = self->bytes_sent > (guint64) outq ?
+    self->bytes_sent - outq : 0;
+
+  if (!GST_CLOCK_TIME_IS_VALID (self->rate_time))
+    {
+      self->rate_time = now;
+      self->rate_delivered = delivered;
+    }
+  else if (now - self->rate_time >= RATE_PERIOD)
+    {
+      guint64 sample = 0;
+
+      if (delivered > self->rate_delivered)
+        sample = gst_util_uint64_scale (delivered - self->rate_delivered,
+            GST_SECOND, now - self->rate_time);
+
+      /* Only sample while there is something to send, an idle link says
+       * nothing about its capacity */
+      if (sample || self->queued_bytes || outq)
+        {
+          if (self->send_rate)
+            self->send_rate = (7 * self->send_rate + sample) / 8;
+          else
+            self->send_rate = sample;
+        }
+
+      self->rate_time = now;
+      self->rate_delivered = MAX (delivered, self->rate_delivered);
+    }
+
+  backlog = self->queued_bytes + outq;
+  if (!backlog)
+    self->backlog_latency = 0;
+  else if (!self->send_rate)
+    self->backlog_latency = MAX_BACKLOG_LATENCY;
+  else
+    self->backlog_latency = MIN (MAX_BACKLOG_LATENCY,
+        gst_util_uint64_scale (backlog, GST_SECOND, self->send_rate));
+
+  GST_OBJECT_UNLOCK (self);
+}
+
+static gboolean
+fs_msn_frame_sink_is_header (GstBuffer *buffer)
+{
+  guint8 *data = GST_BUFFER_DATA (buffer);
+
+  return GST_BUFFER_SIZE (buffer) == FS_MSN_FRAME_HEADER_SIZE &&
+    GST_READ_UINT16_LE (data) == FS_MSN_FRAME_HEADER_SIZE &&
+    !memcmp (data + 12, FS_MSN_FRAME_FOURCC, 4) &&
+    GST_READ_UINT32_LE (data + 8) > 0;
+}
+
+/*
+ * The encoded frame starts with a libmimic header in which the 32 bit word
+ * at offset 12 is set for P-frames
+ */
+static gboolean
+fs_msn_frame_sink_is_keyframe (QueuedFrame *frame)
+{
+  GstBuffer *payload = frame->buffers[frame->n_buffers - 1];
+  guint offset = 0;
+
+  if (frame->n_buffers == 1)
+    {
+      if (GST_BUFFER_SIZE (payload) < FS_MSN_FRAME_HEADER_SIZE ||
+          GST_READ_UINT16_LE (GST_BUFFER_DATA (payload)) !=
+          FS_MSN_FRAME_HEADER_SIZE)
+        return TRUE;
+      offset = FS_MSN_FRAME_HEADER_SIZE;
+    }
+
+  /* Not something we understand, don't hold it back */
+  if (GST_BUFFER_SIZE (payload) < offset + 16)
+    return TRUE;
+
+  return GST_READ_UINT32_LE (GST_BUFFER_DATA (payload) + offset + 12) == 0;
+}
+
+static GstFlowReturn
+fs_msn_frame_sink_render_locked (FsMsnFrameSink *self, GstBuffer *buffer)
+{
+  QueuedFrame *frame;
+  guint max_queued_bytes;
+  guint queued_bytes;
+  gboolean keyframe;
+  gboolean late;
+  GstFlowReturn ret;
+
+  /* The error was posted from the reactor thread */
+  if (self->write_error)
+    return GST_FLOW_ERROR;
+
+  if (self->failed)
+    return GST_FLOW_OK;
+
+  /* Wait for the payload that goes with this header */
+  if (!self->pending_header && fs_msn_frame_sink_is_header (buffer))
+    {
+      self->pending_header = gst_buffer_ref (buffer);
+      return GST_FLOW_OK;
+    }
+
+  frame = g_slice_new0 (QueuedFrame);
+  if (self->pending_header)
+    {
+      frame->buffers[frame->n_buffers++] = self->pending_header;
+      frame->size += GST_BUFFER_SIZE (self->pending_header);
+      self->pending_header = NULL;
+    }
+  frame->buffers[frame->n_buffers++] = gst_buffer_ref (buffer);
+  frame->size += GST_BUFFER_SIZE (buffer);
+
+  keyframe = fs_msn_frame_sink_is_keyframe (frame);
+
+  /* Make room first, whatever the socket takes now does not count */
+  ret = fs_msn_frame_sink_flush (self);
+  if (ret != GST_FLOW_OK || self->failed)
+    {
+      queued_frame_free (frame);
+      return ret;
+    }
+
+  fs_msn_frame_sink_update_latency (self);
+
+  GST_OBJECT_LOCK (self);
+  max_queued_bytes = self->max_queued_bytes;
+  queued_bytes = self->queued_bytes;
+  /* Until the peer acknowledged something, the latency is only a guess */
+  late = self->max_latency && self->send_rate &&
+    self->backlog_latency > self->max_latency;
+  GST_OBJECT_UNLOCK (self);
+
+  if (keyframe)
+    max_queued_bytes *= 2;
+
+  if ((self->wait_keyframe && !keyframe) || late ||
+      (!g_queue_is_empty (&self->queue) &&
+          queued_bytes + frame->size > max_queued_bytes))
+    {
+      GST_LOG_OBJECT (self, "Dropping %s of %u bytes, %u bytes queued%s",
+          keyframe ? "keyframe" : "frame", frame->size, queued_bytes,
+          late ? ", the peer is late" : "");
+      queued_frame_free (frame);
+      self->wait_keyframe = TRUE;
+
+      GST_OBJECT_LOCK (self);
+      self->frames_dropped++;
+      GST_OBJECT_UNLOCK (self);
+
+      return GST_FLOW_OK;
+    }
+
+  self->wait_keyframe = FALSE;
+  g_queue_push_tail (&self->queue, frame);
+
+  GST_OBJECT_LOCK (self);
+  self->queued_bytes += frame->size;
+  GST_OBJECT_UNLOCK (self);
+
+  ret = fs_msn_frame_sink_flush (self);
+
+  fs_msn_frame_sink_update_latency (self);
+
+  return ret;
+}
+
+static GstFlowReturn
+fs_msn_frame_sink_render (GstBaseSink *bsink, GstBuffer *buffer)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (bsink);
+  GstFlowReturn ret;
+
+  g_mutex_lock (self->queue_mutex);
+  ret = fs_msn_frame_sink_render_locked (self, buffer);
+  g_mutex_unlock (self->queue_mutex);
+
+  return ret;
+}
+
+/*
+ * Called from the reactor thread when the socket accepts data again
+ */
+static gboolean
+fs_msn_frame_sink_writable_cb (gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+  FsMsnFrameSink *self = user_data;
+  gboolean keep = TRUE;
+
+  g_mutex_lock (self->queue_mutex);
+
+  /* The stream notices the disconnection, the next write reports it */
+  if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+    {
+      GST_DEBUG_OBJECT (self, "Socket closed, not watching it anymore");
+      keep = FALSE;
+    }
+  else if (condition & G_IO_OUT && !self->failed)
+    {
+      if (fs_msn_frame_sink_flush (self) == GST_FLOW_OK)
+        {
+          fs_msn_frame_sink_update_latency (self);
+        }
+      else
+        {
+          self->write_error = TRUE;
+          keep = FALSE;
+        }
+    }
+
+  if (!keep)
+    self->watch_id = 0;
+
+  g_mutex_unlock (self->queue_mutex);
+
+  return keep;
+}
+
+/*
+ * Waits for the socket to be writable, returns FALSE on timeout or if
+ * unlock() was called
+ */
+static gboolean
+fs_msn_frame_sink_wait (FsMsnFrameSink *self, gint timeout)
+{
+  struct pollfd fds[2];
+  gint ret;
+
+  fds[0].fd = self->fd;
+  fds[0].events = POLLOUT;
+  fds[1].fd = self->control_sock[0];
+  fds[1].events = POLLIN;
+
+  do {
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    ret = poll (fds, 2, timeout);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret > 0 && !fds[1].revents;
+}
+
+static gboolean
+fs_msn_frame_sink_event (GstBaseSink *bsink, GstEvent *event)
+{
+  FsMsnFrameSink *self = FS_MSN_FRAME_SINK (bsink);
+
+  switch (GST_EVENT_TYPE (event))
+    {
+      case GST_EVENT_EOS:
+        {
+          GstClockTime deadline = gst_util_get_timestamp () +
+            EOS_FLUSH_TIMEOUT * GST_MSECOND;
+          gboolean done;
+
+          for (;;)
+            {
+              GstClockTime now;
+
+              g_mutex_lock (self->queue_mutex);
+              done = self->write_error ||
+                fs_msn_frame_sink_flush (self) != GST_FLOW_OK ||
+                g_queue_is_empty (&self->queue);
+              g_mutex_unlock (self->queue_mutex);
+
+              if (done)
+                break;
+
+              now = gst_util_get_timestamp ();
+              if (now >= deadline ||
+                  !fs_msn_frame_sink_wait (self,
+                      (deadline - now) / GST_MSECOND + 1))
+                {
+                  GST_WARNING_OBJECT (self, "Could not send %u queued bytes"
+                      " before EOS", self->queued_bytes);
+                  break;
+                }
+            }
+        }
+        break;
+      case GST_EVENT_FLUSH_STOP:
+        g_mutex_lock (self->queue_mutex);
+        fs_msn_frame_sink_clear (self, FALSE);
+        g_mutex_unlock (self->queue_mutex);
+        break;
+      default:
+        break;
+    }
+
+  return TRUE;
+}
@@ -0,0 +1,115 @@
+/*
+ * Farsight2 - Farsight MSN Frame Sink
+ *
+ * fs-msn-frame-sink.h - Sink writing MSN webcam frames to a socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_MSN_FRAME_SINK_H__
+#define __FS_MSN_FRAME_SINK_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+
+#include "fs-msn-reactor.h"
+
+G_BEGIN_DECLS
+
+#define FS_TYPE_MSN_FRAME_SINK \
+  (fs_msn_frame_sink_get_type ())
+#define FS_MSN_FRAME_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),FS_TYPE_MSN_FRAME_SINK,FsMsnFrameSink))
+#define FS_MSN_FRAME_SINK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),FS_TYPE_MSN_FRAME_SINK,FsMsnFrameSinkClass))
+#define FS_IS_MSN_FRAME_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),FS_TYPE_MSN_FRAME_SINK))
+#define FS_IS_MSN_FRAME_SINK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),FS_TYPE_MSN_FRAME_SINK))
+
+typedef struct _FsMsnFrameSink          FsMsnFrameSink;
+typedef struct _FsMsnFrameSinkClass     FsMsnFrameSinkClass;
+
+/**
+ * FsMsnFrameSink:
+ *
+ * Opaque #FsMsnFrameSink data structure.
+ */
+struct _FsMsnFrameSink {
+  GstBaseSink     parent;
+
+  /*< private >*/
+  gint fd;
+  guint max_queued_bytes;
+  gboolean ignore_errors;
+  GstClockTime max_latency;
+
+  /* Used to interrupt poll() in unlock() */
+  gint control_sock[2];
+
+  /* Drains the queue when the socket becomes writable, the watch is on a
+   * duplicate of the socket as the reactor takes one watch per fd */
+  FsMsnReactor *reactor;
+  gint watch_fd;
+  guint watch_id;
+
+  /* Protects the queue and the state below, the reactor thread flushes it
+   * too */
+  GMutex *queue_mutex;
+
+  /* A header buffer waiting for its payload */
+  GstBuffer *pending_header;
+
+  /* Frames not completely written yet */
+  GQueue queue;
+  /* Bytes of the first queued frame already written */
+  guint head_offset;
+
+  /* When the socket stopped accepting data, or GST_CLOCK_TIME_NONE */
+  GstClockTime stall_start;
+
+  /* A frame was dropped, drop the following ones until a keyframe */
+  gboolean wait_keyframe;
+
+  /* The socket failed and errors are ignored, drop everything */
+  gboolean failed;
+
+  /* The reactor thread already posted a write error */
+  gboolean write_error;
+
+  /* Protected by the object lock */
+  guint queued_bytes;
+  guint64 stall_time;
+  guint64 bytes_sent;
+  guint64 frames_sent;
+  guint64 frames_dropped;
+  guint64 write_calls;
+
+  /* Rate at which the peer acknowledges data, in bytes per second */
+  guint64 send_rate;
+  GstClockTime rate_time;
+  guint64 rate_delivered;
+  GstClockTime backlog_latency;
+};
+
+struct _FsMsnFrameSinkClass {
+  GstBaseSinkClass parent_class;
+};
+
+GType   fs_msn_frame_sink_get_type        (void);
+
+G_END_DECLS
+
+#endif /* __FS_MSN_FRAME_SINK_H__ */
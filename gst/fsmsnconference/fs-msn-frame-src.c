@@ -0,0 +1,491 @@
+/*
+ * Farsight2 - Farsight MSN Frame Source
+ *
+ * fs-msn-frame-src.c - Source reading MSN webcam frames from a socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:element-fsmsnframesrc
+ * @short_description: Reads framed MSN webcam data from a socket
+ *
+ * Reads the MSN webcam stream from a connected socket and pushes exactly one
+ * buffer per encoded frame, header included, which is what mimdec expects.
+ * Frames that are not ML20, like the ones with a zero fourcc that the peer
+ * sends while it is paused, are dropped.
+ *
+ * Data is read into a large slab with as few read() calls as possible and
+ * each frame is pushed as a sub-buffer of that slab, so no data is copied
+ * except for the beginning of a frame that does not fit at the end of a
+ * slab. A slab is reused as soon as all the frames cut from it have been
+ * released downstream.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "fs-msn-frame-src.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+GST_DEBUG_CATEGORY_STATIC (fs_msn_frame_src_debug);
+#define GST_CAT_DEFAULT fs_msn_frame_src_debug
+
+#define DEFAULT_FD -1
+#define DEFAULT_MAX_FRAME_SIZE (256 * 1024)
+
+/* Large enough to hold several 640x480 frames */
+#define SLAB_SIZE (64 * 1024)
+
+/* props */
+enum
+{
+  PROP_0,
+  PROP_FD,
+  PROP_MAX_FRAME_SIZE,
+  PROP_FRAMES,
+  PROP_BYTES,
+  PROP_READ_CALLS
+};
+
+static GstStaticPadTemplate fs_msn_frame_src_template =
+  GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("video/x-msnwebcam"));
+
+
+#define _do_init(bla) \
+    GST_DEBUG_CATEGORY_INIT (fs_msn_frame_src_debug, "fsmsnframesrc", 0, \
+        "fsmsnframesrc element");
+
+GST_BOILERPLATE_FULL (FsMsnFrameSrc, fs_msn_frame_src, GstPushSrc,
+  GST_TYPE_PUSH_SRC, _do_init);
+
+
+static void fs_msn_frame_src_set_property (GObject *object,
+    guint prop_id, const GValue *value, GParamSpec *pspec);
+static void fs_msn_frame_src_get_property (GObject *object,
+    guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean fs_msn_frame_src_start (GstBaseSrc *bsrc);
+static gboolean fs_msn_frame_src_stop (GstBaseSrc *bsrc);
+static gboolean fs_msn_frame_src_unlock (GstBaseSrc *bsrc);
+static gboolean fs_msn_frame_src_unlock_stop (GstBaseSrc *bsrc);
+static GstFlowReturn fs_msn_frame_src_create (GstPushSrc *psrc,
+    GstBuffer **outbuf);
+
+
+static void
+fs_msn_frame_src_base_init (gpointer g_class)
+{
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "Farsight MSN webcam frame source",
+      "Source/Network",
+      "Reads MSN webcam frames from a socket, one buffer per frame",
+      "Farsight developers");
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&fs_msn_frame_src_template));
+}
+
+static void
+fs_msn_frame_src_class_init (FsMsnFrameSrcClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstBaseSrcClass *gstbasesrc_class = GST_BASE_SRC_CLASS (klass);
+  GstPushSrcClass *gstpushsrc_class = GST_PUSH_SRC_CLASS (klass);
+
+  gobject_class->set_property = fs_msn_frame_src_set_property;
+  gobject_class->get_property = fs_msn_frame_src_get_property;
+
+  gstbasesrc_class->start = GST_DEBUG_FUNCPTR (fs_msn_frame_src_start);
+  gstbasesrc_class->stop = GST_DEBUG_FUNCPTR (fs_msn_frame_src_stop);
+  gstbasesrc_class->unlock = GST_DEBUG_FUNCPTR (fs_msn_frame_src_unlock);
+  gstbasesrc_class->unlock_stop =
+    GST_DEBUG_FUNCPTR (fs_msn_frame_src_unlock_stop);
+
+  gstpushsrc_class->create = GST_DEBUG_FUNCPTR (fs_msn_frame_src_create);
+
+  g_object_class_install_property (gobject_class,
+      PROP_FD,
+      g_param_spec_int ("fd",
+          "File descriptor",
+          "The connected socket to read the frames from",
+          -1, G_MAXINT, DEFAULT_FD,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_MAX_FRAME_SIZE,
+      g_param_spec_uint ("max-frame-size",
+          "Maximum frame size",
+          "Frames with a larger payload are treated as a stream error",
+          0, G_MAXUINT, DEFAULT_MAX_FRAME_SIZE,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_FRAMES,
+      g_param_spec_uint64 ("frames",
+          "Frames",
+          "Number of frames pushed since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_BYTES,
+      g_param_spec_uint64 ("bytes",
+          "Bytes",
+          "Number of bytes pushed since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_READ_CALLS,
+      g_param_spec_uint64 ("read-calls",
+          "Read calls",
+          "Number of read() system calls made since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+}
+
+static void
+fs_msn_frame_src_init (FsMsnFrameSrc *self, FsMsnFrameSrcClass *g_class)
+{
+  self->fd = DEFAULT_FD;
+  self->max_frame_size = DEFAULT_MAX_FRAME_SIZE;
+  self->control_sock[0] = -1;
+  self->control_sock[1] = -1;
+}
+
+static void
+fs_msn_frame_src_set_property (GObject *object,
+    guint prop_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  FsMsnFrameSrc *self = FS_MSN_FRAME_SRC (object);
+
+  switch (prop_id)
+    {
+      case PROP_FD:
+        GST_OBJECT_LOCK (self);
+        self->fd = g_value_get_int (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+      case PROP_MAX_FRAME_SIZE:
+        GST_OBJECT_LOCK (self);
+        self->max_frame_size = g_value_get_uint (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+fs_msn_frame_src_get_property (GObject *object,
+    guint prop_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  FsMsnFrameSrc *self = FS_MSN_FRAME_SRC (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+    {
+      case PROP_FD:
+        g_value_set_int (value, self->fd);
+        break;
+      case PROP_MAX_FRAME_SIZE:
+        g_value_set_uint (value, self->max_frame_size);
+        break;
+      case PROP_FRAMES:
+        g_value_set_uint64 (value, self->frames);
+        break;
+      case PROP_BYTES:
+        g_value_set_uint64 (value, self->bytes);
+        break;
+      case PROP_READ_CALLS:
+        g_value_set_uint64 (value, self->read_calls);
+        break;
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static gboolean
+fs_msn_frame_src_start (GstBaseSrc *bsrc)
+{
+  FsMsnFrameSrc *self = FS_MSN_FRAME_SRC (bsrc);
+
+  if (self->fd < 0)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL),
+          ("No socket was set on the \"fd\" property"));
+      return FALSE;
+    }
+
+  if (pipe (self->control_sock) < 0)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL),
+          ("Could not create control pipe: %s", g_strerror (errno)));
+      return FALSE;
+    }
+  fcntl (self->control_sock[0], F_SETFL, O_NONBLOCK);
+  fcntl (self->control_sock[1], F_SETFL, O_NONBLOCK);
+
+  self->slab = gst_buffer_new_and_alloc (SLAB_SIZE);
+  self->slab_pos = 0;
+  self->slab_filled = 0;
+
+  GST_OBJECT_LOCK (self);
+  self->frames = 0;
+  self->bytes = 0;
+  self->read_calls = 0;
+  GST_OBJECT_UNLOCK (self);
+
+  return TRUE;
+}
+
+static gboolean
+fs_msn_frame_src_stop (GstBaseSrc *bsrc)
+{
+  FsMsnFrameSrc *self = FS_MSN_FRAME_SRC (bsrc);
+
+  if (self->control_sock[0] >= 0)
+    close (self->control_sock[0]);
+  if (self->control_sock[1] >= 0)
+    close (self->control_sock[1]);
+  self->control_sock[0] = -1;
+  self->control_sock[1] = -1;
+
+  if (self->slab)
+    gst_buffer_unref (self->slab);
+  self->slab = NULL;
+
+  return TRUE;
+}
+
+static gboolean
+fs_msn_frame_src_unlock (GstBaseSrc *bsrc)
+{
+  FsMsnFrameSrc *self = FS_MSN_FRAME_SRC (bsrc);
+  const gchar c = 'x';
+
+  if (write (self->control_sock[1], &c, 1) < 0 && errno != EAGAIN)
+    GST_WARNING_OBJECT (self, "Could not wake up the streaming thread: %s",
+        g_strerror (errno));
+
+  return TRUE;
+}
+
+static gboolean
+fs_msn_frame_src_unlock_stop (GstBaseSrc *bsrc)
+{
+  FsMsnFrameSrc *self = FS_MSN_FRAME_SRC (bsrc);
+  gchar buf[16];
+
+  while (read (self->control_sock[0], buf, sizeof (buf)) > 0);
+
+  return TRUE;
+}
+
+/*
+ * Makes sure there is room for @needed bytes from the current position,
+ * moving the partial frame to the start of a slab if needed
+ */
+static void
+fs_msn_frame_src_make_room (FsMsnFrameSrc *self, guint needed)
+{
+  guint avail = self->slab_filled - self->slab_pos;
+  gboolean shared = GST_MINI_OBJECT_REFCOUNT_VALUE (self->slab) > 1;
+  GstBuffer *slab;
+
+  if (!shared && avail == 0)
+    {
+      self->slab_pos = 0;
+      self->slab_filled = 0;
+    }
+
+  if (self->slab_pos + needed <= GST_BUFFER_SIZE (self->slab))
+    return;
+
+  if (!shared && needed <= GST_BUFFER_SIZE (self->slab))
+    {
+      memmove (GST_BUFFER_DATA (self->slab),
+          GST_BUFFER_DATA (self->slab) + self->slab_pos, avail);
+    }
+  else
+    {
+      /* Frames cut from the old slab are still in use downstream */
+      slab = gst_buffer_new_and_alloc (MAX (needed, SLAB_SIZE));
+      memcpy (GST_BUFFER_DATA (slab),
+          GST_BUFFER_DATA (self->slab) + self->slab_pos, avail);
+      gst_buffer_unref (self->slab);
+      self->slab = slab;
+    }
+
+  self->slab_pos = 0;
+  self->slab_filled = avail;
+}
+
+static GstFlowReturn
+fs_msn_frame_src_read (FsMsnFrameSrc *self, guint needed)
+{
+  struct pollfd fds[2];
+  gssize ret;
+
+  fs_msn_frame_src_make_room (self, needed);
+
+  fds[0].fd = self->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = self->control_sock[0];
+  fds[1].events = POLLIN;
+
+  do {
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    ret = poll (fds, 2, -1);
+  } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+  if (ret < 0)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+          ("poll() failed: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+
+  if (fds[1].revents)
+    {
+      GST_DEBUG_OBJECT (self, "Unlocked");
+      return GST_FLOW_WRONG_STATE;
+    }
+
+  /* Read everything that is available, it may be several frames */
+  do {
+    ret = read (self->fd, GST_BUFFER_DATA (self->slab) + self->slab_filled,
+        GST_BUFFER_SIZE (self->slab) - self->slab_filled);
+  } while (ret < 0 && errno == EINTR);
+
+  GST_OBJECT_LOCK (self);
+  self->read_calls++;
+  GST_OBJECT_UNLOCK (self);
+
+  if (ret == 0)
+    {
+      GST_DEBUG_OBJECT (self, "Connection closed by the peer");
+      return GST_FLOW_UNEXPECTED;
+    }
+  else if (ret < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return GST_FLOW_OK;
+
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+          ("read() failed: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+
+  self->slab_filled += ret;
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+fs_msn_frame_src_create (GstPushSrc *psrc, GstBuffer **outbuf)
+{
+  FsMsnFrameSrc *self = FS_MSN_FRAME_SRC (psrc);
+  guint needed = FS_MSN_FRAME_HEADER_SIZE;
+  GstFlowReturn ret;
+
+  for (;;)
+    {
+      guint avail = self->slab_filled - self->slab_pos;
+      guint8 *data = GST_BUFFER_DATA (self->slab) + self->slab_pos;
+
+      if (avail >= FS_MSN_FRAME_HEADER_SIZE)
+        {
+          guint32 payload_size;
+          guint max_frame_size;
+
+          if (GST_READ_UINT16_LE (data) != FS_MSN_FRAME_HEADER_SIZE)
+            {
+              GST_ELEMENT_ERROR (self, STREAM, DECODE, (NULL),
+                  ("Invalid MSN webcam frame header size %u",
+                      GST_READ_UINT16_LE (data)));
+              return GST_FLOW_ERROR;
+            }
+
+          GST_OBJECT_LOCK (self);
+          max_frame_size = self->max_frame_size;
+          GST_OBJECT_UNLOCK (self);
+
+          payload_size = GST_READ_UINT32_LE (data + 8);
+          if (payload_size > max_frame_size)
+            {
+              GST_ELEMENT_ERROR (self, STREAM, DECODE, (NULL),
+                  ("Frame payload of %u bytes is larger than"
+                      " max-frame-size (%u)",
+                      payload_size, max_frame_size));
+              return GST_FLOW_ERROR;
+            }
+
+          needed = FS_MSN_FRAME_HEADER_SIZE + payload_size;
+
+          if (avail >= needed)
+            {
+              /* The peer sends frames with a zero fourcc while it is
+               * paused, mimdec can not decode them */
+              if (memcmp (data + 12, FS_MSN_FRAME_FOURCC, 4))
+                {
+                  GST_DEBUG_OBJECT (self, "Dropping frame of %u bytes with"
+                      " fourcc 0x%08x", needed, GST_READ_UINT32_BE (data + 12));
+                  self->slab_pos += needed;
+                  needed = FS_MSN_FRAME_HEADER_SIZE;
+                  continue;
+                }
+
+              *outbuf = gst_buffer_create_sub (self->slab, self->slab_pos,
+                  needed);
+              gst_buffer_set_caps (*outbuf,
+                  GST_PAD_CAPS (GST_BASE_SRC_PAD (self)));
+              self->slab_pos += needed;
+
+              GST_OBJECT_LOCK (self);
+              self->frames++;
+              self->bytes += needed;
+              GST_OBJECT_UNLOCK (self);
+
+              GST_LOG_OBJECT (self, "Pushing frame of %u bytes", needed);
+
+              return GST_FLOW_OK;
+            }
+        }
+
+      ret = fs_msn_frame_src_read (self, needed);
+      if (ret != GST_FLOW_OK)
+        return ret;
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Farsight2 - Farsight MSN Frame Source
+ *
+ * fs-msn-frame-src.h - Source reading MSN webcam frames from a socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_MSN_FRAME_SRC_H__
+#define __FS_MSN_FRAME_SRC_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstpushsrc.h>
+
+G_BEGIN_DECLS
+
+#define FS_TYPE_MSN_FRAME_SRC \
+  (fs_msn_frame_src_get_type ())
+#define FS_MSN_FRAME_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),FS_TYPE_MSN_FRAME_SRC,FsMsnFrameSrc))
+#define FS_MSN_FRAME_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),FS_TYPE_MSN_FRAME_SRC,FsMsnFrameSrcClass))
+#define FS_IS_MSN_FRAME_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),FS_TYPE_MSN_FRAME_SRC))
+#define FS_IS_MSN_FRAME_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),FS_TYPE_MSN_FRAME_SRC))
+
+/* Size of the header in front of each frame on the wire */
+#define FS_MSN_FRAME_HEADER_SIZE 24
+#define FS_MSN_FRAME_FOURCC "ML20"
+
+typedef struct _FsMsnFrameSrc          FsMsnFrameSrc;
+typedef struct _FsMsnFrameSrcClass     FsMsnFrameSrcClass;
+
+/**
+ * FsMsnFrameSrc:
+ *
+ * Opaque #FsMsnFrameSrc data structure.
+ */
+struct _FsMsnFrameSrc {
+  GstPushSrc      parent;
+
+  /*< private >*/
+  gint fd;
+  guint max_frame_size;
+
+  /* Used to interrupt poll() in unlock() */
+  gint control_sock[2];
+
+  /* Frames are cut out of this buffer as sub-buffers */
+  GstBuffer *slab;
+  guint slab_pos;
+  guint slab_filled;
+
+  /* Protected by the object lock */
+  guint64 frames;
+  guint64 bytes;
+  guint64 read_calls;
+};
+
+struct _FsMsnFrameSrcClass {
+  GstPushSrcClass parent_class;
+};
+
+GType   fs_msn_frame_src_get_type        (void);
+
+G_END_DECLS
+
+#endif /* __FS_MSN_FRAME_SRC_H__ */
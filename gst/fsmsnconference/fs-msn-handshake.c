@@ -0,0 +1,578 @@
+/*
+ * Farsight2 - Farsight MSN Handshake
+ *
+ * fs-msn-handshake.c - Non-blocking MSN webcam connection handshake
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The MSN webcam handshake is a short exchange of text lines, each
+ * terminated by an empty line:
+ *
+ *   connecting side                      accepting side
+ *   recipientid=R&sessionid=S\r\n\r\n  ->
+ *                                      <-  connected\r\n\r\n
+ *   connected\r\n\r\n                  ->
+ *
+ * It is driven here as a small state machine from the readiness callbacks
+ * of the conference's reactor, so that no call ever blocks. Lines are assembled
+ * incrementally and we never consume a byte past the end of the current
+ * line, so media data that the peer sends right after the handshake is
+ * left in the socket for the streaming element.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs-msn-handshake.h"
+
+#include "fs-msn-conference.h"
+#include "fs-msn-reactor.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define GST_CAT_DEFAULT fsmsnconference_debug
+
+#define FS_MSN_HANDSHAKE_MAX_LINE 128
+#define FS_MSN_HANDSHAKE_TERMINATOR "\r\n\r\n"
+#define FS_MSN_HANDSHAKE_CONNECTED "connected" FS_MSN_HANDSHAKE_TERMINATOR
+
+typedef enum
+{
+  HANDSHAKE_STATE_CONNECTING,
+  HANDSHAKE_STATE_SEND_AUTH,
+  HANDSHAKE_STATE_WAIT_AUTH,
+  HANDSHAKE_STATE_SEND_CONNECTED,
+  HANDSHAKE_STATE_WAIT_CONNECTED,
+  HANDSHAKE_STATE_DONE
+} HandshakeState;
+
+typedef enum
+{
+  HANDSHAKE_RESULT_AGAIN,
+  HANDSHAKE_RESULT_DONE,
+  HANDSHAKE_RESULT_FAILED
+} HandshakeResult;
+
+struct _FsMsnHandshake
+{
+  gint fd;
+  FsMsnReactor *reactor;
+
+  FsMsnHandshakeDirection direction;
+  HandshakeState state;
+
+  guint recipientid;
+  guint sessionid;
+
+  /* The line being received, it is never longer than one line */
+  gchar in[FS_MSN_HANDSHAKE_MAX_LINE];
+  gsize in_len;
+
+  /* The line being sent */
+  gchar out[FS_MSN_HANDSHAKE_MAX_LINE];
+  gsize out_len;
+  gsize out_pos;
+
+  guint io_watch;
+  guint timeout_id;
+
+  /* Incoming handshakes that accept any ids the callback knows about */
+  FsMsnHandshakeAuthFunc auth_func;
+
+  FsMsnHandshakeDoneFunc func;
+  gpointer user_data;
+};
+
+static void
+fs_msn_handshake_queue_line (FsMsnHandshake *self, const gchar *line)
+{
+  self->out_len = g_strlcpy (self->out, line, sizeof (self->out));
+  self->out_pos = 0;
+}
+
+static HandshakeResult
+fs_msn_handshake_flush (FsMsnHandshake *self)
+{
+  while (self->out_pos < self->out_len)
+    {
+      gssize ret = send (self->fd, self->out + self->out_pos,
+                         self->out_len - self->out_pos, MSG_NOSIGNAL);
+
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return HANDSHAKE_RESULT_AGAIN;
+          GST_DEBUG ("send() failed on fd %d: %s", self->fd,
+                     g_strerror (errno));
+          return HANDSHAKE_RESULT_FAILED;
+        }
+
+      self->out_pos += ret;
+    }
+
+  return HANDSHAKE_RESULT_DONE;
+}
+
+/*
+ * Peeks at the socket and consumes bytes up to and including the end of the
+ * current line, never further.
+ */
+static HandshakeResult
+fs_msn_handshake_read_line (FsMsnHandshake *self)
+{
+  const gsize term_len = strlen (FS_MSN_HANDSHAKE_TERMINATOR);
+
+  for (;;)
+    {
+      gsize space = sizeof (self->in) - 1 - self->in_len;
+      gsize search_from;
+      gsize consume;
+      gchar *term;
+      gssize ret;
+
+      if (space == 0)
+        {
+          GST_DEBUG ("Handshake line on fd %d is too long", self->fd);
+          return HANDSHAKE_RESULT_FAILED;
+        }
+
+      ret = recv (self->fd, self->in + self->in_len, space, MSG_PEEK);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return HANDSHAKE_RESULT_AGAIN;
+          GST_DEBUG ("recv() failed on fd %d: %s", self->fd,
+                     g_strerror (errno));
+          return HANDSHAKE_RESULT_FAILED;
+        }
+      else if (ret == 0)
+        {
+          GST_DEBUG ("Peer closed fd %d during the handshake", self->fd);
+          return HANDSHAKE_RESULT_FAILED;
+        }
+
+      self->in[self->in_len + ret] = '\0';
+
+      /* The terminator may straddle what we had and what we just peeked */
+      search_from = self->in_len > term_len ? self->in_len - term_len : 0;
+      term = strstr (self->in + search_from, FS_MSN_HANDSHAKE_TERMINATOR);
+
+      if (term)
+        consume = (term - self->in) + term_len - self->in_len;
+      else
+        consume = ret;
+
+      /* These bytes are already queued, so this can not block */
+      ret = recv (self->fd, self->in + self->in_len, consume, 0);
+      if (ret != (gssize) consume)
+        {
+          GST_DEBUG ("Could not consume %"G_GSIZE_FORMAT" peeked bytes"
+                     " on fd %d", consume, self->fd);
+          return HANDSHAKE_RESULT_FAILED;
+        }
+
+      self->in_len += consume;
+      self->in[self->in_len] = '\0';
+
+      if (term)
+        return HANDSHAKE_RESULT_DONE;
+    }
+}
+
+static gboolean
+fs_msn_handshake_check_auth (FsMsnHandshake *self)
+{
+  gchar *expected;
+  gboolean ret;
+
+  if (self->auth_func)
+    {
+      guint recipientid, sessionid;
+
+      if (sscanf (self->in, "recipientid=%u&sessionid=%u", &recipientid,
+                  &sessionid) != 2)
+        {
+          GST_DEBUG ("Got invalid auth line on fd %d: %s", self->fd,
+                     self->in);
+          return FALSE;
+        }
+
+      self->recipientid = recipientid;
+      self->sessionid = sessionid;
+    }
+
+  expected = g_strdup_printf ("recipientid=%u&sessionid=%u"
+                              FS_MSN_HANDSHAKE_TERMINATOR,
+                              self->recipientid, self->sessionid);
+  ret = !strcmp (self->in, expected);
+  g_free (expected);
+
+  if (ret && self->auth_func &&
+      !self->auth_func (self, self->recipientid, self->sessionid,
+                        self->user_data))
+    {
+      GST_DEBUG ("Nobody expects recipientid %u sessionid %u on fd %d",
+                 self->recipientid, self->sessionid, self->fd);
+      return FALSE;
+    }
+
+  if (!ret)
+    GST_DEBUG ("Got unexpected auth line on fd %d: %s", self->fd, self->in);
+
+  return ret;
+}
+
+static HandshakeResult
+fs_msn_handshake_advance (FsMsnHandshake *self, GIOCondition cond)
+{
+  HandshakeResult res;
+
+  for (;;)
+    {
+      switch (self->state)
+        {
+          case HANDSHAKE_STATE_CONNECTING:
+            {
+              gint error = 0;
+              socklen_t option_len = sizeof (error);
+
+              if (!(cond & (G_IO_OUT | G_IO_ERR | G_IO_HUP)))
+                return HANDSHAKE_RESULT_AGAIN;
+
+              if (getsockopt (self->fd, SOL_SOCKET, SO_ERROR, &error,
+                              &option_len) < 0 || error)
+                {
+                  GST_DEBUG ("Connection failed on fd %d: %s", self->fd,
+                             g_strerror (error ? error : errno));
+                  return HANDSHAKE_RESULT_FAILED;
+                }
+
+              {
+                gchar *line = g_strdup_printf ("recipientid=%u&sessionid=%u"
+                                               FS_MSN_HANDSHAKE_TERMINATOR,
+                                               self->recipientid,
+                                               self->sessionid);
+                fs_msn_handshake_queue_line (self, line);
+                g_free (line);
+              }
+              self->state = HANDSHAKE_STATE_SEND_AUTH;
+            }
+            break;
+          case HANDSHAKE_STATE_SEND_AUTH:
+            res = fs_msn_handshake_flush (self);
+            if (res != HANDSHAKE_RESULT_DONE)
+              return res;
+            self->state = HANDSHAKE_STATE_WAIT_CONNECTED;
+            break;
+          case HANDSHAKE_STATE_WAIT_AUTH:
+            res = fs_msn_handshake_read_line (self);
+            if (res != HANDSHAKE_RESULT_DONE)
+              return res;
+            if (!fs_msn_handshake_check_auth (self))
+              return HANDSHAKE_RESULT_FAILED;
+            self->in_len = 0;
+            fs_msn_handshake_queue_line (self, FS_MSN_HANDSHAKE_CONNECTED);
+            self->state = HANDSHAKE_STATE_SEND_CONNECTED;
+            break;
+          case HANDSHAKE_STATE_SEND_CONNECTED:
+            res = fs_msn_handshake_flush (self);
+            if (res != HANDSHAKE_RESULT_DONE)
+              return res;
+            if (self->direction == FS_MSN_HANDSHAKE_INCOMING)
+              self->state = HANDSHAKE_STATE_WAIT_CONNECTED;
+            else
+              self->state = HANDSHAKE_STATE_DONE;
+            break;
+          case HANDSHAKE_STATE_WAIT_CONNECTED:
+            res = fs_msn_handshake_read_line (self);
+            if (res != HANDSHAKE_RESULT_DONE)
+              return res;
+            if (strcmp (self->in, FS_MSN_HANDSHAKE_CONNECTED))
+              {
+                GST_DEBUG ("Expected connected on fd %d, got: %s", self->fd,
+                           self->in);
+                return HANDSHAKE_RESULT_FAILED;
+              }
+            self->in_len = 0;
+            if (self->direction == FS_MSN_HANDSHAKE_INCOMING)
+              {
+                self->state = HANDSHAKE_STATE_DONE;
+              }
+            else
+              {
+                fs_msn_handshake_queue_line (self,
+                                             FS_MSN_HANDSHAKE_CONNECTED);
+                self->state = HANDSHAKE_STATE_SEND_CONNECTED;
+              }
+            break;
+          case HANDSHAKE_STATE_DONE:
+            return HANDSHAKE_RESULT_DONE;
+        }
+    }
+}
+
+static GIOCondition
+fs_msn_handshake_wanted_condition (FsMsnHandshake *self)
+{
+  switch (self->state)
+    {
+      case HANDSHAKE_STATE_CONNECTING:
+      case HANDSHAKE_STATE_SEND_AUTH:
+      case HANDSHAKE_STATE_SEND_CONNECTED:
+        return G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+      default:
+        return G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+    }
+}
+
+/*
+ * The watch and the timeout are left in place, they are removed when the
+ * handshake is freed, so their ids can be read from any thread.
+ */
+static void
+fs_msn_handshake_finish (FsMsnHandshake *self, gboolean success)
+{
+  self->state = HANDSHAKE_STATE_DONE;
+
+  GST_DEBUG ("Handshake on fd %d %s", self->fd,
+             success ? "succeeded" : "failed");
+
+  /* The callback may free us, don't touch self after this */
+  self->func (self, success, self->user_data);
+}
+
+static gboolean
+fs_msn_handshake_io_cb (gint fd,
+                        GIOCondition cond,
+                        gpointer data)
+{
+  FsMsnHandshake *self = data;
+
+  if (self->state == HANDSHAKE_STATE_DONE)
+    return FALSE;
+
+  if (cond & G_IO_NVAL)
+    {
+      fs_msn_handshake_finish (self, FALSE);
+      return FALSE;
+    }
+
+  switch (fs_msn_handshake_advance (self, cond))
+    {
+      case HANDSHAKE_RESULT_AGAIN:
+        /* The reactor ignores it if the condition did not change */
+        fs_msn_reactor_set_watch_condition (self->reactor, self->io_watch,
+            fs_msn_handshake_wanted_condition (self));
+        return TRUE;
+      case HANDSHAKE_RESULT_DONE:
+        fs_msn_handshake_finish (self, TRUE);
+        return FALSE;
+      case HANDSHAKE_RESULT_FAILED:
+      default:
+        fs_msn_handshake_finish (self, FALSE);
+        return FALSE;
+    }
+}
+
+static gboolean
+fs_msn_handshake_timeout_cb (gpointer data)
+{
+  FsMsnHandshake *self = data;
+
+  if (self->state == HANDSHAKE_STATE_DONE)
+    return FALSE;
+
+  GST_DEBUG ("Handshake on fd %d timed out", self->fd);
+
+  fs_msn_handshake_finish (self, FALSE);
+
+  return FALSE;
+}
+
+static FsMsnHandshake *
+fs_msn_handshake_start (FsMsnReactor *reactor,
+                        gint fd,
+                        FsMsnHandshakeDirection direction,
+                        guint recipientid,
+                        guint sessionid,
+                        guint timeout,
+                        FsMsnHandshakeAuthFunc auth_func,
+                        FsMsnHandshakeDoneFunc func,
+                        gpointer user_data)
+{
+  FsMsnHandshake *self = g_slice_new0 (FsMsnHandshake);
+
+  self->fd = fd;
+  self->reactor = reactor;
+  self->direction = direction;
+  self->recipientid = recipientid;
+  self->sessionid = sessionid;
+  self->auth_func = auth_func;
+  self->func = func;
+  self->user_data = user_data;
+
+  if (direction == FS_MSN_HANDSHAKE_OUTGOING)
+    self->state = HANDSHAKE_STATE_CONNECTING;
+  else
+    self->state = HANDSHAKE_STATE_WAIT_AUTH;
+
+  self->timeout_id = fs_msn_reactor_add_timeout (reactor, timeout * 1000,
+                                                 fs_msn_handshake_timeout_cb,
+                                                 self);
+  self->io_watch = fs_msn_reactor_add_watch (reactor, fd,
+      fs_msn_handshake_wanted_condition (self), fs_msn_handshake_io_cb, self);
+
+  return self;
+}
+
+/**
+ * fs_msn_handshake_new:
+ * @reactor: The #FsMsnReactor that drives the handshake
+ * @fd: A non-blocking TCP socket, for outgoing handshakes it can still be
+ *  connecting
+ * @direction: Whether we initiated the connection or accepted it
+ * @recipientid: The recipient id to send (outgoing) or to expect (incoming)
+ * @sessionid: The session id to send (outgoing) or to expect (incoming)
+ * @timeout: The maximum duration of the whole handshake in seconds
+ * @func: Called from the reactor thread when the handshake completes or fails
+ * @user_data: Passed to @func
+ *
+ * Starts a new handshake, the handshake takes ownership of @fd, use
+ * fs_msn_handshake_steal_fd() to take it back once it is done.
+ *
+ * @func can be called before this function returns, so the caller must hold
+ * a lock that @func takes until it has stored the handshake.
+ *
+ * Returns: a new #FsMsnHandshake
+ */
+FsMsnHandshake *
+fs_msn_handshake_new (FsMsnReactor *reactor,
+                      gint fd,
+                      FsMsnHandshakeDirection direction,
+                      guint recipientid,
+                      guint sessionid,
+                      guint timeout,
+                      FsMsnHandshakeDoneFunc func,
+                      gpointer user_data)
+{
+  return fs_msn_handshake_start (reactor, fd, direction, recipientid,
+                                 sessionid, timeout, NULL, func, user_data);
+}
+
+/**
+ * fs_msn_handshake_new_incoming:
+ * @reactor: The #FsMsnReactor that drives the handshake
+ * @fd: A non-blocking TCP socket that has just been accepted
+ * @timeout: The maximum duration of the whole handshake in seconds
+ * @auth_func: Called from the reactor thread with the ids sent by the peer,
+ *  it decides if they are accepted
+ * @func: Called from the reactor thread when the handshake completes or fails
+ * @user_data: Passed to @auth_func and @func
+ *
+ * Starts a handshake on an accepted connection for which the expected ids
+ * are not known in advance. They can be retrieved with
+ * fs_msn_handshake_get_recipientid() and fs_msn_handshake_get_sessionid()
+ * once @auth_func has been called. The same rules as for
+ * fs_msn_handshake_new() apply.
+ *
+ * Returns: a new #FsMsnHandshake
+ */
+FsMsnHandshake *
+fs_msn_handshake_new_incoming (FsMsnReactor *reactor,
+                               gint fd,
+                               guint timeout,
+                               FsMsnHandshakeAuthFunc auth_func,
+                               FsMsnHandshakeDoneFunc func,
+                               gpointer user_data)
+{
+  return fs_msn_handshake_start (reactor, fd, FS_MSN_HANDSHAKE_INCOMING, 0, 0,
+                                 timeout, auth_func, func, user_data);
+}
+
+/**
+ * fs_msn_handshake_free:
+ * @handshake: a #FsMsnHandshake
+ *
+ * Cancels the handshake if it is still running and closes its socket unless
+ * it has been stolen. When called from another thread, this waits for a
+ * running callback of the handshake to return, so it must not be called with
+ * a lock held that the done callback takes.
+ */
+void
+fs_msn_handshake_free (FsMsnHandshake *handshake)
+{
+  fs_msn_reactor_remove (handshake->reactor, handshake->io_watch);
+  fs_msn_reactor_remove (handshake->reactor, handshake->timeout_id);
+
+  if (handshake->fd >= 0)
+    close (handshake->fd);
+
+  g_slice_free (FsMsnHandshake, handshake);
+}
+
+gint
+fs_msn_handshake_get_fd (FsMsnHandshake *handshake)
+{
+  return handshake->fd;
+}
+
+/**
+ * fs_msn_handshake_steal_fd:
+ * @handshake: a #FsMsnHandshake
+ *
+ * Takes the ownership of the socket away from the handshake, it will not be
+ * closed when the handshake is freed.
+ *
+ * Returns: the socket
+ */
+gint
+fs_msn_handshake_steal_fd (FsMsnHandshake *handshake)
+{
+  gint fd = handshake->fd;
+
+  handshake->fd = -1;
+
+  return fd;
+}
+
+FsMsnHandshakeDirection
+fs_msn_handshake_get_direction (FsMsnHandshake *handshake)
+{
+  return handshake->direction;
+}
+
+guint
+fs_msn_handshake_get_recipientid (FsMsnHandshake *handshake)
+{
+  return handshake->recipientid;
+}
+
+guint
+fs_msn_handshake_get_sessionid (FsMsnHandshake *handshake)
+{
+  return handshake->sessionid;
+}
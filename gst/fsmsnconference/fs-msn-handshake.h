@@ -0,0 +1,87 @@
+/*
+ * Farsight2 - Farsight MSN Handshake
+ *
+ * fs-msn-handshake.h - Non-blocking MSN webcam connection handshake
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_MSN_HANDSHAKE_H__
+#define __FS_MSN_HANDSHAKE_H__
+
+#include <glib.h>
+
+#include "fs-msn-reactor.h"
+
+G_BEGIN_DECLS
+
+/* Private declaration */
+typedef struct _FsMsnHandshake FsMsnHandshake;
+
+typedef enum
+{
+  FS_MSN_HANDSHAKE_OUTGOING,
+  FS_MSN_HANDSHAKE_INCOMING
+} FsMsnHandshakeDirection;
+
+/*
+ * Called exactly once, from the reactor thread, when the handshake has either
+ * completed or failed. The callback may free the handshake.
+ */
+typedef void (*FsMsnHandshakeDoneFunc) (FsMsnHandshake *handshake,
+                                        gboolean success,
+                                        gpointer user_data);
+
+/*
+ * Called from the reactor thread with the ids received on an incoming
+ * handshake, returns TRUE if they are expected.
+ */
+typedef gboolean (*FsMsnHandshakeAuthFunc) (FsMsnHandshake *handshake,
+                                            guint recipientid,
+                                            guint sessionid,
+                                            gpointer user_data);
+
+FsMsnHandshake *fs_msn_handshake_new (FsMsnReactor *reactor,
+                                      gint fd,
+                                      FsMsnHandshakeDirection direction,
+                                      guint recipientid,
+                                      guint sessionid,
+                                      guint timeout,
+                                      FsMsnHandshakeDoneFunc func,
+                                      gpointer user_data);
+
+FsMsnHandshake *fs_msn_handshake_new_incoming (FsMsnReactor *reactor,
+                                               gint fd,
+                                               guint timeout,
+                                               FsMsnHandshakeAuthFunc auth_func,
+                                               FsMsnHandshakeDoneFunc func,
+                                               gpointer user_data);
+
+void fs_msn_handshake_free (FsMsnHandshake *handshake);
+
+gint fs_msn_handshake_get_fd (FsMsnHandshake *handshake);
+
+gint fs_msn_handshake_steal_fd (FsMsnHandshake *handshake);
+
+FsMsnHandshakeDirection fs_msn_handshake_get_direction (
+  FsMsnHandshake *handshake);
+
+guint fs_msn_handshake_get_recipientid (FsMsnHandshake *handshake);
+
+guint fs_msn_handshake_get_sessionid (FsMsnHandshake *handshake);
+
+G_END_DECLS
+
+#endif /* __FS_MSN_HANDSHAKE_H__ */
@@ -0,0 +1,842 @@
+/*
+ * Farsight2 - Farsight MSN Reactor
+ *
+ * fs-msn-reactor.c - Socket readiness dispatcher shared by the MSN streams
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The reactor owns a thread that waits on every socket of every MSN stream
+ * of a conference (listeners, connections being established and the media
+ * connections) and dispatches their readiness to per-socket callbacks. It
+ * uses epoll where available so that the cost of a wakeup does not depend on
+ * the number of sockets, and falls back to poll() elsewhere.
+ *
+ * Watches and timeouts are both identified by a non-zero id that is never
+ * reused. Callbacks run from the reactor thread without the reactor lock
+ * held, so they can add and remove sources. fs_msn_reactor_remove() called
+ * from another thread waits for a running callback of that source to return,
+ * so once it returns the callback's data can be freed. It must therefore
+ * never be called while holding a lock that the callback takes.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs-msn-reactor.h"
+
+#include "fs-msn-conference.h"
+
+#include <gst/gst.h>
+#include <gst/farsight/fs-conference-iface.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <sys/poll.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define GST_CAT_DEFAULT fsmsnconference_debug
+
+/* Events fetched by one epoll_wait() */
+#define MAX_EVENTS 64
+
+/* The id the wakeup pipe is registered with */
+#define WAKEUP_ID 0
+
+typedef struct _ReactorSource ReactorSource;
+
+struct _ReactorSource
+{
+  guint id;
+
+  /* Watches */
+  gint fd;
+  GIOCondition condition;
+  FsMsnReactorFunc watch_func;
+
+  /* Timeouts */
+  GSourceFunc timeout_func;
+  GstClockTime interval;
+  GstClockTime deadline;
+  GSequenceIter *iter;
+
+  gpointer user_data;
+
+  /* Removed while its callback was running, freed by the loop */
+  gboolean removed;
+};
+
+struct _FsMsnReactor
+{
+  GMutex *mutex;
+  GCond *cond;
+  GThread *thread;
+  gboolean quit;
+  /* Freed from a callback, the thread frees it when it exits */
+  gboolean free_on_exit;
+
+  /* id -> ReactorSource */
+  GHashTable *sources;
+  guint next_id;
+
+  /* Timeouts sorted by deadline */
+  GSequence *timeouts;
+
+  /* The source whose callback is running, 0 if none */
+  guint dispatching_id;
+
+  gint wakeup[2];
+  gboolean wakeup_pending;
+
+#ifdef HAVE_SYS_EPOLL_H
+  gint epoll_fd;
+#endif
+};
+
+static void
+fs_msn_reactor_wakeup_locked (FsMsnReactor *self)
+{
+  if (self->wakeup_pending || g_thread_self () == self->thread)
+    return;
+
+  while (write (self->wakeup[1], "", 1) < 0 && errno == EINTR);
+  self->wakeup_pending = TRUE;
+}
+
+static void
+fs_msn_reactor_drain_wakeup_locked (FsMsnReactor *self)
+{
+  gchar buf[16];
+
+  while (read (self->wakeup[0], buf, sizeof (buf)) > 0);
+  self->wakeup_pending = FALSE;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static guint32
+condition_to_epoll (GIOCondition condition)
+{
+  guint32 events = 0;
+
+  if (condition & G_IO_IN)
+    events |= EPOLLIN;
+  if (condition & G_IO_PRI)
+    events |= EPOLLPRI;
+  if (condition & G_IO_OUT)
+    events |= EPOLLOUT;
+
+  /* Errors and hangups are always reported */
+  return events;
+}
+
+static GIOCondition
+epoll_to_condition (guint32 events)
+{
+  GIOCondition condition = 0;
+
+  if (events & EPOLLIN)
+    condition |= G_IO_IN;
+  if (events & EPOLLPRI)
+    condition |= G_IO_PRI;
+  if (events & EPOLLOUT)
+    condition |= G_IO_OUT;
+  if (events & EPOLLERR)
+    condition |= G_IO_ERR;
+  if (events & EPOLLHUP)
+    condition |= G_IO_HUP;
+
+  return condition;
+}
+
+static gboolean
+fs_msn_reactor_epoll_ctl (FsMsnReactor *self, gint op, gint fd, guint id,
+                          GIOCondition condition)
+{
+  struct epoll_event event;
+
+  event.events = condition_to_epoll (condition);
+  event.data.u64 = 0;
+  event.data.u32 = id;
+
+  if (epoll_ctl (self->epoll_fd, op, fd, &event) < 0)
+    {
+      GST_WARNING ("epoll_ctl (%d) failed on fd %d: %s", op, fd,
+                   g_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+#else
+
+static gshort
+condition_to_poll (GIOCondition condition)
+{
+  gshort events = 0;
+
+  if (condition & G_IO_IN)
+    events |= POLLIN;
+  if (condition & G_IO_PRI)
+    events |= POLLPRI;
+  if (condition & G_IO_OUT)
+    events |= POLLOUT;
+
+  return events;
+}
+
+static GIOCondition
+poll_to_condition (gshort revents)
+{
+  GIOCondition condition = 0;
+
+  if (revents & POLLIN)
+    condition |= G_IO_IN;
+  if (revents & POLLPRI)
+    condition |= G_IO_PRI;
+  if (revents & POLLOUT)
+    condition |= G_IO_OUT;
+  if (revents & POLLERR)
+    condition |= G_IO_ERR;
+  if (revents & POLLHUP)
+    condition |= G_IO_HUP;
+  if (revents & POLLNVAL)
+    condition |= G_IO_NVAL;
+
+  return condition;
+}
+
+#endif
+
+static gint
+compare_deadlines (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const ReactorSource *source_a = a;
+  const ReactorSource *source_b = b;
+
+  if (source_a->deadline < source_b->deadline)
+    return -1;
+  else if (source_a->deadline > source_b->deadline)
+    return 1;
+  else if (source_a->id < source_b->id)
+    return -1;
+  else
+    return source_a->id > source_b->id;
+}
+
+/*
+ * Takes the source out of the lookup structures, it is not freed
+ */
+static void
+fs_msn_reactor_detach_locked (FsMsnReactor *self, ReactorSource *source)
+{
+  g_hash_table_remove (self->sources, GUINT_TO_POINTER (source->id));
+
+  if (source->watch_func)
+    {
+#ifdef HAVE_SYS_EPOLL_H
+      struct epoll_event event;
+
+      /* Fails harmlessly if the fd was closed first */
+      epoll_ctl (self->epoll_fd, EPOLL_CTL_DEL, source->fd, &event);
+#else
+      fs_msn_reactor_wakeup_locked (self);
+#endif
+    }
+  else if (source->iter)
+    {
+      g_sequence_remove (source->iter);
+      source->iter = NULL;
+    }
+}
+
+static ReactorSource *
+fs_msn_reactor_source_new_locked (FsMsnReactor *self, gpointer user_data)
+{
+  ReactorSource *source = g_slice_new0 (ReactorSource);
+
+  source->id = self->next_id++;
+  if (self->next_id == WAKEUP_ID)
+    self->next_id++;
+  source->fd = -1;
+  source->user_data = user_data;
+
+  g_hash_table_insert (self->sources, GUINT_TO_POINTER (source->id), source);
+
+  return source;
+}
+
+static void
+fs_msn_reactor_source_free (ReactorSource *source)
+{
+  g_slice_free (ReactorSource, source);
+}
+
+static void
+free_source (gpointer key, gpointer value, gpointer user_data)
+{
+  fs_msn_reactor_source_free (value);
+}
+
+/*
+ * Runs the callback of a source without the lock held. Returns TRUE if the
+ * source is still alive afterwards.
+ */
+static gboolean
+fs_msn_reactor_dispatch_locked (FsMsnReactor *self, ReactorSource *source,
+                                GIOCondition condition)
+{
+  gboolean keep;
+
+  self->dispatching_id = source->id;
+  g_mutex_unlock (self->mutex);
+
+  if (source->watch_func)
+    keep = source->watch_func (source->fd, condition, source->user_data);
+  else
+    keep = source->timeout_func (source->user_data);
+
+  g_mutex_lock (self->mutex);
+  self->dispatching_id = 0;
+  g_cond_broadcast (self->cond);
+
+  if (source->removed)
+    {
+      fs_msn_reactor_source_free (source);
+      return FALSE;
+    }
+  else if (!keep)
+    {
+      fs_msn_reactor_detach_locked (self, source);
+      fs_msn_reactor_source_free (source);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Returns the poll timeout in milliseconds until the next timeout expires
+ */
+static gint
+fs_msn_reactor_next_timeout_locked (FsMsnReactor *self)
+{
+  GSequenceIter *iter = g_sequence_get_begin_iter (self->timeouts);
+  ReactorSource *source;
+  GstClockTime now;
+
+  if (g_sequence_iter_is_end (iter))
+    return -1;
+
+  source = g_sequence_get (iter);
+  now = gst_util_get_timestamp ();
+
+  if (source->deadline <= now)
+    return 0;
+
+  /* Round up so that we don't wake up just before the deadline */
+  return MIN ((source->deadline - now + GST_MSECOND - 1) / GST_MSECOND,
+              G_MAXINT);
+}
+
+static void
+fs_msn_reactor_run_timeouts_locked (FsMsnReactor *self)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+  GList *rescheduled = NULL;
+  GList *item;
+
+  while (!self->quit)
+    {
+      GSequenceIter *iter = g_sequence_get_begin_iter (self->timeouts);
+      ReactorSource *source;
+
+      if (g_sequence_iter_is_end (iter))
+        break;
+
+      source = g_sequence_get (iter);
+      if (source->deadline > now)
+        break;
+
+      g_sequence_remove (iter);
+      source->iter = NULL;
+
+      if (fs_msn_reactor_dispatch_locked (self, source, 0))
+        rescheduled = g_list_prepend (rescheduled,
+                                      GUINT_TO_POINTER (source->id));
+    }
+
+  /* Reinserted afterwards so that a short interval can not starve the
+   * watches */
+  for (item = rescheduled; item; item = g_list_next (item))
+    {
+      /* It may have been removed by a later callback */
+      ReactorSource *source = g_hash_table_lookup (self->sources, item->data);
+
+      if (!source)
+        continue;
+
+      source->deadline = now + source->interval;
+      source->iter = g_sequence_insert_sorted (self->timeouts, source,
+                                               compare_deadlines, NULL);
+    }
+  g_list_free (rescheduled);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static void
+fs_msn_reactor_poll_locked (FsMsnReactor *self)
+{
+  struct epoll_event events[MAX_EVENTS];
+  gint timeout = fs_msn_reactor_next_timeout_locked (self);
+  gint n;
+  gint i;
+
+  g_mutex_unlock (self->mutex);
+  n = epoll_wait (self->epoll_fd, events, MAX_EVENTS, timeout);
+  g_mutex_lock (self->mutex);
+
+  if (n < 0)
+    {
+      if (errno != EINTR)
+        GST_WARNING ("epoll_wait() failed: %s", g_strerror (errno));
+      return;
+    }
+
+  for (i = 0; i < n && !self->quit; i++)
+    {
+      ReactorSource *source;
+
+      if (events[i].data.u32 == WAKEUP_ID)
+        {
+          fs_msn_reactor_drain_wakeup_locked (self);
+          continue;
+        }
+
+      /* Its watch may have been removed by an earlier callback */
+      source = g_hash_table_lookup (self->sources,
+                                    GUINT_TO_POINTER (events[i].data.u32));
+      if (source)
+        fs_msn_reactor_dispatch_locked (self, source,
+                                        epoll_to_condition (events[i].events));
+    }
+}
+
+#else
+
+typedef struct
+{
+  struct pollfd *fds;
+  guint *ids;
+  guint nfds;
+} PollSet;
+
+static void
+add_to_poll_set (gpointer key, gpointer value, gpointer user_data)
+{
+  ReactorSource *source = value;
+  PollSet *set = user_data;
+
+  if (!source->watch_func)
+    return;
+
+  set->fds[set->nfds].fd = source->fd;
+  set->fds[set->nfds].events = condition_to_poll (source->condition);
+  set->fds[set->nfds].revents = 0;
+  set->ids[set->nfds] = source->id;
+  set->nfds++;
+}
+
+static void
+fs_msn_reactor_poll_locked (FsMsnReactor *self)
+{
+  gint timeout = fs_msn_reactor_next_timeout_locked (self);
+  guint size = g_hash_table_size (self->sources) + 1;
+  PollSet set;
+  struct pollfd *fds;
+  guint *ids;
+  guint nfds;
+  gint n;
+  guint i;
+
+  set.fds = fds = g_new (struct pollfd, size);
+  set.ids = ids = g_new (guint, size);
+
+  fds[0].fd = self->wakeup[0];
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  ids[0] = WAKEUP_ID;
+  set.nfds = 1;
+
+  g_hash_table_foreach (self->sources, add_to_poll_set, &set);
+  nfds = set.nfds;
+
+  g_mutex_unlock (self->mutex);
+  n = poll (fds, nfds, timeout);
+  g_mutex_lock (self->mutex);
+
+  if (n < 0 && errno != EINTR)
+    GST_WARNING ("poll() failed: %s", g_strerror (errno));
+
+  for (i = 0; n > 0 && i < nfds && !self->quit; i++)
+    {
+      ReactorSource *source;
+
+      if (!fds[i].revents)
+        continue;
+
+      if (ids[i] == WAKEUP_ID)
+        {
+          fs_msn_reactor_drain_wakeup_locked (self);
+          continue;
+        }
+
+      source = g_hash_table_lookup (self->sources, GUINT_TO_POINTER (ids[i]));
+      if (source)
+        fs_msn_reactor_dispatch_locked (self, source,
+                                        poll_to_condition (fds[i].revents));
+    }
+
+  g_free (fds);
+  g_free (ids);
+}
+
+#endif
+
+static void fs_msn_reactor_destroy (FsMsnReactor *self);
+
+static gpointer
+fs_msn_reactor_thread (gpointer data)
+{
+  FsMsnReactor *self = data;
+  gboolean free_on_exit;
+
+  g_mutex_lock (self->mutex);
+  while (!self->quit)
+    {
+      fs_msn_reactor_poll_locked (self);
+      if (!self->quit)
+        fs_msn_reactor_run_timeouts_locked (self);
+    }
+  free_on_exit = self->free_on_exit;
+  g_mutex_unlock (self->mutex);
+
+  if (free_on_exit)
+    fs_msn_reactor_destroy (self);
+
+  return NULL;
+}
+
+/**
+ * fs_msn_reactor_new:
+ * @error: location of a #GError, or NULL if no error occured
+ *
+ * Creates a new reactor and starts its thread.
+ *
+ * Returns: a new #FsMsnReactor or NULL on error
+ */
+FsMsnReactor *
+fs_msn_reactor_new (GError **error)
+{
+  FsMsnReactor *self = g_slice_new0 (FsMsnReactor);
+  GError *thread_error = NULL;
+
+  self->next_id = WAKEUP_ID + 1;
+  self->wakeup[0] = self->wakeup[1] = -1;
+
+  if (pipe (self->wakeup) < 0)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not create the reactor wakeup pipe: %s",
+                   g_strerror (errno));
+      g_slice_free (FsMsnReactor, self);
+      return NULL;
+    }
+
+  fcntl (self->wakeup[0], F_SETFL, fcntl (self->wakeup[0], F_GETFL) |
+         O_NONBLOCK);
+  fcntl (self->wakeup[1], F_SETFL, fcntl (self->wakeup[1], F_GETFL) |
+         O_NONBLOCK);
+
+#ifdef HAVE_SYS_EPOLL_H
+  self->epoll_fd = epoll_create (MAX_EVENTS);
+  if (self->epoll_fd < 0)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not create the epoll instance: %s",
+                   g_strerror (errno));
+      close (self->wakeup[0]);
+      close (self->wakeup[1]);
+      g_slice_free (FsMsnReactor, self);
+      return NULL;
+    }
+  fcntl (self->epoll_fd, F_SETFD, FD_CLOEXEC);
+
+  fs_msn_reactor_epoll_ctl (self, EPOLL_CTL_ADD, self->wakeup[0], WAKEUP_ID,
+                            G_IO_IN);
+#endif
+
+  self->mutex = g_mutex_new ();
+  self->cond = g_cond_new ();
+  self->sources = g_hash_table_new (g_direct_hash, g_direct_equal);
+  self->timeouts = g_sequence_new (NULL);
+
+  g_mutex_lock (self->mutex);
+  self->thread = g_thread_create (fs_msn_reactor_thread, self, TRUE,
+                                  &thread_error);
+  g_mutex_unlock (self->mutex);
+
+  if (!self->thread)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not start the reactor thread: %s",
+                   thread_error->message);
+      g_clear_error (&thread_error);
+      fs_msn_reactor_free (self);
+      return NULL;
+    }
+
+  return self;
+}
+
+static void
+fs_msn_reactor_destroy (FsMsnReactor *reactor)
+{
+  if (g_hash_table_size (reactor->sources))
+    GST_WARNING ("Freeing a reactor with %u sources left",
+                 g_hash_table_size (reactor->sources));
+
+  g_hash_table_foreach (reactor->sources, free_source, NULL);
+
+  g_hash_table_destroy (reactor->sources);
+  g_sequence_free (reactor->timeouts);
+  g_cond_free (reactor->cond);
+  g_mutex_free (reactor->mutex);
+
+#ifdef HAVE_SYS_EPOLL_H
+  close (reactor->epoll_fd);
+#endif
+  close (reactor->wakeup[0]);
+  close (reactor->wakeup[1]);
+
+  g_slice_free (FsMsnReactor, reactor);
+}
+
+/**
+ * fs_msn_reactor_free:
+ * @reactor: a #FsMsnReactor
+ *
+ * Stops the reactor thread and frees the reactor. Its sources are dropped
+ * without their callbacks being called. If it is called from a callback, the
+ * reactor is freed by its thread once the callback returns.
+ */
+void
+fs_msn_reactor_free (FsMsnReactor *reactor)
+{
+  if (reactor->thread)
+    {
+      g_mutex_lock (reactor->mutex);
+      reactor->quit = TRUE;
+      if (g_thread_self () == reactor->thread)
+        {
+          reactor->free_on_exit = TRUE;
+          g_mutex_unlock (reactor->mutex);
+          return;
+        }
+      fs_msn_reactor_wakeup_locked (reactor);
+      g_mutex_unlock (reactor->mutex);
+
+      g_thread_join (reactor->thread);
+    }
+
+  fs_msn_reactor_destroy (reactor);
+}
+
+/**
+ * fs_msn_reactor_add_watch:
+ * @reactor: a #FsMsnReactor
+ * @fd: the file descriptor to watch
+ * @condition: the conditions to watch for, errors and hangups are always
+ *  reported
+ * @func: called from the reactor thread when @fd is ready
+ * @user_data: passed to @func
+ *
+ * Adds a watch on @fd. There must be at most one watch per file descriptor.
+ *
+ * Returns: the id of the watch, 0 on error
+ */
+guint
+fs_msn_reactor_add_watch (FsMsnReactor *reactor,
+                          gint fd,
+                          GIOCondition condition,
+                          FsMsnReactorFunc func,
+                          gpointer user_data)
+{
+  ReactorSource *source;
+  guint id;
+
+  g_return_val_if_fail (fd >= 0, 0);
+  g_return_val_if_fail (func, 0);
+
+  g_mutex_lock (reactor->mutex);
+
+  source = fs_msn_reactor_source_new_locked (reactor, user_data);
+  source->fd = fd;
+  source->condition = condition;
+  source->watch_func = func;
+  id = source->id;
+
+#ifdef HAVE_SYS_EPOLL_H
+  if (!fs_msn_reactor_epoll_ctl (reactor, EPOLL_CTL_ADD, fd, id, condition))
+    {
+      g_hash_table_remove (reactor->sources, GUINT_TO_POINTER (id));
+      fs_msn_reactor_source_free (source);
+      id = 0;
+    }
+#else
+  fs_msn_reactor_wakeup_locked (reactor);
+#endif
+
+  g_mutex_unlock (reactor->mutex);
+
+  return id;
+}
+
+/**
+ * fs_msn_reactor_set_watch_condition:
+ * @reactor: a #FsMsnReactor
+ * @id: the id of a watch
+ * @condition: the new conditions to watch for
+ *
+ * Changes the conditions a watch waits for.
+ */
+void
+fs_msn_reactor_set_watch_condition (FsMsnReactor *reactor,
+                                    guint id,
+                                    GIOCondition condition)
+{
+  ReactorSource *source;
+
+  g_mutex_lock (reactor->mutex);
+
+  source = g_hash_table_lookup (reactor->sources, GUINT_TO_POINTER (id));
+  if (source && source->watch_func && source->condition != condition)
+    {
+      source->condition = condition;
+#ifdef HAVE_SYS_EPOLL_H
+      fs_msn_reactor_epoll_ctl (reactor, EPOLL_CTL_MOD, source->fd, id,
+                                condition);
+#else
+      fs_msn_reactor_wakeup_locked (reactor);
+#endif
+    }
+
+  g_mutex_unlock (reactor->mutex);
+}
+
+/**
+ * fs_msn_reactor_add_timeout:
+ * @reactor: a #FsMsnReactor
+ * @interval: the time between calls to @func in milliseconds
+ * @func: called from the reactor thread, return FALSE to remove the timeout
+ * @user_data: passed to @func
+ *
+ * Adds a timeout, like g_timeout_add().
+ *
+ * Returns: the id of the timeout
+ */
+guint
+fs_msn_reactor_add_timeout (FsMsnReactor *reactor,
+                            guint interval,
+                            GSourceFunc func,
+                            gpointer user_data)
+{
+  ReactorSource *source;
+  GSequenceIter *first;
+  guint id;
+
+  g_return_val_if_fail (func, 0);
+
+  g_mutex_lock (reactor->mutex);
+
+  source = fs_msn_reactor_source_new_locked (reactor, user_data);
+  source->timeout_func = func;
+  source->interval = interval * GST_MSECOND;
+  source->deadline = gst_util_get_timestamp () + source->interval;
+  source->iter = g_sequence_insert_sorted (reactor->timeouts, source,
+                                           compare_deadlines, NULL);
+  id = source->id;
+
+  /* The thread has to recompute its poll timeout */
+  first = g_sequence_get_begin_iter (reactor->timeouts);
+  if (first == source->iter)
+    fs_msn_reactor_wakeup_locked (reactor);
+
+  g_mutex_unlock (reactor->mutex);
+
+  return id;
+}
+
+/**
+ * fs_msn_reactor_remove:
+ * @reactor: a #FsMsnReactor
+ * @id: the id of a watch or of a timeout
+ *
+ * Removes a watch or a timeout, it is not an error if it has already been
+ * removed. If its callback is running in the reactor thread, this waits for
+ * it to return, unless it is called from the reactor thread itself.
+ */
+void
+fs_msn_reactor_remove (FsMsnReactor *reactor,
+                       guint id)
+{
+  ReactorSource *source;
+
+  if (id == WAKEUP_ID)
+    return;
+
+  g_mutex_lock (reactor->mutex);
+
+  source = g_hash_table_lookup (reactor->sources, GUINT_TO_POINTER (id));
+  if (source)
+    {
+      fs_msn_reactor_detach_locked (reactor, source);
+
+      if (reactor->dispatching_id == id)
+        {
+          /* The loop frees it when the callback returns */
+          source->removed = TRUE;
+
+          if (g_thread_self () != reactor->thread)
+            while (reactor->dispatching_id == id)
+              g_cond_wait (reactor->cond, reactor->mutex);
+        }
+      else
+        {
+          fs_msn_reactor_source_free (source);
+        }
+    }
+
+  g_mutex_unlock (reactor->mutex);
+}
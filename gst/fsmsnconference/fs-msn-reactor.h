@@ -0,0 +1,63 @@
+/*
+ * Farsight2 - Farsight MSN Reactor
+ *
+ * fs-msn-reactor.h - Socket readiness dispatcher shared by the MSN streams
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_MSN_REACTOR_H__
+#define __FS_MSN_REACTOR_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Private declaration */
+typedef struct _FsMsnReactor FsMsnReactor;
+
+/*
+ * Called from the reactor thread when @fd is ready, return FALSE to remove
+ * the watch.
+ */
+typedef gboolean (*FsMsnReactorFunc) (gint fd,
+                                      GIOCondition condition,
+                                      gpointer user_data);
+
+FsMsnReactor *fs_msn_reactor_new (GError **error);
+
+void fs_msn_reactor_free (FsMsnReactor *reactor);
+
+guint fs_msn_reactor_add_watch (FsMsnReactor *reactor,
+                                gint fd,
+                                GIOCondition condition,
+                                FsMsnReactorFunc func,
+                                gpointer user_data);
+
+void fs_msn_reactor_set_watch_condition (FsMsnReactor *reactor,
+                                         guint id,
+                                         GIOCondition condition);
+
+guint fs_msn_reactor_add_timeout (FsMsnReactor *reactor,
+                                  guint interval,
+                                  GSourceFunc func,
+                                  gpointer user_data);
+
+void fs_msn_reactor_remove (FsMsnReactor *reactor,
+                            guint id);
+
+G_END_DECLS
+
+#endif /* __FS_MSN_REACTOR_H__ */
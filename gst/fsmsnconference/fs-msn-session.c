@@ -25,7 +25,34 @@
  * SECTION:fs-msn-session
  * @short_description: A  MSN session in a #FsMsnConference
  *
+ * The session keeps a small pool of send and receive chains (the valve,
+ * colorspace converter, Mimic codec and socket element of a stream, in a
+ * #GstBin) already in the READY state. A new stream takes one from the pool
+ * instead of creating and starting its elements, and gives it back when it
+ * is disposed. The branches of the shared encoder described below are
+ * pooled the same way.
  *
+ * The colorspace converter of a chain is taken out of the data path as soon
+ * as the codec (when sending) or the downstream element (when receiving)
+ * accepts the raw video caps as they are, and put back if the caps change
+ * to something that needs converting.
+ *
+ * The camera is linked to the session's #FsSession:sink-pad, which is fed
+ * to a single encoder. That encoder drops everything until the first
+ * sending stream is created, it is then linked to a tee and every sending
+ * stream gets a branch of that tee with its own socket sink. Each sink
+ * queues at most #FsMsnFrameSink:max-queued-bytes and drops frames until
+ * the next keyframe when its peer can not keep up, so a slow peer never
+ * holds back the others. Each branch starts sending at the next keyframe.
+ * If the #FsStream:sink-pad of a sending stream is linked instead, its
+ * branch gets an encoder of its own.
+ *
+ * Each socket sink drops frames until the next keyframe while the data
+ * waiting in it takes more than the #FsMsnStream:max-latency of its stream
+ * to reach the peer, so a late peer only loses frames of its own. Raw frames
+ * are also dropped in front of every encoder, which slows down only when
+ * even the fastest of the sinks it feeds is late, and speeds up again once
+ * that one is well under its target.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -42,6 +69,15 @@
 
 #define GST_CAT_DEFAULT fsmsnconference_debug
 
+/* Number of idle chains of each direction kept by the session */
+#define CHAIN_POOL_SIZE 2
+
+/* Rate control in front of the encoders */
+#define RATE_ADJUST_PERIOD (250 * GST_MSECOND)
+#define MIN_FRAME_INTERVAL (50 * GST_MSECOND)
+#define MAX_FRAME_INTERVAL GST_SECOND
+#define FRAME_INTERVAL_STEP (10 * GST_MSECOND)
+
 /* Signals */
 enum
 {
@@ -54,6 +90,7 @@ enum
   PROP_0,
   PROP_MEDIA_TYPE,
   PROP_ID,
+  PROP_SINK_PAD,
   PROP_CODEC_PREFERENCES,
   PROP_CONFERENCE
 };
@@ -68,6 +105,20 @@ struct _FsMsnSessionPrivate
 
     /* These lists are protected by the session mutex */
     GList *streams;
+    /* Idle chains in the READY state */
+    GList *send_chains;
+    GList *recv_chains;
+
+    /* The shared encoder, its tee and the number of branches on it */
+    GstElement *encoder;
+    GstElement *tee;
+    GstElement *tee_fakesink;
+    GstPad *media_sink_pad;
+    guint n_branches;
+    /* All the branches, including those with an encoder of their own */
+    GList *branches;
+    /* Idle branches, in the READY state */
+    GList *idle_branches;
 
     GError *construction_error;
 
@@ -104,6 +155,52 @@ static FsStream *fs_msn_session_new_stream (FsSession *session,
 static void _remove_stream (gpointer user_data,
                             GObject *where_the_object_was);
 
+/*
+ * The pads around the colorspace converter of a chain, the converter is
+ * linked between @pad and @next unless it is bypassed.
+ */
+typedef struct {
+  GstPad *pad;
+  GstPad *convert_sink, *convert_src;
+  GstPad *next;
+  /* The pad that must accept the caps to bypass the converter, or whose
+   * peer must if @check_peer is set */
+  GstPad *check;
+  gboolean check_peer;
+  /* Last caps seen on @pad */
+  GstCaps *caps;
+} ChainBypass;
+
+/*
+ * The state of the frame dropping in front of an encoder. The sinks are the
+ * socket sinks fed by the encoder, with the max-latency of their stream.
+ */
+typedef struct {
+  GMutex *mutex;
+  GList *sinks;
+  GstClockTime frame_interval;
+  GstClockTime last_frame;
+  GstClockTime last_adjust;
+  guint64 frames_dropped;
+} RateControl;
+
+typedef struct {
+  GstElement *sink;
+  guint max_latency;
+} RateSink;
+
+static GstElement *fs_msn_session_build_chain (FsStreamDirection direction,
+                                               GError **error);
+static void fs_msn_session_destroy_chain (GstElement *chain);
+
+static GstElement *fs_msn_session_build_encoder (GError **error);
+static GstElement *fs_msn_session_build_branch (GError **error);
+static gboolean fs_msn_session_add_encoder (FsMsnSession *self,
+                                            GstElement *encoder,
+                                            GError **error);
+static gboolean fs_msn_session_start_encoder (FsMsnSession *self,
+                                              GError **error);
+
 static GObjectClass *parent_class = NULL;
 
 static void
@@ -126,6 +223,8 @@ fs_msn_session_class_init (FsMsnSessionClass *klass)
                                     PROP_MEDIA_TYPE, "media-type");
   g_object_class_override_property (gobject_class,
                                     PROP_ID, "id");
+  g_object_class_override_property (gobject_class,
+                                    PROP_SINK_PAD, "sink-pad");
 
   g_object_class_install_property (gobject_class,
                                    PROP_CONFERENCE,
@@ -154,7 +253,7 @@ fs_msn_session_init (FsMsnSession *self)
   self->priv->media_type = FS_MEDIA_TYPE_LAST + 1;
 }
 
-/*static void
+static void
 stop_and_remove (GstBin *conf, GstElement **element, gboolean unref)
 {
   if (*element == NULL)
@@ -166,7 +265,7 @@ stop_and_remove (GstBin *conf, GstElement **element, gboolean unref)
   if (unref)
     gst_object_unref (*element);
   *element = NULL;
-}*/
+}
 
 static void
 fs_msn_session_dispose (GObject *object)
@@ -180,10 +279,34 @@ fs_msn_session_dispose (GObject *object)
 
   conferencebin = GST_BIN (self->priv->conference);
 
-  FS_MSN_SESSION_UNLOCK (self);
-
-  /* MAKE sure dispose does not run twice. */
+  FS_MSN_SESSION_LOCK (self);
+  /* MAKE sure dispose does not run twice, chains released after this are
+   * destroyed. */
   self->priv->disposed = TRUE;
+  g_list_foreach (self->priv->send_chains,
+                  (GFunc) fs_msn_session_destroy_chain, NULL);
+  g_list_free (self->priv->send_chains);
+  self->priv->send_chains = NULL;
+  g_list_foreach (self->priv->recv_chains,
+                  (GFunc) fs_msn_session_destroy_chain, NULL);
+  g_list_free (self->priv->recv_chains);
+  self->priv->recv_chains = NULL;
+  g_list_foreach (self->priv->idle_branches,
+                  (GFunc) fs_msn_session_destroy_chain, NULL);
+  g_list_free (self->priv->idle_branches);
+  self->priv->idle_branches = NULL;
+
+  if (self->priv->media_sink_pad)
+    {
+      gst_pad_set_active (self->priv->media_sink_pad, FALSE);
+      gst_element_remove_pad (GST_ELEMENT (conferencebin),
+                              self->priv->media_sink_pad);
+      self->priv->media_sink_pad = NULL;
+    }
+  stop_and_remove (conferencebin, &self->priv->encoder, FALSE);
+  stop_and_remove (conferencebin, &self->priv->tee_fakesink, FALSE);
+  stop_and_remove (conferencebin, &self->priv->tee, FALSE);
+  FS_MSN_SESSION_UNLOCK (self);
 
   parent_class->dispose (object);
 }
@@ -214,6 +337,11 @@ fs_msn_session_get_property (GObject *object,
       case PROP_ID:
         g_value_set_uint (value, self->id);
         break;
+      case PROP_SINK_PAD:
+        FS_MSN_SESSION_LOCK (self);
+        g_value_set_object (value, self->priv->media_sink_pad);
+        FS_MSN_SESSION_UNLOCK (self);
+        break;
       case PROP_CONFERENCE:
         g_value_set_object (value, self->priv->conference);
         break;
@@ -251,9 +379,1179 @@ fs_msn_session_set_property (GObject *object,
 static void
 fs_msn_session_constructed (GObject *object)
 {
+  FsMsnSession *self = FS_MSN_SESSION (object);
+  GstElement *chain;
+  GstPad *pad;
+  GError *error = NULL;
+  gchar *name;
+
+  /* The sink pad exists from the start. The shared encoder behind it drops
+   * everything until the first sending stream links it to its tee. If it
+   * can not be built, the pad has no target and the sending streams get a
+   * chain of their own. */
+  name = g_strdup_printf ("sink_%u", self->id);
+  self->priv->encoder = fs_msn_session_build_encoder (&error);
+  if (self->priv->encoder &&
+      !fs_msn_session_add_encoder (self, self->priv->encoder, &error))
+    self->priv->encoder = NULL;
+
+  if (self->priv->encoder)
+    {
+      pad = gst_element_get_static_pad (self->priv->encoder, "sink");
+      self->priv->media_sink_pad = gst_ghost_pad_new (name, pad);
+      gst_object_unref (pad);
+    }
+  else
+    {
+      GST_WARNING ("Could not prepare the shared encoder: %s",
+                   error->message);
+      g_clear_error (&error);
+      self->priv->media_sink_pad = gst_ghost_pad_new_no_target (name,
+                                   GST_PAD_SINK);
+    }
+  g_free (name);
+
+  gst_pad_set_active (self->priv->media_sink_pad, TRUE);
+  if (!gst_element_add_pad (GST_ELEMENT (self->priv->conference),
+                            self->priv->media_sink_pad))
+    {
+      self->priv->construction_error = g_error_new (FS_ERROR,
+          FS_ERROR_CONSTRUCTION,
+          "Could not add the sink pad to the FsMsnConference");
+      gst_object_unref (self->priv->media_sink_pad);
+      self->priv->media_sink_pad = NULL;
+      return;
+    }
+
+  /* Warm up a receive chain, a missing element is only reported when a
+   * stream needs it. Sending streams are branches of the shared encoder,
+   * they only need a chain of their own if it can not be started. */
+  chain = fs_msn_session_build_chain (FS_DIRECTION_RECV, &error);
+  if (chain)
+    self->priv->recv_chains = g_list_prepend (NULL, chain);
+  else
+    GST_WARNING ("Could not prepare a receive chain: %s", error->message);
+  g_clear_error (&error);
+
+  /* And a branch, its socket sink is only started with a connection */
+  if (self->priv->encoder)
+    {
+      chain = fs_msn_session_build_branch (&error);
+      if (chain)
+        {
+          gst_element_set_state (chain, GST_STATE_READY);
+          self->priv->idle_branches = g_list_prepend (NULL, chain);
+        }
+      else
+        {
+          GST_WARNING ("Could not prepare a branch: %s", error->message);
+        }
+      g_clear_error (&error);
+    }
+
   GST_CALL_PARENT (G_OBJECT_CLASS, constructed, (object));
 }
 
+static GstElement *
+fs_msn_session_add_element (GstElement *chain,
+                            const gchar *factory,
+                            const gchar *name,
+                            GError **error)
+{
+  GstElement *element = gst_element_factory_make (factory, name);
+
+  if (!element)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not create the %s element", factory);
+      return NULL;
+    }
+
+  if (!gst_bin_add (GST_BIN (chain), element))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not add the %s element to the chain", factory);
+      gst_object_unref (element);
+      return NULL;
+    }
+
+  return element;
+}
+
+static void
+fs_msn_session_bypass_free (gpointer data)
+{
+  ChainBypass *bypass = data;
+
+  gst_object_unref (bypass->pad);
+  gst_object_unref (bypass->convert_sink);
+  gst_object_unref (bypass->convert_src);
+  gst_object_unref (bypass->next);
+  gst_object_unref (bypass->check);
+  gst_caps_replace (&bypass->caps, NULL);
+  g_slice_free (ChainBypass, bypass);
+}
+
+/*
+ * Links the converter in or out of the data path. If a link fails, the
+ * original path is restored so the stream keeps going through the way
+ * that worked until now.
+ */
+static void
+fs_msn_session_bypass_relink (ChainBypass *bypass, gboolean direct)
+{
+  GstPad *peer = gst_pad_get_peer (bypass->pad);
+  GstPadLinkReturn ret;
+
+  if (direct && peer == bypass->convert_sink)
+    {
+      if (!gst_pad_unlink (bypass->pad, bypass->convert_sink))
+        {
+          GST_WARNING ("Could not unlink the colorspace converter");
+          goto out;
+        }
+      gst_pad_unlink (bypass->convert_src, bypass->next);
+
+      ret = gst_pad_link (bypass->pad, bypass->next);
+      if (GST_PAD_LINK_FAILED (ret))
+        {
+          GST_WARNING ("Could not bypass the colorspace converter (%d),"
+                       " keeping it", ret);
+          gst_pad_link (bypass->pad, bypass->convert_sink);
+          gst_pad_link (bypass->convert_src, bypass->next);
+        }
+    }
+  else if (!direct && peer == bypass->next)
+    {
+      if (!gst_pad_unlink (bypass->pad, bypass->next))
+        {
+          GST_WARNING ("Could not unlink the colorspace converter bypass");
+          goto out;
+        }
+
+      ret = gst_pad_link (bypass->pad, bypass->convert_sink);
+      if (!GST_PAD_LINK_FAILED (ret))
+        {
+          ret = gst_pad_link (bypass->convert_src, bypass->next);
+          if (GST_PAD_LINK_FAILED (ret))
+            gst_pad_unlink (bypass->pad, bypass->convert_sink);
+        }
+
+      if (GST_PAD_LINK_FAILED (ret))
+        {
+          GST_WARNING ("Could not link the colorspace converter (%d),"
+                       " bypassing it", ret);
+          gst_pad_link (bypass->pad, bypass->next);
+        }
+    }
+
+ out:
+  if (peer)
+    gst_object_unref (peer);
+}
+
+/*
+ * Checks the caps of every new format before it reaches the converter. The
+ * pad is relinked from its own buffer probe, which is safe because
+ * gst_pad_push() only looks up the peer once the probes have run, so this
+ * buffer already goes the new way.
+ */
+static gboolean
+fs_msn_session_bypass_probe (GstPad *pad, GstBuffer *buffer,
+                             gpointer user_data)
+{
+  ChainBypass *bypass = user_data;
+  GstCaps *caps = GST_BUFFER_CAPS (buffer);
+  gboolean direct;
+
+  if (!caps || caps == bypass->caps ||
+      (bypass->caps && gst_caps_is_equal (caps, bypass->caps)))
+    return TRUE;
+
+  gst_caps_replace (&bypass->caps, caps);
+
+  if (bypass->check_peer)
+    direct = gst_pad_peer_accept_caps (bypass->check, caps);
+  else
+    direct = gst_pad_accept_caps (bypass->check, caps);
+
+  GST_DEBUG ("%s the colorspace converter for %" GST_PTR_FORMAT,
+             direct ? "Bypassing" : "Using", caps);
+
+  fs_msn_session_bypass_relink (bypass, direct);
+
+  return TRUE;
+}
+
+/*
+ * Sets up the bypass around @colorspace, which is linked between @prev and
+ * @next. The caps are checked on the sink pad of @next when sending, and
+ * by the peer of the src pad of @next (outside of the chain) when receiving.
+ */
+static void
+fs_msn_session_add_bypass (GstElement *chain, GstElement *prev,
+                           GstElement *colorspace, GstElement *next,
+                           gboolean check_peer)
+{
+  ChainBypass *bypass = g_slice_new0 (ChainBypass);
+
+  bypass->pad = gst_element_get_static_pad (prev, "src");
+  bypass->convert_sink = gst_element_get_static_pad (colorspace, "sink");
+  bypass->convert_src = gst_element_get_static_pad (colorspace, "src");
+  bypass->next = gst_element_get_static_pad (next, "sink");
+  if (check_peer)
+    bypass->check = gst_element_get_static_pad (next, "src");
+  else
+    bypass->check = gst_object_ref (bypass->next);
+  bypass->check_peer = check_peer;
+
+  g_object_set_data_full (G_OBJECT (chain), "bypass", bypass,
+                          fs_msn_session_bypass_free);
+
+  gst_pad_add_buffer_probe (bypass->pad,
+                            G_CALLBACK (fs_msn_session_bypass_probe), bypass);
+}
+
+static void
+fs_msn_session_rate_control_reset (RateControl *rc)
+{
+  rc->frame_interval = 0;
+  rc->last_frame = GST_CLOCK_TIME_NONE;
+  rc->last_adjust = GST_CLOCK_TIME_NONE;
+  rc->frames_dropped = 0;
+}
+
+static void
+fs_msn_session_rate_control_free (gpointer data)
+{
+  RateControl *rc = data;
+  GList *item;
+
+  for (item = rc->sinks; item; item = g_list_next (item))
+    {
+      RateSink *rsink = item->data;
+
+      gst_object_unref (rsink->sink);
+      g_slice_free (RateSink, rsink);
+    }
+  g_list_free (rc->sinks);
+  g_mutex_free (rc->mutex);
+  g_slice_free (RateControl, rc);
+}
+
+static GList *
+fs_msn_session_rate_control_find (RateControl *rc, GstElement *sink)
+{
+  GList *item;
+
+  for (item = rc->sinks; item; item = g_list_next (item))
+    if (((RateSink *) item->data)->sink == sink)
+      return item;
+
+  return NULL;
+}
+
+/* Adds @sink to the sinks fed by the encoder or updates its max-latency */
+static void
+fs_msn_session_rate_control_set_sink (RateControl *rc, GstElement *sink,
+                                      guint max_latency)
+{
+  GList *item;
+  RateSink *rsink;
+
+  g_mutex_lock (rc->mutex);
+  item = fs_msn_session_rate_control_find (rc, sink);
+  if (item)
+    {
+      rsink = item->data;
+    }
+  else
+    {
+      rsink = g_slice_new (RateSink);
+      rsink->sink = gst_object_ref (sink);
+      rc->sinks = g_list_prepend (rc->sinks, rsink);
+    }
+  rsink->max_latency = max_latency;
+  g_mutex_unlock (rc->mutex);
+
+  g_object_set (sink, "max-latency", (guint64) max_latency * GST_MSECOND,
+                NULL);
+}
+
+/* Returns the max-latency of @sink, or 0 if the encoder did not feed it */
+static guint
+fs_msn_session_rate_control_remove_sink (RateControl *rc, GstElement *sink)
+{
+  GList *item;
+  RateSink *rsink;
+  guint max_latency = 0;
+
+  g_mutex_lock (rc->mutex);
+  item = fs_msn_session_rate_control_find (rc, sink);
+  if (item)
+    {
+      rsink = item->data;
+      max_latency = rsink->max_latency;
+      rc->sinks = g_list_delete_link (rc->sinks, item);
+      gst_object_unref (rsink->sink);
+      g_slice_free (RateSink, rsink);
+    }
+  g_mutex_unlock (rc->mutex);
+
+  g_object_set (sink, "max-latency", G_GUINT64_CONSTANT (0), NULL);
+
+  return max_latency;
+}
+
+/*
+ * Drops raw frames before the encoder when none of the sinks it feeds can
+ * keep up. The late sinks drop frames on their own, so the encoder follows
+ * the fastest one: the minimum interval between two frames is doubled while
+ * every sink is late and lowered step by step once one of them is well under
+ * its target. The sinks are only looked at once per RATE_ADJUST_PERIOD.
+ * Dropping before the encoder never breaks the chain of P-frames, mimenc
+ * still decides when to send keyframes.
+ */
+static gboolean
+fs_msn_session_rate_control_probe (GstPad *pad, GstBuffer *buffer,
+                                   gpointer user_data)
+{
+  RateControl *rc = user_data;
+  GstClockTime now = gst_util_get_timestamp ();
+  gboolean enabled = FALSE;
+  gboolean keep = TRUE;
+  GList *item;
+
+  g_mutex_lock (rc->mutex);
+
+  for (item = rc->sinks; item && !enabled; item = g_list_next (item))
+    enabled = (((RateSink *) item->data)->max_latency != 0);
+
+  if (!enabled)
+    {
+      rc->frame_interval = 0;
+    }
+  else if (!GST_CLOCK_TIME_IS_VALID (rc->last_adjust) ||
+           now - rc->last_adjust >= RATE_ADJUST_PERIOD)
+    {
+      gboolean late = TRUE, early = FALSE;
+
+      for (item = rc->sinks; item; item = g_list_next (item))
+        {
+          RateSink *rsink = item->data;
+          GstClockTime target = rsink->max_latency * GST_MSECOND;
+          guint64 latency = 0;
+
+          if (!target)
+            continue;
+
+          g_object_get (rsink->sink, "backlog-latency", &latency, NULL);
+          if (latency <= target)
+            late = FALSE;
+          if (latency < target / 2)
+            early = TRUE;
+        }
+
+      if (late)
+        rc->frame_interval = CLAMP (rc->frame_interval * 2,
+                                    MIN_FRAME_INTERVAL, MAX_FRAME_INTERVAL);
+      else if (early)
+        rc->frame_interval = rc->frame_interval > FRAME_INTERVAL_STEP ?
+          rc->frame_interval - FRAME_INTERVAL_STEP : 0;
+
+      rc->last_adjust = now;
+    }
+
+  if (rc->frame_interval && GST_CLOCK_TIME_IS_VALID (rc->last_frame) &&
+      now - rc->last_frame < rc->frame_interval)
+    {
+      rc->frames_dropped++;
+      keep = FALSE;
+    }
+  else
+    {
+      rc->last_frame = now;
+    }
+
+  g_mutex_unlock (rc->mutex);
+
+  return keep;
+}
+
+/*
+ * Sets up the frame dropping on the src pad of @valve, which is in front of
+ * the colorspace converter and the encoder of @encoder
+ */
+static void
+fs_msn_session_add_rate_control (GstElement *encoder, GstElement *valve)
+{
+  RateControl *rc = g_slice_new0 (RateControl);
+  GstPad *pad;
+
+  rc->mutex = g_mutex_new ();
+  fs_msn_session_rate_control_reset (rc);
+
+  g_object_set_data_full (G_OBJECT (encoder), "rate-control", rc,
+                          fs_msn_session_rate_control_free);
+
+  pad = gst_element_get_static_pad (valve, "src");
+  gst_pad_add_buffer_probe (pad,
+                            G_CALLBACK (fs_msn_session_rate_control_probe), rc);
+  gst_object_unref (pad);
+}
+
+/*
+ * Builds the elements of a stream in a bin and brings them to READY. The
+ * socket element is named "fd", the valve "valve" and the bin has a "sink"
+ * or "src" ghost pad depending on the direction.
+ */
+static GstElement *
+fs_msn_session_build_chain (FsStreamDirection direction, GError **error)
+{
+  GstElement *chain = gst_bin_new (NULL);
+  GstElement *valve, *colorspace, *codec, *fd;
+  GstPad *pad;
+
+  if (!(valve = fs_msn_session_add_element (chain, "fsvalve", "valve",
+                                            error)) ||
+      !(colorspace = fs_msn_session_add_element (chain, "ffmpegcolorspace",
+                                                 NULL, error)))
+    goto error;
+
+  if (direction == FS_DIRECTION_SEND)
+    {
+      if (!(codec = fs_msn_session_add_element (chain, "mimenc", NULL,
+                                                error)) ||
+          !(fd = fs_msn_session_add_element (chain, "fsmsnframesink", "fd",
+                                             error)))
+        goto error;
+
+      g_object_set (valve, "drop", TRUE, NULL);
+
+      if (!gst_element_link_many (valve, colorspace, codec, fd, NULL))
+        {
+          g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                       "Could not link the send chain");
+          goto error;
+        }
+
+      fs_msn_session_add_bypass (chain, valve, colorspace, codec, FALSE);
+      fs_msn_session_add_rate_control (chain, valve);
+
+      pad = gst_element_get_static_pad (valve, "sink");
+      gst_element_add_pad (chain, gst_ghost_pad_new ("sink", pad));
+      gst_object_unref (pad);
+    }
+  else
+    {
+      if (!(codec = fs_msn_session_add_element (chain, "mimdec", NULL,
+                                                error)) ||
+          !(fd = fs_msn_session_add_element (chain, "fsmsnframesrc", "fd",
+                                             error)))
+        goto error;
+
+      g_object_set (valve, "drop", FALSE, NULL);
+
+      if (!gst_element_link_many (fd, codec, colorspace, valve, NULL))
+        {
+          g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                       "Could not link the receive chain");
+          goto error;
+        }
+
+      fs_msn_session_add_bypass (chain, codec, colorspace, valve, TRUE);
+
+      pad = gst_element_get_static_pad (valve, "src");
+      gst_element_add_pad (chain, gst_ghost_pad_new ("src", pad));
+      gst_object_unref (pad);
+    }
+
+  /* The socket element only starts once it has a connection */
+  gst_element_set_locked_state (fd, TRUE);
+  gst_element_set_locked_state (chain, TRUE);
+
+  if (gst_element_set_state (chain, GST_STATE_READY) ==
+      GST_STATE_CHANGE_FAILURE)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not bring the chain to the READY state");
+      goto error;
+    }
+
+  return chain;
+
+ error:
+  gst_element_set_state (chain, GST_STATE_NULL);
+  gst_object_unref (chain);
+  return NULL;
+}
+
+static void
+fs_msn_session_destroy_chain (GstElement *chain)
+{
+  GstElement *fd = gst_bin_get_by_name (GST_BIN (chain), "fd");
+
+  gst_element_set_state (fd, GST_STATE_NULL);
+  gst_object_unref (fd);
+  gst_element_set_state (chain, GST_STATE_NULL);
+  gst_object_unref (chain);
+}
+
+/*
+ * Builds an encoder for the branches, a valve that drops the frames while
+ * it feeds no branch, the colorspace converter and mimenc, with "sink" and
+ * "src" ghost pads
+ */
+static GstElement *
+fs_msn_session_build_encoder (GError **error)
+{
+  GstElement *encoder = gst_bin_new (NULL);
+  GstElement *valve, *colorspace, *codec;
+  GstPad *pad;
+
+  if (!(valve = fs_msn_session_add_element (encoder, "fsvalve", "valve",
+                                            error)) ||
+      !(colorspace = fs_msn_session_add_element (encoder, "ffmpegcolorspace",
+                                                 NULL, error)) ||
+      !(codec = fs_msn_session_add_element (encoder, "mimenc", NULL, error)))
+    goto error;
+
+  g_object_set (valve, "drop", TRUE, NULL);
+
+  if (!gst_element_link_many (valve, colorspace, codec, NULL))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not link the shared encoder");
+      goto error;
+    }
+
+  fs_msn_session_add_bypass (encoder, valve, colorspace, codec, FALSE);
+  fs_msn_session_add_rate_control (encoder, valve);
+
+  pad = gst_element_get_static_pad (valve, "sink");
+  gst_element_add_pad (encoder, gst_ghost_pad_new ("sink", pad));
+  gst_object_unref (pad);
+  pad = gst_element_get_static_pad (codec, "src");
+  gst_element_add_pad (encoder, gst_ghost_pad_new ("src", pad));
+  gst_object_unref (pad);
+
+  return encoder;
+
+ error:
+  gst_object_unref (encoder);
+  return NULL;
+}
+
+/*
+ * Adds an encoder built by fs_msn_session_build_encoder() to the conference
+ * and brings it to the state of the conference, its valve drops everything.
+ * The encoder is destroyed on error.
+ */
+static gboolean
+fs_msn_session_add_encoder (FsMsnSession *self, GstElement *encoder,
+                            GError **error)
+{
+  GstBin *conferencebin = GST_BIN (self->priv->conference);
+
+  if (!gst_bin_add (conferencebin, encoder))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not add the encoder to the FsMsnConference");
+      gst_object_unref (encoder);
+      return FALSE;
+    }
+
+  if (!gst_element_sync_state_with_parent (encoder))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not sync the state of the encoder");
+      stop_and_remove (conferencebin, &encoder, FALSE);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Links the shared encoder to its tee in the conference, must be called
+ * with the session lock held
+ */
+static gboolean
+fs_msn_session_start_encoder (FsMsnSession *self, GError **error)
+{
+  GstBin *conferencebin = GST_BIN (self->priv->conference);
+
+  self->priv->tee = gst_element_factory_make ("tee", NULL);
+  if (!self->priv->tee)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not create the tee element");
+      goto error;
+    }
+  if (!gst_bin_add (conferencebin, self->priv->tee))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not add the tee element to the FsMsnConference");
+      gst_object_unref (self->priv->tee);
+      self->priv->tee = NULL;
+      goto error;
+    }
+
+  /* The tee must always have a linked pad, even without any stream */
+  self->priv->tee_fakesink = gst_element_factory_make ("fakesink", NULL);
+  if (!self->priv->tee_fakesink)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not create the fakesink element");
+      goto error;
+    }
+  g_object_set (self->priv->tee_fakesink, "sync", FALSE, "async", FALSE,
+                NULL);
+  if (!gst_bin_add (conferencebin, self->priv->tee_fakesink))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not add the fakesink element to the FsMsnConference");
+      gst_object_unref (self->priv->tee_fakesink);
+      self->priv->tee_fakesink = NULL;
+      goto error;
+    }
+
+  if (!gst_element_link (self->priv->tee, self->priv->tee_fakesink) ||
+      !gst_element_sync_state_with_parent (self->priv->tee_fakesink) ||
+      !gst_element_sync_state_with_parent (self->priv->tee))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not start the tee of the shared encoder");
+      goto error;
+    }
+
+  if (!gst_element_link (self->priv->encoder, self->priv->tee))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not link the shared encoder to its tee");
+      goto error;
+    }
+
+  return TRUE;
+
+ error:
+  stop_and_remove (conferencebin, &self->priv->tee_fakesink, FALSE);
+  stop_and_remove (conferencebin, &self->priv->tee, FALSE);
+  return FALSE;
+}
+
+static void
+fs_msn_session_set_encoder_drop (GstElement *encoder, gboolean drop)
+{
+  GstElement *valve = gst_bin_get_by_name (GST_BIN (encoder), "valve");
+
+  g_object_set (valve, "drop", drop, NULL);
+  gst_object_unref (valve);
+}
+
+/*
+ * Builds the branch of a sending stream fed by the shared encoder, its valve
+ * and socket sink
+ */
+static GstElement *
+fs_msn_session_build_branch (GError **error)
+{
+  GstElement *branch = gst_bin_new (NULL);
+  GstElement *valve, *fd;
+  GstPad *pad;
+
+  if (!(valve = fs_msn_session_add_element (branch, "fsvalve", "valve",
+                                            error)) ||
+      !(fd = fs_msn_session_add_element (branch, "fsmsnframesink", "fd",
+                                         error)))
+    goto error;
+
+  g_object_set (valve, "drop", TRUE, NULL);
+  /* A failing peer must not stop the tee */
+  g_object_set (fd, "ignore-errors", TRUE, NULL);
+
+  if (!gst_element_link (valve, fd))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not link the branch");
+      goto error;
+    }
+
+  pad = gst_element_get_static_pad (valve, "sink");
+  gst_element_add_pad (branch, gst_ghost_pad_new ("sink", pad));
+  gst_object_unref (pad);
+
+  gst_element_set_locked_state (fd, TRUE);
+  gst_element_set_locked_state (branch, TRUE);
+
+  return branch;
+
+ error:
+  gst_object_unref (branch);
+  return NULL;
+}
+
+/*
+ * Adds a branch to the tee of the shared encoder, must be called with the
+ * session lock held
+ */
+static GstElement *
+fs_msn_session_add_branch (FsMsnSession *self, GError **error)
+{
+  GstBin *conferencebin = GST_BIN (self->priv->conference);
+  GstElement *branch;
+  gboolean pooled = FALSE;
+
+  if (!self->priv->tee && !fs_msn_session_start_encoder (self, error))
+    return NULL;
+
+  if (self->priv->idle_branches)
+    {
+      branch = self->priv->idle_branches->data;
+      self->priv->idle_branches = g_list_delete_link (
+          self->priv->idle_branches, self->priv->idle_branches);
+      pooled = TRUE;
+    }
+  else
+    {
+      GST_DEBUG ("Branch pool empty, building a new branch");
+      branch = fs_msn_session_build_branch (error);
+      if (!branch)
+        return NULL;
+    }
+
+  if (!gst_bin_add (conferencebin, branch))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not add the branch to the FsMsnConference");
+      fs_msn_session_destroy_chain (branch);
+      return NULL;
+    }
+
+  /* The bin took a reference of its own, a new branch was still floating */
+  if (pooled)
+    gst_object_unref (branch);
+
+  /* The valve drops everything until there is a connection, the branch can
+   * be started before it is linked to the running tee */
+  gst_element_set_locked_state (branch, FALSE);
+  if (!gst_element_sync_state_with_parent (branch) ||
+      !gst_element_link (self->priv->tee, branch))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not start the branch");
+      stop_and_remove (conferencebin, &branch, FALSE);
+      return NULL;
+    }
+
+  if (self->priv->n_branches++ == 0)
+    fs_msn_session_set_encoder_drop (self->priv->encoder, FALSE);
+
+  self->priv->branches = g_list_prepend (self->priv->branches, branch);
+
+  return branch;
+}
+
+/*
+ * Unlinks @branch from the tee of the shared encoder, must be called with
+ * the session lock held
+ */
+static void
+fs_msn_session_unlink_from_tee (FsMsnSession *self, GstElement *branch)
+{
+  GstPad *pad = gst_element_get_static_pad (branch, "sink");
+  GstPad *tee_pad = gst_pad_get_peer (pad);
+
+  if (tee_pad)
+    {
+      gst_pad_unlink (tee_pad, pad);
+      if (self->priv->tee)
+        gst_element_release_request_pad (self->priv->tee, tee_pad);
+      gst_object_unref (tee_pad);
+    }
+  gst_object_unref (pad);
+
+  if (--self->priv->n_branches == 0 && self->priv->encoder)
+    fs_msn_session_set_encoder_drop (self->priv->encoder, TRUE);
+}
+
+/* Must be called with the session lock held */
+static void
+fs_msn_session_remove_branch (FsMsnSession *self, GstElement *branch)
+{
+  GstBin *conferencebin = GST_BIN (self->priv->conference);
+  GstElement *encoder = g_object_get_data (G_OBJECT (branch), "encoder");
+  GstElement *fd = gst_bin_get_by_name (GST_BIN (branch), "fd");
+  GstElement *valve;
+  RateControl *rc;
+
+  self->priv->branches = g_list_remove (self->priv->branches, branch);
+
+  if (encoder)
+    {
+      g_object_set_data (G_OBJECT (branch), "encoder", NULL);
+      stop_and_remove (conferencebin, &encoder, FALSE);
+    }
+  else
+    {
+      fs_msn_session_unlink_from_tee (self, branch);
+      if (self->priv->encoder)
+        {
+          rc = g_object_get_data (G_OBJECT (self->priv->encoder),
+                                  "rate-control");
+          fs_msn_session_rate_control_remove_sink (rc, fd);
+        }
+    }
+
+  /* The socket belonged to the stream, the branch goes back to the pool */
+  gst_element_set_state (fd, GST_STATE_NULL);
+  gst_element_set_locked_state (fd, TRUE);
+  g_object_set (fd, "fd", -1, "reactor", NULL, NULL);
+  gst_object_unref (fd);
+
+  valve = gst_bin_get_by_name (GST_BIN (branch), "valve");
+  g_object_set (valve, "drop", TRUE, NULL);
+  gst_object_unref (valve);
+
+  gst_object_ref (branch);
+  gst_element_set_locked_state (branch, TRUE);
+  gst_element_set_state (branch, GST_STATE_READY);
+  gst_bin_remove (conferencebin, branch);
+
+  if (!self->priv->disposed &&
+      g_list_length (self->priv->idle_branches) < CHAIN_POOL_SIZE)
+    self->priv->idle_branches = g_list_prepend (self->priv->idle_branches,
+                                                branch);
+  else
+    fs_msn_session_destroy_chain (branch);
+}
+
+/*
+ * Returns the state of the frame dropping in front of the encoder that
+ * feeds @chain, must be called with the session lock held
+ */
+static RateControl *
+fs_msn_session_get_rate_control (FsMsnSession *self, GstElement *chain)
+{
+  GstElement *encoder;
+
+  if (!g_list_find (self->priv->branches, chain))
+    return g_object_get_data (G_OBJECT (chain), "rate-control");
+
+  encoder = g_object_get_data (G_OBJECT (chain), "encoder");
+  if (!encoder)
+    encoder = self->priv->encoder;
+  if (!encoder)
+    return NULL;
+
+  return g_object_get_data (G_OBJECT (encoder), "rate-control");
+}
+
+/**
+ * fs_msn_session_get_chain:
+ * @session: a #FsMsnSession
+ * @direction: %FS_DIRECTION_SEND or %FS_DIRECTION_RECV
+ * @error: location of a #GError, or NULL if no error occured
+ *
+ * Takes a chain from the pool, or builds a new one if it is empty, adds it
+ * to the conference and brings it to the state of the conference. The
+ * socket element stays in READY, with its state locked.
+ *
+ * Sending streams get a branch of the tee of the shared encoder instead,
+ * with only a valve and a socket sink, and the encoder is linked to the tee
+ * with the first one. Its "sink" pad is already linked. If the encoder can
+ * not be started, they get a chain of their own.
+ *
+ * Returns: the chain, owned by the conference, or NULL on error
+ */
+GstElement *
+fs_msn_session_get_chain (FsMsnSession *session,
+                          FsStreamDirection direction,
+                          GError **error)
+{
+  GList **pool;
+  GstElement *chain = NULL;
+
+  g_return_val_if_fail (direction == FS_DIRECTION_SEND ||
+                        direction == FS_DIRECTION_RECV, NULL);
+
+  if (direction == FS_DIRECTION_SEND)
+    pool = &session->priv->send_chains;
+  else
+    pool = &session->priv->recv_chains;
+
+  FS_MSN_SESSION_LOCK (session);
+  if (direction == FS_DIRECTION_SEND && session->priv->encoder)
+    {
+      GError *encoder_error = NULL;
+
+      chain = fs_msn_session_add_branch (session, &encoder_error);
+      if (chain)
+        {
+          FS_MSN_SESSION_UNLOCK (session);
+          return chain;
+        }
+
+      GST_WARNING ("Could not start a branch of the shared encoder, the"
+                   " stream gets a chain of its own: %s",
+                   encoder_error->message);
+      g_clear_error (&encoder_error);
+    }
+  if (*pool)
+    {
+      chain = (*pool)->data;
+      *pool = g_list_delete_link (*pool, *pool);
+    }
+  FS_MSN_SESSION_UNLOCK (session);
+
+  if (!chain)
+    {
+      GST_DEBUG ("Chain pool empty, building a new chain");
+      chain = fs_msn_session_build_chain (direction, error);
+      if (!chain)
+        return NULL;
+    }
+
+  if (!gst_bin_add (GST_BIN (session->priv->conference), chain))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not add the chain to the FsMsnConference");
+      fs_msn_session_destroy_chain (chain);
+      return NULL;
+    }
+
+  gst_element_set_locked_state (chain, FALSE);
+  if (!gst_element_sync_state_with_parent (chain))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not sync the state of the chain");
+      gst_element_set_locked_state (chain, TRUE);
+      gst_element_set_state (chain, GST_STATE_NULL);
+      gst_bin_remove (GST_BIN (session->priv->conference), chain);
+      return NULL;
+    }
+
+  return chain;
+}
+
+/**
+ * fs_msn_session_release_chain:
+ * @session: a #FsMsnSession
+ * @chain: a chain returned by fs_msn_session_get_chain()
+ *
+ * Removes the chain from the conference, brings it back to READY and puts it
+ * back in the pool if there is room left. Branches of the shared encoder are
+ * unlinked from its tee and destroyed.
+ */
+void
+fs_msn_session_release_chain (FsMsnSession *session, GstElement *chain)
+{
+  GstElement *fd;
+  GstElement *valve;
+  GstPad *pad;
+  gboolean send;
+  ChainBypass *bypass;
+  RateControl *rc;
+  GList **pool;
+
+  FS_MSN_SESSION_LOCK (session);
+  if (g_list_find (session->priv->branches, chain))
+    {
+      fs_msn_session_remove_branch (session, chain);
+      FS_MSN_SESSION_UNLOCK (session);
+      return;
+    }
+  FS_MSN_SESSION_UNLOCK (session);
+
+  fd = gst_bin_get_by_name (GST_BIN (chain), "fd");
+  valve = gst_bin_get_by_name (GST_BIN (chain), "valve");
+  pad = gst_element_get_static_pad (chain, "sink");
+  send = (pad != NULL);
+  if (pad)
+    gst_object_unref (pad);
+
+  gst_object_ref (chain);
+  gst_element_set_locked_state (chain, TRUE);
+  gst_element_set_state (chain, GST_STATE_READY);
+  gst_bin_remove (GST_BIN (session->priv->conference), chain);
+
+  /* The socket belonged to the stream */
+  gst_element_set_state (fd, GST_STATE_READY);
+  gst_element_set_locked_state (fd, TRUE);
+  g_object_set (fd, "fd", -1, NULL);
+  g_object_set (valve, "drop", send, NULL);
+
+  rc = g_object_get_data (G_OBJECT (chain), "rate-control");
+  if (rc)
+    {
+      fs_msn_session_rate_control_remove_sink (rc, fd);
+      g_mutex_lock (rc->mutex);
+      fs_msn_session_rate_control_reset (rc);
+      g_mutex_unlock (rc->mutex);
+    }
+  gst_object_unref (fd);
+
+  /* The next stream may need the converter */
+  bypass = g_object_get_data (G_OBJECT (chain), "bypass");
+  fs_msn_session_bypass_relink (bypass, FALSE);
+  gst_caps_replace (&bypass->caps, NULL);
+
+  gst_object_unref (valve);
+
+  pool = send ? &session->priv->send_chains : &session->priv->recv_chains;
+
+  FS_MSN_SESSION_LOCK (session);
+  if (!session->priv->disposed && g_list_length (*pool) < CHAIN_POOL_SIZE)
+    {
+      *pool = g_list_prepend (*pool, chain);
+      chain = NULL;
+    }
+  FS_MSN_SESSION_UNLOCK (session);
+
+  if (chain)
+    fs_msn_session_destroy_chain (chain);
+}
+
+/**
+ * fs_msn_session_detach_branch:
+ * @session: a #FsMsnSession
+ * @chain: a chain returned by fs_msn_session_get_chain()
+ * @error: location of a #GError, or NULL if no error occured
+ *
+ * Unlinks a branch from the tee of the shared encoder and feeds it from an
+ * encoder of its own instead, for a stream whose own sink pad is used. The
+ * socket sink of the branch keeps going, it starts again at the next
+ * keyframe. Calling it again returns the same encoder.
+ *
+ * Returns: the sink pad of the encoder of the branch, or NULL on error or
+ * if @chain is not a branch. Unref it after use.
+ */
+GstPad *
+fs_msn_session_detach_branch (FsMsnSession *session,
+                              GstElement *chain,
+                              GError **error)
+{
+  GstElement *encoder;
+  GstElement *fd;
+  GstPad *pad = NULL;
+  RateControl *rc;
+  guint max_latency;
+
+  FS_MSN_SESSION_LOCK (session);
+
+  if (!g_list_find (session->priv->branches, chain))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+                   "The stream is not fed by the shared encoder");
+      goto out;
+    }
+
+  encoder = g_object_get_data (G_OBJECT (chain), "encoder");
+  if (encoder)
+    {
+      pad = gst_element_get_static_pad (encoder, "sink");
+      goto out;
+    }
+
+  encoder = fs_msn_session_build_encoder (error);
+  if (!encoder ||
+      !fs_msn_session_add_encoder (session, encoder, error))
+    goto out;
+
+  fd = gst_bin_get_by_name (GST_BIN (chain), "fd");
+
+  fs_msn_session_unlink_from_tee (session, chain);
+  if (!gst_element_link (encoder, chain))
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
+                   "Could not link the encoder of the branch");
+      stop_and_remove (GST_BIN (session->priv->conference), &encoder, FALSE);
+
+      /* Go back to the shared encoder */
+      if (gst_element_link (session->priv->tee, chain) &&
+          session->priv->n_branches++ == 0)
+        fs_msn_session_set_encoder_drop (session->priv->encoder, FALSE);
+      gst_object_unref (fd);
+      goto out;
+    }
+
+  g_object_set_data (G_OBJECT (chain), "encoder", encoder);
+
+  rc = g_object_get_data (G_OBJECT (session->priv->encoder), "rate-control");
+  max_latency = fs_msn_session_rate_control_remove_sink (rc, fd);
+  rc = g_object_get_data (G_OBJECT (encoder), "rate-control");
+  fs_msn_session_rate_control_set_sink (rc, fd, max_latency);
+  gst_object_unref (fd);
+
+  /* The valve of the branch still drops everything until it is connected */
+  fs_msn_session_set_encoder_drop (encoder, FALSE);
+
+  pad = gst_element_get_static_pad (encoder, "sink");
+
+ out:
+  FS_MSN_SESSION_UNLOCK (session);
+  return pad;
+}
+
+/**
+ * fs_msn_session_set_max_latency:
+ * @session: a #FsMsnSession
+ * @chain: a send chain returned by fs_msn_session_get_chain()
+ * @max_latency: the maximum send latency of the stream in milliseconds,
+ *   or 0 to disable the rate control
+ *
+ * Frames are dropped in front of the encoder that feeds @chain when the
+ * backlog of its socket sink takes more than @max_latency to reach the peer.
+ */
+void
+fs_msn_session_set_max_latency (FsMsnSession *session,
+                                GstElement *chain,
+                                guint max_latency)
+{
+  GstElement *fd = gst_bin_get_by_name (GST_BIN (chain), "fd");
+  RateControl *rc;
+
+  FS_MSN_SESSION_LOCK (session);
+  rc = fs_msn_session_get_rate_control (session, chain);
+  if (rc)
+    fs_msn_session_rate_control_set_sink (rc, fd, max_latency);
+  FS_MSN_SESSION_UNLOCK (session);
+
+  gst_object_unref (fd);
+}
+
+/**
+ * fs_msn_session_get_frames_dropped:
+ * @session: a #FsMsnSession
+ * @chain: a send chain returned by fs_msn_session_get_chain()
+ * @shared: location for whether @chain is fed by the shared encoder, or NULL
+ *
+ * Returns: the number of raw frames dropped in front of the encoder that
+ * feeds @chain since it started feeding it
+ */
+guint64
+fs_msn_session_get_frames_dropped (FsMsnSession *session,
+                                   GstElement *chain,
+                                   gboolean *shared)
+{
+  RateControl *rc;
+  guint64 dropped = 0;
+
+  FS_MSN_SESSION_LOCK (session);
+  rc = fs_msn_session_get_rate_control (session, chain);
+  if (rc)
+    {
+      g_mutex_lock (rc->mutex);
+      dropped = rc->frames_dropped;
+      g_mutex_unlock (rc->mutex);
+    }
+  if (shared)
+    *shared = (g_list_find (session->priv->branches, chain) &&
+               !g_object_get_data (G_OBJECT (chain), "encoder"));
+  FS_MSN_SESSION_UNLOCK (session);
+
+  return dropped;
+}
 
 static void
 _remove_stream (gpointer user_data,
@@ -303,7 +1601,10 @@ fs_msn_session_new_stream (FsSession *session,
   msnparticipant = FS_MSN_PARTICIPANT (participant);
 
   new_stream = FS_STREAM_CAST (fs_msn_stream_new (self, msnparticipant,
-                               direction,self->priv->conference,error));
+                               direction,self->priv->conference,
+                               n_parameters, parameters, error));
+  if (!new_stream)
+    return NULL;
 
   FS_MSN_SESSION_LOCK (self);
   self->priv->streams = g_list_append (self->priv->streams, new_stream);
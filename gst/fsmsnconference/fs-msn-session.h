@@ -85,6 +85,25 @@ FsMsnSession *fs_msn_session_new (FsMediaType media_type,
                                   FsMsnConference *conference,
                                   guint id,GError **error);
 
+GstElement *fs_msn_session_get_chain (FsMsnSession *session,
+                                     FsStreamDirection direction,
+                                     GError **error);
+
+void fs_msn_session_release_chain (FsMsnSession *session,
+                                   GstElement *chain);
+
+GstPad *fs_msn_session_detach_branch (FsMsnSession *session,
+                                      GstElement *chain,
+                                      GError **error);
+
+void fs_msn_session_set_max_latency (FsMsnSession *session,
+                                     GstElement *chain,
+                                     guint max_latency);
+
+guint64 fs_msn_session_get_frames_dropped (FsMsnSession *session,
+                                           GstElement *chain,
+                                           gboolean *shared);
+
 void fs_msn_session_new_recv_pad (FsMsnSession *session, GstPad *new_pad,
                                   guint32 ssrc, guint pt);
 
@@ -26,7 +26,81 @@
  * SECTION:fs-msn-stream
  * @short_description: A MSN stream in a #FsMsnSession in a #FsMsnConference
  *
-
+ * When it is created, the stream starts listening on #FsMsnStream:local-port
+ * (or on a port shared by the streams of the conference if it is 0) and
+ * posts it as a "farsight-new-local-candidate" message. The listening
+ * sockets belong to the #FsMsnConference, incoming connections are handed to
+ * the stream whose #FsMsnStream:local-recipientid and
+ * #FsMsnStream:remote-sessionid they authenticate with.
+ *
+ * The remote candidates are tried in parallel: a connection to the first one is
+ * started right away and a new one is started every
+ * #FsMsnStream:connection-stagger milliseconds (or as soon as an attempt fails)
+ * while we also accept incoming connections. The first connection to
+ * authenticate is used and all the other attempts are cancelled.
+ *
+ * The sockets of all the streams of a conference are driven by a single
+ * reactor thread owned by the #FsMsnConference, so the messages below are
+ * posted from that thread.
+ *
+ * Sending streams share the encoder behind the #FsSession:sink-pad of their
+ * #FsMsnSession. Their #FsStream:sink-pad has no target until it is linked,
+ * the stream then gets an encoder of its own and stops using the shared one.
+ * </para>
+ * <refsect2><title>The "<literal>farsight-msn-connection-established</literal>"
+ *   message</title>
+ * |[
+ * "stream"           #FsStream           The stream that emits the message
+ * "connect-time"     #guint64            Nanoseconds from the first remote
+ *                                        candidate to the authenticated
+ *                                        connection
+ * "incoming"         #gboolean           %TRUE if the peer connected to us
+ * ]|
+ * <para>
+ * This message is sent on the bus when the stream's connection has been
+ * established and authenticated.
+ * </para>
+ * </refsect2>
+ * <refsect2><title>The "<literal>farsight-msn-frames-dropped</literal>"
+ *   message</title>
+ * |[
+ * "stream"           #FsStream           The stream that emits the message
+ * "dropped"          #guint64            Raw frames dropped before the encoder
+ * "sink-dropped"     #guint64            Encoded frames dropped by the sink
+ * "latency"          #guint64            Current estimate of the send backlog
+ *                                        in nanoseconds
+ * ]|
+ * <para>
+ * On sending streams, frames are dropped so that the data waiting to be
+ * sent never takes more than #FsMsnStream:max-latency to reach the peer. The
+ * socket sink of a late stream drops encoded frames until the next keyframe,
+ * and "sink-dropped" counts them. Raw frames are dropped before the encoder
+ * only when it is not fast enough for any of the streams it feeds. When the
+ * stream uses the shared encoder of its #FsMsnSession, "dropped" counts the
+ * frames dropped by that encoder for all of them. This message is sent at most once per second by connected
+ * streams when more frames have been dropped.
+ * </para>
+ * </refsect2>
+ * <refsect2><title>The "<literal>farsight-msn-send-statistics</literal>"
+ *   message</title>
+ * |[
+ * "stream"           #FsStream           The stream that emits the message
+ * "bytes-sent"       #guint64            Bytes written to the socket
+ * "frames-sent"      #guint64            Encoded frames completely written
+ * "frames-dropped"   #guint64            Encoded frames dropped by the sink
+ * "send-rate"        #guint64            Estimated rate at which the peer
+ *                                        receives data, in bytes per second
+ * "latency"          #guint64            Current estimate of the send backlog
+ *                                        in nanoseconds
+ * "shared-encoder"   #gboolean           %TRUE if the stream is fed by the
+ *                                        encoder of its #FsMsnSession
+ * ]|
+ * <para>
+ * This message is sent every second by connected sending streams. The
+ * counters start when the connection is established.
+ * </para>
+ * </refsect2>
+ * <para>
  */
 
 #ifdef HAVE_CONFIG_H
@@ -34,14 +108,27 @@
 #endif
 
 #include "fs-msn-stream.h"
+#include "fs-msn-handshake.h"
+#include "fs-msn-frame-sink.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <fcntl.h>
 
+#include <errno.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <gst/gst.h>
+#include <gst/farsight/fs-interfaces.h>
+
+#define GST_CAT_DEFAULT fsmsnconference_debug
+
+#define DEFAULT_HANDSHAKE_TIMEOUT 10
+#define DEFAULT_CONNECTION_STAGGER 250
+#define DEFAULT_MAX_LATENCY 500
+
+/* How often the send statistics are posted, in milliseconds */
+#define STATS_PERIOD 1000
 
 /* Signals */
 enum
@@ -63,7 +150,10 @@ enum
   PROP_L_SID,
   PROP_R_RID,
   PROP_R_SID,
-  PROP_PORT
+  PROP_PORT,
+  PROP_HANDSHAKE_TIMEOUT,
+  PROP_CONNECTION_STAGGER,
+  PROP_MAX_LATENCY
 };
 
 struct _FsMsnStreamPrivate
@@ -71,15 +161,42 @@ struct _FsMsnStreamPrivate
     FsMsnSession *session;
     FsMsnParticipant *participant;
     FsStreamDirection direction;
-    GArray *fdlist;
     FsMsnConference *conference;
-    GstElement *media_fd_src,*media_fd_sink,*send_valve;
+    FsMsnReactor *reactor;
+    FsMsnAcceptor *acceptor;
+    /* The ids registered with the acceptor */
+    gboolean registered;
+    guint registered_recipientid, registered_sessionid;
+
+    /* Protects the connection state below, which is mostly used from the
+     * reactor thread */
+    GMutex *mutex;
+    GList *handshakes;
+    /* Remote candidates not tried yet */
+    GList *pending_candidates;
+    guint stagger_id;
+    guint connection_stagger;
+    GstClockTime connect_start;
+    guint main_watch;
+    guint stats_id;
+    gint connection_fd;
+    /* Starts the media elements on the socket, joined in dispose */
+    GThread *media_thread;
+
+    /* Borrowed from the pool of the session, we hold refs on the elements */
+    GstElement *chain;
+    GstElement *media_fd_src,*media_fd_sink,*valve;
     GstPad *sink_pad,*src_pad;
-    guint in_watch, out_watch, main_watch;
     gint local_recipientid, local_sessionid;
     gint remote_recipientid, remote_sessionid;
     gint port;
-    GIOChannel *connection;
+    guint handshake_timeout;
+
+    /* Send rate control, done by the session in front of the encoder */
+    guint max_latency;
+    /* Drops last reported, protected by the mutex */
+    guint64 reported_dropped;
+    guint64 reported_sink_dropped;
 
 
 
@@ -114,27 +231,34 @@ static gboolean fs_msn_stream_set_remote_candidates (FsStream *stream,
     GList *candidates,
     GError **error);
 
-static gboolean fs_msn_stream_set_remote_candidate  (FsMsnStream *stream,
-    FsCandidate *candidate,
-    GError **error);
-
-static gboolean main_fd_closed_cb (GIOChannel *ch,
+static gboolean main_fd_closed_cb (gint fd,
                                    GIOCondition cond,
                                    gpointer data);
 
-static gboolean successfull_connection_cb (GIOChannel *ch,
-    GIOCondition cond,
-    gpointer data);
-
 static gboolean fs_msn_stream_attempt_connection (FsMsnStream *stream,
     gchar const *ip,
-    guint16 port);
+    guint16 port,
+    GError **error);
+
+static gboolean fs_msn_stream_listen (FsMsnStream *self, GError **error);
+
+static void fs_msn_stream_register (FsMsnStream *self);
+
+static void fs_msn_stream_connection_won (FsMsnStream *self,
+                                          gint fd,
+                                          gboolean incoming);
+
+static void fs_msn_stream_cancel_handshakes (FsMsnStream *self);
+
+static void fs_msn_stream_cancel_pending_candidates (FsMsnStream *self);
 
-static gboolean fs_msn_authenticate_outgoing (FsMsnStream *stream,
-    gint fd);
+static void fs_msn_stream_race_candidates (FsMsnStream *self);
 
-static void fs_msn_open_listening_port (FsMsnStream *stream,
-                                        guint16 port);
+static void fs_msn_stream_sink_pad_linked (GstPad *pad,
+    GstPad *peer,
+    gpointer user_data);
+
+static gboolean fs_msn_stream_post_statistics (gpointer user_data);
 
 
 /* Needed ?
@@ -218,7 +342,7 @@ fs_msn_stream_class_init (FsMsnStreamClass *klass)
                                                       "The local recipientid used for this stream",
                                                       "The session ID used for this stream",
                                                       0, G_MAXUINT, 0,
-                                                      G_PARAM_READWRITE));
+                                                      G_PARAM_CONSTRUCT | G_PARAM_READWRITE));
 
   g_object_class_install_property (gobject_class,
                                    PROP_L_SID,
@@ -242,15 +366,42 @@ fs_msn_stream_class_init (FsMsnStreamClass *klass)
                                                       "The remote sessionid used for this stream",
                                                       "The session ID used for this stream",
                                                       0, G_MAXUINT, 0,
-                                                      G_PARAM_READWRITE));
+                                                      G_PARAM_CONSTRUCT | G_PARAM_READWRITE));
   g_object_class_install_property (gobject_class,
                                    PROP_PORT,
                                    g_param_spec_uint ("local-port",
                                                       "The local port used for this stream",
-                                                      "The local port used for this stream",
-                                                      0, G_MAXUINT, 0,
-                                                      G_PARAM_READWRITE));                                                      
+                                                      "The port to listen on, 0 to share one with the other"
+                                                      " streams of the conference",
+                                                      0, G_MAXUINT16, 0,
+                                                      G_PARAM_CONSTRUCT | G_PARAM_READWRITE));
 
+  g_object_class_install_property (gobject_class,
+                                   PROP_HANDSHAKE_TIMEOUT,
+                                   g_param_spec_uint ("handshake-timeout",
+                                                      "Handshake timeout",
+                                                      "Time in seconds allowed for a connection to be established"
+                                                      " and authenticated",
+                                                      1, G_MAXUINT, DEFAULT_HANDSHAKE_TIMEOUT,
+                                                      G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_CONNECTION_STAGGER,
+                                   g_param_spec_uint ("connection-stagger",
+                                                      "Connection stagger",
+                                                      "Delay in milliseconds before starting a connection to"
+                                                      " the next remote candidate",
+                                                      0, G_MAXUINT, DEFAULT_CONNECTION_STAGGER,
+                                                      G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_MAX_LATENCY,
+                                   g_param_spec_uint ("max-latency",
+                                                      "Maximum send latency",
+                                                      "Frames are dropped to keep the send"
+                                                      " backlog under this many milliseconds (0 to disable)",
+                                                      0, G_MAXUINT, DEFAULT_MAX_LATENCY,
+                                                      G_PARAM_READWRITE));
 
 }
 
@@ -265,41 +416,138 @@ fs_msn_stream_init (FsMsnStream *self)
   self->priv->participant = NULL;
 
   self->priv->direction = FS_DIRECTION_NONE;
-  self->priv->fdlist = g_array_new (FALSE, FALSE, sizeof(GIOChannel *));
+  self->priv->mutex = g_mutex_new ();
+  self->priv->connection_fd = -1;
+  self->priv->handshake_timeout = DEFAULT_HANDSHAKE_TIMEOUT;
+  self->priv->connection_stagger = DEFAULT_CONNECTION_STAGGER;
+  self->priv->connect_start = GST_CLOCK_TIME_NONE;
+  self->priv->max_latency = DEFAULT_MAX_LATENCY;
 }
 
 static void
 fs_msn_stream_dispose (GObject *object)
 {
   FsMsnStream *self = FS_MSN_STREAM (object);
+  GList *handshakes, *candidates, *item;
+  guint stagger_id, main_watch, stats_id;
+  GThread *media_thread;
 
+  g_mutex_lock (self->priv->mutex);
   if (self->priv->disposed)
     {
       /* If dispose did already run, return. */
+      g_mutex_unlock (self->priv->mutex);
       return;
     }
 
+  /* Make sure dispose does not run twice and that the reactor callbacks
+   * that are about to run leave the stream alone. */
+  self->priv->disposed = TRUE;
+
+  handshakes = self->priv->handshakes;
+  self->priv->handshakes = NULL;
+  candidates = self->priv->pending_candidates;
+  self->priv->pending_candidates = NULL;
+  stagger_id = self->priv->stagger_id;
+  self->priv->stagger_id = 0;
+  main_watch = self->priv->main_watch;
+  self->priv->main_watch = 0;
+  stats_id = self->priv->stats_id;
+  self->priv->stats_id = 0;
+  media_thread = self->priv->media_thread;
+  self->priv->media_thread = NULL;
+  g_mutex_unlock (self->priv->mutex);
+
+  /* Removing a source waits for its callback to return, and the callbacks
+   * take the mutex, so this must be done without it. The same goes for the
+   * acceptor. */
+  if (self->priv->registered)
+    fs_msn_acceptor_remove_recipient (self->priv->acceptor,
+                                      self->priv->registered_recipientid,
+                                      self->priv->registered_sessionid,
+                                      self);
+
+  if (self->priv->reactor)
+    {
+      fs_msn_reactor_remove (self->priv->reactor, stagger_id);
+      fs_msn_reactor_remove (self->priv->reactor, main_watch);
+      fs_msn_reactor_remove (self->priv->reactor, stats_id);
+    }
+
+  /* It uses the chain and the socket released below */
+  if (media_thread)
+    g_thread_join (media_thread);
+
+  for (item = handshakes; item; item = g_list_next (item))
+    fs_msn_handshake_free (item->data);
+  g_list_free (handshakes);
+  fs_candidate_list_destroy (candidates);
+
+  /* The chain is stopped before its socket is closed */
+  if (self->priv->chain)
+    {
+      if (self->priv->sink_pad)
+        gst_ghost_pad_set_target (GST_GHOST_PAD (self->priv->sink_pad), NULL);
+      if (self->priv->src_pad)
+        gst_ghost_pad_set_target (GST_GHOST_PAD (self->priv->src_pad), NULL);
+
+      fs_msn_session_release_chain (self->priv->session, self->priv->chain);
+      self->priv->chain = NULL;
+    }
+
+  if (self->priv->valve)
+    {
+      gst_object_unref (self->priv->valve);
+      self->priv->valve = NULL;
+    }
+  if (self->priv->media_fd_sink)
+    {
+      gst_object_unref (self->priv->media_fd_sink);
+      self->priv->media_fd_sink = NULL;
+    }
+  if (self->priv->media_fd_src)
+    {
+      gst_object_unref (self->priv->media_fd_src);
+      self->priv->media_fd_src = NULL;
+    }
+
+  if (self->priv->connection_fd >= 0)
+    {
+      close (self->priv->connection_fd);
+      self->priv->connection_fd = -1;
+    }
+
   if (self->priv->participant)
     {
       g_object_unref (self->priv->participant);
       self->priv->participant = NULL;
     }
 
-  /* Make sure dispose does not run twice. */
-  self->priv->disposed = TRUE;
-
   if (self->priv->session)
     {
       g_object_unref (self->priv->session);
       self->priv->session = NULL;
     }
 
+  /* They belong to the conference, nothing uses them anymore */
+  self->priv->acceptor = NULL;
+  self->priv->reactor = NULL;
+  if (self->priv->conference)
+    {
+      g_object_unref (self->priv->conference);
+      self->priv->conference = NULL;
+    }
+
   parent_class->dispose (object);
 }
 
 static void
 fs_msn_stream_finalize (GObject *object)
 {
+  FsMsnStream *self = FS_MSN_STREAM (object);
+
+  g_mutex_free (self->priv->mutex);
+
   parent_class->finalize (object);
 }
 
@@ -347,6 +595,15 @@ fs_msn_stream_get_property (GObject *object,
       case PROP_PORT:
         g_value_set_uint (value, self->priv->port);
         break;        
+      case PROP_HANDSHAKE_TIMEOUT:
+        g_value_set_uint (value, self->priv->handshake_timeout);
+        break;
+      case PROP_CONNECTION_STAGGER:
+        g_value_set_uint (value, self->priv->connection_stagger);
+        break;
+      case PROP_MAX_LATENCY:
+        g_value_set_uint (value, self->priv->max_latency);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -377,6 +634,7 @@ fs_msn_stream_set_property (GObject *object,
         break;
       case PROP_L_RID:
         self->priv->local_recipientid = g_value_get_uint (value);
+        fs_msn_stream_register (self);
         break;
       case PROP_L_SID:
         self->priv->local_sessionid = g_value_get_uint (value);
@@ -386,10 +644,41 @@ fs_msn_stream_set_property (GObject *object,
         break;
       case PROP_R_SID:
         self->priv->remote_sessionid = g_value_get_uint (value);
+        fs_msn_stream_register (self);
         break;
       case PROP_PORT:
         self->priv->port = g_value_get_uint (value);
-        break;      
+        /* The construct property is set before the acceptor exists */
+        if (self->priv->acceptor)
+          {
+            GError *error = NULL;
+
+            if (!fs_msn_stream_listen (self, &error))
+              {
+                fs_stream_emit_error (FS_STREAM (self), error->code,
+                                      "Could not listen for incoming"
+                                      " connections", error->message);
+                g_clear_error (&error);
+              }
+          }
+        break;
+      case PROP_HANDSHAKE_TIMEOUT:
+        self->priv->handshake_timeout = g_value_get_uint (value);
+        /* The acceptor uses it for the incoming connections */
+        if (self->priv->registered)
+          fs_msn_stream_register (self);
+        break;
+      case PROP_CONNECTION_STAGGER:
+        self->priv->connection_stagger = g_value_get_uint (value);
+        break;
+      case PROP_MAX_LATENCY:
+        self->priv->max_latency = g_value_get_uint (value);
+        /* The construct property is set before the chain exists */
+        if (self->priv->chain && self->priv->direction == FS_DIRECTION_SEND)
+          fs_msn_session_set_max_latency (self->priv->session,
+                                          self->priv->chain,
+                                          self->priv->max_latency);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -402,254 +691,113 @@ fs_msn_stream_constructed (GObject *object)
 
   FsMsnStream *self = FS_MSN_STREAM_CAST (object);
 
-  if (self->priv->direction == FS_DIRECTION_SEND)
-    {
-      GstElement *mimenc;
-      GstElement *ffmpegcolorspace;
-
-
-      self->priv->send_valve = gst_element_factory_make ("fsvalve","send_valve");
+  self->priv->reactor = fs_msn_conference_get_reactor (self->priv->conference,
+                        &self->priv->construction_error);
+  if (!self->priv->reactor)
+    return;
 
-      if (!self->priv->send_valve)
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not create the fsvalve element");
-          return;
-        }
-
-      if (!gst_bin_add (GST_BIN (self->priv->conference), self->priv->send_valve))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not add the valve element to the FsRtpConference");
-          gst_object_unref (self->priv->send_valve);
-          return;
-        }
-
-      g_object_set (G_OBJECT (self->priv->send_valve), "drop", TRUE, NULL);
-
-      if (!gst_element_sync_state_with_parent (self->priv->send_valve))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not sync state for valve element");
-          return;
-        }
-
-      ffmpegcolorspace = gst_element_factory_make ("ffmpegcolorspace", "ffmpegcolorspace");
-
-      if (!ffmpegcolorspace)
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not create the ffmpegcolorspace element");
-          return;
-        }
-
-      if (!gst_bin_add (GST_BIN (self->priv->conference), ffmpegcolorspace))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not add the ffmpegcolorspace element to the FsMsnConference");
-          gst_object_unref (ffmpegcolorspace);
-          return;
-        }
-
-      if (!gst_element_sync_state_with_parent (ffmpegcolorspace))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not sync state for ffmpegcolorspace element");
-          return;
-        }
-
-      self->priv->media_fd_sink = gst_element_factory_make ("fdsink", "send_fd_sink");
-
-      if (!self->priv->media_fd_sink)
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not create the media_fd_sink element");
-          return;
-        }
+  self->priv->acceptor = fs_msn_conference_get_acceptor (self->priv->conference,
+                         self->priv->handshake_timeout,
+                         &self->priv->construction_error);
+  if (!self->priv->acceptor)
+    return;
 
-      if (!gst_bin_add (GST_BIN (self->priv->conference), self->priv->media_fd_sink))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not add the media_fd_sink element to the FsMsnConference");
-          gst_object_unref (self->priv->media_fd_sink);
-          return;
-        }
-
-      if (!gst_element_set_locked_state(self->priv->media_fd_sink,TRUE))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not lock state of media_fd_sink element");
-          return;
-        }
-
-      mimenc = gst_element_factory_make ("mimenc", "send_mim_enc");
-
-      if (!mimenc)
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not create the mimenc element");
-          return;
-        }
-
-      if (!gst_bin_add (GST_BIN (self->priv->conference), mimenc))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not add the mimenc element to the FsMsnConference");
-          gst_object_unref (mimenc);
-          return;
-        }
-
-      if (!gst_element_sync_state_with_parent (mimenc))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not set state for mimenc element");
-          return;
-        }
-
-      GstPad *tmp_sink_pad = gst_element_get_static_pad (self->priv->send_valve, "sink");
-      self->priv->sink_pad = gst_ghost_pad_new ("sink", tmp_sink_pad);
-      gst_pad_set_active(self->priv->sink_pad, TRUE);
-
-      gst_element_link_many(self->priv->send_valve,ffmpegcolorspace,mimenc,self->priv->media_fd_sink,NULL);
-    }
-  else if (self->priv->direction == FS_DIRECTION_RECV)
+  if (self->priv->direction == FS_DIRECTION_SEND ||
+      self->priv->direction == FS_DIRECTION_RECV)
     {
+      GstPad *pad;
 
-      GstElement *mimdec;
-      GstElement *ffmpegcolorspace;
-      GstElement *valve;
+      self->priv->chain = fs_msn_session_get_chain (self->priv->session,
+                          self->priv->direction,
+                          &self->priv->construction_error);
+      if (!self->priv->chain)
+        return;
 
-      valve = gst_element_factory_make ("fsvalve","recv_valve");
+      self->priv->valve = gst_bin_get_by_name (GST_BIN (self->priv->chain),
+                          "valve");
 
-      if (!valve)
+      if (self->priv->direction == FS_DIRECTION_SEND)
         {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not create the fsvalve element");
-          return;
-        }
-
-      if (!gst_bin_add (GST_BIN (self->priv->conference), valve))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not add the valve element to the FsRtpConference");
-          gst_object_unref (valve);
-          return;
-        }
+          self->priv->media_fd_sink =
+            gst_bin_get_by_name (GST_BIN (self->priv->chain), "fd");
 
-      g_object_set (G_OBJECT (valve), "drop", FALSE, NULL);
+          pad = gst_element_get_static_pad (self->priv->chain, "sink");
 
-      if (!gst_element_sync_state_with_parent  (valve))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not sync state with parent for valve element");
-          return;
-        }
-
-      ffmpegcolorspace = gst_element_factory_make ("ffmpegcolorspace", "ffmpegcolorspace");
-
-      if (!ffmpegcolorspace)
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not create the ffmpegcolorspace element");
-          return;
-        }
-
-      if (!gst_bin_add (GST_BIN (self->priv->conference), ffmpegcolorspace))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not add the ffmpegcolorspace element to the FsMsnConference");
-          gst_object_unref (ffmpegcolorspace);
-          return;
-        }
-
-      if (!gst_element_sync_state_with_parent  (ffmpegcolorspace))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not sync state with parent for ffmpegcolorspace element");
-          return;
-        }
-
-
-      self->priv->media_fd_src = gst_element_factory_make ("fdsrc", "recv_fd_src");
-
-      if (!self->priv->media_fd_src)
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not create the media_fd_src element");
-          return;
+          /* A branch of the shared encoder is fed by the session's sink pad,
+           * ours only gets a target once it is used */
+          if (gst_pad_is_linked (pad))
+            {
+              self->priv->sink_pad = gst_ghost_pad_new_no_target ("sink",
+                                     GST_PAD_SINK);
+              g_signal_connect (self->priv->sink_pad, "linked",
+                                G_CALLBACK (fs_msn_stream_sink_pad_linked),
+                                self);
+            }
+          else
+            {
+              self->priv->sink_pad = gst_ghost_pad_new ("sink", pad);
+            }
+          gst_object_unref (pad);
+          gst_pad_set_active (self->priv->sink_pad, TRUE);
+
+          fs_msn_session_set_max_latency (self->priv->session,
+                                          self->priv->chain,
+                                          self->priv->max_latency);
+          /* Only report what is dropped from now on */
+          self->priv->reported_dropped = fs_msn_session_get_frames_dropped (
+              self->priv->session, self->priv->chain, NULL);
         }
-
-      g_object_set (G_OBJECT(self->priv->media_fd_src), "blocksize", 512, NULL);
-      if (!gst_bin_add (GST_BIN (self->priv->conference), self->priv->media_fd_src))
+      else
         {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not add the media_fd_src element to the FsMsnConference");
-          gst_object_unref (self->priv->media_fd_src);
-          return;
-        }
+          self->priv->media_fd_src =
+            gst_bin_get_by_name (GST_BIN (self->priv->chain), "fd");
 
-      if (!gst_element_set_locked_state(self->priv->media_fd_src,TRUE))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not lock state of media_fd_src element");
-          return;
+          pad = gst_element_get_static_pad (self->priv->chain, "src");
+          self->priv->src_pad = gst_ghost_pad_new ("src", pad);
+          gst_object_unref (pad);
+          gst_pad_set_active (self->priv->src_pad, TRUE);
         }
+    }
 
+  fs_msn_stream_register (self);
+  if (!fs_msn_stream_listen (self, &self->priv->construction_error))
+    return;
 
-      mimdec = gst_element_factory_make ("mimdec", "recv_mim_dec");
+  GST_CALL_PARENT (G_OBJECT_CLASS, constructed, (object));
+}
 
-      if (!mimdec)
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not create the mimdec element");
-          return;
-        }
+/*
+ * The sink pad of a stream fed by the shared encoder is being used, the
+ * branch of the stream gets an encoder of its own
+ */
+static void
+fs_msn_stream_sink_pad_linked (GstPad *pad, GstPad *peer, gpointer user_data)
+{
+  FsMsnStream *self = FS_MSN_STREAM (user_data);
+  GstPad *target;
+  GError *error = NULL;
 
-      if (!gst_bin_add (GST_BIN (self->priv->conference), mimdec))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not add the mimdec element to the FsMsnConference");
-          gst_object_unref (mimdec);
-          return;
-        }
-      if (!gst_element_sync_state_with_parent  (mimdec))
-        {
-          self->priv->construction_error = g_error_new (FS_ERROR,
-                                           FS_ERROR_CONSTRUCTION,
-                                           "Could not sync state with parent for mimdec element");
-          return;
-        }
+  if (!self->priv->chain)
+    return;
 
-      GstPad *tmp_src_pad = gst_element_get_static_pad (valve, "src");
-      self->priv->src_pad = gst_ghost_pad_new ("src", tmp_src_pad);
-      gst_pad_set_active(self->priv->src_pad, TRUE);
-      gst_element_link_many(self->priv->media_fd_src,mimdec,ffmpegcolorspace,valve,NULL);
+  target = fs_msn_session_detach_branch (self->priv->session,
+                                         self->priv->chain, &error);
+  if (!target)
+    {
+      fs_stream_emit_error (FS_STREAM (self), error->code,
+                            "Could not give the stream an encoder of its own",
+                            error->message);
+      g_clear_error (&error);
+      return;
     }
 
-  GST_CALL_PARENT (G_OBJECT_CLASS, constructed, (object));
+  gst_ghost_pad_set_target (GST_GHOST_PAD (self->priv->sink_pad), target);
+  gst_object_unref (target);
+
+  /* The new encoder counts its drops from zero */
+  g_mutex_lock (self->priv->mutex);
+  self->priv->reported_dropped = 0;
+  g_mutex_unlock (self->priv->mutex);
 }
 
 /**
@@ -674,24 +822,41 @@ fs_msn_stream_set_remote_candidates (FsStream *stream, GList *candidates,
         }
     }
 
-  for (item = candidates; item; item = g_list_next (item))
+  g_mutex_lock (self->priv->mutex);
+
+  if (self->priv->connection_fd >= 0)
     {
-      FsCandidate *candidate = item->data;
-      if (!fs_msn_stream_set_remote_candidate (self,candidate,error))
-        return FALSE;
+      g_mutex_unlock (self->priv->mutex);
+      return TRUE;
     }
 
+  if (!GST_CLOCK_TIME_IS_VALID (self->priv->connect_start))
+    self->priv->connect_start = gst_util_get_timestamp ();
+
+  self->priv->pending_candidates = g_list_concat (
+      self->priv->pending_candidates, fs_candidate_list_copy (candidates));
+
+  /* If candidates are already being staggered, these ones join the queue.
+   * This never has to remove the stagger timer, which could not be done
+   * with the mutex held. */
+  if (!self->priv->stagger_id)
+    fs_msn_stream_race_candidates (self);
+
+  g_mutex_unlock (self->priv->mutex);
+
   return TRUE;
 }
 
-static gboolean main_fd_closed_cb (GIOChannel *ch,
+static gboolean main_fd_closed_cb (gint fd,
                                    GIOCondition cond,
                                    gpointer data)
 {
   FsMsnStream *self = FS_MSN_STREAM (data);
 
-  g_message ("disconnection on video feed %p %p", ch, self->priv->connection);
-  g_source_remove (self->priv->main_watch);
+  g_message ("disconnection on video feed %d", fd);
+  g_mutex_lock (self->priv->mutex);
+  self->priv->main_watch = 0;
+  g_mutex_unlock (self->priv->mutex);
   /* FIXME - How to handle the disconnection of the stream
      Destroy the elements involved?
      Set the state to Null ?
@@ -699,439 +864,527 @@ static gboolean main_fd_closed_cb (GIOChannel *ch,
   return FALSE;
 }
 
-static gboolean successfull_connection_cb (GIOChannel *ch,
-    GIOCondition cond,
-    gpointer data)
-{
-  FsMsnStream *self = FS_MSN_STREAM (data);
-  gint error;
-  socklen_t option_len;
-  gint fd = g_io_channel_unix_get_fd (ch);
-
-  g_message ("handler called on fd %d", fd);
+/*
+ * The functions below that remove reactor sources are only called from the
+ * reactor thread with the mutex held, see fs_msn_stream_dispose() for the
+ * other threads.
+ */
 
-  errno = 0;
-  if (!((cond & G_IO_IN) || (cond & G_IO_OUT)))
-    {
-      g_message ("Condition received is %d", cond);
-      goto error;
-    }
+static void
+fs_msn_stream_cancel_handshakes (FsMsnStream *self)
+{
+  GList *item;
 
-  option_len = sizeof(error);
+  for (item = self->priv->handshakes; item; item = g_list_next (item))
+    fs_msn_handshake_free (item->data);
+  g_list_free (self->priv->handshakes);
+  self->priv->handshakes = NULL;
+}
 
-  /* Get the error option */
-  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*) &error, &option_len) < 0)
+static void
+fs_msn_stream_cancel_pending_candidates (FsMsnStream *self)
+{
+  if (self->priv->stagger_id)
     {
-      g_warning ("getsockopt() failed");
-      goto error;
+      fs_msn_reactor_remove (self->priv->reactor, self->priv->stagger_id);
+      self->priv->stagger_id = 0;
     }
 
-  /* Check if there is an error */
-  if (error)
-    {
-      g_message ("getsockopt gave an error : %d", error);
-      goto error;
-    }
+  fs_candidate_list_destroy (self->priv->pending_candidates);
+  self->priv->pending_candidates = NULL;
+}
 
-  /* Remove NON BLOCKING MODE */
-  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != 0)
+/*
+ * Starts a connection to the next pending candidate, skipping the ones
+ * that fail straight away.
+ */
+static void
+fs_msn_stream_start_next_candidate (FsMsnStream *self)
+{
+  while (self->priv->pending_candidates)
     {
-      g_warning ("fcntl() failed");
-      goto error;
-    }
+      FsCandidate *candidate = self->priv->pending_candidates->data;
+      GError *error = NULL;
+      gboolean started;
 
-  g_message ("Got connection on fd %d", fd);
-
-  if (fs_msn_authenticate_outgoing (self,fd))
-    {
-      g_message ("Authenticated outgoing successfully fd %d", fd);
-      self->priv->connection = ch;
+      self->priv->pending_candidates = g_list_delete_link (
+          self->priv->pending_candidates, self->priv->pending_candidates);
 
-      // success! we need to shutdown/close all other channels
-      gint i;
-      for (i = 0; i < self->priv->fdlist->len; i++)
+      started = fs_msn_stream_attempt_connection (self, candidate->ip,
+                                                  candidate->port, &error);
+      if (!started)
         {
-          GIOChannel *chan = g_array_index(self->priv->fdlist, GIOChannel*, i);
-          if (chan != ch)
-            {
-              g_message ("closing fd %d", g_io_channel_unix_get_fd (chan));
-              g_io_channel_shutdown (chan, TRUE, NULL);
-              g_io_channel_unref (chan);
-              g_array_remove_index (self->priv->fdlist, i);
-            }
+          GST_DEBUG ("Skipping candidate %s:%u: %s", candidate->ip,
+                     candidate->port, error->message);
+          g_clear_error (&error);
         }
 
-      g_source_remove (self->priv->out_watch);
-      if (self->priv->direction == FS_DIRECTION_RECV)
-        {
-          g_message("Setting media_fd_src on fd %d",fd);
-
-          GstState state;
-          gst_element_get_state(self->priv->media_fd_src,&state,NULL,GST_CLOCK_TIME_NONE);
+      fs_candidate_destroy (candidate);
 
-          if ( state > GST_STATE_READY)
-            {
-              g_message("Error: fdsrc in state above ready");
-              gst_element_set_state(self->priv->media_fd_src,GST_STATE_READY);
-            }
-          g_object_set (G_OBJECT(self->priv->media_fd_src), "fd", fd, NULL);
-          gst_element_set_locked_state(self->priv->media_fd_src,FALSE);
-          gst_element_sync_state_with_parent(self->priv->media_fd_src);
-        }
-      else if (self->priv->direction == FS_DIRECTION_SEND)
-        {
-          g_message("Setting media_fd_sink on fd %d",fd);
+      if (started)
+        break;
+    }
+}
 
-          GstState state;
-          gst_element_get_state(self->priv->media_fd_sink,&state,NULL,GST_CLOCK_TIME_NONE);
+static gboolean
+fs_msn_stream_stagger_cb (gpointer data)
+{
+  FsMsnStream *self = FS_MSN_STREAM (data);
+  gboolean keep = FALSE;
 
-          if ( state > GST_STATE_READY)
-            {
-              g_message("Error: fdsrc in state above ready");
-              gst_element_set_state(self->priv->media_fd_sink,GST_STATE_READY);
-            }
-          g_object_set (G_OBJECT(self->priv->media_fd_sink), "fd", fd, NULL);
-          gst_element_set_locked_state(self->priv->media_fd_sink,FALSE);
-          gst_element_sync_state_with_parent(self->priv->media_fd_sink);
-          g_object_set (G_OBJECT (self->priv->send_valve), "drop", FALSE, NULL);
+  g_mutex_lock (self->priv->mutex);
 
-        }
-      // add a watch on this fd to when it disconnects
-      self->priv->main_watch = g_io_add_watch (ch,
-                               (G_IO_ERR|G_IO_HUP|G_IO_NVAL),
-                               main_fd_closed_cb, self);
-      return FALSE;
-    }
-  else
+  if (!self->priv->disposed)
     {
-      g_message ("Authentification failed on fd %d", fd);
-    }
+      fs_msn_stream_start_next_candidate (self);
 
-  /* Error */
-error:
-  g_message ("Got error from fd %d, closing", fd);
-  // find, shutdown and remove channel from fdlist
-  gint i;
-  for (i = 0; i < self->priv->fdlist->len; i++)
-    {
-      GIOChannel *chan = g_array_index(self->priv->fdlist, GIOChannel*, i);
-      if (ch == chan)
-        {
-          g_io_channel_shutdown (chan, TRUE, NULL);
-          g_io_channel_unref (chan);
-          g_array_remove_index (self->priv->fdlist, i);
-        }
+      keep = (self->priv->pending_candidates != NULL);
+      if (!keep)
+        self->priv->stagger_id = 0;
     }
 
-  return FALSE;
+  g_mutex_unlock (self->priv->mutex);
+
+  return keep;
 }
 
-static gboolean
-fs_msn_stream_attempt_connection (FsMsnStream *stream,const gchar *ip, guint16 port)
+/*
+ * Starts the next candidate now and the following ones every
+ * connection-stagger milliseconds.
+ */
+static void
+fs_msn_stream_race_candidates (FsMsnStream *self)
 {
-  FsMsnStream *self = FS_MSN_STREAM (stream);
+  if (self->priv->stagger_id)
+    {
+      fs_msn_reactor_remove (self->priv->reactor, self->priv->stagger_id);
+      self->priv->stagger_id = 0;
+    }
 
-  GIOChannel *chan;
-  gint fd = -1;
-  struct sockaddr_in theiraddr;
-  memset(&theiraddr, 0, sizeof(theiraddr));
+  fs_msn_stream_start_next_candidate (self);
 
-  if ( (fd = socket(PF_INET, SOCK_STREAM, 0)) == -1 )
+  if (self->priv->pending_candidates)
+    self->priv->stagger_id = fs_msn_reactor_add_timeout (self->priv->reactor,
+                             self->priv->connection_stagger,
+                             fs_msn_stream_stagger_cb, self);
+}
+
+/*
+ * Hands the authenticated socket over to the media elements, they both
+ * work on a non-blocking socket. Runs in its own thread as the state changes
+ * may have to wait for the streaming threads, which the reactor thread must
+ * never do.
+ */
+static gpointer
+fs_msn_stream_start_media_thread (gpointer data)
+{
+  FsMsnStream *self = FS_MSN_STREAM (data);
+  GstElement *element = NULL;
+  GstElement *valve = NULL;
+  FsMsnReactor *reactor;
+  GstState state;
+  gint fd;
+
+  /* dispose() joins this thread before releasing the chain */
+  g_mutex_lock (self->priv->mutex);
+  if (self->priv->disposed)
     {
-      // show error
-      g_message ("could not create socket!");
-      return FALSE;
+      g_mutex_unlock (self->priv->mutex);
+      return NULL;
     }
 
-  chan = g_io_channel_unix_new (fd);
-  g_io_channel_set_close_on_unref (chan, TRUE);
-  g_array_append_val (self->priv->fdlist, chan);
+  fd = self->priv->connection_fd;
+  reactor = self->priv->reactor;
 
-  // set non-blocking mode
-  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  if (self->priv->direction == FS_DIRECTION_RECV &&
+      self->priv->media_fd_src)
+    element = gst_object_ref (self->priv->media_fd_src);
+  else if (self->priv->direction == FS_DIRECTION_SEND &&
+           self->priv->media_fd_sink)
+    element = gst_object_ref (self->priv->media_fd_sink);
 
-  theiraddr.sin_family = AF_INET;
-  theiraddr.sin_addr.s_addr = inet_addr (ip);
-  theiraddr.sin_port = htons (port);
+  if (self->priv->direction == FS_DIRECTION_SEND && self->priv->valve)
+    valve = gst_object_ref (self->priv->valve);
+  g_mutex_unlock (self->priv->mutex);
 
-  g_message ("Attempting connection to %s %d on socket %d", ip, port, fd);
-  // this is non blocking, the return value isn't too usefull
-  gint ret = connect (fd, (struct sockaddr *) &theiraddr, sizeof (theiraddr));
-  if (ret < 0)
+  if (element)
     {
-      if (errno != EINPROGRESS)
+      GST_DEBUG ("Setting %s on fd %d", GST_ELEMENT_NAME (element), fd);
+
+      gst_element_get_state (element, &state, NULL, GST_CLOCK_TIME_NONE);
+      if (state > GST_STATE_READY)
         {
-          g_io_channel_shutdown (chan, TRUE, NULL);
-          g_io_channel_unref (chan);
-          return FALSE;
+          GST_WARNING ("%s in state above ready", GST_ELEMENT_NAME (element));
+          gst_element_set_state (element, GST_STATE_READY);
         }
+      g_object_set (G_OBJECT (element), "fd", fd, NULL);
+      /* Lets the sink write its queue as soon as the socket drains */
+      if (FS_IS_MSN_FRAME_SINK (element))
+        g_object_set (G_OBJECT (element), "reactor", reactor, NULL);
+      gst_element_set_locked_state (element, FALSE);
+      gst_element_sync_state_with_parent (element);
+      gst_object_unref (element);
     }
-  g_message("ret %d %d %s", ret, errno, strerror(errno));
 
-  // add a watch on that io for when it connects
-  self->priv->out_watch = g_io_add_watch (chan,
-                                          (G_IO_IN|G_IO_OUT|G_IO_PRI|G_IO_ERR|G_IO_HUP|G_IO_NVAL),
-                                          successfull_connection_cb, self);
-  return TRUE;
+  if (valve)
+    {
+      g_object_set (G_OBJECT (valve), "drop", FALSE, NULL);
+      gst_object_unref (valve);
+    }
+
+  return NULL;
 }
 
-static gboolean
-fs_msn_stream_set_remote_candidate  (FsMsnStream *stream,
-                                     FsCandidate *candidate,
-                                     GError **error)
+/*
+ * Takes the authenticated socket and watches it for disconnection, must be
+ * called with the mutex held.
+ */
+static void
+fs_msn_stream_connection_established (FsMsnStream *self, gint fd)
 {
-  FsMsnStream *self = FS_MSN_STREAM (stream);
-  fs_msn_open_listening_port(self,self->priv->port); // FIXME - Should be done in the constructor, with a message passed onto the bus to give the port to the client program
-  if (fs_msn_stream_attempt_connection(self,candidate->ip,candidate->port))
-    return TRUE;
-  return FALSE;
+  self->priv->connection_fd = fd;
+
+  // add a watch on this fd to when it disconnects
+  self->priv->main_watch = fs_msn_reactor_add_watch (self->priv->reactor, fd,
+                           (G_IO_ERR|G_IO_HUP|G_IO_NVAL),
+                           main_fd_closed_cb, self);
+
+  if (self->priv->direction == FS_DIRECTION_SEND)
+    self->priv->stats_id = fs_msn_reactor_add_timeout (self->priv->reactor,
+                           STATS_PERIOD, fs_msn_stream_post_statistics, self);
 }
 
-static gboolean
-fs_msn_authenticate_incoming (FsMsnStream *stream, gint fd)
+/*
+ * Uses the first authenticated connection and drops every other attempt.
+ * Must be called with the mutex held, it releases it.
+ */
+static void
+fs_msn_stream_connection_won (FsMsnStream *self, gint fd, gboolean incoming)
 {
-  FsMsnStream *self = FS_MSN_STREAM (stream);
-  if (fd != 0)
-    {
-      gchar str[400];
-      gchar check[400];
+  FsMsnConference *conference;
+  GstClockTime connect_time = 0;
+  GError *error = NULL;
 
-      memset(str, 0, sizeof(str));
-      if (recv(fd, str, sizeof(str), 0) != -1)
-        {
-          g_message ("Got %s, checking if it's auth", str);
-          sprintf(str, "recipientid=%d&sessionid=%d\r\n\r\n",
-                  self->priv->local_recipientid, self->priv->remote_sessionid);
-          if (strcmp (str, check) != 0)
-            {
-              // send our connected message also
-              memset(str, 0, sizeof(str));
-              sprintf(str, "connected\r\n\r\n");
-              send(fd, str, strlen(str), 0);
-
-              // now we get connected
-              memset(str, 0, sizeof(str));
-              if (recv(fd, str, sizeof(str), 0) != -1)
-                {
-                  if (strcmp (str, "connected\r\n\r\n") == 0)
-                    {
-                      g_message ("Authentication successfull");
-                      return TRUE;
-                    }
-                }
-            }
-        }
-      else
-        {
-          perror("auth");
-        }
+  fs_msn_stream_cancel_pending_candidates (self);
+  fs_msn_stream_cancel_handshakes (self);
+
+  fs_msn_stream_connection_established (self, fd);
+
+  self->priv->media_thread = g_thread_create (fs_msn_stream_start_media_thread,
+                                              self, TRUE, &error);
+
+  if (GST_CLOCK_TIME_IS_VALID (self->priv->connect_start))
+    connect_time = gst_util_get_timestamp () - self->priv->connect_start;
+
+  /* The stream may be disposed once we release the mutex */
+  g_object_ref (self);
+  conference = g_object_ref (self->priv->conference);
+
+  g_mutex_unlock (self->priv->mutex);
+
+  if (error)
+    {
+      GST_WARNING ("Could not start the media thread, starting the media"
+                   " elements from the reactor thread: %s", error->message);
+      g_clear_error (&error);
+      fs_msn_stream_start_media_thread (self);
     }
-  return FALSE;
+
+  gst_element_post_message (GST_ELEMENT (conference),
+      gst_message_new_element (GST_OBJECT (conference),
+          gst_structure_new ("farsight-msn-connection-established",
+              "stream", FS_TYPE_STREAM, self,
+              "connect-time", G_TYPE_UINT64, connect_time,
+              "incoming", G_TYPE_BOOLEAN, incoming,
+              NULL)));
+
+  g_object_unref (conference);
+  g_object_unref (self);
 }
 
-static gboolean
-fd_accept_connection_cb (GIOChannel *ch, GIOCondition cond, gpointer data)
+static void
+fs_msn_stream_handshake_done (FsMsnHandshake *handshake,
+                              gboolean success,
+                              gpointer user_data)
 {
-  FsMsnStream *self = FS_MSN_STREAM (data);
-  struct sockaddr_in in;
-  int fd;
-  GIOChannel *newchan = NULL;
-  socklen_t n = sizeof (in);
+  FsMsnStream *self = FS_MSN_STREAM (user_data);
+  gint fd;
 
-  if (!(cond & G_IO_IN))
-    {
-      g_message ("Error in condition not G_IO_IN on %d see next error",g_io_channel_unix_get_fd (ch));
-      if (cond & G_IO_OUT)
-        g_message("Error: Data can be written (without blocking) in the accept_connection cb");
-      else if (cond & G_IO_PRI)
-        g_message("Error: There is urgent data to read in the accept_connection cb");
-      else if (cond & G_IO_ERR)
-        g_message("Error: There is an error in the accept_connection cb");
-      else if (cond & G_IO_HUP)
-        g_message("Error: Hung up (the connection has been broken, usually for pipes and sockets) in the accept_connection cb");
-      else if (cond & G_IO_NVAL)
-        g_message("Error: Invalid request. The file descriptor is not open in the accept_connection cb");
-      return FALSE;
-    }
+  g_mutex_lock (self->priv->mutex);
 
-  if ((fd = accept(g_io_channel_unix_get_fd (ch), (struct sockaddr*) &in, &n)) == -1)
+  /* Once disposing, the handshakes belong to fs_msn_stream_dispose() */
+  if (self->priv->disposed ||
+      !g_list_find (self->priv->handshakes, handshake))
     {
-      g_message ("Error while running accept() %d", errno);
-      return FALSE;
+      g_mutex_unlock (self->priv->mutex);
+      return;
     }
 
-  // ok we got a connection, let's set it up
-  newchan = g_io_channel_unix_new (fd);
-  g_io_channel_set_close_on_unref (newchan, TRUE);
+  self->priv->handshakes = g_list_remove (self->priv->handshakes, handshake);
 
-  /* Remove NON BLOCKING MODE */
-  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != 0)
+  if (!success || self->priv->connection_fd >= 0)
     {
-      g_warning ("fcntl() failed");
-      goto error;
+      fs_msn_handshake_free (handshake);
+
+      /* Don't wait for the stagger delay to try the next candidate */
+      if (self->priv->connection_fd < 0 &&
+          self->priv->pending_candidates)
+        fs_msn_stream_race_candidates (self);
+      g_mutex_unlock (self->priv->mutex);
+      return;
     }
 
-  // now we try to auth
-  if (fs_msn_authenticate_incoming(self,fd))
-    {
-      g_message ("Authenticated incoming successfully fd %d", fd);
-      self->priv->connection = newchan;
+  GST_DEBUG ("Authenticated %s connection on fd %d",
+             fs_msn_handshake_get_direction (handshake) ==
+             FS_MSN_HANDSHAKE_OUTGOING ? "outgoing" : "incoming",
+             fs_msn_handshake_get_fd (handshake));
 
-      // success! we need to shutdown/close all other channels
-      g_source_remove (self->priv->in_watch);
-      gint i;
-      for (i = 0; i < self->priv->fdlist->len; i++)
-        {
-          GIOChannel *chan = g_array_index(self->priv->fdlist, GIOChannel*, i);
-          if (chan != newchan)
-            {
-              g_message ("closing fd %d", g_io_channel_unix_get_fd (chan));
-              g_io_channel_shutdown (chan, TRUE, NULL);
-              g_io_channel_unref (chan);
-              g_array_remove_index (self->priv->fdlist, i);
-            }
-        }
-      if (self->priv->direction == FS_DIRECTION_RECV)
-        {
-          g_message("Setting media_fd_src on fd %d",fd);
+  fd = fs_msn_handshake_steal_fd (handshake);
+  fs_msn_handshake_free (handshake);
 
-          GstState state;
-          gst_element_get_state(self->priv->media_fd_src,&state,NULL,GST_CLOCK_TIME_NONE);
+  fs_msn_stream_connection_won (self, fd, FALSE);
+}
 
-          if ( state > GST_STATE_READY)
-            {
-              g_message("Error: fdsrc in state above ready");
-              gst_element_set_state(self->priv->media_fd_src,GST_STATE_READY);
-            }
-          g_object_set (G_OBJECT(self->priv->media_fd_src), "fd", fd, NULL);
-          gst_element_set_locked_state(self->priv->media_fd_src,FALSE);
-          gst_element_sync_state_with_parent(self->priv->media_fd_src);
-        }
-      else if (self->priv->direction == FS_DIRECTION_SEND)
-        {
-        }
-      // add a watch on this fd to when it disconnects
-      self->priv->main_watch = g_io_add_watch (newchan,
-                               (G_IO_ERR|G_IO_HUP|G_IO_NVAL),
-                               main_fd_closed_cb, self);
-      return FALSE;
-    }
+/*
+ * Called from the acceptor, in the reactor thread, with an authenticated
+ * incoming connection.
+ */
+static gboolean
+fs_msn_stream_incoming_cb (gint fd, gpointer user_data)
+{
+  FsMsnStream *self = FS_MSN_STREAM (user_data);
 
-  /* Error */
-error:
-  g_message ("Got error from fd %d, closing", fd);
-  // find, shutdown and remove channel from fdlist
-  gint i;
-  for (i = 0; i < self->priv->fdlist->len; i++)
+  g_mutex_lock (self->priv->mutex);
+
+  if (self->priv->disposed || self->priv->connection_fd >= 0)
     {
-      GIOChannel *chan = g_array_index(self->priv->fdlist, GIOChannel*, i);
-      if (newchan == chan)
-        {
-          g_io_channel_shutdown (chan, TRUE, NULL);
-          g_io_channel_unref (chan);
-          g_array_remove_index (self->priv->fdlist, i);
-        }
+      g_mutex_unlock (self->priv->mutex);
+      return FALSE;
     }
 
-  return FALSE;
+  GST_DEBUG ("Authenticated incoming connection on fd %d", fd);
+
+  fs_msn_stream_connection_won (self, fd, TRUE);
+
+  return TRUE;
 }
 
-static void
-fs_msn_open_listening_port (FsMsnStream *stream,
-                            guint16 port)
+static gboolean
+fs_msn_stream_attempt_connection (FsMsnStream *stream,
+                                  const gchar *ip,
+                                  guint16 port,
+                                  GError **error)
 {
   FsMsnStream *self = FS_MSN_STREAM (stream);
-  g_message ("Attempting to listen on port %d.....\n",port);
-
-  GIOChannel *chan;
+  FsMsnHandshake *handshake;
   gint fd = -1;
   struct sockaddr_in theiraddr;
   memset(&theiraddr, 0, sizeof(theiraddr));
 
+  theiraddr.sin_family = AF_INET;
+  theiraddr.sin_addr.s_addr = inet_addr (ip);
+  theiraddr.sin_port = htons (port);
+
+  if (theiraddr.sin_addr.s_addr == INADDR_NONE)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+                   "Invalid candidate ip %s", ip);
+      return FALSE;
+    }
+
   if ( (fd = socket(PF_INET, SOCK_STREAM, 0)) == -1 )
     {
-      // show error
-      g_message ("could not create socket!");
-      return;
+      g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
+                   "Could not create socket: %s", g_strerror (errno));
+      return FALSE;
     }
 
   // set non-blocking mode
   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
-  theiraddr.sin_family = AF_INET;
-  theiraddr.sin_port = htons (port);
-  // bind
-  if (bind(fd, (struct sockaddr *) &theiraddr, sizeof(theiraddr)) != 0)
+
+  GST_DEBUG ("Attempting connection to %s %d on socket %d", ip, port, fd);
+  // this is non blocking, the handshake will wait for it to complete
+  if (connect (fd, (struct sockaddr *) &theiraddr, sizeof (theiraddr)) < 0 &&
+      errno != EINPROGRESS)
     {
+      g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
+                   "Could not connect to %s:%d: %s", ip, port,
+                   g_strerror (errno));
       close (fd);
-      return;
+      return FALSE;
     }
 
+  handshake = fs_msn_handshake_new (self->priv->reactor, fd,
+                                    FS_MSN_HANDSHAKE_OUTGOING,
+                                    self->priv->remote_recipientid,
+                                    self->priv->remote_sessionid,
+                                    self->priv->handshake_timeout,
+                                    fs_msn_stream_handshake_done, self);
+  self->priv->handshakes = g_list_append (self->priv->handshakes, handshake);
+
+  return TRUE;
+}
+
+/*
+ * Registers the ids that incoming connections for this stream authenticate
+ * with, must not be called with the mutex held.
+ */
+static void
+fs_msn_stream_register (FsMsnStream *self)
+{
+  /* Construct properties are set before the acceptor exists */
+  if (!self->priv->acceptor)
+    return;
+
+  if (self->priv->registered)
+    fs_msn_acceptor_remove_recipient (self->priv->acceptor,
+                                      self->priv->registered_recipientid,
+                                      self->priv->registered_sessionid,
+                                      self);
+
+  self->priv->registered_recipientid = self->priv->local_recipientid;
+  self->priv->registered_sessionid = self->priv->remote_sessionid;
+  self->priv->registered = TRUE;
+
+  fs_msn_acceptor_add_recipient (self->priv->acceptor,
+                                 self->priv->registered_recipientid,
+                                 self->priv->registered_sessionid,
+                                 self->priv->handshake_timeout,
+                                 fs_msn_stream_incoming_cb, self);
+}
+
+/*
+ * Makes sure the conference listens on our port and posts it as our local
+ * candidates, one per address of this host since the acceptor listens on
+ * all of them.
+ */
+static gboolean
+fs_msn_stream_listen (FsMsnStream *self, GError **error)
+{
+  GList *ips, *item;
+  guint16 port;
+  guint i = 0;
+
+  port = fs_msn_acceptor_listen (self->priv->acceptor, self->priv->port,
+                                 error);
+  if (!port)
+    return FALSE;
 
-  /* Listen */
-  if (listen(fd, 3) != 0)
+  self->priv->port = port;
+
+  /* The loopback is only used when there is nothing else */
+  ips = fs_interfaces_get_local_ips (FALSE);
+  if (!ips)
+    ips = fs_interfaces_get_local_ips (TRUE);
+
+  for (item = ips; item; item = g_list_next (item))
     {
-      close (fd);
-      return;
+      gchar *foundation = g_strdup_printf ("%u", i++);
+      FsCandidate *candidate = fs_candidate_new (foundation, 1,
+          FS_CANDIDATE_TYPE_HOST, FS_NETWORK_PROTOCOL_TCP, item->data, port);
+
+      g_free (foundation);
+
+      gst_element_post_message (GST_ELEMENT (self->priv->conference),
+          gst_message_new_element (GST_OBJECT (self->priv->conference),
+              gst_structure_new ("farsight-new-local-candidate",
+                  "stream", FS_TYPE_STREAM, self,
+                  "candidate", FS_TYPE_CANDIDATE, candidate,
+                  NULL)));
+
+      fs_candidate_destroy (candidate);
     }
-  chan = g_io_channel_unix_new (fd);
-  g_io_channel_set_close_on_unref (chan, TRUE);
 
-  g_array_append_val (self->priv->fdlist, chan);
-  g_message ("Listening on port %d\n",port);
-  self->priv->in_watch = g_io_add_watch(chan,
-                                        G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                                        fd_accept_connection_cb, self);
+  g_list_foreach (ips, (GFunc) g_free, NULL);
+  g_list_free (ips);
+
+  gst_element_post_message (GST_ELEMENT (self->priv->conference),
+      gst_message_new_element (GST_OBJECT (self->priv->conference),
+          gst_structure_new ("farsight-local-candidates-prepared",
+              "stream", FS_TYPE_STREAM, self,
+              NULL)));
 
+  return TRUE;
 }
 
-// Authenticate ourselves when connecting out
+/* Called from the reactor thread */
 static gboolean
-fs_msn_authenticate_outgoing (FsMsnStream *stream, gint fd)
+fs_msn_stream_post_statistics (gpointer user_data)
 {
-  FsMsnStream *self = FS_MSN_STREAM (stream);
-  gchar str[400];
-  memset(str, 0, sizeof(str));
-  if (fd != 0)
-    {
-      g_message ("Authenticating connection on %d...", fd);
-      g_message ("sending : recipientid=%d&sessionid=%d\r\n\r\n",self->priv->remote_recipientid,self->priv->remote_sessionid);
-      sprintf(str, "recipientid=%d&sessionid=%d\r\n\r\n",
-              self->priv->remote_recipientid, self->priv->remote_sessionid);
-      if (send(fd, str, strlen(str), 0) == -1)
-        {
-          g_message("sending failed");
-          perror("auth");
-        }
+  FsMsnStream *self = FS_MSN_STREAM (user_data);
+  FsMsnConference *conference;
+  guint64 bytes_sent = 0, frames_sent = 0, frames_dropped = 0;
+  guint64 send_rate = 0, latency = 0;
+  guint64 raw_dropped;
+  gboolean shared = FALSE;
+  gboolean report_drops;
 
-      memset(str, 0, sizeof(str));
-      if (recv(fd, str, 13, 0) != -1)
-        {
-          g_message ("Got %s, checking if it's auth", str);
-          // we should get a connected message now
-          if (strcmp (str, "connected\r\n\r\n") == 0)
-            {
-              // send our connected message also
-              memset(str, 0, sizeof(str));
-              sprintf(str, "connected\r\n\r\n");
-              send(fd, str, strlen(str), 0);
-              g_message ("Authentication successfull");
-              return TRUE;
-            }
-        }
-      else
-        {
-          perror("auth");
-        }
+  g_mutex_lock (self->priv->mutex);
+
+  if (self->priv->disposed)
+    {
+      g_mutex_unlock (self->priv->mutex);
+      return FALSE;
     }
-  return FALSE;
-}
 
+  g_object_get (self->priv->media_fd_sink,
+                "bytes-sent", &bytes_sent,
+                "frames-sent", &frames_sent,
+                "frames-dropped", &frames_dropped,
+                "send-rate", &send_rate,
+                "backlog-latency", &latency,
+                NULL);
+  raw_dropped = fs_msn_session_get_frames_dropped (self->priv->session,
+                self->priv->chain, &shared);
+
+  report_drops = (raw_dropped != self->priv->reported_dropped ||
+                  frames_dropped != self->priv->reported_sink_dropped);
+  self->priv->reported_dropped = raw_dropped;
+  self->priv->reported_sink_dropped = frames_dropped;
+
+  /* The stream may be disposed once we release the mutex */
+  g_object_ref (self);
+  conference = g_object_ref (self->priv->conference);
+
+  g_mutex_unlock (self->priv->mutex);
+
+  gst_element_post_message (GST_ELEMENT (conference),
+      gst_message_new_element (GST_OBJECT (conference),
+          gst_structure_new ("farsight-msn-send-statistics",
+              "stream", FS_TYPE_STREAM, self,
+              "bytes-sent", G_TYPE_UINT64, bytes_sent,
+              "frames-sent", G_TYPE_UINT64, frames_sent,
+              "frames-dropped", G_TYPE_UINT64, frames_dropped,
+              "send-rate", G_TYPE_UINT64, send_rate,
+              "latency", G_TYPE_UINT64, latency,
+              "shared-encoder", G_TYPE_BOOLEAN, shared,
+              NULL)));
+
+  if (report_drops)
+    gst_element_post_message (GST_ELEMENT (conference),
+        gst_message_new_element (GST_OBJECT (conference),
+            gst_structure_new ("farsight-msn-frames-dropped",
+                "stream", FS_TYPE_STREAM, self,
+                "dropped", G_TYPE_UINT64, raw_dropped,
+                "sink-dropped", G_TYPE_UINT64, frames_dropped,
+                "latency", G_TYPE_UINT64, latency,
+                NULL)));
+
+  g_object_unref (conference);
+  g_object_unref (self);
+
+  return TRUE;
+}
 
 /**
  * fs_msn_stream_new:
  * @session: The #FsMsnSession this stream is a child of
  * @participant: The #FsMsnParticipant this stream is for
  * @direction: the initial #FsDirection for this stream
+ * @conference: the #FsMsnConference this stream belongs to
+ * @n_parameters: the number of parameters in @parameters
+ * @parameters: extra construction properties, such as "local-port"
+ * @error: location of a #GError, or NULL if no error occured
  *
  *
  * This function create a new stream
@@ -1144,14 +1397,36 @@ fs_msn_stream_new (FsMsnSession *session,
                    FsMsnParticipant *participant,
                    FsStreamDirection direction,
                    FsMsnConference *conference,
+                   guint n_parameters,
+                   GParameter *parameters,
                    GError **error)
 {
-  FsMsnStream *self = g_object_new (FS_TYPE_MSN_STREAM,
-                                    "session", session,
-                                    "participant", participant,
-                                    "direction", direction,
-                                    "conference",conference,
-                                    NULL);
+  GParameter *params = g_new0 (GParameter, n_parameters + 4);
+  FsMsnStream *self;
+  guint i;
+
+  params[0].name = "session";
+  g_value_init (&params[0].value, FS_TYPE_MSN_SESSION);
+  g_value_set_object (&params[0].value, session);
+  params[1].name = "participant";
+  g_value_init (&params[1].value, FS_TYPE_MSN_PARTICIPANT);
+  g_value_set_object (&params[1].value, participant);
+  params[2].name = "direction";
+  g_value_init (&params[2].value, FS_TYPE_STREAM_DIRECTION);
+  g_value_set_flags (&params[2].value, direction);
+  params[3].name = "conference";
+  g_value_init (&params[3].value, FS_TYPE_MSN_CONFERENCE);
+  g_value_set_object (&params[3].value, conference);
+
+  /* The values are only borrowed */
+  for (i = 0; i < n_parameters; i++)
+    params[i + 4] = parameters[i];
+
+  self = g_object_newv (FS_TYPE_MSN_STREAM, n_parameters + 4, params);
+
+  for (i = 0; i < 4; i++)
+    g_value_unset (&params[i].value);
+  g_free (params);
 
   if (self->priv->construction_error)
     {
@@ -76,6 +76,8 @@ FsMsnStream *fs_msn_stream_new (FsMsnSession *session,
                                 FsMsnParticipant *participant,
                                 FsStreamDirection direction,
                                 FsMsnConference *conference,
+                                guint n_parameters,
+                                GParameter *parameters,
                                 GError **error);
 
 
@@ -29,9 +29,19 @@
 #include <gst/gst.h>
 
 #include "fs-msn-conference.h"
+#include "fs-msn-frame-src.h"
+#include "fs-msn-frame-sink.h"
 
 static gboolean plugin_init (GstPlugin * plugin)
 {
+  if (!gst_element_register (plugin, "fsmsnframesrc",
+                             GST_RANK_NONE, FS_TYPE_MSN_FRAME_SRC))
+    return FALSE;
+
+  if (!gst_element_register (plugin, "fsmsnframesink",
+                             GST_RANK_NONE, FS_TYPE_MSN_FRAME_SINK))
+    return FALSE;
+
   return gst_element_register (plugin, "fsmsnconference",
                                GST_RANK_NONE, FS_TYPE_MSN_CONFERENCE);
 }
@@ -0,0 +1,517 @@
+/* Farsight 2 unit tests for the MSN frame source and sink
+ *
+ * Copyright (C) 2007 Collabora, Nokia
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gst/check/gstcheck.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs-msn-conference.h"
+#include "fs-msn-frame-src.h"
+#include "fs-msn-frame-sink.h"
+
+#define PAUSE_FOURCC "\0\0\0\0"
+
+/* Much more than the socket buffer takes at once */
+#define SINK_PAYLOAD_SIZE (256 * 1024)
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static void
+_make_socketpair (gint *fds)
+{
+  fail_if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0,
+      "Could not create a socketpair: %s", g_strerror (errno));
+
+  fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK);
+}
+
+/* Appends a frame whose payload is filled with @fill to @data */
+static void
+_append_frame (GByteArray *data, guint16 header_size, const gchar *fourcc,
+    guint payload_size, guint8 fill)
+{
+  guint8 header[FS_MSN_FRAME_HEADER_SIZE];
+  guint8 *payload = g_malloc (payload_size + 1);
+
+  memset (header, 0, sizeof (header));
+  GST_WRITE_UINT16_LE (header, header_size);
+  GST_WRITE_UINT16_LE (header + 2, 320);
+  GST_WRITE_UINT16_LE (header + 4, 240);
+  GST_WRITE_UINT32_LE (header + 8, payload_size);
+  memcpy (header + 12, fourcc, 4);
+
+  memset (payload, fill, payload_size);
+
+  g_byte_array_append (data, header, sizeof (header));
+  g_byte_array_append (data, payload, payload_size);
+
+  g_free (payload);
+}
+
+static void
+_write_all (gint fd, const guint8 *data, guint len)
+{
+  fail_unless (write (fd, data, len) == (gssize) len,
+      "Could not write %u bytes to the socket", len);
+}
+
+static void
+_wait_for_buffers (guint count)
+{
+  g_mutex_lock (check_mutex);
+  while (g_list_length (buffers) < count)
+    g_cond_wait (check_cond, check_mutex);
+  g_mutex_unlock (check_mutex);
+}
+
+static void
+_check_frame (guint index, guint payload_size, guint8 fill)
+{
+  GstBuffer *buffer;
+  guint i;
+
+  g_mutex_lock (check_mutex);
+  buffer = g_list_nth_data (buffers, index);
+  g_mutex_unlock (check_mutex);
+
+  fail_unless (GST_BUFFER_SIZE (buffer) ==
+      FS_MSN_FRAME_HEADER_SIZE + payload_size,
+      "Frame %u has %u bytes instead of %u", index, GST_BUFFER_SIZE (buffer),
+      FS_MSN_FRAME_HEADER_SIZE + payload_size);
+  fail_unless (!memcmp (GST_BUFFER_DATA (buffer) + 12, FS_MSN_FRAME_FOURCC,
+          4), "Frame %u does not start with its header", index);
+
+  for (i = FS_MSN_FRAME_HEADER_SIZE; i < GST_BUFFER_SIZE (buffer); i++)
+    fail_unless (GST_BUFFER_DATA (buffer)[i] == fill,
+        "Byte %u of frame %u is %u instead of %u", i, index,
+        GST_BUFFER_DATA (buffer)[i], fill);
+}
+
+static gboolean
+_bus_has_error (GstBus *bus)
+{
+  GstMessage *message;
+  gboolean has_error = FALSE;
+
+  while ((message = gst_bus_pop (bus)))
+  {
+    if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR)
+      has_error = TRUE;
+    gst_message_unref (message);
+  }
+
+  return has_error;
+}
+
+static GstElement *
+_setup_frame_src (gint fd, GstBus *bus)
+{
+  GstElement *src = g_object_new (FS_TYPE_MSN_FRAME_SRC, "fd", fd, NULL);
+  GstPad *sinkpad = gst_check_setup_sink_pad (src, &sinktemplate, NULL);
+
+  gst_element_set_bus (src, bus);
+  gst_pad_set_active (sinkpad, TRUE);
+
+  fail_unless (gst_element_set_state (src, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE, "Could not start the frame src");
+
+  return src;
+}
+
+static void
+_teardown_frame_src (GstElement *src)
+{
+  fail_unless (gst_element_set_state (src, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS, "Could not stop the frame src");
+
+  gst_check_teardown_sink_pad (src);
+  gst_element_set_bus (src, NULL);
+  gst_object_unref (src);
+
+  gst_check_drop_buffers ();
+}
+
+/*
+ * This test checks that the src pushes one buffer per frame whatever the
+ * way the frames are cut by the socket, and that it drops the frames the
+ * peer sends while it is paused
+ */
+
+GST_START_TEST (test_msnframesrc_framing)
+{
+  GstBus *bus = gst_bus_new ();
+  GByteArray *data = g_byte_array_new ();
+  GstElement *src;
+  guint64 frames;
+  gint fds[2];
+
+  _make_socketpair (fds);
+  src = _setup_frame_src (fds[1], bus);
+
+  /* Two frames and a pause frame in one write */
+  _append_frame (data, FS_MSN_FRAME_HEADER_SIZE, FS_MSN_FRAME_FOURCC, 100, 1);
+  _append_frame (data, FS_MSN_FRAME_HEADER_SIZE, PAUSE_FOURCC, 0, 0);
+  _append_frame (data, FS_MSN_FRAME_HEADER_SIZE, FS_MSN_FRAME_FOURCC, 10, 2);
+  _write_all (fds[0], data->data, data->len);
+  g_byte_array_set_size (data, 0);
+
+  _wait_for_buffers (2);
+  _check_frame (0, 100, 1);
+  _check_frame (1, 10, 2);
+
+  /* A pause frame with a payload, then a frame cut in the header and in
+   * the payload */
+  _append_frame (data, FS_MSN_FRAME_HEADER_SIZE, PAUSE_FOURCC, 30, 9);
+  _append_frame (data, FS_MSN_FRAME_HEADER_SIZE, FS_MSN_FRAME_FOURCC, 200, 3);
+  _write_all (fds[0], data->data, 54 + 10);
+  g_usleep (G_USEC_PER_SEC / 10);
+  _write_all (fds[0], data->data + 64, 100);
+  g_usleep (G_USEC_PER_SEC / 10);
+  _write_all (fds[0], data->data + 164, data->len - 164);
+
+  _wait_for_buffers (3);
+  _check_frame (2, 200, 3);
+
+  g_object_get (src, "frames", &frames, NULL);
+  fail_unless (frames == 3, "The src counted %" G_GUINT64_FORMAT
+      " frames instead of 3", frames);
+
+  fail_if (_bus_has_error (bus), "The src posted an error");
+
+  _teardown_frame_src (src);
+  close (fds[0]);
+  close (fds[1]);
+  g_byte_array_free (data, TRUE);
+  gst_object_unref (bus);
+}
+GST_END_TEST;
+
+/*
+ * This test checks that a header of the wrong size is a stream error
+ */
+
+GST_START_TEST (test_msnframesrc_bad_header)
+{
+  GstBus *bus = gst_bus_new ();
+  GByteArray *data = g_byte_array_new ();
+  GstElement *src;
+  GstMessage *message;
+  GError *error = NULL;
+  gint fds[2];
+
+  _make_socketpair (fds);
+  src = _setup_frame_src (fds[1], bus);
+
+  _append_frame (data, 20, FS_MSN_FRAME_FOURCC, 10, 1);
+  _write_all (fds[0], data->data, data->len);
+
+  message = gst_bus_poll (bus, GST_MESSAGE_ERROR, 5 * GST_SECOND);
+  fail_if (message == NULL, "The src did not post an error");
+
+  gst_message_parse_error (message, &error, NULL);
+  fail_unless (error->domain == GST_STREAM_ERROR &&
+      error->code == GST_STREAM_ERROR_DECODE,
+      "Got the wrong error: %s", error->message);
+  g_clear_error (&error);
+  gst_message_unref (message);
+
+  g_mutex_lock (check_mutex);
+  fail_unless (buffers == NULL, "The src pushed a bad frame");
+  g_mutex_unlock (check_mutex);
+
+  _teardown_frame_src (src);
+  close (fds[0]);
+  close (fds[1]);
+  g_byte_array_free (data, TRUE);
+  gst_object_unref (bus);
+}
+GST_END_TEST;
+/* Pushes a frame as mimenc does, the header and the payload separately. The
+ * payload starts with a libmimic header, which marks P-frames at offset 12 */
+static void
+_push_frame (GstPad *srcpad, guint payload_size, gboolean keyframe)
+{
+  GByteArray *data = g_byte_array_new ();
+  GstBuffer *buffer;
+
+  _append_frame (data, FS_MSN_FRAME_HEADER_SIZE, FS_MSN_FRAME_FOURCC,
+      payload_size, 0);
+  if (!keyframe)
+    GST_WRITE_UINT32_LE (data->data + FS_MSN_FRAME_HEADER_SIZE + 12, 1);
+
+  buffer = gst_buffer_new_and_alloc (FS_MSN_FRAME_HEADER_SIZE);
+  memcpy (GST_BUFFER_DATA (buffer), data->data, FS_MSN_FRAME_HEADER_SIZE);
+  fail_unless (gst_pad_push (srcpad, buffer) == GST_FLOW_OK,
+      "Could not push the frame header");
+
+  buffer = gst_buffer_new_and_alloc (payload_size);
+  memcpy (GST_BUFFER_DATA (buffer), data->data + FS_MSN_FRAME_HEADER_SIZE,
+      payload_size);
+  fail_unless (gst_pad_push (srcpad, buffer) == GST_FLOW_OK,
+      "Could not push the frame payload");
+
+  g_byte_array_free (data, TRUE);
+}
+
+/* Reads at most @max bytes that are already there */
+static void
+_read_some (gint fd, guint max)
+{
+  guint8 buf[4096];
+  gssize len;
+
+  while (max > 0 &&
+         (len = read (fd, buf, MIN (max, sizeof (buf)))) > 0)
+    max -= len;
+}
+
+static GstElement *
+_setup_frame_sink (gint fd, GstPad **srcpad)
+{
+  GstElement *sink = g_object_new (FS_TYPE_MSN_FRAME_SINK,
+      "fd", fd,
+      "max-queued-bytes", 1024 * 1024,
+      "max-latency", 100 * GST_MSECOND,
+      NULL);
+
+  *srcpad = gst_check_setup_src_pad (sink, &srctemplate, NULL);
+  gst_pad_set_active (*srcpad, TRUE);
+
+  fail_unless (gst_element_set_state (sink, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE, "Could not start the frame sink");
+  gst_pad_push_event (*srcpad, gst_event_new_new_segment (FALSE, 1.0,
+          GST_FORMAT_TIME, 0, -1, 0));
+
+  return sink;
+}
+
+static void
+_teardown_frame_sink (GstElement *sink)
+{
+  fail_unless (gst_element_set_state (sink, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS, "Could not stop the frame sink");
+  gst_check_teardown_src_pad (sink);
+  gst_object_unref (sink);
+}
+
+/*
+ * This test checks that the sink writes what the socket could not take as
+ * soon as the peer reads, from the reactor thread, without waiting for the
+ * next frame
+ */
+
+GST_START_TEST (test_msnframesink_drain)
+{
+  GError *error = NULL;
+  FsMsnReactor *reactor = fs_msn_reactor_new (&error);
+  GByteArray *data = g_byte_array_new ();
+  guint8 *received;
+  guint received_len = 0;
+  GstElement *sink;
+  GstPad *srcpad;
+  GstClockTime deadline;
+  guint queued_bytes;
+  guint64 frames_sent = 0;
+  gint sndbuf = 4096;
+  gint fds[2];
+
+  fail_if (reactor == NULL, "Could not create the reactor: %s",
+      error ? error->message : "no error");
+
+  _make_socketpair (fds);
+  setsockopt (fds[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+
+  sink = g_object_new (FS_TYPE_MSN_FRAME_SINK,
+      "fd", fds[1],
+      "reactor", reactor,
+      "max-queued-bytes", 2 * SINK_PAYLOAD_SIZE,
+      NULL);
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate, NULL);
+  gst_pad_set_active (srcpad, TRUE);
+
+  fail_unless (gst_element_set_state (sink, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE, "Could not start the frame sink");
+  gst_pad_push_event (srcpad, gst_event_new_new_segment (FALSE, 1.0,
+          GST_FORMAT_TIME, 0, -1, 0));
+
+  /* What _push_frame() sends for a keyframe */
+  _append_frame (data, FS_MSN_FRAME_HEADER_SIZE, FS_MSN_FRAME_FOURCC,
+      SINK_PAYLOAD_SIZE, 0);
+  _push_frame (srcpad, SINK_PAYLOAD_SIZE, TRUE);
+
+  g_object_get (sink, "queued-bytes", &queued_bytes, NULL);
+  fail_unless (queued_bytes > 0, "The socket took the whole frame at once");
+
+  /* Nothing else is pushed, only the reactor can write the rest */
+  received = g_malloc (data->len);
+  deadline = gst_util_get_timestamp () + 5 * GST_SECOND;
+  while (received_len < data->len)
+  {
+    struct pollfd pfd = { fds[0], POLLIN, 0 };
+    GstClockTime now = gst_util_get_timestamp ();
+    gssize len;
+
+    fail_if (now >= deadline, "Only got %u of the %u bytes of the frame",
+        received_len, data->len);
+
+    if (poll (&pfd, 1, (deadline - now) / GST_MSECOND + 1) <= 0)
+      continue;
+
+    len = read (fds[0], received + received_len, data->len - received_len);
+    fail_if (len == 0, "The sink closed the socket");
+    if (len > 0)
+      received_len += len;
+  }
+
+  fail_unless (!memcmp (received, data->data, data->len),
+      "The frame was corrupted on the way");
+
+  /* The counters are updated right after the last write */
+  while (frames_sent == 0 && gst_util_get_timestamp () < deadline)
+  {
+    g_object_get (sink, "frames-sent", &frames_sent, NULL);
+    if (!frames_sent)
+      g_usleep (G_USEC_PER_SEC / 100);
+  }
+  fail_unless (frames_sent == 1, "The sink sent %" G_GUINT64_FORMAT
+      " frames instead of 1", frames_sent);
+
+  g_object_get (sink, "queued-bytes", &queued_bytes, NULL);
+  fail_unless (queued_bytes == 0, "%u bytes are still queued", queued_bytes);
+
+  _teardown_frame_sink (sink);
+
+  fs_msn_reactor_free (reactor);
+  close (fds[0]);
+  close (fds[1]);
+  g_free (received);
+  g_byte_array_free (data, TRUE);
+}
+GST_END_TEST;
+
+/*
+ * This test checks that a sink whose peer is late drops frames without
+ * affecting a sink fed the same frames whose peer keeps up, like two
+ * branches of the shared encoder
+ */
+
+#define LATE_FRAMES 40
+#define LATE_PAYLOAD_SIZE 2000
+
+GST_START_TEST (test_msnframesink_late_peer)
+{
+  GstElement *fast, *slow;
+  GstPad *fast_pad, *slow_pad;
+  guint64 fast_sent, fast_dropped, slow_sent, slow_dropped;
+  gint sndbuf = 4096;
+  gint fast_fds[2], slow_fds[2];
+  guint i;
+
+  _make_socketpair (fast_fds);
+  _make_socketpair (slow_fds);
+  setsockopt (slow_fds[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+
+  fast = _setup_frame_sink (fast_fds[1], &fast_pad);
+  slow = _setup_frame_sink (slow_fds[1], &slow_pad);
+
+  /* 50 frames per second, the slow peer takes about 300 bytes of each
+   * 2 kB frame */
+  for (i = 0; i < LATE_FRAMES; i++)
+  {
+    gboolean keyframe = (i % 10 == 0);
+
+    _push_frame (fast_pad, LATE_PAYLOAD_SIZE, keyframe);
+    _push_frame (slow_pad, LATE_PAYLOAD_SIZE, keyframe);
+
+    _read_some (fast_fds[0], G_MAXUINT);
+    _read_some (slow_fds[0], 300);
+
+    g_usleep (G_USEC_PER_SEC / 50);
+  }
+
+  g_object_get (fast,
+      "frames-sent", &fast_sent,
+      "frames-dropped", &fast_dropped,
+      NULL);
+  g_object_get (slow,
+      "frames-sent", &slow_sent,
+      "frames-dropped", &slow_dropped,
+      NULL);
+
+  fail_unless (fast_sent == LATE_FRAMES && fast_dropped == 0,
+      "The fast sink sent %" G_GUINT64_FORMAT " and dropped %"
+      G_GUINT64_FORMAT " of %d frames", fast_sent, fast_dropped, LATE_FRAMES);
+  fail_unless (slow_dropped > 0, "The late sink did not drop anything");
+  fail_unless (slow_sent < LATE_FRAMES, "The late sink sent every frame");
+
+  _teardown_frame_sink (fast);
+  _teardown_frame_sink (slow);
+
+  close (fast_fds[0]);
+  close (fast_fds[1]);
+  close (slow_fds[0]);
+  close (slow_fds[1]);
+}
+GST_END_TEST;
+
+
+static Suite *
+fsmsnframing_suite (void)
+{
+  Suite *s = suite_create ("fsmsnframing");
+  TCase *tc_chain;
+
+  /* Normally done by the conference class */
+  GST_DEBUG_CATEGORY_INIT (fsmsnconference_debug, "fsmsnconference", 0,
+      "Farsight MSN Conference Element");
+
+  tc_chain = tcase_create ("fsmsnframing-src");
+  tcase_add_test (tc_chain, test_msnframesrc_framing);
+  tcase_add_test (tc_chain, test_msnframesrc_bad_header);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("fsmsnframing-sink");
+  tcase_add_test (tc_chain, test_msnframesink_drain);
+  tcase_add_test (tc_chain, test_msnframesink_late_peer);
+  suite_add_tcase (s, tc_chain);
+
+  return s;
+}
+
+
+GST_CHECK_MAIN (fsmsnframing);
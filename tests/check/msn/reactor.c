@@ -0,0 +1,541 @@
+/* Farsight 2 unit tests for the sockets of the MSN conference
+ *
+ * Copyright (C) 2007 Collabora, Nokia
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gst/check/gstcheck.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check-threadsafe.h"
+
+#include "fs-msn-conference.h"
+#include "fs-msn-reactor.h"
+#include "fs-msn-handshake.h"
+#include "fs-msn-acceptor.h"
+
+#define RECIPIENTID 1234
+#define SESSIONID 5678
+
+/*
+ * The callbacks run in the reactor thread and record what they saw here, the
+ * test thread waits on the condition for the counters to change
+ */
+
+typedef struct {
+  GMutex *mutex;
+  GCond *cond;
+
+  gint watch_calls;
+  GIOCondition watch_condition;
+  gssize watch_read;
+
+  /* Indexed by handshake direction */
+  gint done[2];
+  gboolean success[2];
+  /* Sent by the outgoing side as soon as its handshake succeeds */
+  gboolean send_media;
+
+  gint accepted;
+  gint accepted_fd;
+} Results;
+
+static Results *
+_results_new (void)
+{
+  Results *results = g_slice_new0 (Results);
+
+  results->mutex = g_mutex_new ();
+  results->cond = g_cond_new ();
+  results->accepted_fd = -1;
+
+  return results;
+}
+
+static void
+_results_free (Results *results)
+{
+  g_mutex_free (results->mutex);
+  g_cond_free (results->cond);
+  g_slice_free (Results, results);
+}
+
+/* Waits for up to 5 seconds until *counter reaches count */
+static gboolean
+_results_wait (Results *results, gint *counter, gint count)
+{
+  GTimeVal deadline;
+  gboolean reached;
+
+  g_get_current_time (&deadline);
+  g_time_val_add (&deadline, 5 * G_USEC_PER_SEC);
+
+  g_mutex_lock (results->mutex);
+  while (*counter < count)
+    if (!g_cond_timed_wait (results->cond, results->mutex, &deadline))
+      break;
+  reached = (*counter >= count);
+  g_mutex_unlock (results->mutex);
+
+  return reached;
+}
+
+static void
+_make_socketpair (gint *fds)
+{
+  ts_fail_if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0,
+      "Could not create a socketpair: %s", g_strerror (errno));
+
+  fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK);
+}
+
+static FsMsnReactor *
+_new_reactor (void)
+{
+  GError *error = NULL;
+  FsMsnReactor *reactor = fs_msn_reactor_new (&error);
+
+  if (error)
+    ts_fail ("Error creating the reactor: (%s:%d) %s",
+        g_quark_to_string (error->domain), error->code, error->message);
+
+  ts_fail_if (reactor == NULL, "No reactor created, yet error is NULL");
+
+  return reactor;
+}
+
+static gboolean
+_watch_read_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+  Results *results = user_data;
+  gchar buf[16];
+  gssize ret = read (fd, buf, sizeof (buf));
+
+  g_mutex_lock (results->mutex);
+  results->watch_calls++;
+  results->watch_condition = condition;
+  results->watch_read = ret;
+  g_cond_broadcast (results->cond);
+  g_mutex_unlock (results->mutex);
+
+  /* Removed once the peer is gone */
+  return ret != 0;
+}
+
+/*
+ * This test checks that a watch sees the data and then the close of its
+ * peer, and that returning FALSE from its callback removes it
+ */
+
+GST_START_TEST (test_msnreactor_watch_close)
+{
+  FsMsnReactor *reactor = _new_reactor ();
+  Results *results = _results_new ();
+  gint fds[2];
+  guint id;
+
+  _make_socketpair (fds);
+
+  id = fs_msn_reactor_add_watch (reactor, fds[0],
+      G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL, _watch_read_cb, results);
+  ts_fail_if (id == 0, "Could not add the watch");
+
+  ts_fail_unless (write (fds[1], "data", 4) == 4, "Could not write");
+  ts_fail_unless (_results_wait (results, &results->watch_calls, 1),
+      "The watch was not called for the data");
+  ts_fail_unless (results->watch_read == 4,
+      "The watch read %d bytes instead of 4", (gint) results->watch_read);
+
+  close (fds[1]);
+  ts_fail_unless (_results_wait (results, &results->watch_calls, 2),
+      "The watch was not called when the peer closed");
+  ts_fail_unless (results->watch_condition & (G_IO_IN | G_IO_HUP),
+      "The close was reported as condition %d", results->watch_condition);
+  ts_fail_unless (results->watch_read == 0,
+      "Read %d bytes from a closed socket", (gint) results->watch_read);
+
+  /* The watch is gone, it must not be called again on the closed socket */
+  g_usleep (G_USEC_PER_SEC / 5);
+  g_mutex_lock (results->mutex);
+  ts_fail_unless (results->watch_calls == 2,
+      "The watch was called %d times after it returned FALSE",
+      results->watch_calls - 2);
+  g_mutex_unlock (results->mutex);
+
+  /* Removing it again is harmless */
+  fs_msn_reactor_remove (reactor, id);
+
+  close (fds[0]);
+  fs_msn_reactor_free (reactor);
+  _results_free (results);
+}
+GST_END_TEST;
+
+static void
+_handshake_done (FsMsnHandshake *handshake, gboolean success,
+    gpointer user_data)
+{
+  Results *results = user_data;
+  FsMsnHandshakeDirection direction =
+    fs_msn_handshake_get_direction (handshake);
+
+  g_mutex_lock (results->mutex);
+  results->done[direction]++;
+  results->success[direction] = success;
+  /* Queued right behind our last handshake line */
+  if (success && direction == FS_MSN_HANDSHAKE_OUTGOING &&
+      results->send_media)
+    ts_fail_unless (write (fs_msn_handshake_get_fd (handshake), "media", 5) ==
+        5, "Could not write the media data");
+  g_cond_broadcast (results->cond);
+  g_mutex_unlock (results->mutex);
+}
+
+static void
+_run_handshakes (guint sent_sessionid, gboolean expect_success)
+{
+  FsMsnReactor *reactor = _new_reactor ();
+  Results *results = _results_new ();
+  FsMsnHandshake *outgoing, *incoming;
+  gchar buf[16];
+  gint fds[2];
+
+  _make_socketpair (fds);
+
+  results->send_media = expect_success;
+
+  g_mutex_lock (results->mutex);
+  outgoing = fs_msn_handshake_new (reactor, fds[0], FS_MSN_HANDSHAKE_OUTGOING,
+      RECIPIENTID, sent_sessionid, 5, _handshake_done, results);
+  incoming = fs_msn_handshake_new (reactor, fds[1], FS_MSN_HANDSHAKE_INCOMING,
+      RECIPIENTID, SESSIONID, 5, _handshake_done, results);
+  g_mutex_unlock (results->mutex);
+
+  ts_fail_unless (_results_wait (results,
+          &results->done[FS_MSN_HANDSHAKE_INCOMING], 1),
+      "The incoming handshake did not finish");
+  ts_fail_unless (results->success[FS_MSN_HANDSHAKE_INCOMING] ==
+      expect_success, "The incoming handshake %s",
+      expect_success ? "failed" : "succeeded with the wrong ids");
+
+  /* Closes the socket, the outgoing side sees it if it is still waiting */
+  if (!expect_success)
+    fs_msn_handshake_free (incoming);
+
+  ts_fail_unless (_results_wait (results,
+          &results->done[FS_MSN_HANDSHAKE_OUTGOING], 1),
+      "The outgoing handshake did not finish");
+  ts_fail_unless (results->success[FS_MSN_HANDSHAKE_OUTGOING] ==
+      expect_success, "The outgoing handshake %s",
+      expect_success ? "failed" : "succeeded with the wrong ids");
+
+  if (expect_success)
+  {
+    /* Nothing past the handshake may have been consumed */
+    ts_fail_unless (read (fds[1], buf, sizeof (buf)) == 5,
+        "The media data was not left in the socket");
+    ts_fail_unless (!memcmp (buf, "media", 5), "Got the wrong data");
+
+    fs_msn_handshake_free (incoming);
+  }
+
+  fs_msn_handshake_free (outgoing);
+
+  g_mutex_lock (results->mutex);
+  ts_fail_unless (results->done[0] == 1 && results->done[1] == 1,
+      "The handshakes finished %d and %d times instead of once",
+      results->done[0], results->done[1]);
+  g_mutex_unlock (results->mutex);
+
+  fs_msn_reactor_free (reactor);
+  _results_free (results);
+}
+
+GST_START_TEST (test_msnreactor_handshake)
+{
+  _run_handshakes (SESSIONID, TRUE);
+}
+GST_END_TEST;
+
+GST_START_TEST (test_msnreactor_handshake_wrong_ids)
+{
+  _run_handshakes (SESSIONID + 1, FALSE);
+}
+GST_END_TEST;
+
+GST_START_TEST (test_msnreactor_handshake_timeout)
+{
+  FsMsnReactor *reactor = _new_reactor ();
+  Results *results = _results_new ();
+  FsMsnHandshake *incoming;
+  GTimeVal start, end;
+  glong elapsed;
+  gint fds[2];
+
+  _make_socketpair (fds);
+
+  g_get_current_time (&start);
+
+  g_mutex_lock (results->mutex);
+  incoming = fs_msn_handshake_new (reactor, fds[1], FS_MSN_HANDSHAKE_INCOMING,
+      RECIPIENTID, SESSIONID, 1, _handshake_done, results);
+  g_mutex_unlock (results->mutex);
+
+  /* The peer never says anything */
+  ts_fail_unless (_results_wait (results,
+          &results->done[FS_MSN_HANDSHAKE_INCOMING], 1),
+      "The handshake did not time out");
+  ts_fail_if (results->success[FS_MSN_HANDSHAKE_INCOMING],
+      "The handshake succeeded without a peer");
+
+  g_get_current_time (&end);
+  elapsed = (end.tv_sec - start.tv_sec) * G_USEC_PER_SEC +
+    end.tv_usec - start.tv_usec;
+  ts_fail_if (elapsed < G_USEC_PER_SEC * 9 / 10,
+      "The handshake timed out after %ld us instead of a second", elapsed);
+
+  fs_msn_handshake_free (incoming);
+  close (fds[0]);
+
+  fs_msn_reactor_free (reactor);
+  _results_free (results);
+}
+GST_END_TEST;
+
+static gboolean
+_accept_cb (gint fd, gpointer user_data)
+{
+  Results *results = user_data;
+
+  g_mutex_lock (results->mutex);
+  results->accepted++;
+  results->accepted_fd = fd;
+  g_cond_broadcast (results->cond);
+  g_mutex_unlock (results->mutex);
+
+  return TRUE;
+}
+
+static gint
+_connect_to (guint16 port)
+{
+  struct sockaddr_in addr;
+  gint fd = socket (AF_INET, SOCK_STREAM, 0);
+
+  ts_fail_if (fd < 0, "Could not create a socket");
+
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = htons (port);
+
+  ts_fail_if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 &&
+      errno != EINPROGRESS, "Could not connect to port %u: %s", port,
+      g_strerror (errno));
+
+  return fd;
+}
+
+/* Runs a client handshake to the acceptor and returns whether it succeeded */
+static gboolean
+_connect_handshake (FsMsnReactor *reactor, Results *results, guint16 port,
+    guint sessionid)
+{
+  FsMsnHandshake *handshake;
+  gint done = results->done[FS_MSN_HANDSHAKE_OUTGOING];
+  gboolean success;
+
+  g_mutex_lock (results->mutex);
+  handshake = fs_msn_handshake_new (reactor, _connect_to (port),
+      FS_MSN_HANDSHAKE_OUTGOING, RECIPIENTID, sessionid, 5, _handshake_done,
+      results);
+  g_mutex_unlock (results->mutex);
+
+  ts_fail_unless (_results_wait (results,
+          &results->done[FS_MSN_HANDSHAKE_OUTGOING], done + 1),
+      "The client handshake did not finish");
+  success = results->success[FS_MSN_HANDSHAKE_OUTGOING];
+
+  fs_msn_handshake_free (handshake);
+
+  return success;
+}
+
+/*
+ * This test checks that the acceptor hands an authenticated connection to
+ * the recipient registered for its ids, and closes the other ones
+ */
+
+GST_START_TEST (test_msnreactor_acceptor)
+{
+  GError *error = NULL;
+  FsMsnReactor *reactor = _new_reactor ();
+  FsMsnAcceptor *acceptor = fs_msn_acceptor_new (reactor, 5);
+  Results *results = _results_new ();
+  guint16 port;
+  gint fd;
+
+  port = fs_msn_acceptor_listen (acceptor, 0, &error);
+  if (error)
+    ts_fail ("Error listening: (%s:%d) %s",
+        g_quark_to_string (error->domain), error->code, error->message);
+  ts_fail_if (port == 0, "Did not get a port, yet error is NULL");
+
+  ts_fail_unless (fs_msn_acceptor_listen (acceptor, 0, NULL) == port,
+      "The default port was not shared");
+
+  fs_msn_acceptor_add_recipient (acceptor, RECIPIENTID, SESSIONID, 5,
+      _accept_cb, results);
+
+  /* Closed right away, before sending anything */
+  close (_connect_to (port));
+
+  /* Closed in the middle of the auth line */
+  fd = _connect_to (port);
+  g_usleep (G_USEC_PER_SEC / 10);
+  ts_fail_unless (write (fd, "recipientid=", 12) == 12, "Could not write");
+  close (fd);
+
+  ts_fail_if (_connect_handshake (reactor, results, port, SESSIONID + 1),
+      "A connection with unknown ids was accepted");
+
+  ts_fail_unless (_connect_handshake (reactor, results, port, SESSIONID),
+      "The acceptor refused a connection with known ids");
+  ts_fail_unless (_results_wait (results, &results->accepted, 1),
+      "The recipient did not get the connection");
+
+  g_mutex_lock (results->mutex);
+  ts_fail_unless (results->accepted == 1,
+      "The recipient got %d connections instead of one", results->accepted);
+  ts_fail_if (results->accepted_fd < 0, "The recipient got no socket");
+  close (results->accepted_fd);
+  g_mutex_unlock (results->mutex);
+
+  /* Once removed, the same ids are refused */
+  fs_msn_acceptor_remove_recipient (acceptor, RECIPIENTID, SESSIONID,
+      results);
+  ts_fail_if (_connect_handshake (reactor, results, port, SESSIONID),
+      "A connection was accepted for a removed recipient");
+
+  fs_msn_acceptor_free (acceptor);
+  fs_msn_reactor_free (reactor);
+  _results_free (results);
+}
+GST_END_TEST;
+
+/*
+ * This test checks that the incoming connections get the handshake timeout
+ * of the registered recipient, not the one the acceptor was created with
+ */
+
+GST_START_TEST (test_msnreactor_acceptor_timeout)
+{
+  GError *error = NULL;
+  FsMsnReactor *reactor = _new_reactor ();
+  FsMsnAcceptor *acceptor = fs_msn_acceptor_new (reactor, 60);
+  Results *results = _results_new ();
+  GTimeVal start, end;
+  glong elapsed;
+  guint16 port;
+  gchar buf[16];
+  gint fd;
+
+  port = fs_msn_acceptor_listen (acceptor, 0, &error);
+  if (error)
+    ts_fail ("Error listening: (%s:%d) %s",
+        g_quark_to_string (error->domain), error->code, error->message);
+
+  fs_msn_acceptor_add_recipient (acceptor, RECIPIENTID, SESSIONID, 1,
+      _accept_cb, results);
+
+  g_get_current_time (&start);
+
+  /* The peer never says anything, the acceptor closes it */
+  fd = _connect_to (port);
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+  ts_fail_unless (read (fd, buf, sizeof (buf)) <= 0,
+      "The acceptor sent something before the peer authenticated");
+
+  g_get_current_time (&end);
+  elapsed = (end.tv_sec - start.tv_sec) * G_USEC_PER_SEC +
+    end.tv_usec - start.tv_usec;
+  ts_fail_if (elapsed < G_USEC_PER_SEC * 9 / 10 || elapsed > 5 * G_USEC_PER_SEC,
+      "The handshake timed out after %ld us instead of a second", elapsed);
+
+  g_mutex_lock (results->mutex);
+  ts_fail_unless (results->accepted == 0, "The recipient got a connection");
+  g_mutex_unlock (results->mutex);
+
+  close (fd);
+  fs_msn_acceptor_remove_recipient (acceptor, RECIPIENTID, SESSIONID,
+      results);
+  fs_msn_acceptor_free (acceptor);
+  fs_msn_reactor_free (reactor);
+  _results_free (results);
+}
+GST_END_TEST;
+
+
+static Suite *
+fsmsnreactor_suite (void)
+{
+  Suite *s = suite_create ("fsmsnreactor");
+  TCase *tc_chain;
+  GLogLevelFlags fatal_mask;
+
+  fatal_mask = g_log_set_always_fatal (G_LOG_FATAL_MASK);
+  fatal_mask |= G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL;
+  g_log_set_always_fatal (fatal_mask);
+
+  /* Normally done by the conference class */
+  GST_DEBUG_CATEGORY_INIT (fsmsnconference_debug, "fsmsnconference", 0,
+      "Farsight MSN Conference Element");
+
+  tc_chain = tcase_create ("fsmsnreactor-watch");
+  tcase_add_test (tc_chain, test_msnreactor_watch_close);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("fsmsnreactor-handshake");
+  tcase_add_test (tc_chain, test_msnreactor_handshake);
+  tcase_add_test (tc_chain, test_msnreactor_handshake_wrong_ids);
+  tcase_add_test (tc_chain, test_msnreactor_handshake_timeout);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("fsmsnreactor-acceptor");
+  tcase_add_test (tc_chain, test_msnreactor_acceptor);
+  tcase_add_test (tc_chain, test_msnreactor_acceptor_timeout);
+  suite_add_tcase (s, tc_chain);
+
+  return s;
+}
+
+
+GST_CHECK_MAIN (fsmsnreactor);
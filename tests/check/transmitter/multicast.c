@@ -22,6 +22,10 @@
 # include <config.h>
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <gst/check/gstcheck.h>
 #include <gst/farsight/fs-transmitter.h>
 #include <gst/farsight/fs-conference-iface.h>
@@ -33,6 +37,14 @@
  #include <arpa/inet.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
 #include "check-threadsafe.h"
 #include "generic.h"
 
@@ -42,6 +54,14 @@ gint candidates[2] = {0, 0};
 GstElement *pipeline = NULL;
 gboolean src_setup[2] = {FALSE, FALSE};
 
+/* Number of buffers of each size pushed by the src of the RTP component */
+volatile gint received[1500];
+
+#define GROUP1 "224.0.0.111"
+#define GROUP2 "224.0.0.112"
+#define GROUP_OTHER "224.0.0.113"
+#define GROUP_PORT 2424
+
 GST_START_TEST (test_multicasttransmitter_new)
 {
   GError *error = NULL;
@@ -303,6 +323,1085 @@ GST_START_TEST (test_multicasttransmitter_run_local_candidates)
 }
 GST_END_TEST;
 
+GST_START_TEST (test_multicasttransmitter_run_source_filter)
+{
+  GParameter params[2];
+  GList *list = NULL;
+  FsCandidate *candidate;
+  gchar *address = _find_multicast_capable_address ();
+
+  if (address == NULL)
+    return;
+
+  memset (params, 0, sizeof (GParameter) * 2);
+
+  candidate = fs_candidate_new ("L1", FS_COMPONENT_RTP, FS_CANDIDATE_TYPE_HOST,
+      FS_NETWORK_PROTOCOL_UDP, address, 0);
+  list = g_list_prepend (list, candidate);
+
+  candidate = fs_candidate_new ("L2", FS_COMPONENT_RTCP, FS_CANDIDATE_TYPE_HOST,
+      FS_NETWORK_PROTOCOL_UDP, address, 0);
+  list = g_list_prepend (list, candidate);
+
+  params[0].name = "preferred-local-candidates";
+  g_value_init (&params[0].value, FS_TYPE_CANDIDATE_LIST);
+  g_value_set_boxed (&params[0].value, list);
+
+  /* We send from that address, so only accepting it as a source must
+   * still get us our own packets back */
+  params[1].name = "source-ip";
+  g_value_init (&params[1].value, G_TYPE_STRING);
+  g_value_set_string (&params[1].value, address);
+
+  run_multicast_transmitter_test (2, params);
+
+  g_value_reset (&params[0].value);
+  g_value_unset (&params[1].value);
+
+  g_free (address);
+  fs_candidate_list_destroy (list);
+}
+GST_END_TEST;
+
+static void
+_count_handoff (GstElement *element, GstBuffer *buffer, GstPad *pad,
+  gpointer user_data)
+{
+  if (GPOINTER_TO_INT (user_data) == 1 &&
+      GST_BUFFER_SIZE (buffer) < G_N_ELEMENTS (received))
+    g_atomic_int_inc (&received[GST_BUFFER_SIZE (buffer)]);
+}
+
+/*
+ * Waits up to 5 seconds for the src to push @count buffers of @size bytes
+ */
+static gboolean
+_wait_for_received (guint size, gint count)
+{
+  gint i;
+
+  for (i = 0; i < 500; i++)
+  {
+    while (g_main_context_iteration (NULL, FALSE));
+    if (g_atomic_int_get (&received[size]) >= count)
+      return TRUE;
+    g_usleep (10000);
+  }
+
+  return FALSE;
+}
+
+/*
+ * Waits up to 5 seconds for the guint64 property @name of @element to
+ * reach @count
+ */
+static gboolean
+_wait_for_property (GstElement *element, const gchar *name, guint64 count)
+{
+  guint64 value;
+  gint i;
+
+  for (i = 0; i < 500; i++)
+  {
+    while (g_main_context_iteration (NULL, FALSE));
+    g_object_get (element, name, &value, NULL);
+    if (value >= count)
+      return TRUE;
+    g_usleep (10000);
+  }
+
+  return FALSE;
+}
+
+static FsTransmitter *
+_new_group_transmitter (void)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  GstBus *bus;
+
+  trans = fs_transmitter_new ("multicast", 2, &error);
+
+  if (error) {
+    ts_fail ("Error creating transmitter: (%s:%d) %s",
+      g_quark_to_string (error->domain), error->code, error->message);
+  }
+
+  ts_fail_if (trans == NULL, "No transmitter create, yet error is still NULL");
+
+  memset ((gpointer) received, 0, sizeof (received));
+  pipeline = setup_pipeline (trans, G_CALLBACK (_count_handoff));
+
+  bus = gst_element_get_bus (pipeline);
+  gst_bus_add_watch (bus, bus_error_callback, NULL);
+  gst_object_unref (bus);
+
+  return trans;
+}
+
+static void
+_free_group_transmitter (FsTransmitter *trans)
+{
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+
+  gst_element_get_state (pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+
+  g_object_unref (trans);
+
+  gst_object_unref (pipeline);
+}
+
+/*
+ * Creates a stream transmitter that sends and receives the RTP component
+ * on @group with @ttl
+ */
+static FsStreamTransmitter *
+_new_group_stream (FsTransmitter *trans, const gchar *group, guint8 ttl)
+{
+  GError *error = NULL;
+  FsStreamTransmitter *st;
+  FsCandidate *candidate;
+  GList *candidates;
+
+  st = fs_transmitter_new_stream_transmitter (trans, NULL, 0, NULL, &error);
+
+  if (error) {
+    ts_fail ("Error creating stream transmitter: (%s:%d) %s",
+        g_quark_to_string (error->domain), error->code, error->message);
+  }
+
+  ts_fail_if (st == NULL, "No stream transmitter created, yet error is NULL");
+
+  ts_fail_unless (g_signal_connect (st, "error",
+      G_CALLBACK (stream_transmitter_error), NULL),
+    "Could not connect error signal");
+
+  candidate = fs_candidate_new ("L1", FS_COMPONENT_RTP,
+      FS_CANDIDATE_TYPE_MULTICAST, FS_NETWORK_PROTOCOL_UDP,
+      group, GROUP_PORT);
+  candidate->ttl = ttl;
+  candidates = g_list_prepend (NULL, candidate);
+
+  if (!fs_stream_transmitter_set_remote_candidates (st, candidates, &error))
+    ts_fail ("Error setting the remote candidates: %p %s", error,
+        error ? error->message : "NO ERROR SET");
+
+  fs_candidate_list_destroy (candidates);
+
+  return st;
+}
+
+/*
+ * Returns the first element of type @type_name in the bin of the
+ * transmitter in its @bin_property, or %NULL, and the number of them in
+ * @count
+ */
+static GstElement *
+_lookup_multicast_element (FsTransmitter *trans, const gchar *bin_property,
+    const gchar *type_name, guint *count)
+{
+  GstElement *bin;
+  GstElement *found = NULL;
+  GstIterator *iter;
+  gboolean done = FALSE;
+
+  g_object_get (trans, bin_property, &bin, NULL);
+  *count = 0;
+
+  iter = gst_bin_iterate_elements (GST_BIN (bin));
+  while (!done)
+  {
+    gpointer item;
+
+    switch (gst_iterator_next (iter, &item)) {
+      case GST_ITERATOR_OK:
+        if (strcmp (G_OBJECT_TYPE_NAME (item), type_name))
+        {
+          gst_object_unref (item);
+          break;
+        }
+        (*count)++;
+        if (found)
+          gst_object_unref (item);
+        else
+          found = item;
+        break;
+      case GST_ITERATOR_RESYNC:
+        if (found)
+          gst_object_unref (found);
+        found = NULL;
+        *count = 0;
+        gst_iterator_resync (iter);
+        break;
+      case GST_ITERATOR_ERROR:
+      case GST_ITERATOR_DONE:
+        done = TRUE;
+        break;
+    }
+  }
+
+  gst_iterator_free (iter);
+  gst_object_unref (bin);
+
+  return found;
+}
+
+/*
+ * Same as _lookup_multicast_element(), but there must be one
+ */
+static GstElement *
+_find_multicast_element (FsTransmitter *trans, const gchar *bin_property,
+    const gchar *type_name, guint *count)
+{
+  GstElement *found = _lookup_multicast_element (trans, bin_property,
+      type_name, count);
+
+  ts_fail_if (found == NULL, "There is no %s in the %s", type_name,
+      bin_property);
+
+  return found;
+}
+
+/*
+ * Checks that the transmitter has @expected sockets, each with its
+ * FsMulticastSrc and FsMulticastSink
+ */
+static void
+_check_multicast_sockets (FsTransmitter *trans, guint expected,
+    const gchar *when)
+{
+  GstElement *element;
+  guint srcs, sinks;
+
+  element = _lookup_multicast_element (trans, "gst-src", "FsMulticastSrc",
+      &srcs);
+  if (element)
+    gst_object_unref (element);
+  element = _lookup_multicast_element (trans, "gst-sink", "FsMulticastSink",
+      &sinks);
+  if (element)
+    gst_object_unref (element);
+
+  ts_fail_unless (srcs == expected && sinks == expected,
+      "There are %u srcs and %u sinks %s instead of %u", srcs, sinks, when,
+      expected);
+}
+
+static void
+_send_to_group (gint fd, const gchar *group, guint size, gint count)
+{
+  struct sockaddr_in addr;
+  gchar buf[1500];
+  gint i;
+
+  memset (buf, 0, size);
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr (group);
+  addr.sin_port = htons (GROUP_PORT);
+
+  for (i = 0; i < count; i++)
+    ts_fail_unless (sendto (fd, buf, size, 0, (struct sockaddr *) &addr,
+            sizeof (addr)) == size,
+        "Could not send to %s: %s", group, g_strerror (errno));
+}
+
+#if defined (IP_PKTINFO) && defined (IP_RECVTTL)
+
+/*
+ * Opens a socket that shares the port of the groups with the transmitter,
+ * as another application of this host would, and joins @groups with it.
+ * It is told the destination and the TTL of each packet.
+ */
+static gint
+_open_group_socket (const gchar **groups)
+{
+  struct sockaddr_in addr;
+  struct ip_mreq mreq;
+  int one = 1;
+  gint fd;
+  gint i;
+
+  fd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ts_fail_if (fd < 0, "Could not create the socket: %s", g_strerror (errno));
+
+  ts_fail_if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one,
+          sizeof (one)) < 0, "Could not set SO_REUSEADDR");
+#ifdef SO_REUSEPORT
+  ts_fail_if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &one,
+          sizeof (one)) < 0, "Could not set SO_REUSEPORT");
+#endif
+  ts_fail_if (setsockopt (fd, IPPROTO_IP, IP_PKTINFO, &one,
+          sizeof (one)) < 0, "Could not set IP_PKTINFO");
+  ts_fail_if (setsockopt (fd, IPPROTO_IP, IP_RECVTTL, &one,
+          sizeof (one)) < 0, "Could not set IP_RECVTTL");
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_ANY);
+  addr.sin_port = htons (GROUP_PORT);
+  ts_fail_if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0,
+      "Could not bind to port %d: %s", GROUP_PORT, g_strerror (errno));
+
+  for (i = 0; groups[i]; i++)
+  {
+    mreq.imr_multiaddr.s_addr = inet_addr (groups[i]);
+    mreq.imr_interface.s_addr = htonl (INADDR_ANY);
+    ts_fail_if (setsockopt (fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+            sizeof (mreq)) < 0,
+        "Could not join %s: %s", groups[i], g_strerror (errno));
+  }
+
+  return fd;
+}
+
+/*
+ * Reads one packet with its destination and TTL, returns -1 if nothing
+ * came within 5 seconds
+ */
+static gssize
+_recv_from_group (gint fd, guint32 *destination, gint *ttl)
+{
+  struct pollfd pfd;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  gchar buf[1500];
+  union {
+    struct cmsghdr align;
+    gchar buf[CMSG_SPACE (sizeof (struct in_pktinfo)) +
+        CMSG_SPACE (sizeof (int))];
+  } control;
+  gssize len;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if (poll (&pfd, 1, 5000) <= 0)
+    return -1;
+
+  iov.iov_base = buf;
+  iov.iov_len = sizeof (buf);
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof (control);
+
+  len = recvmsg (fd, &msg, 0);
+  ts_fail_if (len < 0, "Could not receive: %s", g_strerror (errno));
+
+  *destination = 0;
+  *ttl = -1;
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+  {
+    if (cmsg->cmsg_level != IPPROTO_IP)
+      continue;
+
+    if (cmsg->cmsg_type == IP_PKTINFO)
+    {
+      struct in_pktinfo pktinfo;
+
+      memcpy (&pktinfo, CMSG_DATA (cmsg), sizeof (pktinfo));
+      *destination = pktinfo.ipi_addr.s_addr;
+    }
+    else if (cmsg->cmsg_type == IP_TTL)
+    {
+      memcpy (ttl, CMSG_DATA (cmsg), sizeof (int));
+    }
+  }
+
+  return len;
+}
+
+#endif
+
+/*
+ * This test checks that two streams that use two groups on the same port
+ * share one socket, that each group gets the packets with the TTL of its
+ * stream, and that the src only pushes the packets sent to the groups of
+ * the streams, although the socket gets those of every group of the host
+ */
+
+GST_START_TEST (test_multicasttransmitter_two_groups)
+{
+#if defined (IP_PKTINFO) && defined (IP_RECVTTL)
+  const gchar *groups[] = { GROUP1, GROUP2, GROUP_OTHER, NULL };
+  FsTransmitter *trans;
+  FsStreamTransmitter *st1, *st2;
+  GstElement *src, *sink;
+  guint srcs, sinks;
+  gint got1 = 0, got2 = 0;
+  gint fd;
+
+  trans = _new_group_transmitter ();
+
+  st1 = _new_group_stream (trans, GROUP1, 1);
+  st2 = _new_group_stream (trans, GROUP2, 2);
+
+  src = _find_multicast_element (trans, "gst-src", "FsMulticastSrc", &srcs);
+  sink = _find_multicast_element (trans, "gst-sink", "FsMulticastSink",
+      &sinks);
+  ts_fail_unless (srcs == 1 && sinks == 1,
+      "The two groups use %u srcs and %u sinks instead of one socket",
+      srcs, sinks);
+
+  fd = _open_group_socket (groups);
+
+  _start_pipeline (pipeline);
+
+  /* Each buffer goes once to each group, with the TTL of its stream */
+  setup_fakesrc (trans, pipeline, 1);
+
+  while (got1 < 20 || got2 < 20)
+  {
+    guint32 destination;
+    gint ttl;
+    gssize len = _recv_from_group (fd, &destination, &ttl);
+
+    ts_fail_if (len < 0, "Only got %d packets sent to %s and %d to %s",
+        got1, GROUP1, got2, GROUP2);
+
+    ts_fail_unless (len == 10, "Got a packet of %d bytes", (gint) len);
+
+    if (destination == inet_addr (GROUP1))
+    {
+      ts_fail_unless (ttl == 1, "A packet sent to %s has a TTL of %d",
+          GROUP1, ttl);
+      got1++;
+    }
+    else if (destination == inet_addr (GROUP2))
+    {
+      ts_fail_unless (ttl == 2, "A packet sent to %s has a TTL of %d",
+          GROUP2, ttl);
+      got2++;
+    }
+    else
+    {
+      ts_fail ("Got a packet sent to %x", ntohl (destination));
+    }
+  }
+
+  ts_fail_unless (got1 == 20 && got2 == 20,
+      "Got %d packets sent to %s and %d to %s instead of 20", got1, GROUP1,
+      got2, GROUP2);
+
+  ts_fail_unless (_wait_for_received (10, 40),
+      "The src pushed %d of the 40 packets sent to the groups",
+      received[10]);
+  ts_fail_unless (_wait_for_property (sink, "packets", 40),
+      "The sink did not count the 40 packets it sent");
+
+  /* Those of the other group are read from the same socket but dropped,
+   * they are sent first so they are read before the others */
+  _send_to_group (fd, GROUP_OTHER, 13, 5);
+  _send_to_group (fd, GROUP1, 11, 5);
+  _send_to_group (fd, GROUP2, 12, 5);
+
+  ts_fail_unless (_wait_for_received (11, 5) && _wait_for_received (12, 5),
+      "The src pushed %d of the packets sent to %s and %d of those sent"
+      " to %s", received[11], GROUP1, received[12], GROUP2);
+  ts_fail_unless (received[13] == 0,
+      "The src pushed %d packets sent to a group it is not in",
+      received[13]);
+  ts_fail_unless (_wait_for_property (src, "dropped", 5),
+      "The src did not count the packets it dropped");
+
+  /* Once the second stream is gone, so is its group */
+  g_object_unref (st2);
+
+  _send_to_group (fd, GROUP2, 12, 5);
+  _send_to_group (fd, GROUP1, 11, 5);
+
+  ts_fail_unless (_wait_for_received (11, 10),
+      "The src pushed %d of the packets sent to %s", received[11], GROUP1);
+  ts_fail_unless (received[12] == 5,
+      "The src pushed the packets sent to %s after it was left", GROUP2);
+
+  close (fd);
+  gst_object_unref (src);
+  gst_object_unref (sink);
+  g_object_unref (st1);
+
+  _free_group_transmitter (trans);
+#else
+  g_message ("This system can not tell the destination and the TTL of the"
+      " packets it receives, this test will be disabled");
+#endif
+}
+GST_END_TEST;
+
+#define SHARING_THREADS 4
+#define SHARING_ROUNDS 25
+
+static gpointer
+_create_and_drop_streams (gpointer user_data)
+{
+  FsTransmitter *trans = user_data;
+  gint i;
+
+  for (i = 0; i < SHARING_ROUNDS; i++)
+    g_object_unref (_new_group_stream (trans, GROUP1, 1));
+
+  return NULL;
+}
+
+/*
+ * This test checks that the streams on the same group share one socket,
+ * that streams created and dropped from several threads at once only
+ * change its refcount, and that the socket and its elements are gone with
+ * the last stream and come back with the next one
+ */
+
+GST_START_TEST (test_multicasttransmitter_socket_sharing)
+{
+  FsTransmitter *trans;
+  FsStreamTransmitter *st1, *st2;
+  GstElement *sink;
+  GThread *threads[SHARING_THREADS];
+  guint sinks;
+  guint64 packets;
+  gint i;
+
+  trans = _new_group_transmitter ();
+
+  _check_multicast_sockets (trans, 0, "before any stream");
+
+  st1 = _new_group_stream (trans, GROUP1, 1);
+  st2 = _new_group_stream (trans, GROUP1, 1);
+  _check_multicast_sockets (trans, 1, "with two streams on the same group");
+
+  g_object_unref (st2);
+  _check_multicast_sockets (trans, 1, "once one of the two streams is gone");
+
+  for (i = 0; i < SHARING_THREADS; i++)
+  {
+    threads[i] = g_thread_create (_create_and_drop_streams, trans, TRUE,
+        NULL);
+    ts_fail_unless (threads[i] != NULL, "Could not create thread %d", i);
+  }
+  for (i = 0; i < SHARING_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  _check_multicast_sockets (trans, 1,
+      "after streams came and went from several threads");
+
+  /* The group is still a destination of the sink, once */
+  sink = _find_multicast_element (trans, "gst-sink", "FsMulticastSink",
+      &sinks);
+
+  _start_pipeline (pipeline);
+  setup_fakesrc (trans, pipeline, 1);
+
+  ts_fail_unless (_wait_for_property (sink, "packets", 20),
+      "The sink did not send the 20 buffers to the group");
+  g_usleep (100000);
+  g_object_get (sink, "packets", &packets, NULL);
+  ts_fail_unless (packets == 20,
+      "The sink sent %" G_GUINT64_FORMAT " packets for 20 buffers", packets);
+
+  gst_object_unref (sink);
+
+  g_object_unref (st1);
+  _check_multicast_sockets (trans, 0, "once the last stream is gone");
+
+  st1 = _new_group_stream (trans, GROUP1, 1);
+  _check_multicast_sockets (trans, 1, "with a new stream");
+  g_object_unref (st1);
+
+  _free_group_transmitter (trans);
+}
+GST_END_TEST;
+
+/*
+ * This test checks that with drop-own-packets, the packets we send come
+ * back to our socket but are dropped, while those of another sender of
+ * this host, which uses another port, still get through
+ */
+
+GST_START_TEST (test_multicasttransmitter_drop_own_packets)
+{
+  FsTransmitter *trans;
+  FsStreamTransmitter *st;
+  GstElement *src;
+  guint srcs;
+  gint fd;
+
+  trans = _new_group_transmitter ();
+  g_object_set (trans, "drop-own-packets", TRUE, NULL);
+
+  st = _new_group_stream (trans, GROUP1, 1);
+  src = _find_multicast_element (trans, "gst-src", "FsMulticastSrc", &srcs);
+
+  _start_pipeline (pipeline);
+  setup_fakesrc (trans, pipeline, 1);
+
+  ts_fail_unless (_wait_for_property (src, "dropped", 20),
+      "The src did not drop the 20 packets we sent");
+  ts_fail_unless (received[10] == 0,
+      "The src pushed %d of our own packets", received[10]);
+
+  fd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ts_fail_if (fd < 0, "Could not create the socket: %s", g_strerror (errno));
+
+  _send_to_group (fd, GROUP1, 11, 5);
+
+  ts_fail_unless (_wait_for_received (11, 5),
+      "The src pushed %d of the packets of another sender", received[11]);
+  ts_fail_unless (received[10] == 0,
+      "The src pushed %d of our own packets", received[10]);
+
+  close (fd);
+  gst_object_unref (src);
+  g_object_unref (st);
+
+  _free_group_transmitter (trans);
+}
+GST_END_TEST;
+
+/*
+ * This test checks that without multicast-loop, the packets we send never
+ * come back, while those of another sender of this host still do
+ */
+
+GST_START_TEST (test_multicasttransmitter_no_multicast_loop)
+{
+  FsTransmitter *trans;
+  FsStreamTransmitter *st;
+  GstElement *src, *sink;
+  guint64 dropped;
+  guint srcs, sinks;
+  gint fd;
+
+  trans = _new_group_transmitter ();
+  g_object_set (trans, "multicast-loop", FALSE, NULL);
+
+  st = _new_group_stream (trans, GROUP1, 1);
+  src = _find_multicast_element (trans, "gst-src", "FsMulticastSrc", &srcs);
+  sink = _find_multicast_element (trans, "gst-sink", "FsMulticastSink",
+      &sinks);
+
+  _start_pipeline (pipeline);
+  setup_fakesrc (trans, pipeline, 1);
+
+  ts_fail_unless (_wait_for_property (sink, "packets", 20),
+      "The sink did not send the 20 packets");
+
+  /* The packets of the other sender are sent after ours, so ours would
+   * have been read before them if they had been looped back */
+  fd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ts_fail_if (fd < 0, "Could not create the socket: %s", g_strerror (errno));
+
+  _send_to_group (fd, GROUP1, 11, 5);
+
+  ts_fail_unless (_wait_for_received (11, 5),
+      "The src pushed %d of the packets of another sender", received[11]);
+  ts_fail_unless (received[10] == 0,
+      "The src pushed %d of our own packets", received[10]);
+
+  g_object_get (src, "dropped", &dropped, NULL);
+  ts_fail_unless (dropped == 0,
+      "The src dropped %" G_GUINT64_FORMAT " packets, ours were looped back",
+      dropped);
+
+  close (fd);
+  gst_object_unref (src);
+  gst_object_unref (sink);
+  g_object_unref (st);
+
+  _free_group_transmitter (trans);
+}
+GST_END_TEST;
+
+/*
+ * The sink of a transmitter, into which the RTP packets are pushed directly,
+ * and what it should have sent so far
+ */
+
+typedef struct {
+  GstElement *sink;
+  GstPad *pad;
+  guint16 seq;
+  guint64 packets;
+  guint64 syscalls;
+  /* If the sink could use UDP_SEGMENT before the last push */
+  gboolean gso;
+} SinkTest;
+
+static void
+_sink_test_event (SinkTest *test, GstEvent *event)
+{
+  g_object_get (test->sink, "segmentation-offload", &test->gso, NULL);
+
+  ts_fail_unless (gst_pad_send_event (test->pad, event),
+      "The sink refused an event");
+}
+
+static void
+_sink_test_push (SinkTest *test, guint size, guint32 timestamp,
+    gboolean marker)
+{
+  GstBuffer *buf = gst_buffer_new_and_alloc (size);
+  guint8 *data = GST_BUFFER_DATA (buf);
+
+  memset (data, 0, size);
+  data[0] = 0x80;
+  data[1] = (marker ? 0x80 : 0) | 96;
+  GST_WRITE_UINT16_BE (data + 2, test->seq++);
+  GST_WRITE_UINT32_BE (data + 4, timestamp);
+  GST_WRITE_UINT32_BE (data + 8, 0x12345678);
+
+  g_object_get (test->sink, "segmentation-offload", &test->gso, NULL);
+
+  ts_fail_unless (gst_pad_chain (test->pad, buf) == GST_FLOW_OK,
+      "Could not push an RTP packet of %u bytes", size);
+}
+
+/*
+ * The sink just sent a batch of @n packets to its only destination
+ */
+static void
+_sink_test_expect_batch (SinkTest *test, guint n)
+{
+  gboolean gso;
+
+  g_object_get (test->sink, "segmentation-offload", &gso, NULL);
+
+  test->packets += n;
+
+  if (n == 1)
+  {
+    test->syscalls++;
+    return;
+  }
+
+  /* If the kernel refused the UDP_SEGMENT send, the packets were sent
+   * again without it */
+  if (test->gso && !gso)
+    test->syscalls++;
+
+  if (gso)
+    test->syscalls++;
+  else
+#ifdef HAVE_SENDMMSG
+    test->syscalls++;
+#else
+    test->syscalls += n;
+#endif
+}
+
+static void
+_sink_test_check (SinkTest *test, const gchar *what)
+{
+  guint64 packets, syscalls;
+
+  g_object_get (test->sink, "packets", &packets, "syscalls", &syscalls, NULL);
+
+  ts_fail_unless (packets == test->packets && syscalls == test->syscalls,
+      "%s: the sink sent %" G_GUINT64_FORMAT " packets with %"
+      G_GUINT64_FORMAT " system calls instead of %" G_GUINT64_FORMAT
+      " with %" G_GUINT64_FORMAT, what, packets, syscalls, test->packets,
+      test->syscalls);
+}
+
+/*
+ * This test checks that with drop-own-packets, the RTP packets of another
+ * sender of this host that uses the same port as us still get through,
+ * since their SSRC is not one of ours, while ours are dropped
+ */
+
+GST_START_TEST (test_multicasttransmitter_drop_own_packets_same_port)
+{
+#if defined (IP_PKTINFO) && defined (IP_RECVTTL)
+  const gchar *groups[] = { NULL };
+  FsTransmitter *trans;
+  FsStreamTransmitter *st;
+  SinkTest test;
+  GstElement *src;
+  struct sockaddr_in addr;
+  guint8 data[15];
+  guint srcs, sinks;
+  gint fd;
+  gint i;
+
+  memset (&test, 0, sizeof (test));
+
+  trans = _new_group_transmitter ();
+  g_object_set (trans, "drop-own-packets", TRUE, NULL);
+
+  st = _new_group_stream (trans, GROUP1, 1);
+  src = _find_multicast_element (trans, "gst-src", "FsMulticastSrc", &srcs);
+  test.sink = _find_multicast_element (trans, "gst-sink", "FsMulticastSink",
+      &sinks);
+  test.pad = gst_element_get_static_pad (test.sink, "sink");
+
+  _start_pipeline (pipeline);
+
+  _sink_test_event (&test, gst_event_new_new_segment (FALSE, 1.0,
+          GST_FORMAT_TIME, 0, -1, 0));
+
+  for (i = 0; i < 5; i++)
+    _sink_test_push (&test, 14, 1000 + i, TRUE);
+
+  ts_fail_unless (_wait_for_property (src, "dropped", 5),
+      "The src did not drop the 5 RTP packets we sent");
+
+  /* Another application that sends from our port with its own SSRC */
+  fd = _open_group_socket (groups);
+
+  memset (data, 0, sizeof (data));
+  data[0] = 0x80;
+  data[1] = 0x80 | 96;
+  GST_WRITE_UINT32_BE (data + 8, 0x0badcafe);
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr (GROUP1);
+  addr.sin_port = htons (GROUP_PORT);
+
+  for (i = 0; i < 5; i++)
+  {
+    GST_WRITE_UINT16_BE (data + 2, i);
+    ts_fail_unless (sendto (fd, data, sizeof (data), 0,
+            (struct sockaddr *) &addr, sizeof (addr)) == sizeof (data),
+        "Could not send to %s: %s", GROUP1, g_strerror (errno));
+  }
+
+  ts_fail_unless (_wait_for_received (sizeof (data), 5),
+      "The src pushed %d of the packets of the other sender on our port",
+      received[sizeof (data)]);
+  ts_fail_unless (received[14] == 0,
+      "The src pushed %d of our own packets", received[14]);
+
+  close (fd);
+  gst_object_unref (test.pad);
+  gst_object_unref (test.sink);
+  gst_object_unref (src);
+  g_object_unref (st);
+
+  _free_group_transmitter (trans);
+#else
+  g_message ("This system can not share the port of the groups with"
+      " another socket in this test, it will be disabled");
+#endif
+}
+GST_END_TEST;
+
+/*
+ * Checks that the "statistics" of @trans, which has a single socket, are
+ * those of the sink of @test
+ */
+static void
+_check_statistics (FsTransmitter *trans, SinkTest *test)
+{
+  GstStructure *stats = NULL;
+  const GValue *value;
+  guint64 packets, syscalls;
+  gdouble ratio;
+  gboolean gso, sink_gso;
+
+  g_object_get (trans, "statistics", &stats, NULL);
+
+  ts_fail_unless (stats != NULL, "The transmitter has no statistics");
+  ts_fail_unless (gst_structure_has_name (stats, "multicast-statistics"),
+      "The statistics are named %s", gst_structure_get_name (stats));
+
+  value = gst_structure_get_value (stats, "packets-sent");
+  ts_fail_unless (value && G_VALUE_HOLDS_UINT64 (value),
+      "The statistics have no packets-sent counter");
+  packets = g_value_get_uint64 (value);
+
+  value = gst_structure_get_value (stats, "send-syscalls");
+  ts_fail_unless (value && G_VALUE_HOLDS_UINT64 (value),
+      "The statistics have no send-syscalls counter");
+  syscalls = g_value_get_uint64 (value);
+
+  ts_fail_unless (packets == test->packets && syscalls == test->syscalls,
+      "The statistics have %" G_GUINT64_FORMAT " packets sent with %"
+      G_GUINT64_FORMAT " system calls instead of %" G_GUINT64_FORMAT
+      " with %" G_GUINT64_FORMAT, packets, syscalls, test->packets,
+      test->syscalls);
+
+  ts_fail_unless (gst_structure_get_double (stats, "packets-per-send-syscall",
+          &ratio), "The statistics have no packets-per-send-syscall ratio");
+  ts_fail_unless (ratio == (gdouble) packets / (gdouble) syscalls,
+      "The packets-per-send-syscall ratio is %f for %" G_GUINT64_FORMAT
+      " packets and %" G_GUINT64_FORMAT " system calls", ratio, packets,
+      syscalls);
+
+  g_object_get (test->sink, "segmentation-offload", &sink_gso, NULL);
+  ts_fail_unless (gst_structure_get_boolean (stats, "segmentation-offload",
+          &gso), "The statistics have no segmentation-offload field");
+  ts_fail_unless (gso == sink_gso,
+      "The statistics say segmentation offload is %s, the sink %s",
+      gso ? "used" : "not used", sink_gso ? "uses it" : "does not");
+
+  value = gst_structure_get_value (stats, "packets-received");
+  ts_fail_unless (value && G_VALUE_HOLDS_UINT64 (value) &&
+      g_value_get_uint64 (value) > 0,
+      "The statistics have no packets-received counter");
+  ts_fail_unless (gst_structure_get_value (stats, "packets-dropped") != NULL,
+      "The statistics have no packets-dropped counter");
+
+  gst_structure_free (stats);
+}
+
+/*
+ * This test pushes RTP packets straight into the sink to check which ones
+ * it holds and how it groups them, and that the datagrams it sends come
+ * back one by one whether they were sent together or not
+ */
+
+GST_START_TEST (test_multicasttransmitter_sink_batching)
+{
+  FsTransmitter *trans;
+  FsStreamTransmitter *st;
+  SinkTest test;
+  guint depth;
+  guint sinks;
+  gint i;
+
+  memset (&test, 0, sizeof (test));
+
+  trans = _new_group_transmitter ();
+  st = _new_group_stream (trans, GROUP1, 1);
+
+  test.sink = _find_multicast_element (trans, "gst-sink", "FsMulticastSink",
+      &sinks);
+  test.pad = gst_element_get_static_pad (test.sink, "sink");
+
+  _start_pipeline (pipeline);
+
+  _sink_test_event (&test, gst_event_new_new_segment (FALSE, 1.0,
+          GST_FORMAT_TIME, 0, -1, 0));
+
+  /* Until a frame is seen to span several packets, nothing is held */
+  _sink_test_push (&test, 100, 1000, FALSE);
+  _sink_test_expect_batch (&test, 1);
+  _sink_test_check (&test, "First packet of the first frame");
+
+  _sink_test_push (&test, 100, 1000, FALSE);
+  _sink_test_check (&test, "Second packet of the first frame");
+
+  _sink_test_push (&test, 100, 1000, TRUE);
+  _sink_test_expect_batch (&test, 2);
+  _sink_test_check (&test, "End of the first frame");
+
+  /* Now whole frames are held until their marker */
+  _sink_test_push (&test, 100, 2000, FALSE);
+  _sink_test_push (&test, 100, 2000, FALSE);
+  _sink_test_check (&test, "Start of the second frame");
+
+  _sink_test_push (&test, 100, 2000, TRUE);
+  _sink_test_expect_batch (&test, 3);
+  _sink_test_check (&test, "End of the second frame");
+
+  ts_fail_unless (_wait_for_received (100, 6),
+      "Only got %d of the 6 packets of the fragmented frames",
+      received[100]);
+
+  /* A frame that fits in one packet is never delayed */
+  for (i = 0; i < 5; i++)
+  {
+    _sink_test_push (&test, 90, 3000 + i, TRUE);
+    _sink_test_expect_batch (&test, 1);
+    _sink_test_check (&test, "Single packet frame");
+  }
+
+  ts_fail_unless (_wait_for_received (90, 5),
+      "Only got %d of the 5 single packet frames", received[90]);
+
+  /* The packets sent together are all as large as the first one, except
+   * the last one, so a smaller packet ends the batch ... */
+  _sink_test_push (&test, 120, 4000, FALSE);
+  _sink_test_push (&test, 120, 4000, FALSE);
+  _sink_test_push (&test, 60, 4000, FALSE);
+  _sink_test_check (&test, "Frame with a smaller packet");
+
+  _sink_test_push (&test, 120, 4000, TRUE);
+  _sink_test_expect_batch (&test, 3);
+  _sink_test_expect_batch (&test, 1);
+  _sink_test_check (&test, "Packet after a smaller packet");
+
+  /* ... and a larger one starts a new one */
+  _sink_test_push (&test, 60, 5000, FALSE);
+  _sink_test_check (&test, "Frame with a larger packet");
+
+  _sink_test_push (&test, 120, 5000, TRUE);
+  _sink_test_expect_batch (&test, 1);
+  _sink_test_expect_batch (&test, 1);
+  _sink_test_check (&test, "Larger packet");
+
+  ts_fail_unless (_wait_for_received (120, 4) && _wait_for_received (60, 2),
+      "Only got %d of the 4 packets of 120 bytes and %d of the 2 of 60 bytes",
+      received[120], received[60]);
+
+  /* No more than batch-depth packets are held */
+  g_object_set (trans, "batch-depth", 4, NULL);
+  g_object_get (test.sink, "batch-depth", &depth, NULL);
+  ts_fail_unless (depth == 4, "The batch depth of the sink is %u", depth);
+
+  for (i = 1; i <= 10; i++)
+  {
+    _sink_test_push (&test, 110, 6000, i == 10);
+    if (i % 4 == 0)
+      _sink_test_expect_batch (&test, 4);
+    else if (i == 10)
+      _sink_test_expect_batch (&test, 2);
+    _sink_test_check (&test, "Frame larger than the batch depth");
+  }
+
+  ts_fail_unless (_wait_for_received (110, 10),
+      "Only got %d of the 10 packets of the large frame", received[110]);
+
+  /* What is held when the pipeline is flushed is dropped */
+  _sink_test_push (&test, 50, 7000, FALSE);
+  _sink_test_push (&test, 50, 7000, FALSE);
+  _sink_test_check (&test, "Frame before a flush");
+
+  _sink_test_event (&test, gst_event_new_flush_start ());
+  _sink_test_event (&test, gst_event_new_flush_stop ());
+  _sink_test_check (&test, "Flush");
+
+  _sink_test_event (&test, gst_event_new_new_segment (FALSE, 1.0,
+          GST_FORMAT_TIME, 0, -1, 0));
+
+  _sink_test_push (&test, 40, 8000, TRUE);
+  _sink_test_expect_batch (&test, 1);
+  _sink_test_check (&test, "Frame after a flush");
+
+  ts_fail_unless (_wait_for_received (40, 1),
+      "Did not get the frame sent after the flush");
+  ts_fail_unless (received[50] == 0,
+      "Got %d of the packets held when the pipeline was flushed",
+      received[50]);
+
+  /* And what is held at the end of the stream is sent */
+  _sink_test_push (&test, 30, 9000, FALSE);
+  _sink_test_expect_batch (&test, 1);
+  _sink_test_push (&test, 30, 9000, FALSE);
+  _sink_test_push (&test, 30, 9000, FALSE);
+  _sink_test_check (&test, "Frame before the end of the stream");
+
+  _sink_test_event (&test, gst_event_new_eos ());
+  _sink_test_expect_batch (&test, 2);
+  _sink_test_check (&test, "End of the stream");
+
+  ts_fail_unless (_wait_for_received (30, 3),
+      "Only got %d of the 3 packets of the last frame", received[30]);
+
+  /* The transmitter adds up the counters of its only sink */
+  _check_statistics (trans, &test);
+
+  gst_object_unref (test.pad);
+  gst_object_unref (test.sink);
+  g_object_unref (st);
+
+  _free_group_transmitter (trans);
+}
+GST_END_TEST;
+
 static Suite *
 multicasttransmitter_suite (void)
 {
@@ -323,6 +1422,35 @@ multicasttransmitter_suite (void)
   tcase_add_test (tc_chain, test_multicasttransmitter_run_local_candidates);
   suite_add_tcase (s, tc_chain);
 
+  tc_chain = tcase_create ("multicast_transmitter_source_filter");
+  tcase_add_test (tc_chain, test_multicasttransmitter_run_source_filter);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("multicast_transmitter_two_groups");
+  tcase_add_test (tc_chain, test_multicasttransmitter_two_groups);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("multicast_transmitter_socket_sharing");
+  tcase_add_test (tc_chain, test_multicasttransmitter_socket_sharing);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("multicast_transmitter_drop_own_packets");
+  tcase_add_test (tc_chain, test_multicasttransmitter_drop_own_packets);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("multicast_transmitter_drop_own_packets_same_port");
+  tcase_add_test (tc_chain,
+      test_multicasttransmitter_drop_own_packets_same_port);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("multicast_transmitter_no_multicast_loop");
+  tcase_add_test (tc_chain, test_multicasttransmitter_no_multicast_loop);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("multicast_transmitter_sink_batching");
+  tcase_add_test (tc_chain, test_multicasttransmitter_sink_batching);
+  suite_add_tcase (s, tc_chain);
+
   return s;
 }
 
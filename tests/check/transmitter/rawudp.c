@@ -25,9 +25,17 @@
 #include <gst/check/gstcheck.h>
 #include <gst/farsight/fs-transmitter.h>
 #include <gst/farsight/fs-conference-iface.h>
+#include <gst/farsight/fs-interfaces.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
 #include "check-threadsafe.h"
 #include "generic.h"
+#include "stun.h"
 
 gint buffer_count[2] = {0, 0};
 GMainLoop *loop = NULL;
@@ -38,12 +46,25 @@ volatile gint running = TRUE;
 
 enum {
   FLAG_HAS_STUN = 1 << 0,
-  FLAG_IS_LOCAL = 1 << 1
+  FLAG_IS_LOCAL = 1 << 1,
+  FLAG_IPV6 = 1 << 2
 };
 
 #define RTP_PORT 9828
 #define RTCP_PORT 9829
 
+#define PORT_RANGE_MIN 45000
+#define PORT_QUARANTINE 300
+
+#define STUN_TIMEOUT 10
+
+/* Documentation addresses, they can not be one of ours */
+#define STUN_MAPPED_IP "192.0.2.1"
+#define STUN_MAPPED_IP2 "198.51.100.1"
+
+guint srflx_ports[2] = {0, 0};
+volatile gint streams_left = 0;
+
 
 GST_START_TEST (test_rawudptransmitter_new)
 {
@@ -84,6 +105,8 @@ _new_local_candidate (FsStreamTransmitter *st, FsCandidate *candidate,
 {
   gboolean has_stun = GPOINTER_TO_INT (user_data) & FLAG_HAS_STUN;
   gboolean is_local = GPOINTER_TO_INT (user_data) & FLAG_IS_LOCAL;
+  const gchar *local_ip =
+    (GPOINTER_TO_INT (user_data) & FLAG_IPV6) ? "::1" : "127.0.0.1";
   GError *error = NULL;
   GList *item = NULL;
   gboolean ret;
@@ -114,9 +137,9 @@ _new_local_candidate (FsStreamTransmitter *st, FsCandidate *candidate,
   }
 
   if (is_local) {
-    ts_fail_unless (!strcmp (candidate->ip, "127.0.0.1"),
-      "IP is wrong, it is %s but should be 127.0.0.1 when local candidate set",
-      candidate->ip);
+    ts_fail_unless (!strcmp (candidate->ip, local_ip),
+      "IP is wrong, it is %s but should be %s when local candidate set",
+      candidate->ip, local_ip);
 
     if (candidate->component_id == FS_COMPONENT_RTP) {
       ts_fail_unless (candidate->port >= RTP_PORT  , "RTP port invalid");
@@ -259,6 +282,14 @@ run_rawudp_transmitter_test (gint n_parameters, GParameter *params,
       g_debug ("Skipping stunserver test, we have no network");
       goto skip;
     }
+    else if (flags & FLAG_IPV6 &&
+        error->domain == FS_ERROR &&
+        error->code == FS_ERROR_NETWORK)
+    {
+      g_debug ("Skipping IPv6 test, we can not bind to ::1: %s",
+          error->message);
+      goto skip;
+    }
     else
       ts_fail ("Error creating stream transmitter: (%s:%d) %s",
           g_quark_to_string (error->domain), error->code, error->message);
@@ -369,7 +400,8 @@ GST_START_TEST (test_rawudptransmitter_run_stunserver_dot_org)
 GST_END_TEST;
 
 
-GST_START_TEST (test_rawudptransmitter_run_local_candidates)
+static void
+run_rawudp_transmitter_local_test (const gchar *ip, gint flags)
 {
   GParameter params[1];
   GList *list = NULL;
@@ -379,24 +411,245 @@ GST_START_TEST (test_rawudptransmitter_run_local_candidates)
 
   candidate = fs_candidate_new ("L1",
       FS_COMPONENT_RTP, FS_CANDIDATE_TYPE_HOST,
-      FS_NETWORK_PROTOCOL_UDP, "127.0.0.1", RTP_PORT);
+      FS_NETWORK_PROTOCOL_UDP, ip, RTP_PORT);
   list = g_list_prepend (list, candidate);
 
   candidate = fs_candidate_new ("L1",
       FS_COMPONENT_RTCP, FS_CANDIDATE_TYPE_HOST,
-      FS_NETWORK_PROTOCOL_UDP, "127.0.0.1", RTCP_PORT);
+      FS_NETWORK_PROTOCOL_UDP, ip, RTCP_PORT);
   list = g_list_prepend (list, candidate);
 
   params[0].name = "preferred-local-candidates";
   g_value_init (&params[0].value, FS_TYPE_CANDIDATE_LIST);
   g_value_set_boxed (&params[0].value, list);
 
-  run_rawudp_transmitter_test (1, params, FLAG_IS_LOCAL);
+  run_rawudp_transmitter_test (1, params, FLAG_IS_LOCAL | flags);
 
   g_value_reset (&params[0].value);
 
   fs_candidate_list_destroy (list);
 }
+
+GST_START_TEST (test_rawudptransmitter_run_local_candidates)
+{
+  run_rawudp_transmitter_local_test ("127.0.0.1", 0);
+}
+GST_END_TEST;
+
+/*
+ * The candidates are on the IPv6 loopback and the packets go through it,
+ * the test is skipped on hosts without IPv6
+ */
+
+GST_START_TEST (test_rawudptransmitter_run_ipv6_local_candidates)
+{
+  run_rawudp_transmitter_local_test ("::1", FLAG_IPV6);
+}
+GST_END_TEST;
+
+static void
+_free_ip_list (GList *ips)
+{
+  g_list_foreach (ips, (GFunc) g_free, NULL);
+  g_list_free (ips);
+}
+
+/*
+ * Checks that @ips are addresses of @family in the order the interface
+ * helpers promise: the loopback, if any, comes last and, in IPv6, the
+ * global addresses come before the unique local ones
+ */
+static void
+_check_ip_list (GList *ips, gint family, gboolean include_loopback)
+{
+  GList *item;
+  gboolean seen_ula = FALSE;
+
+  for (item = ips; item; item = g_list_next (item))
+  {
+    const gchar *ip = item->data;
+    gboolean is_loopback;
+
+    if (family == AF_INET6)
+    {
+      struct in6_addr addr;
+
+      ts_fail_unless (inet_pton (AF_INET6, ip, &addr) == 1,
+          "%s is not an IPv6 address", ip);
+      ts_fail_if (IN6_IS_ADDR_LINKLOCAL (&addr),
+          "The link-local address %s was listed", ip);
+      ts_fail_if (IN6_IS_ADDR_V4MAPPED (&addr),
+          "The IPv4-mapped address %s was listed", ip);
+
+      is_loopback = IN6_IS_ADDR_LOOPBACK (&addr);
+      if (!is_loopback)
+      {
+        gboolean is_ula = (addr.s6_addr[0] & 0xfe) == 0xfc;
+
+        ts_fail_if (seen_ula && !is_ula,
+            "The global address %s comes after a unique local one", ip);
+        seen_ula = seen_ula || is_ula;
+      }
+    }
+    else
+    {
+      struct in_addr addr;
+
+      ts_fail_unless (inet_pton (AF_INET, ip, &addr) == 1,
+          "%s is not an IPv4 address", ip);
+      is_loopback = (ntohl (addr.s_addr) >> 24) == 127;
+    }
+
+    if (is_loopback)
+    {
+      ts_fail_unless (include_loopback,
+          "The loopback %s was listed without being asked for", ip);
+      ts_fail_unless (g_list_next (item) == NULL,
+          "The loopback %s is not the last address", ip);
+    }
+  }
+}
+
+static void
+_record_local_ip (FsStreamTransmitter *st, FsCandidate *candidate,
+  gpointer user_data)
+{
+  GList **ips = user_data;
+
+  ts_fail_unless (candidate->type == FS_CANDIDATE_TYPE_HOST,
+    "Candidate %s:%u is not a host candidate", candidate->ip, candidate->port);
+
+  if (candidate->component_id == FS_COMPONENT_RTP)
+    *ips = g_list_append (*ips, g_strdup (candidate->ip));
+}
+
+static void
+_record_active_local_ip (FsStreamTransmitter *st, FsCandidate *local,
+  FsCandidate *remote, gpointer user_data)
+{
+  gchar **ip = user_data;
+
+  if (local->component_id == FS_COMPONENT_RTP)
+  {
+    g_free (*ip);
+    *ip = g_strdup (local->ip);
+  }
+}
+
+/*
+ * This test checks the IPv4 and IPv6 addresses listed by the interface
+ * helpers, then that a stream on the default dual-stack socket gets one
+ * host candidate per address, the IPv6 ones first, and that the first one
+ * becomes the active local candidate
+ */
+
+GST_START_TEST (test_rawudptransmitter_local_addresses)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  FsStreamTransmitter *st;
+  GList *ips4, *ips6, *emitted = NULL, *expected, *item, *item2;
+  GList *candidates;
+  gboolean has_ipv6;
+  gchar *active_ip = NULL;
+
+  ips4 = fs_interfaces_get_local_ips (TRUE);
+  _check_ip_list (ips4, AF_INET, TRUE);
+  _free_ip_list (ips4);
+
+  ips6 = fs_interfaces_get_local_ips6 (TRUE);
+  _check_ip_list (ips6, AF_INET6, TRUE);
+  _free_ip_list (ips6);
+
+  ips4 = fs_interfaces_get_local_ips (FALSE);
+  _check_ip_list (ips4, AF_INET, FALSE);
+  ips6 = fs_interfaces_get_local_ips6 (FALSE);
+  _check_ip_list (ips6, AF_INET6, FALSE);
+
+  trans = fs_transmitter_new ("rawudp", 2, &error);
+
+  if (error) {
+    ts_fail ("Error creating transmitter: (%s:%d) %s",
+      g_quark_to_string (error->domain), error->code, error->message);
+  }
+
+  ts_fail_if (trans == NULL, "No transmitter create, yet error is still NULL");
+
+  st = fs_transmitter_new_stream_transmitter (trans, NULL, 0, NULL, &error);
+
+  if (error)
+    ts_fail ("Error creating stream transmitter: (%s:%d) %s",
+        g_quark_to_string (error->domain), error->code, error->message);
+
+  ts_fail_unless (g_signal_connect (st, "new-local-candidate",
+          G_CALLBACK (_record_local_ip), &emitted),
+      "Could not connect new-local-candidate signal");
+
+  if (!fs_stream_transmitter_gather_local_candidates (st, &error))
+    ts_fail ("Could not start gathering local candidates %s",
+        error ? error->message : "(without a specified error)");
+
+  ts_fail_unless (emitted != NULL, "No host candidate was emitted");
+
+  /* Hosts that can not have a dual-stack socket only get IPv4 candidates */
+  has_ipv6 = FALSE;
+  for (item = emitted; item; item = g_list_next (item))
+    has_ipv6 = has_ipv6 || strchr (item->data, ':') != NULL;
+
+  if (ips4 || (has_ipv6 && ips6))
+  {
+    expected = has_ipv6 ? ips6 : NULL;
+    expected = g_list_concat (expected, ips4);
+  }
+  else
+  {
+    /* Without any interface up, only the loopback is left */
+    _free_ip_list (ips6);
+    expected = has_ipv6 ? fs_interfaces_get_local_ips6 (TRUE) :
+      fs_interfaces_get_local_ips (TRUE);
+    ips6 = NULL;
+  }
+
+  for (item = emitted, item2 = expected;
+       item && item2;
+       item = g_list_next (item), item2 = g_list_next (item2))
+    ts_fail_unless (!strcmp (item->data, item2->data),
+        "Host candidate %s was emitted where %s was expected",
+        (gchar *) item->data, (gchar *) item2->data);
+  ts_fail_unless (item == NULL && item2 == NULL,
+      "%u host candidates were emitted for %u addresses",
+      g_list_length (emitted), g_list_length (expected));
+
+  ts_fail_unless (g_signal_connect (st, "new-active-candidate-pair",
+          G_CALLBACK (_record_active_local_ip), &active_ip),
+      "Could not connect new-active-candidate-pair signal");
+
+  candidates = g_list_prepend (NULL, fs_candidate_new ("R1",
+          FS_COMPONENT_RTP, FS_CANDIDATE_TYPE_HOST, FS_NETWORK_PROTOCOL_UDP,
+          "127.0.0.1", 9));
+  if (!fs_stream_transmitter_set_remote_candidates (st, candidates, &error))
+    ts_fail ("Error setting the remote candidates: %p %s", error,
+        error ? error->message : "NO ERROR SET");
+  fs_candidate_list_destroy (candidates);
+
+  /* An IPv6 address whenever the socket has one */
+  ts_fail_unless (active_ip != NULL, "No candidate pair became active");
+  ts_fail_unless (!strcmp (active_ip, emitted->data),
+      "%s is the active local candidate instead of %s", active_ip,
+      (gchar *) emitted->data);
+  ts_fail_unless (!has_ipv6 || strchr (active_ip, ':') != NULL,
+      "The IPv4 address %s is active although IPv6 ones were emitted",
+      active_ip);
+  g_free (active_ip);
+
+  if (!has_ipv6)
+    _free_ip_list (ips6);
+  _free_ip_list (expected);
+  _free_ip_list (emitted);
+
+  g_object_unref (st);
+  g_object_unref (trans);
+}
 GST_END_TEST;
 
 static gboolean
@@ -500,40 +753,1533 @@ GST_START_TEST (test_rawudptransmitter_stop_stream)
 }
 GST_END_TEST;
 
+static void
+_record_local_port (FsStreamTransmitter *st, FsCandidate *candidate,
+  gpointer user_data)
+{
+  guint *ports = user_data;
+
+  ts_fail_unless (candidate->type == FS_CANDIDATE_TYPE_HOST,
+    "Candidate %s:%u is not a host candidate", candidate->ip, candidate->port);
 
-static Suite *
-rawudptransmitter_suite (void)
+  ports[candidate->component_id - 1] = candidate->port;
+}
+
+/*
+ * Creates a stream transmitter with @params and returns the ports of its
+ * host candidates in @ports
+ */
+static FsStreamTransmitter *
+_new_stream_with_params (FsTransmitter *trans, guint n_parameters,
+  GParameter *params, guint *ports)
 {
-  Suite *s = suite_create ("rawudptransmitter");
-  TCase *tc_chain;
-  GLogLevelFlags fatal_mask;
+  GError *error = NULL;
+  FsStreamTransmitter *st;
+  guint components;
 
-  fatal_mask = g_log_set_always_fatal (G_LOG_FATAL_MASK);
-  fatal_mask |= G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL;
-  g_log_set_always_fatal (fatal_mask);
+  st = fs_transmitter_new_stream_transmitter (trans, NULL, n_parameters,
+      params, &error);
 
-  tc_chain = tcase_create ("rawudptransmitter");
-  tcase_set_timeout (tc_chain, 5);
-  tcase_add_test (tc_chain, test_rawudptransmitter_new);
-  tcase_add_test (tc_chain, test_rawudptransmitter_run_nostun);
-  suite_add_tcase (s, tc_chain);
+  if (error)
+    ts_fail ("Error creating stream transmitter: (%s:%d) %s",
+        g_quark_to_string (error->domain), error->code, error->message);
 
-  tc_chain = tcase_create ("rawudptransmitter-stun-timeout");
-  tcase_set_timeout (tc_chain, 5);
-  tcase_add_test (tc_chain, test_rawudptransmitter_run_invalid_stun);
-  suite_add_tcase (s, tc_chain);
+  ts_fail_if (st == NULL, "No stream transmitter created, yet error is NULL");
 
-  tc_chain = tcase_create ("rawudptransmitter-stunserver-org");
-  tcase_set_timeout (tc_chain, 15);
-  tcase_add_test (tc_chain, test_rawudptransmitter_run_stunserver_dot_org);
-  suite_add_tcase (s, tc_chain);
+  ts_fail_unless (g_signal_connect (st, "new-local-candidate",
+          G_CALLBACK (_record_local_port), ports),
+      "Could not connect new-local-candidate signal");
+  ts_fail_unless (g_signal_connect (st, "error",
+          G_CALLBACK (stream_transmitter_error), NULL),
+      "Could not connect error signal");
 
-  tc_chain = tcase_create ("rawudptransmitter-local-candidates");
-  tcase_add_test (tc_chain, test_rawudptransmitter_run_local_candidates);
-  suite_add_tcase (s, tc_chain);
+  ports[0] = ports[1] = 0;
 
-  tc_chain = tcase_create ("rawudptransmitter-stop-stream");
-  tcase_add_test (tc_chain, test_rawudptransmitter_stop_stream);
+  /* Without STUN, the host candidates are emitted right away */
+  if (!fs_stream_transmitter_gather_local_candidates (st, &error))
+    ts_fail ("Could not start gathering local candidates %s",
+        error ? error->message : "(without a specified error)");
+
+  g_object_get (trans, "components", &components, NULL);
+  ts_fail_unless (ports[0] && (components < 2 || ports[1]),
+      "Did not get a host candidate for each component");
+
+  return st;
+}
+
+/*
+ * Creates a stream transmitter with the default ports and returns the ports
+ * of its host candidates in @ports
+ */
+static FsStreamTransmitter *
+_new_stream_on_ports (FsTransmitter *trans, guint *ports)
+{
+  return _new_stream_with_params (trans, 0, NULL, ports);
+}
+
+/*
+ * Fills @param with preferred local candidates that request @rtp_port, and
+ * @rtcp_port unless it is 0, on @ip, or on any address if it is %NULL
+ */
+static void
+_set_requested_ports (GParameter *param, const gchar *ip, guint rtp_port,
+  guint rtcp_port)
+{
+  GList *list = NULL;
+
+  if (rtcp_port)
+    list = g_list_prepend (list, fs_candidate_new ("L1", FS_COMPONENT_RTCP,
+            FS_CANDIDATE_TYPE_HOST, FS_NETWORK_PROTOCOL_UDP, ip, rtcp_port));
+  list = g_list_prepend (list, fs_candidate_new ("L1", FS_COMPONENT_RTP,
+          FS_CANDIDATE_TYPE_HOST, FS_NETWORK_PROTOCOL_UDP, ip, rtp_port));
+
+  memset (param, 0, sizeof (GParameter));
+  param->name = "preferred-local-candidates";
+  g_value_init (&param->value, FS_TYPE_CANDIDATE_LIST);
+  g_value_set_boxed (&param->value, list);
+
+  fs_candidate_list_destroy (list);
+}
+
+/*
+ * Creates a stream transmitter with the ports of _set_requested_ports() and
+ * returns the ports of its host candidates in @ports
+ */
+static FsStreamTransmitter *
+_new_stream_requesting (FsTransmitter *trans, const gchar *ip,
+  guint rtp_port, guint rtcp_port, guint *ports)
+{
+  FsStreamTransmitter *st;
+  GParameter param;
+
+  _set_requested_ports (&param, ip, rtp_port, rtcp_port);
+  st = _new_stream_with_params (trans, 1, &param, ports);
+  g_value_unset (&param.value);
+
+  return st;
+}
+
+static gdouble
+_get_port_range_usage (FsTransmitter *trans)
+{
+  gdouble usage;
+
+  g_object_get (trans, "port-range-usage", &usage, NULL);
+
+  return usage;
+}
+
+/*
+ * This test checks that the ports are reserved in RTP/RTCP pairs, that a
+ * released pair is skipped while it is in quarantine and that it is used
+ * again afterwards. The streams that should not share the sockets of the
+ * others request other ports than the default one.
+ */
+
+GST_START_TEST (test_rawudptransmitter_port_allocator)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  FsStreamTransmitter *st, *st2;
+  GstElement *pipeline;
+  GParameter param;
+  guint ports[2];
+  guint first_rtp_port;
+
+  trans = fs_transmitter_new ("rawudp", 2, &error);
+
+  if (error) {
+    ts_fail ("Error creating transmitter: (%s:%d) %s",
+      g_quark_to_string (error->domain), error->code, error->message);
+  }
+
+  ts_fail_if (trans == NULL, "No transmitter create, yet error is still NULL");
+
+  g_object_set (trans,
+      "port-range-min", PORT_RANGE_MIN,
+      "port-range-max", PORT_RANGE_MIN + 3,
+      "port-quarantine", PORT_QUARANTINE,
+      NULL);
+
+  pipeline = setup_pipeline (trans, NULL);
+
+  st = _new_stream_on_ports (trans, ports);
+
+  ts_fail_unless (ports[0] % 2 == 0, "RTP port %u is not even", ports[0]);
+  ts_fail_unless (ports[1] == ports[0] + 1,
+      "RTCP port %u does not follow RTP port %u", ports[1], ports[0]);
+  ts_fail_unless (ports[0] >= PORT_RANGE_MIN && ports[1] <= PORT_RANGE_MIN + 3,
+      "Ports %u-%u are outside of the range", ports[0], ports[1]);
+  ts_fail_unless (_get_port_range_usage (trans) == 0.5,
+      "Port range usage is %f with one pair bound",
+      _get_port_range_usage (trans));
+
+  first_rtp_port = ports[0];
+  g_object_unref (st);
+
+  ts_fail_unless (_get_port_range_usage (trans) == 0.5,
+      "Port range usage is %f with one pair in quarantine",
+      _get_port_range_usage (trans));
+
+  /* The first pair is in quarantine, the new stream gets the other one */
+  st = _new_stream_on_ports (trans, ports);
+
+  ts_fail_if (ports[0] == first_rtp_port,
+      "Port %u was reused while in quarantine", ports[0]);
+  ts_fail_unless (ports[0] % 2 == 0 && ports[1] == ports[0] + 1,
+      "Ports %u-%u are not an RTP/RTCP pair", ports[0], ports[1]);
+  ts_fail_unless (_get_port_range_usage (trans) == 1.0,
+      "Port range usage is %f with the whole range used",
+      _get_port_range_usage (trans));
+
+  /* Nothing is left until the quarantine is over */
+  _set_requested_ports (&param, NULL, PORT_RANGE_MIN, 0);
+  st2 = fs_transmitter_new_stream_transmitter (trans, NULL, 1, &param,
+      &error);
+  g_value_unset (&param.value);
+  ts_fail_unless (st2 == NULL, "Could create a stream with a full port range");
+  ts_fail_unless (error && error->domain == FS_ERROR &&
+      error->code == FS_ERROR_NETWORK,
+      "Wrong error with a full port range");
+  g_clear_error (&error);
+
+  g_usleep ((PORT_QUARANTINE + 100) * 1000);
+
+  ts_fail_unless (_get_port_range_usage (trans) == 0.5,
+      "Port range usage is %f after the quarantine",
+      _get_port_range_usage (trans));
+
+  st2 = _new_stream_requesting (trans, NULL, PORT_RANGE_MIN, 0, ports);
+
+  ts_fail_unless (ports[0] == first_rtp_port,
+      "Port %u was not reused after the quarantine", first_rtp_port);
+
+  g_object_unref (st2);
+  g_object_unref (st);
+
+  g_object_unref (trans);
+
+  gst_object_unref (pipeline);
+}
+GST_END_TEST;
+
+/*
+ * This test checks that an RTP port is reserved together with the RTCP port
+ * above it even when the transmitter has a single component, and that the
+ * reservations are shared by all the local addresses: a port bound on the
+ * loopback is not handed out again to a socket bound on any address.
+ */
+
+GST_START_TEST (test_rawudptransmitter_port_allocator_pairs)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  FsStreamTransmitter *st, *st2;
+  GstElement *pipeline;
+  guint ports[2];
+
+  trans = fs_transmitter_new ("rawudp", 1, &error);
+
+  if (error) {
+    ts_fail ("Error creating transmitter: (%s:%d) %s",
+      g_quark_to_string (error->domain), error->code, error->message);
+  }
+
+  ts_fail_if (trans == NULL, "No transmitter create, yet error is still NULL");
+
+  g_object_set (trans,
+      "port-range-min", PORT_RANGE_MIN,
+      "port-range-max", PORT_RANGE_MIN + 3,
+      NULL);
+
+  pipeline = setup_pipeline (trans, NULL);
+
+  st = _new_stream_requesting (trans, "127.0.0.1", PORT_RANGE_MIN, 0, ports);
+
+  ts_fail_unless (ports[0] == PORT_RANGE_MIN,
+      "Got port %u instead of %u on the loopback", ports[0], PORT_RANGE_MIN);
+  ts_fail_unless (_get_port_range_usage (trans) == 0.5,
+      "Port range usage is %f with a single RTP port bound, its RTCP port"
+      " is not reserved with it", _get_port_range_usage (trans));
+
+  st2 = _new_stream_requesting (trans, NULL, PORT_RANGE_MIN, 0, ports);
+
+  ts_fail_unless (ports[0] == PORT_RANGE_MIN + 2,
+      "Got port %u on any address while %u is bound on the loopback",
+      ports[0], PORT_RANGE_MIN);
+  ts_fail_unless (_get_port_range_usage (trans) == 1.0,
+      "Port range usage is %f with two pairs reserved",
+      _get_port_range_usage (trans));
+
+  g_object_unref (st2);
+  g_object_unref (st);
+
+  g_object_unref (trans);
+
+  gst_object_unref (pipeline);
+}
+GST_END_TEST;
+
+/*
+ * A STUN server on the loopback, run by the main loop, that answers every
+ * binding request with the source port and @mapped_ip in a
+ * XOR-MAPPED-ADDRESS, and counts the binding indications it gets. Without
+ * @mapped_ip, it never reads anything.
+ */
+
+typedef struct {
+  gint fd;
+  guint port;
+  guint watch_id;
+  guint32 mapped_ip;
+  gint packets;
+  gint requests;
+  gint indications;
+} FakeStunServer;
+
+static gboolean
+_fake_stun_server_recv (GIOChannel *channel, GIOCondition condition,
+  gpointer user_data)
+{
+  FakeStunServer *server = user_data;
+  guint8 buf[1500];
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof (from);
+  gssize len;
+
+  len = recvfrom (server->fd, buf, sizeof (buf), 0,
+      (struct sockaddr *) &from, &fromlen);
+
+  if (len < 0)
+    return TRUE;
+
+  server->packets++;
+
+  /* Keepalives are binding indications without any attribute */
+  if (len == 20 && GST_READ_UINT16_BE (buf) == 0x0011 &&
+      GST_READ_UINT32_BE (buf + 4) == STUN_MAGIC_COOKIE)
+  {
+    server->indications++;
+    return TRUE;
+  }
+
+  if (len < 20 || GST_READ_UINT16_BE (buf) != 0x0001)
+    return TRUE;
+
+  server->requests++;
+
+  /* The transaction id is kept, it starts with the magic cookie */
+  GST_WRITE_UINT16_BE (buf, 0x0101);
+  GST_WRITE_UINT16_BE (buf + 2, 12);
+  GST_WRITE_UINT16_BE (buf + 20, 0x0020);
+  GST_WRITE_UINT16_BE (buf + 22, 8);
+  buf[24] = 0;
+  buf[25] = 1;
+  GST_WRITE_UINT16_BE (buf + 26,
+      ntohs (from.sin_port) ^ (STUN_MAGIC_COOKIE >> 16));
+  GST_WRITE_UINT32_BE (buf + 28, server->mapped_ip ^ STUN_MAGIC_COOKIE);
+
+  sendto (server->fd, buf, 32, 0, (struct sockaddr *) &from, fromlen);
+
+  return TRUE;
+}
+
+static FakeStunServer *
+_fake_stun_server_new (const gchar *mapped_ip)
+{
+  FakeStunServer *server = g_slice_new0 (FakeStunServer);
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof (addr);
+  GIOChannel *channel;
+
+  server->fd = socket (AF_INET, SOCK_DGRAM, 0);
+  ts_fail_if (server->fd < 0, "Could not create the STUN server socket");
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  ts_fail_if (bind (server->fd, (struct sockaddr *) &addr, sizeof (addr)) < 0,
+      "Could not bind the STUN server socket");
+  ts_fail_if (getsockname (server->fd, (struct sockaddr *) &addr,
+          &addrlen) < 0, "Could not get the port of the STUN server");
+  server->port = ntohs (addr.sin_port);
+
+  if (mapped_ip)
+  {
+    server->mapped_ip = ntohl (inet_addr (mapped_ip));
+    channel = g_io_channel_unix_new (server->fd);
+    server->watch_id = g_io_add_watch (channel, G_IO_IN,
+        _fake_stun_server_recv, server);
+    g_io_channel_unref (channel);
+  }
+
+  return server;
+}
+
+static void
+_fake_stun_server_free (FakeStunServer *server)
+{
+  if (server->watch_id)
+    g_source_remove (server->watch_id);
+  close (server->fd);
+  g_slice_free (FakeStunServer, server);
+}
+
+static void
+_stun_new_local_candidate (FsStreamTransmitter *st, FsCandidate *candidate,
+  gpointer user_data)
+{
+  const gchar *mapped_ip = user_data;
+
+  ts_fail_unless (candidate->type == FS_CANDIDATE_TYPE_SRFLX,
+    "Candidate %s:%u of component %u is not server reflexive",
+    candidate->ip, candidate->port, candidate->component_id);
+  ts_fail_unless (!strcmp (candidate->ip, mapped_ip),
+    "Reflexive candidate is %s but should be %s", candidate->ip, mapped_ip);
+
+  srflx_ports[candidate->component_id - 1] = candidate->port;
+}
+
+static void
+_stun_local_candidates_prepared (FsStreamTransmitter *st, gpointer user_data)
+{
+  g_atomic_int_set (&running, FALSE);
+  g_main_loop_quit (loop);
+}
+
+static FsStreamTransmitter *
+_new_stun_stream_transmitter (FsTransmitter *trans, const gchar *stun_ip)
+{
+  GError *error = NULL;
+  FsStreamTransmitter *st;
+  GParameter params[2];
+
+  memset (params, 0, sizeof (GParameter) * 2);
+
+  params[0].name = "stun-ip";
+  g_value_init (&params[0].value, G_TYPE_STRING);
+  g_value_set_string (&params[0].value, stun_ip);
+
+  params[1].name = "stun-timeout";
+  g_value_init (&params[1].value, G_TYPE_UINT);
+  g_value_set_uint (&params[1].value, STUN_TIMEOUT);
+
+  st = fs_transmitter_new_stream_transmitter (trans, NULL, 2, params, &error);
+
+  g_value_unset (&params[0].value);
+  g_value_unset (&params[1].value);
+
+  if (error)
+    ts_fail ("Error creating stream transmitter: (%s:%d) %s",
+        g_quark_to_string (error->domain), error->code, error->message);
+
+  ts_fail_if (st == NULL, "No stream transmitter created, yet error is NULL");
+
+  ts_fail_unless (g_signal_connect (st, "error",
+          G_CALLBACK (stream_transmitter_error), NULL),
+      "Could not connect error signal");
+
+  return st;
+}
+
+/*
+ * Creates a stream transmitter that uses the STUN servers in @stun_ip and
+ * waits until it has a reflexive candidate of @mapped_ip for each component
+ */
+static FsStreamTransmitter *
+_gather_stun_candidates (FsTransmitter *trans, const gchar *stun_ip,
+  const gchar *mapped_ip)
+{
+  GError *error = NULL;
+  FsStreamTransmitter *st;
+
+  st = _new_stun_stream_transmitter (trans, stun_ip);
+
+  ts_fail_unless (g_signal_connect (st, "new-local-candidate",
+          G_CALLBACK (_stun_new_local_candidate), (gpointer) mapped_ip),
+      "Could not connect new-local-candidate signal");
+  ts_fail_unless (g_signal_connect (st, "local-candidates-prepared",
+          G_CALLBACK (_stun_local_candidates_prepared), NULL),
+      "Could not connect local-candidates-prepared signal");
+
+  srflx_ports[0] = srflx_ports[1] = 0;
+  g_atomic_int_set (&running, TRUE);
+
+  if (!fs_stream_transmitter_gather_local_candidates (st, &error))
+    ts_fail ("Could not start gathering local candidates %s",
+        error ? error->message : "(without a specified error)");
+
+  g_idle_add (check_running, NULL);
+
+  g_main_run (loop);
+
+  ts_fail_unless (srflx_ports[0] && srflx_ports[1],
+      "Did not get a reflexive candidate for each component");
+
+  return st;
+}
+
+static FsTransmitter *
+_new_stun_transmitter (guint cache_ttl)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  GstBus *bus;
+
+  loop = g_main_loop_new (NULL, FALSE);
+  trans = fs_transmitter_new ("rawudp", 2, &error);
+
+  if (error) {
+    ts_fail ("Error creating transmitter: (%s:%d) %s",
+      g_quark_to_string (error->domain), error->code, error->message);
+  }
+
+  ts_fail_if (trans == NULL, "No transmitter create, yet error is still NULL");
+
+  g_object_set (trans, "stun-cache-ttl", cache_ttl, NULL);
+
+  pipeline = setup_pipeline (trans, NULL);
+
+  bus = gst_element_get_bus (pipeline);
+  gst_bus_add_watch (bus, bus_error_callback, NULL);
+  gst_object_unref (bus);
+
+  /* The answers are received by the transmitter's src */
+  ts_fail_if (gst_element_set_state (pipeline, GST_STATE_PLAYING) ==
+    GST_STATE_CHANGE_FAILURE, "Could not set the pipeline to playing");
+
+  return trans;
+}
+
+static void
+_free_stun_transmitter (FsTransmitter *trans)
+{
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+
+  gst_element_get_state (pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+
+  g_object_unref (trans);
+
+  gst_object_unref (pipeline);
+
+  g_main_loop_unref (loop);
+}
+
+/*
+ * This test checks that the servers are asked in parallel: the first one
+ * never answers, but the candidates arrive as soon as the second one does
+ */
+
+GST_START_TEST (test_rawudptransmitter_stun_failover)
+{
+  FsTransmitter *trans;
+  FsStreamTransmitter *st;
+  FakeStunServer *dead, *live;
+  gchar *stun_ip;
+  GTimer *timer;
+
+  trans = _new_stun_transmitter (0);
+
+  dead = _fake_stun_server_new (NULL);
+  live = _fake_stun_server_new (STUN_MAPPED_IP);
+  stun_ip = g_strdup_printf ("127.0.0.1:%u,127.0.0.1:%u", dead->port,
+      live->port);
+
+  timer = g_timer_new ();
+  st = _gather_stun_candidates (trans, stun_ip, STUN_MAPPED_IP);
+
+  ts_fail_unless (g_timer_elapsed (timer, NULL) < STUN_TIMEOUT / 5,
+      "The reflexive candidates took %f seconds",
+      g_timer_elapsed (timer, NULL));
+  ts_fail_unless (live->requests >= 2,
+      "The second server only got %d requests", live->requests);
+
+  g_timer_destroy (timer);
+  g_object_unref (st);
+  g_free (stun_ip);
+  _fake_stun_server_free (live);
+  _fake_stun_server_free (dead);
+
+  _free_stun_transmitter (trans);
+}
+GST_END_TEST;
+
+/*
+ * This test checks that a stream bound to the same ports as another one
+ * reuses its reflexive addresses, until they expire or the cache is dropped
+ */
+
+GST_START_TEST (test_rawudptransmitter_stun_cache)
+{
+  FsTransmitter *trans;
+  FsStreamTransmitter *st, *st2;
+  FakeStunServer *server;
+  gchar *stun_ip;
+  gint requests;
+
+  trans = _new_stun_transmitter (1);
+
+  server = _fake_stun_server_new (STUN_MAPPED_IP);
+  stun_ip = g_strdup_printf ("127.0.0.1:%u", server->port);
+
+  st = _gather_stun_candidates (trans, stun_ip, STUN_MAPPED_IP);
+  requests = server->requests;
+  ts_fail_unless (requests >= 2, "The server only got %d requests", requests);
+
+  /* The second stream gets the same UdpPorts as the first one */
+  st2 = _gather_stun_candidates (trans, stun_ip, STUN_MAPPED_IP);
+  ts_fail_unless (server->requests == requests,
+      "The server was asked again instead of using the cache");
+  g_object_unref (st2);
+
+  g_usleep (G_USEC_PER_SEC + G_USEC_PER_SEC / 5);
+
+  st2 = _gather_stun_candidates (trans, stun_ip, STUN_MAPPED_IP);
+  ts_fail_unless (server->requests > requests,
+      "The server was not asked again once the cache expired");
+  requests = server->requests;
+  g_object_unref (st2);
+
+  /* Disabling the cache drops what it had */
+  g_object_set (trans, "stun-cache-ttl", 0, NULL);
+  g_object_set (trans, "stun-cache-ttl", 60, NULL);
+
+  st2 = _gather_stun_candidates (trans, stun_ip, STUN_MAPPED_IP);
+  ts_fail_unless (server->requests > requests,
+      "The server was not asked again once the cache was dropped");
+  g_object_unref (st2);
+
+  g_object_unref (st);
+  g_free (stun_ip);
+  _fake_stun_server_free (server);
+
+  _free_stun_transmitter (trans);
+}
+GST_END_TEST;
+
+typedef struct {
+  const gchar *mapped_ip;
+  guint ports[2];
+} SharedStream;
+
+static void
+_shared_new_local_candidate (FsStreamTransmitter *st, FsCandidate *candidate,
+  gpointer user_data)
+{
+  SharedStream *stream = user_data;
+
+  _stun_new_local_candidate (st, candidate, (gpointer) stream->mapped_ip);
+
+  stream->ports[candidate->component_id - 1] = candidate->port;
+}
+
+static void
+_shared_local_candidates_prepared (FsStreamTransmitter *st,
+  gpointer user_data)
+{
+  if (g_atomic_int_dec_and_test (&streams_left))
+  {
+    g_atomic_int_set (&running, FALSE);
+    g_main_loop_quit (loop);
+  }
+}
+
+/*
+ * This test checks that with a shared socket, the answers of the STUN server
+ * of each stream only reach that stream although they arrive on the same
+ * port at the same time
+ */
+
+GST_START_TEST (test_rawudptransmitter_shared_socket)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  FsStreamTransmitter *st[2];
+  FakeStunServer *server[2];
+  SharedStream stream[2];
+  gchar *stun_ip;
+  gint i, c;
+
+  trans = _new_stun_transmitter (0);
+  g_object_set (trans, "shared-socket", TRUE, NULL);
+
+  stream[0].mapped_ip = STUN_MAPPED_IP;
+  stream[1].mapped_ip = STUN_MAPPED_IP2;
+
+  for (i = 0; i < 2; i++)
+  {
+    server[i] = _fake_stun_server_new (stream[i].mapped_ip);
+    stun_ip = g_strdup_printf ("127.0.0.1:%u", server[i]->port);
+    st[i] = _new_stun_stream_transmitter (trans, stun_ip);
+    g_free (stun_ip);
+
+    stream[i].ports[0] = stream[i].ports[1] = 0;
+    ts_fail_unless (g_signal_connect (st[i], "new-local-candidate",
+            G_CALLBACK (_shared_new_local_candidate), &stream[i]),
+        "Could not connect new-local-candidate signal");
+    ts_fail_unless (g_signal_connect (st[i], "local-candidates-prepared",
+            G_CALLBACK (_shared_local_candidates_prepared), NULL),
+        "Could not connect local-candidates-prepared signal");
+  }
+
+  g_atomic_int_set (&streams_left, 2);
+  g_atomic_int_set (&running, TRUE);
+
+  /* Both discoveries are in flight before the servers answer */
+  for (i = 0; i < 2; i++)
+    if (!fs_stream_transmitter_gather_local_candidates (st[i], &error))
+      ts_fail ("Could not start gathering local candidates %s",
+          error ? error->message : "(without a specified error)");
+
+  g_idle_add (check_running, NULL);
+
+  g_main_run (loop);
+
+  for (c = 0; c < 2; c++)
+  {
+    ts_fail_unless (stream[0].ports[c] && stream[1].ports[c],
+        "Did not get a reflexive candidate for component %d of each stream",
+        c + 1);
+    ts_fail_unless (stream[0].ports[c] == stream[1].ports[c],
+        "The streams do not share the port of component %d (%u and %u)",
+        c + 1, stream[0].ports[c], stream[1].ports[c]);
+  }
+
+  for (i = 0; i < 2; i++)
+  {
+    ts_fail_unless (server[i]->requests >= 2,
+        "Server %d only got %d requests", i, server[i]->requests);
+    g_object_unref (st[i]);
+    _fake_stun_server_free (server[i]);
+  }
+
+  _free_stun_transmitter (trans);
+}
+GST_END_TEST;
+
+/*
+ * This test checks that with a shared socket, a stream with the default
+ * ports gets the ports forced by the first stream, whether they follow each
+ * other or not, instead of looking for consecutive ones forever
+ */
+
+GST_START_TEST (test_rawudptransmitter_shared_socket_forced_ports)
+{
+  const guint forced_ports[][2] = { {9000, 9001}, {9000, 9003} };
+  FsTransmitter *trans;
+  FsStreamTransmitter *st, *st2;
+  guint ports[2], ports2[2];
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (forced_ports); i++)
+  {
+    trans = _new_stun_transmitter (0);
+    g_object_set (trans, "shared-socket", TRUE, NULL);
+
+    st = _new_stream_requesting (trans, "127.0.0.1", forced_ports[i][0],
+        forced_ports[i][1], ports);
+
+    ts_fail_unless (ports[0] == forced_ports[i][0] &&
+        ports[1] == forced_ports[i][1],
+        "The first stream got ports %u-%u instead of %u-%u", ports[0],
+        ports[1], forced_ports[i][0], forced_ports[i][1]);
+
+    st2 = _new_stream_on_ports (trans, ports2);
+
+    ts_fail_unless (ports2[0] == ports[0] && ports2[1] == ports[1],
+        "The second stream got ports %u-%u instead of sharing %u-%u",
+        ports2[0], ports2[1], ports[0], ports[1]);
+
+    g_object_unref (st2);
+    g_object_unref (st);
+
+    _free_stun_transmitter (trans);
+  }
+}
+GST_END_TEST;
+
+static gboolean
+_push_rtp_traffic (gpointer user_data)
+{
+  GstPad *pad = user_data;
+  GstBuffer *buf = gst_buffer_new_and_alloc (10);
+
+  memset (GST_BUFFER_DATA (buf), 0, 10);
+
+  ts_fail_unless (gst_pad_push (pad, buf) == GST_FLOW_OK,
+      "Could not push a buffer to the RTP component");
+
+  return TRUE;
+}
+
+static gboolean
+_stop_loop (gpointer user_data)
+{
+  g_main_loop_quit (loop);
+
+  return FALSE;
+}
+
+/*
+ * This test checks that a candidate pair that sends nothing for a whole
+ * keepalive interval gets a binding indication, and that one that keeps
+ * sending does not. The RTP component sends all along, the RTCP one never.
+ */
+
+GST_START_TEST (test_rawudptransmitter_keepalive)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  FsStreamTransmitter *st;
+  FakeStunServer *rtp_server, *rtcp_server;
+  GstElement *trans_sink;
+  GstPad *srcpad, *sinkpad;
+  GList *candidates = NULL;
+  FsCandidate *candidate;
+  guint ports[2];
+  guint push_id;
+
+  trans = _new_stun_transmitter (0);
+  g_object_set (trans, "keepalive-interval", 1, NULL);
+
+  rtp_server = _fake_stun_server_new (STUN_MAPPED_IP);
+  rtcp_server = _fake_stun_server_new (STUN_MAPPED_IP);
+
+  st = _new_stream_on_ports (trans, ports);
+
+  /* Linked once the sink of the stream exists, so it gets the segment */
+  g_object_get (trans, "gst-sink", &trans_sink, NULL);
+  sinkpad = gst_element_get_static_pad (trans_sink, "sink1");
+  srcpad = gst_pad_new ("src", GST_PAD_SRC);
+  ts_fail_unless (GST_PAD_LINK_SUCCESSFUL (gst_pad_link (srcpad, sinkpad)),
+      "Could not link to the RTP sink pad of the transmitter");
+  gst_pad_set_active (srcpad, TRUE);
+  gst_pad_push_event (srcpad, gst_event_new_new_segment (FALSE, 1.0,
+          GST_FORMAT_TIME, 0, -1, 0));
+
+  candidate = fs_candidate_new ("R1", FS_COMPONENT_RTP,
+      FS_CANDIDATE_TYPE_HOST, FS_NETWORK_PROTOCOL_UDP, "127.0.0.1",
+      rtp_server->port);
+  candidates = g_list_prepend (candidates, candidate);
+  candidate = fs_candidate_new ("R2", FS_COMPONENT_RTCP,
+      FS_CANDIDATE_TYPE_HOST, FS_NETWORK_PROTOCOL_UDP, "127.0.0.1",
+      rtcp_server->port);
+  candidates = g_list_prepend (candidates, candidate);
+
+  /* The candidate pairs become active and are kept alive from now on */
+  if (!fs_stream_transmitter_set_remote_candidates (st, candidates, &error))
+    ts_fail ("Error setting the remote candidates: %p %s", error,
+        error ? error->message : "NO ERROR SET");
+
+  fs_candidate_list_destroy (candidates);
+
+  push_id = g_timeout_add (100, _push_rtp_traffic, srcpad);
+  g_timeout_add (2500, _stop_loop, NULL);
+
+  g_main_run (loop);
+
+  g_source_remove (push_id);
+
+  ts_fail_unless (rtcp_server->indications >= 1,
+      "The idle RTCP pair did not get a binding indication");
+  ts_fail_unless (rtcp_server->packets == rtcp_server->indications,
+      "The idle RTCP pair got %d packets that are not keepalives",
+      rtcp_server->packets - rtcp_server->indications);
+
+  ts_fail_unless (rtp_server->packets > 0,
+      "The RTP pair did not get the buffers that were pushed");
+  ts_fail_unless (rtp_server->indications == 0,
+      "The RTP pair got %d binding indications while it was sending",
+      rtp_server->indications);
+
+  g_object_unref (st);
+
+  gst_pad_set_active (srcpad, FALSE);
+  gst_pad_unlink (srcpad, sinkpad);
+  gst_object_unref (srcpad);
+  gst_object_unref (sinkpad);
+  gst_object_unref (trans_sink);
+
+  _fake_stun_server_free (rtp_server);
+  _fake_stun_server_free (rtcp_server);
+
+  _free_stun_transmitter (trans);
+}
+GST_END_TEST;
+
+/*
+ * Sets a single RTP remote candidate pointing to @server on @st
+ */
+static void
+_set_rtp_remote_candidate (FsStreamTransmitter *st, FakeStunServer *server)
+{
+  GError *error = NULL;
+  GList *candidates;
+
+  candidates = g_list_prepend (NULL, fs_candidate_new ("R1",
+          FS_COMPONENT_RTP, FS_CANDIDATE_TYPE_HOST, FS_NETWORK_PROTOCOL_UDP,
+          "127.0.0.1", server->port));
+
+  if (!fs_stream_transmitter_set_remote_candidates (st, candidates, &error))
+    ts_fail ("Error setting the remote candidates: %p %s", error,
+        error ? error->message : "NO ERROR SET");
+
+  fs_candidate_list_destroy (candidates);
+}
+
+/*
+ * This test checks that the keepalives look at what is sent to each
+ * destination: two streams share the same RTP socket, the first one sends
+ * all along while the second one is not sending, only the second one must
+ * get binding indications.
+ */
+
+GST_START_TEST (test_rawudptransmitter_keepalive_not_sending)
+{
+  FsTransmitter *trans;
+  FsStreamTransmitter *st, *st2;
+  FakeStunServer *sending_server, *idle_server;
+  GstElement *trans_sink;
+  GstPad *srcpad, *sinkpad;
+  guint ports[2], ports2[2];
+  guint push_id;
+
+  trans = _new_stun_transmitter (0);
+  g_object_set (trans, "keepalive-interval", 1, NULL);
+
+  sending_server = _fake_stun_server_new (STUN_MAPPED_IP);
+  idle_server = _fake_stun_server_new (STUN_MAPPED_IP);
+
+  st = _new_stream_on_ports (trans, ports);
+  st2 = _new_stream_on_ports (trans, ports2);
+
+  ts_fail_unless (ports2[0] == ports[0],
+      "The streams do not share their RTP port");
+
+  g_object_get (trans, "gst-sink", &trans_sink, NULL);
+  sinkpad = gst_element_get_static_pad (trans_sink, "sink1");
+  srcpad = gst_pad_new ("src", GST_PAD_SRC);
+  ts_fail_unless (GST_PAD_LINK_SUCCESSFUL (gst_pad_link (srcpad, sinkpad)),
+      "Could not link to the RTP sink pad of the transmitter");
+  gst_pad_set_active (srcpad, TRUE);
+  gst_pad_push_event (srcpad, gst_event_new_new_segment (FALSE, 1.0,
+          GST_FORMAT_TIME, 0, -1, 0));
+
+  g_object_set (st2, "sending", FALSE, NULL);
+
+  _set_rtp_remote_candidate (st, sending_server);
+  _set_rtp_remote_candidate (st2, idle_server);
+
+  push_id = g_timeout_add (100, _push_rtp_traffic, srcpad);
+  g_timeout_add (2500, _stop_loop, NULL);
+
+  g_main_run (loop);
+
+  g_source_remove (push_id);
+
+  ts_fail_unless (idle_server->indications >= 1,
+      "The stream that is not sending did not get a binding indication");
+  ts_fail_unless (idle_server->packets == idle_server->indications,
+      "The stream that is not sending got %d packets that are not"
+      " keepalives", idle_server->packets - idle_server->indications);
+
+  ts_fail_unless (sending_server->packets > 0,
+      "The sending stream did not get the buffers that were pushed");
+  ts_fail_unless (sending_server->indications == 0,
+      "The sending stream got %d binding indications",
+      sending_server->indications);
+
+  g_object_unref (st2);
+  g_object_unref (st);
+
+  gst_pad_set_active (srcpad, FALSE);
+  gst_pad_unlink (srcpad, sinkpad);
+  gst_object_unref (srcpad);
+  gst_object_unref (sinkpad);
+  gst_object_unref (trans_sink);
+
+  _fake_stun_server_free (sending_server);
+  _fake_stun_server_free (idle_server);
+
+  _free_stun_transmitter (trans);
+}
+GST_END_TEST;
+
+#define BATCH_DESTINATIONS 3
+#define BATCH_BUFFERS 10
+
+/*
+ * Reads the send counters out of the "statistics" of @trans
+ */
+static guint64
+_get_send_statistics (FsTransmitter *trans, guint64 *syscalls, gdouble *ratio)
+{
+  GstStructure *stats = NULL;
+  const GValue *value;
+  guint64 packets;
+
+  g_object_get (trans, "statistics", &stats, NULL);
+
+  ts_fail_unless (stats != NULL, "The transmitter has no statistics");
+
+  value = gst_structure_get_value (stats, "packets-sent");
+  ts_fail_unless (value && G_VALUE_HOLDS_UINT64 (value),
+      "The statistics have no packets-sent counter");
+  packets = g_value_get_uint64 (value);
+
+  value = gst_structure_get_value (stats, "send-syscalls");
+  ts_fail_unless (value && G_VALUE_HOLDS_UINT64 (value),
+      "The statistics have no send-syscalls counter");
+  *syscalls = g_value_get_uint64 (value);
+
+  ts_fail_unless (gst_structure_get_double (stats, "packets-per-send-syscall",
+          ratio), "The statistics have no packets-per-send-syscall ratio");
+
+  gst_structure_free (stats);
+
+  return packets;
+}
+
+/*
+ * This test checks that the streams that requested the same port send every
+ * buffer to all their destinations through the same socket, several
+ * datagrams per system call where sendmmsg() is available, and that the
+ * transmitter statistics count them
+ */
+
+GST_START_TEST (test_rawudptransmitter_batch_statistics)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  FsStreamTransmitter *st[BATCH_DESTINATIONS];
+  FakeStunServer *server[BATCH_DESTINATIONS];
+  GstElement *trans_sink;
+  GstPad *srcpad, *sinkpad;
+  GList *candidates;
+  guint ports[BATCH_DESTINATIONS][2];
+  guint64 packets, syscalls;
+  gdouble ratio;
+  gint i;
+
+  trans = _new_stun_transmitter (0);
+
+  packets = _get_send_statistics (trans, &syscalls, &ratio);
+  ts_fail_unless (packets == 0 && syscalls == 0 && ratio == 0,
+      "The transmitter sent %" G_GUINT64_FORMAT " packets without any socket",
+      packets);
+
+  for (i = 0; i < BATCH_DESTINATIONS; i++)
+  {
+    server[i] = _fake_stun_server_new (STUN_MAPPED_IP);
+    st[i] = _new_stream_on_ports (trans, ports[i]);
+
+    ts_fail_unless (ports[i][0] == ports[0][0],
+        "Stream %d got RTP port %u instead of sharing %u", i, ports[i][0],
+        ports[0][0]);
+  }
+
+  g_object_get (trans, "gst-sink", &trans_sink, NULL);
+  sinkpad = gst_element_get_static_pad (trans_sink, "sink1");
+  srcpad = gst_pad_new ("src", GST_PAD_SRC);
+  ts_fail_unless (GST_PAD_LINK_SUCCESSFUL (gst_pad_link (srcpad, sinkpad)),
+      "Could not link to the RTP sink pad of the transmitter");
+  gst_pad_set_active (srcpad, TRUE);
+  gst_pad_push_event (srcpad, gst_event_new_new_segment (FALSE, 1.0,
+          GST_FORMAT_TIME, 0, -1, 0));
+
+  for (i = 0; i < BATCH_DESTINATIONS; i++)
+  {
+    candidates = g_list_prepend (NULL, fs_candidate_new ("R1",
+            FS_COMPONENT_RTP, FS_CANDIDATE_TYPE_HOST, FS_NETWORK_PROTOCOL_UDP,
+            "127.0.0.1", server[i]->port));
+
+    if (!fs_stream_transmitter_set_remote_candidates (st[i], candidates,
+            &error))
+      ts_fail ("Error setting the remote candidates: %p %s", error,
+          error ? error->message : "NO ERROR SET");
+
+    fs_candidate_list_destroy (candidates);
+  }
+
+  for (i = 0; i < BATCH_BUFFERS; i++)
+    _push_rtp_traffic (srcpad);
+
+  /* The servers read what they got from the main loop */
+  g_timeout_add (200, _stop_loop, NULL);
+  g_main_run (loop);
+
+  for (i = 0; i < BATCH_DESTINATIONS; i++)
+    ts_fail_unless (server[i]->packets == BATCH_BUFFERS,
+        "Destination %d got %d packets instead of %d", i, server[i]->packets,
+        BATCH_BUFFERS);
+
+  packets = _get_send_statistics (trans, &syscalls, &ratio);
+
+  ts_fail_unless (packets == BATCH_DESTINATIONS * BATCH_BUFFERS,
+      "The statistics count %" G_GUINT64_FORMAT " packets instead of %d",
+      packets, BATCH_DESTINATIONS * BATCH_BUFFERS);
+  ts_fail_unless (ratio == (gdouble) packets / (gdouble) syscalls,
+      "%f packets per system call for %" G_GUINT64_FORMAT " packets in %"
+      G_GUINT64_FORMAT " system calls", ratio, packets, syscalls);
+
+#ifdef HAVE_SENDMMSG
+  ts_fail_unless (syscalls == BATCH_BUFFERS,
+      "%" G_GUINT64_FORMAT " system calls for %d buffers sent to %d"
+      " destinations", syscalls, BATCH_BUFFERS, BATCH_DESTINATIONS);
+  ts_fail_unless (ratio > 1, "Only %f packets per system call", ratio);
+#else
+  ts_fail_unless (syscalls == packets,
+      "%" G_GUINT64_FORMAT " system calls for %" G_GUINT64_FORMAT
+      " packets without sendmmsg()", syscalls, packets);
+#endif
+
+  for (i = 0; i < BATCH_DESTINATIONS; i++)
+    g_object_unref (st[i]);
+
+  gst_pad_set_active (srcpad, FALSE);
+  gst_pad_unlink (srcpad, sinkpad);
+  gst_object_unref (srcpad);
+  gst_object_unref (sinkpad);
+  gst_object_unref (trans_sink);
+
+  for (i = 0; i < BATCH_DESTINATIONS; i++)
+    _fake_stun_server_free (server[i]);
+
+  _free_stun_transmitter (trans);
+}
+GST_END_TEST;
+
+static GstStaticPadTemplate batch_sinktemplate = GST_STATIC_PAD_TEMPLATE (
+    "sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+#define BATCH_SRC_PACKETS 5
+#define BATCH_SRC_BIG_PACKET 60000
+
+/*
+ * Packet @i has @i + 1 bytes of value @i, except the last one which is
+ * almost as big as a datagram can be
+ */
+static guint
+_batch_src_packet_size (guint i)
+{
+  return (i == BATCH_SRC_PACKETS - 1) ? BATCH_SRC_BIG_PACKET : i + 1;
+}
+
+/*
+ * This test checks that the batch source pushes the packets that were
+ * queued on its socket in order and without truncating them, with a single
+ * recvmmsg() call where it is available, and that it can be stopped while
+ * it waits for more
+ */
+
+GST_START_TEST (test_rawudptransmitter_batch_src)
+{
+  GError *error = NULL;
+  FsTransmitter *trans;
+  GstElement *src;
+  GstPad *sinkpad;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof (addr);
+  gint fd, sender;
+  guint8 *data;
+  guint64 packets, syscalls;
+  GList *item;
+  guint i, j;
+
+  /* The element type is registered by the plugin of the transmitter */
+  trans = fs_transmitter_new ("rawudp", 2, &error);
+
+  if (error) {
+    ts_fail ("Error creating transmitter: (%s:%d) %s",
+      g_quark_to_string (error->domain), error->code, error->message);
+  }
+
+  ts_fail_if (trans == NULL, "No transmitter create, yet error is still NULL");
+
+  fd = socket (AF_INET, SOCK_DGRAM, 0);
+  ts_fail_if (fd < 0, "Could not create the receiving socket");
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  ts_fail_if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0,
+      "Could not bind the receiving socket");
+  ts_fail_if (getsockname (fd, (struct sockaddr *) &addr, &addrlen) < 0,
+      "Could not get the port of the receiving socket");
+
+  sender = socket (AF_INET, SOCK_DGRAM, 0);
+  ts_fail_if (sender < 0, "Could not create the sending socket");
+
+  /* Everything is queued before the source reads anything */
+  data = g_malloc (BATCH_SRC_BIG_PACKET);
+  for (i = 0; i < BATCH_SRC_PACKETS; i++)
+  {
+    memset (data, i, _batch_src_packet_size (i));
+    ts_fail_unless (sendto (sender, data, _batch_src_packet_size (i), 0,
+            (struct sockaddr *) &addr, sizeof (addr)) ==
+        (gssize) _batch_src_packet_size (i), "Could not send packet %u", i);
+  }
+  g_free (data);
+
+  src = g_object_new (g_type_from_name ("FsRawUdpBatchSrc"),
+      "sockfd", fd,
+      "batch-depth", 8,
+      NULL);
+  ts_fail_unless (src != NULL, "Could not create the batch source");
+
+  sinkpad = gst_check_setup_sink_pad (src, &batch_sinktemplate, NULL);
+  gst_pad_set_active (sinkpad, TRUE);
+
+  ts_fail_unless (gst_element_set_state (src, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE, "Could not start the batch source");
+
+  g_mutex_lock (check_mutex);
+  while (g_list_length (buffers) < BATCH_SRC_PACKETS)
+    g_cond_wait (check_cond, check_mutex);
+  g_mutex_unlock (check_mutex);
+
+  for (item = buffers, i = 0; item; item = g_list_next (item), i++)
+  {
+    GstBuffer *buffer = item->data;
+
+    ts_fail_unless (GST_BUFFER_SIZE (buffer) == _batch_src_packet_size (i),
+        "Packet %u has %u bytes instead of %u", i, GST_BUFFER_SIZE (buffer),
+        _batch_src_packet_size (i));
+    for (j = 0; j < GST_BUFFER_SIZE (buffer); j++)
+      ts_fail_unless (GST_BUFFER_DATA (buffer)[j] == i,
+          "Byte %u of packet %u is %u", j, i, GST_BUFFER_DATA (buffer)[j]);
+  }
+
+  g_object_get (src, "packets", &packets, "syscalls", &syscalls, NULL);
+
+  ts_fail_unless (packets == BATCH_SRC_PACKETS,
+      "The source counted %" G_GUINT64_FORMAT " packets instead of %d",
+      packets, BATCH_SRC_PACKETS);
+#ifdef HAVE_RECVMMSG
+  ts_fail_unless (syscalls == 1,
+      "The queued packets were read with %" G_GUINT64_FORMAT " system calls",
+      syscalls);
+#else
+  ts_fail_unless (syscalls == BATCH_SRC_PACKETS,
+      "%" G_GUINT64_FORMAT " system calls for %d packets without recvmmsg()",
+      syscalls, BATCH_SRC_PACKETS);
+#endif
+
+  /* The streaming thread is now waiting for more and has to be woken up */
+  ts_fail_unless (gst_element_set_state (src, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS, "Could not stop the batch source");
+
+  gst_check_teardown_sink_pad (src);
+  gst_object_unref (src);
+  gst_check_drop_buffers ();
+
+  close (sender);
+  close (fd);
+
+  g_object_unref (trans);
+}
+GST_END_TEST;
+
+/*
+ * The STUN codec is checked on its own with hand written packets, the
+ * transaction id of all of them is the magic cookie then 1 to 12
+ */
+
+#define STUN_TEST_HEADER(type, length) \
+  (type) >> 8, (type) & 0xff, (length) >> 8, (length) & 0xff, \
+  0x21, 0x12, 0xa4, 0x42, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12
+
+typedef struct {
+  const gchar *what;
+  guint8 data[48];
+  guint length;
+  gboolean valid;
+  /* Length of the message found in the packet */
+  guint msg_length;
+} StunParseCase;
+
+static const StunParseCase stun_parse_cases[] = {
+  { "Empty packet", { 0 }, 0, FALSE, 0 },
+  { "Truncated header", { STUN_TEST_HEADER (0x0101, 0) }, 19, FALSE, 0 },
+  { "Header only", { STUN_TEST_HEADER (0x0101, 0) }, 20, TRUE, 20 },
+  { "RTP packet", { 0x80, 0x60, 0, 0 }, 20, FALSE, 0 },
+  { "Bytes after the message", { STUN_TEST_HEADER (0x0101, 0) },
+    24, TRUE, 20 },
+  { "Length not a multiple of 4", { STUN_TEST_HEADER (0x0101, 6),
+      0x80, 0x22, 0, 2, 'f', 's', 0, 0 }, 28, FALSE, 0 },
+  { "Length past the end of the packet", { STUN_TEST_HEADER (0x0101, 12),
+      0x80, 0x22, 0, 4, 'f', 's', '2', 0 }, 28, FALSE, 0 },
+  { "Attribute past the end of the message", { STUN_TEST_HEADER (0x0101, 8),
+      0x00, 0x20, 0, 8, 0, 1, 0, 0 }, 28, FALSE, 0 },
+  { "Padding past the end of the message", { STUN_TEST_HEADER (0x0101, 12),
+      0x80, 0x22, 0, 9, 'f', 'a', 'r', 's', 'i', 'g', 'h', 't' },
+    32, FALSE, 0 },
+  { "Padded attribute", { STUN_TEST_HEADER (0x0101, 12),
+      0x80, 0x22, 0, 5, 'f', 's', '2', '.', '0', 0, 0, 0 }, 32, TRUE, 32 },
+  { "Empty attribute then padded one", { STUN_TEST_HEADER (0x0101, 16),
+      0x80, 0x24, 0, 0,
+      0x80, 0x22, 0, 6, 'f', 's', '2', '.', '0', '0', 0, 0 }, 36, TRUE, 36 },
+};
+
+typedef struct {
+  guint16 type;
+  guint16 length;
+  /* Of the value, from the start of the message */
+  guint offset;
+} StunAttributeCase;
+
+/* A binding response with every kind of attribute the agent reads */
+static const guint8 stun_iter_message[] = {
+  STUN_TEST_HEADER (0x0101, 52),
+  0x80, 0x22, 0, 5, 'f', 's', '2', '.', '0', 0, 0, 0,
+  0x00, 0x20, 0, 8, 0, 1, 0x33, 0x26, 0xe1, 0x12, 0xa6, 0x43,
+  0x80, 0x24, 0, 0,
+  0x80, 0x20, 0, 8, 0, 1, 0x33, 0x26, 0xe1, 0x12, 0xa6, 0x43,
+  0x00, 0x01, 0, 8, 0, 1, 0x12, 0x34, 192, 0, 2, 1,
+};
+
+static const StunAttributeCase stun_iter_attributes[] = {
+  { STUN_ATTRIBUTE_SERVER, 5, 24 },
+  { STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS_RFC5389, 8, 36 },
+  { STUN_ATTRIBUTE_REFRESH_INTERVAL, 0, 48 },
+  { STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, 8, 52 },
+  { STUN_ATTRIBUTE_MAPPED_ADDRESS, 8, 64 },
+};
+
+typedef struct {
+  const gchar *what;
+  guint16 type;
+  guint8 value[20];
+  guint16 length;
+  gboolean valid;
+  guint family;
+  guint8 ip[16];
+  guint16 port;
+} StunAddressCase;
+
+static const StunAddressCase stun_address_cases[] = {
+  { "MAPPED-ADDRESS IPv4", STUN_ATTRIBUTE_MAPPED_ADDRESS,
+    { 0, 1, 0x12, 0x34, 192, 0, 2, 1 }, 8,
+    TRUE, STUN_ADDRESS_FAMILY_IPV4, { 192, 0, 2, 1 }, 0x1234 },
+  { "XOR-MAPPED-ADDRESS 0x0020 IPv4",
+    STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS_RFC5389,
+    { 0, 1, 0x33, 0x26, 0xe1, 0x12, 0xa6, 0x43 }, 8,
+    TRUE, STUN_ADDRESS_FAMILY_IPV4, { 192, 0, 2, 1 }, 0x1234 },
+  { "XOR-MAPPED-ADDRESS 0x8020 IPv4", STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS,
+    { 0, 1, 0x33, 0x26, 0xe1, 0x12, 0xa6, 0x43 }, 8,
+    TRUE, STUN_ADDRESS_FAMILY_IPV4, { 192, 0, 2, 1 }, 0x1234 },
+  { "XOR-MAPPED-ADDRESS 0x0020 IPv6",
+    STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS_RFC5389,
+    { 0, 2, 0x33, 0x26, 0x01, 0x13, 0xa9, 0xfa, 1, 2, 3, 4, 5, 6, 7, 8,
+      9, 10, 11, 13 }, 20,
+    TRUE, STUN_ADDRESS_FAMILY_IPV6,
+    { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 }, 0x1234 },
+  { "XOR-MAPPED-ADDRESS 0x8020 IPv6", STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS,
+    { 0, 2, 0x33, 0x26, 0x01, 0x13, 0xa9, 0xfa, 1, 2, 3, 4, 5, 6, 7, 8,
+      9, 10, 11, 13 }, 20,
+    TRUE, STUN_ADDRESS_FAMILY_IPV6,
+    { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 }, 0x1234 },
+  { "Truncated IPv4 address", STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS,
+    { 0, 1, 0x33, 0x26, 0xe1, 0x12 }, 6, FALSE },
+  { "IPv6 family with an IPv4 address",
+    STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS_RFC5389,
+    { 0, 2, 0x33, 0x26, 0xe1, 0x12, 0xa6, 0x43 }, 8, FALSE },
+  { "Unknown family", STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS,
+    { 0, 3, 0x33, 0x26, 0xe1, 0x12, 0xa6, 0x43 }, 8, FALSE },
+  { "No room for the family", STUN_ATTRIBUTE_MAPPED_ADDRESS,
+    { 0, 1, 0x12 }, 3, FALSE },
+  { "Not an address", STUN_ATTRIBUTE_SERVER,
+    { 0, 1, 0x12, 0x34, 192, 0, 2, 1 }, 8, FALSE },
+};
+
+GST_START_TEST (test_rawudptransmitter_stun_codec)
+{
+  static const guint8 header[] = { STUN_TEST_HEADER (0x0101, 0) };
+  StunMessageView msg;
+  StunAttributeIter iter;
+  guint16 type, length;
+  const gchar *value;
+  gchar packed[STUN_HEADER_LENGTH];
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (stun_parse_cases); i++)
+  {
+    const StunParseCase *c = &stun_parse_cases[i];
+    gboolean valid;
+
+    memset (&msg, 0, sizeof (msg));
+    valid = stun_message_parse (&msg, c->length, (const gchar *) c->data);
+
+    ts_fail_unless (valid == c->valid, "%s: parsed as %s", c->what,
+        valid ? "valid" : "invalid");
+    if (valid)
+      ts_fail_unless (msg.data == (const gchar *) c->data &&
+          msg.length == c->msg_length,
+          "%s: the message is %u bytes long instead of %u", c->what,
+          msg.length, c->msg_length);
+  }
+
+  ts_fail_unless (stun_message_parse (&msg, sizeof (stun_iter_message),
+          (const gchar *) stun_iter_message),
+      "Could not parse the message with every kind of attribute");
+  ts_fail_unless (stun_message_view_get_type (&msg) ==
+      STUN_MESSAGE_BINDING_RESPONSE, "Wrong message type %x",
+      stun_message_view_get_type (&msg));
+
+  stun_attribute_iter_init (&iter, &msg);
+  for (i = 0; i < G_N_ELEMENTS (stun_iter_attributes); i++)
+  {
+    const StunAttributeCase *c = &stun_iter_attributes[i];
+
+    ts_fail_unless (stun_attribute_iter_next (&iter, &type, &length, &value),
+        "The iterator stopped after %u attributes", i);
+    ts_fail_unless (type == c->type && length == c->length &&
+        value == msg.data + c->offset,
+        "Attribute %u is %x of %u bytes at %d instead of %x of %u bytes"
+        " at %u", i, type, length, (gint) (value - msg.data), c->type,
+        c->length, c->offset);
+  }
+  ts_fail_if (stun_attribute_iter_next (&iter, &type, &length, &value),
+      "The iterator found an attribute after the last one");
+
+  msg.data = (const gchar *) header;
+  msg.length = sizeof (header);
+
+  for (i = 0; i < G_N_ELEMENTS (stun_address_cases); i++)
+  {
+    const StunAddressCase *c = &stun_address_cases[i];
+    guint family = 0;
+    guint8 ip[16];
+    guint16 port = 0;
+    gboolean valid;
+
+    valid = stun_attribute_read_mapped_address (&msg, c->type, c->length,
+        (const gchar *) c->value, &family, ip, &port);
+
+    ts_fail_unless (valid == c->valid, "%s: read as %s", c->what,
+        valid ? "valid" : "invalid");
+    if (!valid)
+      continue;
+
+    ts_fail_unless (family == c->family, "%s: family %u instead of %u",
+        c->what, family, c->family);
+    ts_fail_unless (port == c->port, "%s: port %u instead of %u",
+        c->what, port, c->port);
+    ts_fail_unless (!memcmp (ip, c->ip,
+            family == STUN_ADDRESS_FAMILY_IPV4 ? 4 : 16),
+        "%s: wrong address", c->what);
+  }
+
+  /* The keepalives are written with the codec too */
+  ts_fail_unless (stun_message_write (packed, sizeof (packed) - 1,
+          STUN_MESSAGE_BINDING_INDICATION, (const gchar *) header + 4) == 0,
+      "A message was written in a buffer that is too small");
+  ts_fail_unless (stun_message_write (packed, sizeof (packed),
+          STUN_MESSAGE_BINDING_INDICATION, (const gchar *) header + 4) ==
+      STUN_HEADER_LENGTH, "The binding indication is not 20 bytes long");
+  ts_fail_unless (stun_message_parse (&msg, sizeof (packed), packed) &&
+      stun_message_view_get_type (&msg) == STUN_MESSAGE_BINDING_INDICATION &&
+      !memcmp (stun_message_view_get_transaction_id (&msg), header + 4, 16),
+      "Could not parse the binding indication that was written");
+}
+GST_END_TEST;
+
+
+static Suite *
+rawudptransmitter_suite (void)
+{
+  Suite *s = suite_create ("rawudptransmitter");
+  TCase *tc_chain;
+  GLogLevelFlags fatal_mask;
+
+  fatal_mask = g_log_set_always_fatal (G_LOG_FATAL_MASK);
+  fatal_mask |= G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL;
+  g_log_set_always_fatal (fatal_mask);
+
+  tc_chain = tcase_create ("rawudptransmitter");
+  tcase_set_timeout (tc_chain, 5);
+  tcase_add_test (tc_chain, test_rawudptransmitter_new);
+  tcase_add_test (tc_chain, test_rawudptransmitter_run_nostun);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-stun-timeout");
+  tcase_set_timeout (tc_chain, 5);
+  tcase_add_test (tc_chain, test_rawudptransmitter_run_invalid_stun);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-stunserver-org");
+  tcase_set_timeout (tc_chain, 15);
+  tcase_add_test (tc_chain, test_rawudptransmitter_run_stunserver_dot_org);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-local-candidates");
+  tcase_add_test (tc_chain, test_rawudptransmitter_run_local_candidates);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-ipv6-local-candidates");
+  tcase_add_test (tc_chain, test_rawudptransmitter_run_ipv6_local_candidates);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-local-addresses");
+  tcase_add_test (tc_chain, test_rawudptransmitter_local_addresses);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-stop-stream");
+  tcase_add_test (tc_chain, test_rawudptransmitter_stop_stream);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-port-allocator");
+  tcase_add_test (tc_chain, test_rawudptransmitter_port_allocator);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-port-allocator-pairs");
+  tcase_add_test (tc_chain, test_rawudptransmitter_port_allocator_pairs);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-stun-failover");
+  tcase_set_timeout (tc_chain, 5);
+  tcase_add_test (tc_chain, test_rawudptransmitter_stun_failover);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-stun-cache");
+  tcase_set_timeout (tc_chain, 5);
+  tcase_add_test (tc_chain, test_rawudptransmitter_stun_cache);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-shared-socket");
+  tcase_set_timeout (tc_chain, 5);
+  tcase_add_test (tc_chain, test_rawudptransmitter_shared_socket);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-shared-socket-forced-ports");
+  tcase_set_timeout (tc_chain, 5);
+  tcase_add_test (tc_chain, test_rawudptransmitter_shared_socket_forced_ports);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-keepalive");
+  tcase_set_timeout (tc_chain, 10);
+  tcase_add_test (tc_chain, test_rawudptransmitter_keepalive);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-keepalive-not-sending");
+  tcase_set_timeout (tc_chain, 10);
+  tcase_add_test (tc_chain, test_rawudptransmitter_keepalive_not_sending);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-batch-statistics");
+  tcase_set_timeout (tc_chain, 5);
+  tcase_add_test (tc_chain, test_rawudptransmitter_batch_statistics);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-batch-src");
+  tcase_set_timeout (tc_chain, 5);
+  tcase_add_test (tc_chain, test_rawudptransmitter_batch_src);
+  suite_add_tcase (s, tc_chain);
+
+  tc_chain = tcase_create ("rawudptransmitter-stun-codec");
+  tcase_add_test (tc_chain, test_rawudptransmitter_stun_codec);
   suite_add_tcase (s, tc_chain);
 
   return s;
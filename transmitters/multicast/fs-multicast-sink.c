@@ -0,0 +1,975 @@
+/*
+ * Farsight2 - Farsight Multicast UDP sink
+ *
+ * fs-multicast-sink.c - Sink sending to several multicast groups, each with
+ *                       its own TTL, from one socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:fs-multicast-sink
+ * @short_description: Sends to several multicast groups from one socket
+ *
+ * This sink replaces multiudpsink in the multicast transmitter. It sends
+ * every buffer to each of its destinations through a socket that it does
+ * not own. Each destination is a group, a port and a TTL, so the same
+ * socket can serve groups with different scopes.
+ *
+ * The TTL is passed with each packet as an IP_TTL control message. Kernels
+ * that do not accept it for multicast make sendmsg() fail with EINVAL, the
+ * sink then falls back to setting IP_MULTICAST_TTL on the socket before
+ * each packet whose TTL differs from the previous one.
+ *
+ * The packets of an RTP frame that spans several of them, as video frames
+ * do, are held until the packet with the marker bit arrives or
+ * #FsMulticastSink:batch-depth of them are waiting. They then go to each
+ * destination with a single UDP_SEGMENT send, where the kernel splits
+ * them back into datagrams. If the kernel or the route does not support
+ * that, they go out with one sendmmsg() per destination, or one send each
+ * where sendmmsg() is not available. Packets of frames that fit in one
+ * packet, and anything that is not RTP, are never held.
+ *
+ * Destinations are added and removed with fs_multicast_sink_add() and
+ * fs_multicast_sink_remove(), they are refcounted the same way as the
+ * "add" and "remove" signals of multiudpsink.
+ *
+ * The sink remembers the SSRC of every RTP and RTCP packet it sends, so
+ * that the #FsMulticastSrc of the same socket can tell our packets from
+ * those of another sender of this host, see fs_multicast_sink_has_sent().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "fs-multicast-sink.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+GST_DEBUG_CATEGORY_EXTERN (fs_multicast_transmitter_debug);
+#define GST_CAT_DEFAULT fs_multicast_transmitter_debug
+
+#define DEFAULT_SOCKFD -1
+#define DEFAULT_BATCH_DEPTH 8
+#define MAX_BATCH_DEPTH 64
+
+/* Largest payload of a single UDP send, split or not */
+#define MAX_BATCH_BYTES 65507
+
+/* props */
+enum
+{
+  PROP_0,
+  PROP_SOCKFD,
+  PROP_BATCH_DEPTH,
+  PROP_PACKETS,
+  PROP_SYSCALLS,
+  PROP_PACKETS_PER_SYSCALL,
+  PROP_SEGMENTATION_OFFLOAD
+};
+
+typedef struct _MulticastDest {
+  struct sockaddr_in addr;
+  guint8 ttl;
+  gint refcount;
+} MulticastDest;
+
+static guint
+_dest_hash (gconstpointer key)
+{
+  const MulticastDest *dest = key;
+
+  return dest->addr.sin_addr.s_addr ^ (dest->addr.sin_port << 16) ^ dest->ttl;
+}
+
+static gboolean
+_dest_equal (gconstpointer a, gconstpointer b)
+{
+  const MulticastDest *dest_a = a;
+  const MulticastDest *dest_b = b;
+
+  return dest_a->addr.sin_addr.s_addr == dest_b->addr.sin_addr.s_addr &&
+    dest_a->addr.sin_port == dest_b->addr.sin_port &&
+    dest_a->ttl == dest_b->ttl;
+}
+
+static GstStaticPadTemplate fs_multicast_sink_template =
+  GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static GstBaseSinkClass *parent_class = NULL;
+
+static void fs_multicast_sink_base_init (gpointer g_class);
+static void fs_multicast_sink_class_init (FsMulticastSinkClass *klass);
+static void fs_multicast_sink_init (FsMulticastSink *self);
+static void fs_multicast_sink_finalize (GObject *object);
+
+static void fs_multicast_sink_set_property (GObject *object,
+    guint prop_id, const GValue *value, GParamSpec *pspec);
+static void fs_multicast_sink_get_property (GObject *object,
+    guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean fs_multicast_sink_start (GstBaseSink *bsink);
+static gboolean fs_multicast_sink_stop (GstBaseSink *bsink);
+static gboolean fs_multicast_sink_event (GstBaseSink *bsink,
+    GstEvent *event);
+static GstFlowReturn fs_multicast_sink_render (GstBaseSink *bsink,
+    GstBuffer *buffer);
+
+
+static void _drop_pending (FsMulticastSink *self);
+static gboolean _probe_gso (FsMulticastSink *self);
+
+
+static GType type = 0;
+
+GType
+fs_multicast_sink_get_type (void)
+{
+  g_assert (type);
+  return type;
+}
+
+GType
+fs_multicast_sink_register_type (FsPlugin *module)
+{
+  static const GTypeInfo info = {
+    sizeof (FsMulticastSinkClass),
+    (GBaseInitFunc) fs_multicast_sink_base_init,
+    NULL,
+    (GClassInitFunc) fs_multicast_sink_class_init,
+    NULL,
+    NULL,
+    sizeof (FsMulticastSink),
+    0,
+    (GInstanceInitFunc) fs_multicast_sink_init
+  };
+
+  type = g_type_module_register_type (G_TYPE_MODULE (module),
+      GST_TYPE_BASE_SINK, "FsMulticastSink", &info, 0);
+
+  return type;
+}
+
+static void
+fs_multicast_sink_base_init (gpointer g_class)
+{
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "Farsight multicast UDP sink",
+      "Sink/Network",
+      "Sends UDP packets to several multicast groups from one socket",
+      "Farsight developers");
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&fs_multicast_sink_template));
+}
+
+static void
+fs_multicast_sink_class_init (FsMulticastSinkClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstBaseSinkClass *gstbasesink_class = GST_BASE_SINK_CLASS (klass);
+
+  parent_class = g_type_class_peek_parent (klass);
+
+  gobject_class->set_property = fs_multicast_sink_set_property;
+  gobject_class->get_property = fs_multicast_sink_get_property;
+  gobject_class->finalize = fs_multicast_sink_finalize;
+
+  gstbasesink_class->start = GST_DEBUG_FUNCPTR (fs_multicast_sink_start);
+  gstbasesink_class->stop = GST_DEBUG_FUNCPTR (fs_multicast_sink_stop);
+  gstbasesink_class->event = GST_DEBUG_FUNCPTR (fs_multicast_sink_event);
+  gstbasesink_class->render = GST_DEBUG_FUNCPTR (fs_multicast_sink_render);
+
+  g_object_class_install_property (gobject_class,
+      PROP_SOCKFD,
+      g_param_spec_int ("sockfd",
+          "Socket",
+          "The bound socket to send from, it is not closed by the element",
+          -1, G_MAXINT, DEFAULT_SOCKFD,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_BATCH_DEPTH,
+      g_param_spec_uint ("batch-depth",
+          "Batch depth",
+          "Maximum number of packets of an RTP frame held to be sent with"
+          " one system call, 1 sends every packet as soon as it arrives",
+          1, MAX_BATCH_DEPTH, DEFAULT_BATCH_DEPTH,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PACKETS,
+      g_param_spec_uint64 ("packets",
+          "Packets",
+          "Number of packets sent since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_SYSCALLS,
+      g_param_spec_uint64 ("syscalls",
+          "System calls",
+          "Number of send system calls made since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PACKETS_PER_SYSCALL,
+      g_param_spec_double ("packets-per-syscall",
+          "Packets per system call",
+          "Average number of packets sent by each send system call",
+          0, G_MAXDOUBLE, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_SEGMENTATION_OFFLOAD,
+      g_param_spec_boolean ("segmentation-offload",
+          "Segmentation offload",
+          "Whether batches are sent as one UDP_SEGMENT send that the kernel"
+          " splits, it becomes FALSE if the kernel refuses one",
+          FALSE,
+          G_PARAM_READABLE));
+}
+
+static void
+fs_multicast_sink_init (FsMulticastSink *self)
+{
+  self->sockfd = DEFAULT_SOCKFD;
+  self->ttl_cmsg = TRUE;
+  self->socket_ttl = -1;
+  self->dest_links = g_hash_table_new (_dest_hash, _dest_equal);
+  self->own_ssrcs = g_hash_table_new (g_direct_hash, g_direct_equal);
+  self->batch_depth = DEFAULT_BATCH_DEPTH;
+
+  /* Allocated for the largest depth so it can be changed at any time */
+  self->pending = g_new0 (GstBuffer *, MAX_BATCH_DEPTH);
+  self->iovs = g_new0 (struct iovec, MAX_BATCH_DEPTH);
+#ifdef HAVE_SENDMMSG
+  self->msgs = g_new0 (struct mmsghdr, MAX_BATCH_DEPTH);
+#endif
+
+  gst_base_sink_set_sync (GST_BASE_SINK (self), FALSE);
+  g_object_set (self, "async", FALSE, NULL);
+}
+
+static void
+fs_multicast_sink_finalize (GObject *object)
+{
+  FsMulticastSink *self = FS_MULTICAST_SINK (object);
+  GList *item;
+
+  g_hash_table_destroy (self->dest_links);
+  g_hash_table_destroy (self->own_ssrcs);
+  for (item = self->dests; item; item = g_list_next (item))
+    g_slice_free (MulticastDest, item->data);
+  g_list_free (self->dests);
+
+  _drop_pending (self);
+  g_free (self->pending);
+  g_free (self->iovs);
+  g_free (self->msgs);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+fs_multicast_sink_set_property (GObject *object,
+    guint prop_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  FsMulticastSink *self = FS_MULTICAST_SINK (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+  {
+    case PROP_SOCKFD:
+      self->sockfd = g_value_get_int (value);
+      self->socket_ttl = -1;
+      break;
+    case PROP_BATCH_DEPTH:
+      self->batch_depth = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static void
+fs_multicast_sink_get_property (GObject *object,
+    guint prop_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  FsMulticastSink *self = FS_MULTICAST_SINK (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+  {
+    case PROP_SOCKFD:
+      g_value_set_int (value, self->sockfd);
+      break;
+    case PROP_BATCH_DEPTH:
+      g_value_set_uint (value, self->batch_depth);
+      break;
+    case PROP_PACKETS:
+      g_value_set_uint64 (value, self->packets);
+      break;
+    case PROP_SYSCALLS:
+      g_value_set_uint64 (value, self->syscalls);
+      break;
+    case PROP_PACKETS_PER_SYSCALL:
+      if (self->syscalls)
+        g_value_set_double (value,
+            (gdouble) self->packets / (gdouble) self->syscalls);
+      else
+        g_value_set_double (value, 0);
+      break;
+    case PROP_SEGMENTATION_OFFLOAD:
+      g_value_set_boolean (value, self->gso);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static gboolean
+fs_multicast_sink_start (GstBaseSink *bsink)
+{
+  FsMulticastSink *self = FS_MULTICAST_SINK (bsink);
+
+  if (self->sockfd < 0)
+  {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, (NULL),
+        ("No socket was set on the \"sockfd\" property"));
+    return FALSE;
+  }
+
+  GST_OBJECT_LOCK (self);
+  self->packets = 0;
+  self->syscalls = 0;
+  self->gso = _probe_gso (self);
+  g_hash_table_remove_all (self->own_ssrcs);
+  GST_OBJECT_UNLOCK (self);
+
+  self->have_last = FALSE;
+  self->fragmented_frames = FALSE;
+
+  GST_DEBUG_OBJECT (self, "UDP segmentation offload is %s",
+      self->gso ? "available" : "not available");
+
+  return TRUE;
+}
+
+static gboolean
+fs_multicast_sink_stop (GstBaseSink *bsink)
+{
+  _drop_pending (FS_MULTICAST_SINK (bsink));
+
+  return TRUE;
+}
+
+static gboolean
+_probe_gso (FsMulticastSink *self)
+{
+#ifdef UDP_SEGMENT
+  int segment_size = 0;
+  socklen_t len = sizeof (segment_size);
+
+  /* A kernel that does not know UDP_SEGMENT would ignore it in a control
+   * message and send the whole batch as a single datagram, so only use it
+   * if the socket option exists */
+  return getsockopt (self->sockfd, IPPROTO_UDP, UDP_SEGMENT,
+      (void *) &segment_size, &len) == 0;
+#else
+  return FALSE;
+#endif
+}
+
+static void
+_set_socket_ttl (FsMulticastSink *self,
+    MulticastDest *dest)
+{
+  guchar ttl = dest->ttl;
+
+  if (self->socket_ttl == dest->ttl)
+    return;
+
+  if (setsockopt (self->sockfd, IPPROTO_IP, IP_MULTICAST_TTL,
+          (const void *) &ttl, sizeof (ttl)) < 0)
+  {
+    GST_WARNING_OBJECT (self, "Could not set the multicast TTL to %u: %s",
+        dest->ttl, g_strerror (errno));
+    self->socket_ttl = -1;
+  }
+  else
+  {
+    self->socket_ttl = dest->ttl;
+  }
+}
+
+/* Room for an IP_TTL and a UDP_SEGMENT control message */
+typedef union {
+  struct cmsghdr align;
+  gchar buf[CMSG_SPACE (sizeof (int)) + CMSG_SPACE (sizeof (guint16))];
+} SendControl;
+
+/*
+ * Fills @msg to send @iovlen buffers to @dest, as one datagram that the
+ * kernel splits every @segment_size bytes if it is not 0. The TTL is passed
+ * in a control message, or set on the socket if the kernel refused that.
+ */
+static void
+_fill_msghdr (FsMulticastSink *self,
+    struct msghdr *msg,
+    SendControl *control,
+    MulticastDest *dest,
+    struct iovec *iov,
+    guint iovlen,
+    guint16 segment_size)
+{
+  struct cmsghdr *cmsg;
+  gsize controllen = 0;
+
+  memset (msg, 0, sizeof (struct msghdr));
+  memset (control, 0, sizeof (SendControl));
+  msg->msg_name = &dest->addr;
+  msg->msg_namelen = sizeof (dest->addr);
+  msg->msg_iov = iov;
+  msg->msg_iovlen = iovlen;
+
+#ifdef IP_TTL
+  if (self->ttl_cmsg)
+  {
+    int ttl = dest->ttl;
+
+    cmsg = (struct cmsghdr *) (control->buf + controllen);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_TTL;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+    memcpy (CMSG_DATA (cmsg), &ttl, sizeof (int));
+    controllen += CMSG_SPACE (sizeof (int));
+  }
+  else
+#endif
+  {
+    _set_socket_ttl (self, dest);
+  }
+
+#ifdef UDP_SEGMENT
+  if (segment_size)
+  {
+    cmsg = (struct cmsghdr *) (control->buf + controllen);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (guint16));
+    memcpy (CMSG_DATA (cmsg), &segment_size, sizeof (guint16));
+    controllen += CMSG_SPACE (sizeof (guint16));
+  }
+#endif
+
+  if (controllen)
+  {
+    msg->msg_control = control;
+    msg->msg_controllen = controllen;
+  }
+}
+
+/*
+ * Called after a send failed, returns %TRUE if it failed because the TTL
+ * can not be passed with the packet and it should be sent again
+ */
+static gboolean
+_ttl_cmsg_refused (FsMulticastSink *self)
+{
+#ifdef IP_TTL
+  if (self->ttl_cmsg && errno == EINVAL)
+  {
+    GST_DEBUG_OBJECT (self, "The TTL can not be set per packet,"
+        " setting it on the socket instead");
+    self->ttl_cmsg = FALSE;
+    return TRUE;
+  }
+#endif
+
+  return FALSE;
+}
+
+static void
+_send_one (FsMulticastSink *self,
+    struct iovec *iov,
+    MulticastDest *dest)
+{
+  struct msghdr msg;
+  SendControl control;
+  gssize ret;
+
+  for (;;)
+  {
+    _fill_msghdr (self, &msg, &control, dest, iov, 1, 0);
+    ret = sendmsg (self->sockfd, &msg, 0);
+    self->syscalls++;
+
+    if (ret >= 0)
+    {
+      self->packets++;
+      return;
+    }
+
+    if (errno != EINTR && !_ttl_cmsg_refused (self))
+      break;
+  }
+
+  GST_DEBUG_OBJECT (self, "Could not send packet: %s", g_strerror (errno));
+}
+
+#ifdef UDP_SEGMENT
+
+/*
+ * Sends all the pending packets to @dest with a single UDP_SEGMENT send,
+ * returns %FALSE if the kernel refused it and they still have to be sent
+ */
+static gboolean
+_send_segments (FsMulticastSink *self,
+    MulticastDest *dest)
+{
+  struct iovec *iovs = self->iovs;
+  struct msghdr msg;
+  SendControl control;
+  gssize ret;
+
+  do {
+    _fill_msghdr (self, &msg, &control, dest, iovs, self->n_pending,
+        iovs[0].iov_len);
+    ret = sendmsg (self->sockfd, &msg, 0);
+    self->syscalls++;
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret >= 0)
+  {
+    self->packets += self->n_pending;
+    return TRUE;
+  }
+
+  /* Every kernel with UDP_SEGMENT accepts IP_TTL, so EINVAL is about the
+   * segmentation, as is EIO when the route can not offload checksums */
+  if (errno == EINVAL || errno == EIO)
+  {
+    GST_DEBUG_OBJECT (self, "Could not send %u segments at once (%s),"
+        " sending them separately from now on", self->n_pending,
+        g_strerror (errno));
+    self->gso = FALSE;
+    return FALSE;
+  }
+
+  GST_DEBUG_OBJECT (self, "Could not send %u packets: %s", self->n_pending,
+      g_strerror (errno));
+
+  return TRUE;
+}
+
+#endif
+
+#ifdef HAVE_SENDMMSG
+
+/*
+ * Sends all the pending packets to @dest with as few sendmmsg() calls as
+ * possible
+ */
+static void
+_send_mmsg (FsMulticastSink *self,
+    MulticastDest *dest)
+{
+  struct mmsghdr *msgs = self->msgs;
+  struct iovec *iovs = self->iovs;
+  SendControl control;
+  guint i = 0;
+  guint j;
+  gint ret;
+
+  while (i < self->n_pending)
+  {
+    /* The control data is the same for every packet */
+    for (j = i; j < self->n_pending; j++)
+    {
+      _fill_msghdr (self, &msgs[j].msg_hdr, &control, dest, &iovs[j], 1, 0);
+      msgs[j].msg_len = 0;
+    }
+
+    ret = sendmmsg (self->sockfd, msgs + i, self->n_pending - i, 0);
+    self->syscalls++;
+
+    if (ret < 0)
+    {
+      if (errno == EINTR || _ttl_cmsg_refused (self))
+        continue;
+      /* The first message failed, skip it, like multiudpsink would */
+      GST_DEBUG_OBJECT (self, "Could not send packet: %s",
+          g_strerror (errno));
+      i++;
+    }
+    else
+    {
+      self->packets += ret;
+      i += ret;
+    }
+  }
+}
+
+#endif
+
+static void
+_drop_pending (FsMulticastSink *self)
+{
+  guint i;
+
+  for (i = 0; i < self->n_pending; i++)
+    gst_buffer_unref (self->pending[i]);
+
+  self->n_pending = 0;
+  self->pending_bytes = 0;
+}
+
+/*
+ * Sends the pending packets to every destination and releases them, must
+ * be called with the object lock held
+ */
+static void
+_send_pending (FsMulticastSink *self)
+{
+  struct iovec *iovs = self->iovs;
+  GList *item;
+  guint i;
+
+  for (i = 0; i < self->n_pending; i++)
+  {
+    iovs[i].iov_base = GST_BUFFER_DATA (self->pending[i]);
+    iovs[i].iov_len = GST_BUFFER_SIZE (self->pending[i]);
+  }
+
+  for (item = self->dests; item; item = g_list_next (item))
+  {
+    MulticastDest *dest = item->data;
+
+#ifdef UDP_SEGMENT
+    if (self->n_pending > 1 && self->gso && _send_segments (self, dest))
+      continue;
+#endif
+
+#ifdef HAVE_SENDMMSG
+    if (self->n_pending > 1)
+    {
+      _send_mmsg (self, dest);
+      continue;
+    }
+#endif
+
+    for (i = 0; i < self->n_pending; i++)
+      _send_one (self, &iovs[i], dest);
+  }
+
+  _drop_pending (self);
+}
+
+/*
+ * Returns %TRUE if @buffer looks like an RTP packet, RTCP packets have
+ * types 200 to 204 where RTP has its marker bit and payload type
+ */
+static gboolean
+_parse_rtp (GstBuffer *buffer,
+    guint32 *ssrc,
+    guint32 *timestamp,
+    gboolean *marker)
+{
+  guint8 *data = GST_BUFFER_DATA (buffer);
+
+  if (GST_BUFFER_SIZE (buffer) < 12 || (data[0] & 0xc0) != 0x80)
+    return FALSE;
+
+  if (data[1] >= 192 && data[1] <= 223)
+    return FALSE;
+
+  *marker = (data[1] & 0x80) != 0;
+  *timestamp = GST_READ_UINT32_BE (data + 4);
+  *ssrc = GST_READ_UINT32_BE (data + 8);
+
+  return TRUE;
+}
+
+/*
+ * Reads the SSRC of the sender of an RTP packet, or of an RTCP packet,
+ * which has it right after its 4 bytes header
+ */
+static gboolean
+_get_ssrc (const guint8 *data,
+    guint len,
+    guint32 *ssrc)
+{
+  if (len < 8 || (data[0] & 0xc0) != 0x80)
+    return FALSE;
+
+  if (data[1] >= 192 && data[1] <= 223)
+  {
+    *ssrc = GST_READ_UINT32_BE (data + 4);
+    return TRUE;
+  }
+
+  if (len < 12)
+    return FALSE;
+
+  *ssrc = GST_READ_UINT32_BE (data + 8);
+
+  return TRUE;
+}
+
+static GstFlowReturn
+fs_multicast_sink_render (GstBaseSink *bsink, GstBuffer *buffer)
+{
+  FsMulticastSink *self = FS_MULTICAST_SINK (bsink);
+  guint size = GST_BUFFER_SIZE (buffer);
+  guint32 ssrc = 0, timestamp = 0;
+  gboolean marker = FALSE;
+  gboolean rtp;
+  gboolean same_frame = FALSE;
+  gboolean hold;
+  guint32 own_ssrc;
+
+  rtp = _parse_rtp (buffer, &ssrc, &timestamp, &marker);
+
+  /* Packets are only held if the frames of their stream are known to span
+   * several packets, so a packet that is a whole frame is never delayed */
+  if (rtp)
+  {
+    same_frame = self->have_last && ssrc == self->last_ssrc &&
+      timestamp == self->last_timestamp;
+
+    if (same_frame)
+      self->fragmented_frames = TRUE;
+    else if (!self->have_last || ssrc != self->last_ssrc ||
+        !self->last_marker)
+      /* Either another stream, or one that does not mark its frames */
+      self->fragmented_frames = FALSE;
+
+    self->have_last = TRUE;
+    self->last_ssrc = ssrc;
+    self->last_timestamp = timestamp;
+    self->last_marker = marker;
+  }
+  else
+  {
+    self->have_last = FALSE;
+  }
+
+  GST_OBJECT_LOCK (self);
+
+  /* Known before it can be looped back to our socket */
+  if (_get_ssrc (GST_BUFFER_DATA (buffer), size, &own_ssrc))
+    g_hash_table_insert (self->own_ssrcs, GUINT_TO_POINTER (own_ssrc),
+        GUINT_TO_POINTER (TRUE));
+
+  /* The packets sent together must be of the same frame and all as large
+   * as the first one, except the last one */
+  if (self->n_pending &&
+      (!same_frame ||
+          self->n_pending >= self->batch_depth ||
+          self->pending_bytes + size > MAX_BATCH_BYTES ||
+          size > GST_BUFFER_SIZE (self->pending[0]) ||
+          GST_BUFFER_SIZE (self->pending[self->n_pending - 1]) !=
+          GST_BUFFER_SIZE (self->pending[0])))
+    _send_pending (self);
+
+  self->pending[self->n_pending++] = gst_buffer_ref (buffer);
+  self->pending_bytes += size;
+
+  hold = rtp && !marker && self->fragmented_frames &&
+    self->n_pending < self->batch_depth;
+
+  if (!hold)
+    _send_pending (self);
+
+  GST_OBJECT_UNLOCK (self);
+
+  return GST_FLOW_OK;
+}
+
+static gboolean
+fs_multicast_sink_event (GstBaseSink *bsink, GstEvent *event)
+{
+  FsMulticastSink *self = FS_MULTICAST_SINK (bsink);
+
+  switch (GST_EVENT_TYPE (event))
+  {
+    case GST_EVENT_EOS:
+      GST_OBJECT_LOCK (self);
+      _send_pending (self);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      _drop_pending (self);
+      self->have_last = FALSE;
+      break;
+    default:
+      break;
+  }
+
+  return TRUE;
+}
+
+static GList *
+_find_dest (FsMulticastSink *self,
+    guint32 group,
+    guint16 port,
+    guint8 ttl)
+{
+  MulticastDest key;
+
+  key.addr.sin_addr.s_addr = group;
+  key.addr.sin_port = htons (port);
+  key.ttl = ttl;
+
+  return g_hash_table_lookup (self->dest_links, &key);
+}
+
+/**
+ * fs_multicast_sink_add:
+ * @self: a #FsMulticastSink
+ * @group: the address of the group in network order
+ * @port: the destination port
+ * @ttl: the TTL of the packets sent to this destination
+ *
+ * Adds a destination to which every buffer will be sent, adding the same
+ * destination again only increases its refcount.
+ */
+
+void
+fs_multicast_sink_add (FsMulticastSink *self,
+    guint32 group,
+    guint16 port,
+    guint8 ttl)
+{
+  GList *item;
+
+  GST_OBJECT_LOCK (self);
+  item = _find_dest (self, group, port, ttl);
+  if (item)
+  {
+    ((MulticastDest *) item->data)->refcount++;
+  }
+  else
+  {
+    MulticastDest *dest = g_slice_new0 (MulticastDest);
+
+    dest->addr.sin_family = AF_INET;
+    dest->addr.sin_addr.s_addr = group;
+    dest->addr.sin_port = htons (port);
+    dest->ttl = ttl;
+    dest->refcount = 1;
+    self->dests = g_list_prepend (self->dests, dest);
+    g_hash_table_insert (self->dest_links, dest, self->dests);
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+/**
+ * fs_multicast_sink_remove:
+ * @self: a #FsMulticastSink
+ * @group: the address of the group in network order
+ * @port: the destination port
+ * @ttl: the TTL it was added with
+ *
+ * Drops a reference to a destination added with fs_multicast_sink_add(),
+ * nothing more is sent to it once the last reference is gone.
+ */
+
+void
+fs_multicast_sink_remove (FsMulticastSink *self,
+    guint32 group,
+    guint16 port,
+    guint8 ttl)
+{
+  GList *item;
+
+  GST_OBJECT_LOCK (self);
+  item = _find_dest (self, group, port, ttl);
+  if (item)
+  {
+    MulticastDest *dest = item->data;
+
+    if (--dest->refcount == 0)
+    {
+      g_hash_table_remove (self->dest_links, dest);
+      self->dests = g_list_delete_link (self->dests, item);
+      g_slice_free (MulticastDest, dest);
+    }
+  }
+  else
+  {
+    GST_WARNING_OBJECT (self, "Tried to remove unknown destination on port"
+        " %u with TTL %u", port, ttl);
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+/**
+ * fs_multicast_sink_has_sent:
+ * @self: a #FsMulticastSink
+ * @data: a received packet
+ * @len: the length of @data
+ *
+ * Tells if @data may be a packet that this sink sent, it can be called from
+ * any thread.
+ *
+ * Returns: %TRUE if @data carries the SSRC of an RTP or RTCP packet that
+ * was sent since the sink was started, or no SSRC at all
+ */
+
+gboolean
+fs_multicast_sink_has_sent (FsMulticastSink *self,
+    const guint8 *data,
+    guint len)
+{
+  guint32 ssrc;
+  gboolean sent;
+
+  if (!_get_ssrc (data, len, &ssrc))
+    return TRUE;
+
+  GST_OBJECT_LOCK (self);
+  sent = g_hash_table_lookup (self->own_ssrcs, GUINT_TO_POINTER (ssrc)) !=
+    NULL;
+  GST_OBJECT_UNLOCK (self);
+
+  return sent;
+}
@@ -0,0 +1,119 @@
+/*
+ * Farsight2 - Farsight Multicast UDP sink
+ *
+ * fs-multicast-sink.h - Sink sending to several multicast groups, each with
+ *                       its own TTL, from one socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_MULTICAST_SINK_H__
+#define __FS_MULTICAST_SINK_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+
+#include <gst/farsight/fs-plugin.h>
+
+G_BEGIN_DECLS
+
+#define FS_TYPE_MULTICAST_SINK \
+  (fs_multicast_sink_get_type ())
+#define FS_MULTICAST_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),FS_TYPE_MULTICAST_SINK, \
+      FsMulticastSink))
+#define FS_MULTICAST_SINK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),FS_TYPE_MULTICAST_SINK, \
+      FsMulticastSinkClass))
+#define FS_IS_MULTICAST_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),FS_TYPE_MULTICAST_SINK))
+#define FS_IS_MULTICAST_SINK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),FS_TYPE_MULTICAST_SINK))
+
+typedef struct _FsMulticastSink          FsMulticastSink;
+typedef struct _FsMulticastSinkClass     FsMulticastSinkClass;
+
+/**
+ * FsMulticastSink:
+ *
+ * Opaque #FsMulticastSink data structure.
+ */
+struct _FsMulticastSink {
+  GstBaseSink     parent;
+
+  /*< private >*/
+  gint sockfd;
+
+  /* Protected by the object lock */
+  GList *dests;
+  /* MulticastDest -> its link in dests */
+  GHashTable *dest_links;
+  /* guint32 SSRC of the packets we sent -> TRUE */
+  GHashTable *own_ssrcs;
+  guint batch_depth;
+  guint64 packets;
+  guint64 syscalls;
+  /* FALSE once the kernel refused a UDP_SEGMENT send */
+  gboolean gso;
+
+  /* Only used from the streaming thread */
+  /* FALSE once the kernel refused a TTL passed with the packet */
+  gboolean ttl_cmsg;
+  /* Last IP_MULTICAST_TTL set on the socket, -1 if unknown */
+  gint socket_ttl;
+
+  /* Packets of the current RTP frame held until it is complete */
+  GstBuffer **pending;
+  guint n_pending;
+  gsize pending_bytes;
+  /* One struct iovec per pending packet */
+  gpointer iovs;
+  /* Array of struct mmsghdr, one per pending packet */
+  gpointer msgs;
+
+  /* The last RTP packet that was rendered */
+  gboolean have_last;
+  guint32 last_ssrc;
+  guint32 last_timestamp;
+  gboolean last_marker;
+  /* The frames of the last SSRC span several packets, so they are held */
+  gboolean fragmented_frames;
+};
+
+struct _FsMulticastSinkClass {
+  GstBaseSinkClass parent_class;
+};
+
+GType   fs_multicast_sink_register_type (FsPlugin *module);
+
+GType   fs_multicast_sink_get_type      (void);
+
+void    fs_multicast_sink_add           (FsMulticastSink *self,
+                                         guint32 group,
+                                         guint16 port,
+                                         guint8 ttl);
+
+void    fs_multicast_sink_remove        (FsMulticastSink *self,
+                                         guint32 group,
+                                         guint16 port,
+                                         guint8 ttl);
+
+gboolean fs_multicast_sink_has_sent     (FsMulticastSink *self,
+                                         const guint8 *data,
+                                         guint len);
+
+G_END_DECLS
+
+#endif /* __FS_MULTICAST_SINK_H__ */
@@ -0,0 +1,678 @@
+/*
+ * Farsight2 - Farsight Multicast UDP source
+ *
+ * fs-multicast-src.c - Source receiving the packets of several multicast
+ *                      groups from one socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:fs-multicast-src
+ * @short_description: Receives the packets of several multicast groups
+ *
+ * This source replaces udpsrc in the multicast transmitter. It reads from a
+ * socket that it does not own, bound to the wildcard address, on which the
+ * transmitter joins every group that uses the same port.
+ *
+ * Such a socket gets every datagram sent to its port, whatever its
+ * destination, so the source asks the kernel for the destination address
+ * of each packet (with IP_PKTINFO, or IP_RECVDSTADDR on BSD) and only pushes
+ * those sent to one of the groups added with fs_multicast_src_add_group().
+ * Where neither option exists, every packet is pushed.
+ *
+ * When the socket loops our multicast packets back, because other
+ * applications on this host need to receive them, the
+ * #FsMulticastSrc:drop-own-packets property makes it drop those that come
+ * from one of the addresses of this host and from the port of the socket.
+ * Other applications can share that port, so if the sink of the socket was
+ * given with fs_multicast_src_set_sender(), such a packet is only dropped
+ * if it carries the SSRC of an RTP or RTCP packet that the sink sent, or
+ * no SSRC at all.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "fs-multicast-src.h"
+#include "fs-multicast-sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <gst/farsight/fs-interfaces.h>
+
+GST_DEBUG_CATEGORY_EXTERN (fs_multicast_transmitter_debug);
+#define GST_CAT_DEFAULT fs_multicast_transmitter_debug
+
+/* Larger than any UDP payload, so packets are never truncated */
+#define MAX_PACKET_SIZE 65536
+
+#define DEFAULT_SOCKFD -1
+
+/* The option that gives the destination address of each packet */
+#if defined (IP_PKTINFO)
+# define DSTADDR_OPTION IP_PKTINFO
+#elif defined (IP_RECVDSTADDR)
+# define DSTADDR_OPTION IP_RECVDSTADDR
+#endif
+
+/* props */
+enum
+{
+  PROP_0,
+  PROP_SOCKFD,
+  PROP_DROP_OWN_PACKETS,
+  PROP_PACKETS,
+  PROP_DROPPED
+};
+
+static GstStaticPadTemplate fs_multicast_src_template =
+  GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static GstPushSrcClass *parent_class = NULL;
+
+static void fs_multicast_src_base_init (gpointer g_class);
+static void fs_multicast_src_class_init (FsMulticastSrcClass *klass);
+static void fs_multicast_src_init (FsMulticastSrc *self);
+static void fs_multicast_src_finalize (GObject *object);
+
+static void fs_multicast_src_set_property (GObject *object,
+    guint prop_id, const GValue *value, GParamSpec *pspec);
+static void fs_multicast_src_get_property (GObject *object,
+    guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean fs_multicast_src_start (GstBaseSrc *bsrc);
+static gboolean fs_multicast_src_stop (GstBaseSrc *bsrc);
+static gboolean fs_multicast_src_unlock (GstBaseSrc *bsrc);
+static gboolean fs_multicast_src_unlock_stop (GstBaseSrc *bsrc);
+static GstFlowReturn fs_multicast_src_create (GstPushSrc *psrc,
+    GstBuffer **outbuf);
+
+
+static GType type = 0;
+
+GType
+fs_multicast_src_get_type (void)
+{
+  g_assert (type);
+  return type;
+}
+
+GType
+fs_multicast_src_register_type (FsPlugin *module)
+{
+  static const GTypeInfo info = {
+    sizeof (FsMulticastSrcClass),
+    (GBaseInitFunc) fs_multicast_src_base_init,
+    NULL,
+    (GClassInitFunc) fs_multicast_src_class_init,
+    NULL,
+    NULL,
+    sizeof (FsMulticastSrc),
+    0,
+    (GInstanceInitFunc) fs_multicast_src_init
+  };
+
+  type = g_type_module_register_type (G_TYPE_MODULE (module),
+      GST_TYPE_PUSH_SRC, "FsMulticastSrc", &info, 0);
+
+  return type;
+}
+
+static void
+fs_multicast_src_base_init (gpointer g_class)
+{
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "Farsight multicast UDP source",
+      "Source/Network",
+      "Receives the packets of several multicast groups from one socket",
+      "Farsight developers");
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&fs_multicast_src_template));
+}
+
+static void
+fs_multicast_src_class_init (FsMulticastSrcClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstBaseSrcClass *gstbasesrc_class = GST_BASE_SRC_CLASS (klass);
+  GstPushSrcClass *gstpushsrc_class = GST_PUSH_SRC_CLASS (klass);
+
+  parent_class = g_type_class_peek_parent (klass);
+
+  gobject_class->set_property = fs_multicast_src_set_property;
+  gobject_class->get_property = fs_multicast_src_get_property;
+  gobject_class->finalize = fs_multicast_src_finalize;
+
+  gstbasesrc_class->start = GST_DEBUG_FUNCPTR (fs_multicast_src_start);
+  gstbasesrc_class->stop = GST_DEBUG_FUNCPTR (fs_multicast_src_stop);
+  gstbasesrc_class->unlock = GST_DEBUG_FUNCPTR (fs_multicast_src_unlock);
+  gstbasesrc_class->unlock_stop =
+    GST_DEBUG_FUNCPTR (fs_multicast_src_unlock_stop);
+
+  gstpushsrc_class->create = GST_DEBUG_FUNCPTR (fs_multicast_src_create);
+
+  g_object_class_install_property (gobject_class,
+      PROP_SOCKFD,
+      g_param_spec_int ("sockfd",
+          "Socket",
+          "The bound socket to receive from, it is not closed by the element",
+          -1, G_MAXINT, DEFAULT_SOCKFD,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_DROP_OWN_PACKETS,
+      g_param_spec_boolean ("drop-own-packets",
+          "Drop own packets",
+          "Drop the packets sent from this host with the port of the socket,"
+          " the addresses of the host are read when it is set",
+          FALSE,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PACKETS,
+      g_param_spec_uint64 ("packets",
+          "Packets",
+          "Number of packets pushed since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_DROPPED,
+      g_param_spec_uint64 ("dropped",
+          "Dropped packets",
+          "Number of packets dropped since the element was started because"
+          " they were not sent to one of its groups or were sent by us",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+}
+
+static void
+fs_multicast_src_init (FsMulticastSrc *self)
+{
+  self->sockfd = DEFAULT_SOCKFD;
+  self->control_sock[0] = -1;
+  self->control_sock[1] = -1;
+
+  self->groups = g_hash_table_new (g_direct_hash, g_direct_equal);
+  self->own_addresses = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  gst_base_src_set_live (GST_BASE_SRC (self), TRUE);
+  gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
+  gst_base_src_set_do_timestamp (GST_BASE_SRC (self), TRUE);
+}
+
+static void
+fs_multicast_src_finalize (GObject *object)
+{
+  FsMulticastSrc *self = FS_MULTICAST_SRC (object);
+
+  g_free (self->slot);
+  g_hash_table_destroy (self->groups);
+  g_hash_table_destroy (self->own_addresses);
+  if (self->sender)
+    gst_object_unref (self->sender);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static gboolean
+_remove_all (gpointer key, gpointer value, gpointer user_data)
+{
+  return TRUE;
+}
+
+/*
+ * Must be called with the object lock held
+ */
+static void
+_fill_own_addresses (FsMulticastSrc *self)
+{
+  struct sockaddr_in local;
+  socklen_t len = sizeof (local);
+  GList *ips, *item;
+
+  g_hash_table_foreach_remove (self->own_addresses, _remove_all, NULL);
+  self->own_port = 0;
+
+  if (!self->drop_own_packets || self->sockfd < 0)
+    return;
+
+  if (getsockname (self->sockfd, (struct sockaddr *) &local, &len) < 0 ||
+      local.sin_family != AF_INET)
+  {
+    GST_WARNING_OBJECT (self, "Could not get the port of the socket,"
+        " our own packets will not be dropped");
+    return;
+  }
+  self->own_port = local.sin_port;
+
+  ips = fs_interfaces_get_local_ips (TRUE);
+  for (item = ips; item; item = g_list_next (item))
+  {
+    struct in_addr addr;
+
+    if (inet_pton (AF_INET, item->data, &addr) > 0)
+      g_hash_table_insert (self->own_addresses,
+          GUINT_TO_POINTER (addr.s_addr), GUINT_TO_POINTER (TRUE));
+    g_free (item->data);
+  }
+  g_list_free (ips);
+}
+
+static void
+fs_multicast_src_set_property (GObject *object,
+    guint prop_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  FsMulticastSrc *self = FS_MULTICAST_SRC (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+  {
+    case PROP_SOCKFD:
+      self->sockfd = g_value_get_int (value);
+      _fill_own_addresses (self);
+      break;
+    case PROP_DROP_OWN_PACKETS:
+      self->drop_own_packets = g_value_get_boolean (value);
+      _fill_own_addresses (self);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static void
+fs_multicast_src_get_property (GObject *object,
+    guint prop_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  FsMulticastSrc *self = FS_MULTICAST_SRC (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+  {
+    case PROP_SOCKFD:
+      g_value_set_int (value, self->sockfd);
+      break;
+    case PROP_DROP_OWN_PACKETS:
+      g_value_set_boolean (value, self->drop_own_packets);
+      break;
+    case PROP_PACKETS:
+      g_value_set_uint64 (value, self->packets);
+      break;
+    case PROP_DROPPED:
+      g_value_set_uint64 (value, self->dropped);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static gboolean
+fs_multicast_src_start (GstBaseSrc *bsrc)
+{
+  FsMulticastSrc *self = FS_MULTICAST_SRC (bsrc);
+
+  if (self->sockfd < 0)
+  {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL),
+        ("No socket was set on the \"sockfd\" property"));
+    return FALSE;
+  }
+
+#ifdef DSTADDR_OPTION
+  {
+    int one = 1;
+
+    if (setsockopt (self->sockfd, IPPROTO_IP, DSTADDR_OPTION, &one,
+            sizeof (one)) < 0)
+      GST_WARNING_OBJECT (self, "Could not ask for the destination of the"
+          " packets, those of all the groups on this port will be pushed: %s",
+          g_strerror (errno));
+  }
+#else
+  GST_WARNING_OBJECT (self, "Can not get the destination of the packets,"
+      " those of all the groups on this port will be pushed");
+#endif
+
+  if (pipe (self->control_sock) < 0)
+  {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL),
+        ("Could not create control pipe: %s", g_strerror (errno)));
+    return FALSE;
+  }
+  fcntl (self->control_sock[0], F_SETFL, O_NONBLOCK);
+  fcntl (self->control_sock[1], F_SETFL, O_NONBLOCK);
+
+  if (!self->slot)
+    self->slot = g_malloc (MAX_PACKET_SIZE);
+
+  GST_OBJECT_LOCK (self);
+  self->packets = 0;
+  self->dropped = 0;
+  GST_OBJECT_UNLOCK (self);
+
+  return TRUE;
+}
+
+static gboolean
+fs_multicast_src_stop (GstBaseSrc *bsrc)
+{
+  FsMulticastSrc *self = FS_MULTICAST_SRC (bsrc);
+
+  if (self->control_sock[0] >= 0)
+    close (self->control_sock[0]);
+  if (self->control_sock[1] >= 0)
+    close (self->control_sock[1]);
+  self->control_sock[0] = -1;
+  self->control_sock[1] = -1;
+
+  return TRUE;
+}
+
+static gboolean
+fs_multicast_src_unlock (GstBaseSrc *bsrc)
+{
+  FsMulticastSrc *self = FS_MULTICAST_SRC (bsrc);
+  const gchar c = 'x';
+
+  if (write (self->control_sock[1], &c, 1) < 0 && errno != EAGAIN)
+    GST_WARNING_OBJECT (self, "Could not wake up the streaming thread: %s",
+        g_strerror (errno));
+
+  return TRUE;
+}
+
+static gboolean
+fs_multicast_src_unlock_stop (GstBaseSrc *bsrc)
+{
+  FsMulticastSrc *self = FS_MULTICAST_SRC (bsrc);
+  gchar buf[16];
+
+  while (read (self->control_sock[0], buf, sizeof (buf)) > 0);
+
+  return TRUE;
+}
+
+/*
+ * Returns the destination address of the packet in network order, or 0 if
+ * the kernel did not say
+ */
+static guint32
+_get_destination (struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR (msg); cmsg; cmsg = CMSG_NXTHDR (msg, cmsg))
+  {
+    if (cmsg->cmsg_level != IPPROTO_IP)
+      continue;
+
+#if defined (IP_PKTINFO)
+    if (cmsg->cmsg_type == IP_PKTINFO)
+    {
+      struct in_pktinfo pktinfo;
+
+      memcpy (&pktinfo, CMSG_DATA (cmsg), sizeof (pktinfo));
+      return pktinfo.ipi_addr.s_addr;
+    }
+#elif defined (IP_RECVDSTADDR)
+    if (cmsg->cmsg_type == IP_RECVDSTADDR)
+    {
+      struct in_addr addr;
+
+      memcpy (&addr, CMSG_DATA (cmsg), sizeof (addr));
+      return addr.s_addr;
+    }
+#endif
+  }
+
+  return 0;
+}
+
+/*
+ * Waits for the socket to be readable and reads one packet into the slot
+ */
+static GstFlowReturn
+fs_multicast_src_receive (FsMulticastSrc *self,
+    guint *len,
+    struct sockaddr_in *from,
+    guint32 *destination)
+{
+  struct pollfd fds[2];
+  struct msghdr msg;
+  struct iovec iov;
+  union {
+    struct cmsghdr align;
+#if defined (IP_PKTINFO)
+    gchar buf[CMSG_SPACE (sizeof (struct in_pktinfo))];
+#else
+    gchar buf[CMSG_SPACE (sizeof (struct in_addr))];
+#endif
+  } control;
+  gssize ret;
+
+  fds[0].fd = self->sockfd;
+  fds[0].events = POLLIN;
+  fds[1].fd = self->control_sock[0];
+  fds[1].events = POLLIN;
+
+  for (;;)
+  {
+    gint pollret;
+
+    do {
+      fds[0].revents = 0;
+      fds[1].revents = 0;
+      pollret = poll (fds, 2, -1);
+    } while (pollret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (pollret < 0)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+          ("poll() failed: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+
+    if (fds[1].revents)
+    {
+      GST_DEBUG_OBJECT (self, "Unlocked");
+      return GST_FLOW_WRONG_STATE;
+    }
+
+    iov.iov_base = self->slot;
+    iov.iov_len = MAX_PACKET_SIZE;
+
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_name = from;
+    msg.msg_namelen = sizeof (struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof (control);
+
+    ret = recvmsg (self->sockfd, &msg, MSG_DONTWAIT);
+
+    if (ret >= 0)
+      break;
+
+    if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != ECONNREFUSED)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+          ("Could not receive from the socket: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+  }
+
+  *len = ret;
+  *destination = _get_destination (&msg);
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+fs_multicast_src_create (GstPushSrc *psrc, GstBuffer **outbuf)
+{
+  FsMulticastSrc *self = FS_MULTICAST_SRC (psrc);
+  GstBuffer *buf;
+  guint len;
+
+  for (;;)
+  {
+    struct sockaddr_in from;
+    guint32 destination;
+    gboolean wanted;
+    GstFlowReturn ret = fs_multicast_src_receive (self, &len, &from,
+        &destination);
+
+    if (ret != GST_FLOW_OK)
+      return ret;
+
+    GST_OBJECT_LOCK (self);
+    wanted = (destination == 0 ||
+        g_hash_table_lookup (self->groups, GUINT_TO_POINTER (destination)));
+    if (wanted && self->own_port && from.sin_port == self->own_port &&
+        g_hash_table_lookup (self->own_addresses,
+            GUINT_TO_POINTER (from.sin_addr.s_addr)) &&
+        (!self->sender || fs_multicast_sink_has_sent (
+            FS_MULTICAST_SINK (self->sender), self->slot, len)))
+      wanted = FALSE;
+    if (wanted)
+      self->packets++;
+    else
+      self->dropped++;
+    GST_OBJECT_UNLOCK (self);
+
+    if (wanted)
+      break;
+
+    GST_LOG_OBJECT (self, "Dropped packet of %u bytes that was sent by us or"
+        " to a group we are not in", len);
+  }
+
+  buf = gst_buffer_new_and_alloc (len);
+  memcpy (GST_BUFFER_DATA (buf), self->slot, len);
+
+  *outbuf = buf;
+
+  return GST_FLOW_OK;
+}
+
+/**
+ * fs_multicast_src_add_group:
+ * @self: a #FsMulticastSrc
+ * @group: the address of the group in network order
+ *
+ * Starts pushing the packets sent to @group, adding the same group again
+ * only increases its refcount.
+ */
+
+void
+fs_multicast_src_add_group (FsMulticastSrc *self,
+    guint32 group)
+{
+  guint count;
+
+  GST_OBJECT_LOCK (self);
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (self->groups,
+          GUINT_TO_POINTER (group)));
+  g_hash_table_insert (self->groups, GUINT_TO_POINTER (group),
+      GUINT_TO_POINTER (count + 1));
+  GST_OBJECT_UNLOCK (self);
+}
+
+/**
+ * fs_multicast_src_remove_group:
+ * @self: a #FsMulticastSrc
+ * @group: the address of the group in network order
+ *
+ * Drops a reference to a group added with fs_multicast_src_add_group(), its
+ * packets are dropped once the last reference is gone.
+ */
+
+void
+fs_multicast_src_remove_group (FsMulticastSrc *self,
+    guint32 group)
+{
+  guint count;
+
+  GST_OBJECT_LOCK (self);
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (self->groups,
+          GUINT_TO_POINTER (group)));
+  if (count > 1)
+    g_hash_table_insert (self->groups, GUINT_TO_POINTER (group),
+        GUINT_TO_POINTER (count - 1));
+  else if (count == 1)
+    g_hash_table_remove (self->groups, GUINT_TO_POINTER (group));
+  else
+    GST_WARNING_OBJECT (self, "Tried to remove a group that was not added");
+  GST_OBJECT_UNLOCK (self);
+}
+
+/**
+ * fs_multicast_src_set_sender:
+ * @self: a #FsMulticastSrc
+ * @sender: the #FsMulticastSink that sends from the same socket, or %NULL
+ *
+ * Tells which of the packets that come from our own address and port were
+ * really sent by us, see #FsMulticastSrc:drop-own-packets.
+ */
+
+void
+fs_multicast_src_set_sender (FsMulticastSrc *self,
+    GstElement *sender)
+{
+  GstElement *old_sender;
+
+  if (sender)
+    gst_object_ref (sender);
+
+  GST_OBJECT_LOCK (self);
+  old_sender = self->sender;
+  self->sender = sender;
+  GST_OBJECT_UNLOCK (self);
+
+  if (old_sender)
+    gst_object_unref (old_sender);
+}
@@ -0,0 +1,98 @@
+/*
+ * Farsight2 - Farsight Multicast UDP source
+ *
+ * fs-multicast-src.h - Source receiving the packets of several multicast
+ *                      groups from one socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_MULTICAST_SRC_H__
+#define __FS_MULTICAST_SRC_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstpushsrc.h>
+
+#include <gst/farsight/fs-plugin.h>
+
+G_BEGIN_DECLS
+
+#define FS_TYPE_MULTICAST_SRC \
+  (fs_multicast_src_get_type ())
+#define FS_MULTICAST_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),FS_TYPE_MULTICAST_SRC, \
+      FsMulticastSrc))
+#define FS_MULTICAST_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),FS_TYPE_MULTICAST_SRC, \
+      FsMulticastSrcClass))
+#define FS_IS_MULTICAST_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),FS_TYPE_MULTICAST_SRC))
+#define FS_IS_MULTICAST_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),FS_TYPE_MULTICAST_SRC))
+
+typedef struct _FsMulticastSrc          FsMulticastSrc;
+typedef struct _FsMulticastSrcClass     FsMulticastSrcClass;
+
+/**
+ * FsMulticastSrc:
+ *
+ * Opaque #FsMulticastSrc data structure.
+ */
+struct _FsMulticastSrc {
+  GstPushSrc      parent;
+
+  /*< private >*/
+  gint sockfd;
+
+  /* Used to interrupt poll() in unlock() */
+  gint control_sock[2];
+
+  /* Large enough for any datagram */
+  guint8 *slot;
+
+  /* Protected by the object lock */
+  /* guint32 group address in network order -> refcount */
+  GHashTable *groups;
+  gboolean drop_own_packets;
+  /* guint32 address of this host in network order -> TRUE */
+  GHashTable *own_addresses;
+  /* Port of the socket in network order, 0 if nothing is dropped */
+  guint16 own_port;
+  /* The FsMulticastSink of the same socket, may be NULL */
+  GstElement *sender;
+  guint64 packets;
+  guint64 dropped;
+};
+
+struct _FsMulticastSrcClass {
+  GstPushSrcClass parent_class;
+};
+
+GType   fs_multicast_src_register_type (FsPlugin *module);
+
+GType   fs_multicast_src_get_type      (void);
+
+void    fs_multicast_src_add_group     (FsMulticastSrc *self,
+                                        guint32 group);
+
+void    fs_multicast_src_remove_group  (FsMulticastSrc *self,
+                                        guint32 group);
+
+void    fs_multicast_src_set_sender    (FsMulticastSrc *self,
+                                        GstElement *sender);
+
+G_END_DECLS
+
+#endif /* __FS_MULTICAST_SRC_H__ */
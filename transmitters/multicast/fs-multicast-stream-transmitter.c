@@ -50,6 +50,21 @@
  * </para>
  *
  * <para>
+ * All the groups that a session uses on the same port share a single
+ * socket, whatever their TTL, the packets are sorted by their destination
+ * address when they are received and the TTL is given with each packet
+ * that is sent.
+ * </para>
+ *
+ * <para>
+ * If the "source-ip" property is set, it is the only source that will be
+ * received from on the groups of the remote candidates (source-specific
+ * multicast), otherwise packets from any source are received. When stream
+ * transmitters of the same session share a group and some of them want any
+ * source, all of them get packets from any source.
+ * </para>
+ *
+ * <para>
  * It will only listen to and send from the IP specified in the
  * prefered-local-candidates. There can be only one preferred candidate per
  * component. Only the component_id and the ip will be used from the preferred
@@ -105,7 +120,8 @@ enum
 {
   PROP_0,
   PROP_SENDING,
-  PROP_PREFERRED_LOCAL_CANDIDATES
+  PROP_PREFERRED_LOCAL_CANDIDATES,
+  PROP_SOURCE_IP
 };
 
 struct _FsMulticastStreamTransmitterPrivate
@@ -126,11 +142,13 @@ struct _FsMulticastStreamTransmitterPrivate
   FsCandidate **remote_candidate;
   FsCandidate **local_candidate;
 
-  UdpSock **recvudpsocks;
-  UdpSock **sendudpsocks;
+  UdpSock **udpsocks;
 
   GList *preferred_local_candidates;
 
+  /* The only source to receive from, NULL for any source */
+  gchar *source_ip;
+
   guint next_candidate_id;
 };
 
@@ -208,6 +226,21 @@ fs_multicast_stream_transmitter_class_init (FsMulticastStreamTransmitterClass *k
   g_object_class_override_property (gobject_class,
     PROP_PREFERRED_LOCAL_CANDIDATES, "preferred-local-candidates");
 
+  /**
+   * FsMulticastStreamTransmitter:source-ip:
+   *
+   * The IP address of the only host to receive packets from on the
+   * multicast groups of this stream (source-specific multicast), or %NULL
+   * to receive packets from any source.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_SOURCE_IP,
+      g_param_spec_string ("source-ip",
+          "The multicast source",
+          "The IP address of the only source to receive from",
+          NULL,
+          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE));
+
   gobject_class->dispose = fs_multicast_stream_transmitter_dispose;
   gobject_class->finalize = fs_multicast_stream_transmitter_finalize;
 
@@ -234,31 +267,20 @@ fs_multicast_stream_transmitter_dispose (GObject *object)
     /* If dispose did already run, return. */
     return;
 
-  if (self->priv->sendudpsocks)
+  if (self->priv->udpsocks)
   {
     for (c = 1; c <= self->priv->transmitter->components; c++)
     {
-      if (self->priv->sendudpsocks[c])
+      if (self->priv->udpsocks[c])
       {
         if (self->priv->sending)
           fs_multicast_transmitter_udpsock_dec_sending (
-              self->priv->sendudpsocks[c]);
-        fs_multicast_transmitter_put_udpsock (self->priv->transmitter,
-            self->priv->sendudpsocks[c]);
-        self->priv->sendudpsocks[c] = NULL;
-      }
-    }
-  }
-
-  if (self->priv->recvudpsocks)
-  {
-    for (c = 1; c <= self->priv->transmitter->components; c++)
-    {
-      if (self->priv->recvudpsocks[c])
-      {
+              self->priv->udpsocks[c], self->priv->remote_candidate[c]->ttl);
+        fs_multicast_transmitter_udpsock_remove_source (
+            self->priv->udpsocks[c], self->priv->source_ip);
         fs_multicast_transmitter_put_udpsock (self->priv->transmitter,
-            self->priv->recvudpsocks[c]);
-        self->priv->recvudpsocks[c] = NULL;
+            self->priv->udpsocks[c]);
+        self->priv->udpsocks[c] = NULL;
       }
     }
   }
@@ -281,6 +303,9 @@ fs_multicast_stream_transmitter_finalize (GObject *object)
     self->priv->preferred_local_candidates = NULL;
   }
 
+  g_free (self->priv->source_ip);
+  self->priv->source_ip = NULL;
+
   if (self->priv->remote_candidate)
   {
     for (c = 1; c <= self->priv->transmitter->components; c++)
@@ -305,11 +330,8 @@ fs_multicast_stream_transmitter_finalize (GObject *object)
     self->priv->local_candidate = NULL;
   }
 
-  g_free (self->priv->sendudpsocks);
-  self->priv->sendudpsocks = NULL;
-
-  g_free (self->priv->recvudpsocks);
-  self->priv->recvudpsocks = NULL;
+  g_free (self->priv->udpsocks);
+  self->priv->udpsocks = NULL;
 
   parent_class->finalize (object);
 }
@@ -330,6 +352,9 @@ fs_multicast_stream_transmitter_get_property (GObject *object,
     case PROP_PREFERRED_LOCAL_CANDIDATES:
       g_value_set_boxed (value, self->priv->preferred_local_candidates);
       break;
+    case PROP_SOURCE_IP:
+      g_value_set_string (value, self->priv->source_ip);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -354,20 +379,25 @@ fs_multicast_stream_transmitter_set_property (GObject *object,
 
         if (self->priv->sending != old_sending)
           for (c = 1; c <= self->priv->transmitter->components; c++)
-            if (self->priv->sendudpsocks[c])
+            if (self->priv->udpsocks[c])
             {
               if (self->priv->sending)
                 fs_multicast_transmitter_udpsock_inc_sending (
-                    self->priv->sendudpsocks[c]);
+                    self->priv->udpsocks[c],
+                    self->priv->remote_candidate[c]->ttl);
               else
                 fs_multicast_transmitter_udpsock_dec_sending (
-                    self->priv->sendudpsocks[c]);
+                    self->priv->udpsocks[c],
+                    self->priv->remote_candidate[c]->ttl);
             }
       }
       break;
     case PROP_PREFERRED_LOCAL_CANDIDATES:
       self->priv->preferred_local_candidates = g_value_dup_boxed (value);
       break;
+    case PROP_SOURCE_IP:
+      self->priv->source_ip = g_value_dup_string (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -381,9 +411,7 @@ fs_multicast_stream_transmitter_build (FsMulticastStreamTransmitter *self,
   GList *item;
   gint c;
 
-  self->priv->sendudpsocks = g_new0 (UdpSock *,
-      self->priv->transmitter->components + 1);
-  self->priv->recvudpsocks = g_new0 (UdpSock *,
+  self->priv->udpsocks = g_new0 (UdpSock *,
       self->priv->transmitter->components + 1);
   self->priv->local_candidate = g_new0 (FsCandidate *,
       self->priv->transmitter->components + 1);
@@ -461,13 +489,12 @@ fs_multicast_stream_transmitter_add_remote_candidate (
     FsMulticastStreamTransmitter *self, FsCandidate *candidate,
     GError **error)
 {
-  UdpSock *newrecvudpsock = NULL;
-  UdpSock *newsendudpsock = NULL;
+  UdpSock *newudpsock = NULL;
+  FsCandidate *old_candidate =
+    self->priv->remote_candidate[candidate->component_id];
 
-  if (self->priv->remote_candidate[candidate->component_id])
+  if (old_candidate)
   {
-    FsCandidate *old_candidate =
-      self->priv->remote_candidate[candidate->component_id];
     if (old_candidate->port == candidate->port &&
         old_candidate->ttl == candidate->ttl &&
         !strcmp (old_candidate->ip, candidate->ip))
@@ -475,8 +502,6 @@ fs_multicast_stream_transmitter_add_remote_candidate (
       GST_DEBUG ("Re-set the same candidate, ignoring");
       return TRUE;
     }
-    fs_candidate_destroy (old_candidate);
-    self->priv->remote_candidate[candidate->component_id] = NULL;
   }
 
   /*
@@ -485,53 +510,46 @@ fs_multicast_stream_transmitter_add_remote_candidate (
    * We should also check if the address is in the multicast range
    */
 
-  newrecvudpsock = fs_multicast_transmitter_get_udpsock (
+  newudpsock = fs_multicast_transmitter_get_udpsock (
       self->priv->transmitter,
       candidate->component_id,
       self->priv->local_candidate[candidate->component_id]->ip,
       candidate->ip,
       candidate->port,
-      candidate->ttl,
-      TRUE, error);
+      error);
 
-  if (!newrecvudpsock)
+  if (!newudpsock)
     return FALSE;
 
-  newsendudpsock = fs_multicast_transmitter_get_udpsock (
-      self->priv->transmitter,
-      candidate->component_id,
-      self->priv->local_candidate[candidate->component_id]->ip,
-      candidate->ip,
-      candidate->port,
-      candidate->ttl,
-      FALSE, error);
-
-  if (!newsendudpsock)
+  if (!fs_multicast_transmitter_udpsock_add_source (newudpsock,
+          self->priv->source_ip, error))
   {
     fs_multicast_transmitter_put_udpsock (self->priv->transmitter,
-        newrecvudpsock);
+        newudpsock);
     return FALSE;
   }
 
-  if (self->priv->sendudpsocks[candidate->component_id])
+  if (self->priv->sending)
+    fs_multicast_transmitter_udpsock_inc_sending (newudpsock, candidate->ttl);
+
+  /* The old one may be the same UdpSock, it is only released now so that
+   * the group is not left in between */
+  if (self->priv->udpsocks[candidate->component_id])
   {
     if (self->priv->sending)
       fs_multicast_transmitter_udpsock_dec_sending (
-          self->priv->sendudpsocks[candidate->component_id]);
+          self->priv->udpsocks[candidate->component_id], old_candidate->ttl);
+    fs_multicast_transmitter_udpsock_remove_source (
+        self->priv->udpsocks[candidate->component_id],
+        self->priv->source_ip);
     fs_multicast_transmitter_put_udpsock (self->priv->transmitter,
-        self->priv->sendudpsocks[candidate->component_id]);
+        self->priv->udpsocks[candidate->component_id]);
   }
 
-  if (self->priv->recvudpsocks[candidate->component_id])
-    fs_multicast_transmitter_put_udpsock (self->priv->transmitter,
-        self->priv->recvudpsocks[candidate->component_id]);
-
-  self->priv->sendudpsocks[candidate->component_id] = newsendudpsock;
-  self->priv->recvudpsocks[candidate->component_id] = newrecvudpsock;
+  if (old_candidate)
+    fs_candidate_destroy (old_candidate);
 
-  if (self->priv->sending)
-    fs_multicast_transmitter_udpsock_inc_sending (
-        self->priv->sendudpsocks[candidate->component_id]);
+  self->priv->udpsocks[candidate->component_id] = newudpsock;
 
   self->priv->remote_candidate[candidate->component_id] =
     fs_candidate_copy (candidate);
@@ -28,6 +28,20 @@
  *
  * This transmitter provides multicast udp
  *
+ * By default the packets it sends are looped back to the sockets of this
+ * host, including its own, so they come back up its source and have to be
+ * dropped by the RTP stack. If no other application on this host needs
+ * them, set #FsMulticastTransmitter:multicast-loop to %FALSE. If some do,
+ * #FsMulticastTransmitter:drop-own-packets drops ours before they reach
+ * the source pads. Other applications of this host can send from the same
+ * port, their RTP and RTCP packets are still received as long as their
+ * SSRCs differ from ours.
+ *
+ * The packets of an RTP frame that spans several of them are sent together,
+ * up to #FsMulticastTransmitter:batch-depth at a time, with one system call
+ * per group, using UDP segmentation offload where the kernel has it.
+ * #FsMulticastTransmitter:statistics tells how well that works for all the
+ * sockets together.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -36,6 +50,8 @@
 
 #include "fs-multicast-transmitter.h"
 #include "fs-multicast-stream-transmitter.h"
+#include "fs-multicast-src.h"
+#include "fs-multicast-sink.h"
 
 #include <gst/farsight/fs-conference-iface.h>
 #include <gst/farsight/fs-plugin.h>
@@ -72,9 +88,15 @@ enum
   PROP_0,
   PROP_GST_SINK,
   PROP_GST_SRC,
-  PROP_COMPONENTS
+  PROP_COMPONENTS,
+  PROP_MULTICAST_LOOP,
+  PROP_DROP_OWN_PACKETS,
+  PROP_BATCH_DEPTH,
+  PROP_STATISTICS
 };
 
+#define DEFAULT_BATCH_DEPTH 8
+
 struct _FsMulticastTransmitterPrivate
 {
   /* We hold references to this element */
@@ -87,7 +109,17 @@ struct _FsMulticastTransmitterPrivate
   GstElement **udpsrc_funnels;
   GstElement **udpsink_tees;
 
-  GList **udpsocks;
+  /* Protects the tables below and the refcounts of the UdpPorts */
+  GMutex *mutex;
+
+  /* One table of UdpPort and one of UdpSock per component,
+   * guint16 port -> UdpPort and UdpSock -> UdpSock */
+  GHashTable **udpports;
+  GHashTable **udpsocks;
+
+  gboolean multicast_loop;
+  gboolean drop_own_packets;
+  guint batch_depth;
 
   gboolean disposed;
 };
@@ -119,6 +151,12 @@ static GType fs_multicast_transmitter_get_stream_transmitter_type (
     FsTransmitter *transmitter,
     GError **error);
 
+static GstStructure *fs_multicast_transmitter_get_statistics (
+    FsMulticastTransmitter *self);
+
+static guint _udpsock_hash (gconstpointer key);
+static gboolean _udpsock_equal (gconstpointer a, gconstpointer b);
+
 static GObjectClass *parent_class = NULL;
 //static guint signals[LAST_SIGNAL] = { 0 };
 
@@ -157,6 +195,8 @@ fs_multicast_transmitter_register_type (FsPlugin *module)
         "Farsight multicast UDP transmitter");
 
   fs_multicast_stream_transmitter_register_type (module);
+  fs_multicast_src_register_type (module);
+  fs_multicast_sink_register_type (module);
 
   type = g_type_module_register_type (G_TYPE_MODULE (module),
     FS_TYPE_TRANSMITTER, "FsMulticastTransmitter", &info, 0);
@@ -195,6 +235,52 @@ fs_multicast_transmitter_class_init (FsMulticastTransmitterClass *klass)
   g_object_class_override_property (gobject_class, PROP_COMPONENTS,
     "components");
 
+  g_object_class_install_property (gobject_class,
+      PROP_MULTICAST_LOOP,
+      g_param_spec_boolean ("multicast-loop",
+          "Multicast loop",
+          "Loop the packets sent back to the sockets of this host",
+          TRUE,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_DROP_OWN_PACKETS,
+      g_param_spec_boolean ("drop-own-packets",
+          "Drop own packets",
+          "Drop the packets looped back from our own sockets, those of"
+          " other senders on our port are told apart by their SSRC",
+          FALSE,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_BATCH_DEPTH,
+      g_param_spec_uint ("batch-depth",
+          "Batch depth",
+          "The maximum number of packets of an RTP frame sent to a group"
+          " with one system call, 1 sends each packet as it comes",
+          1, 64, DEFAULT_BATCH_DEPTH,
+          G_PARAM_READWRITE));
+
+  /**
+   * FsMulticastTransmitter:statistics:
+   *
+   * The packet counters of the sockets that are currently open, added over
+   * all the components and ports. The structure is named
+   * "multicast-statistics" and contains the #guint64 fields
+   * "packets-sent", "send-syscalls", "packets-received" and
+   * "packets-dropped", the #gdouble field "packets-per-send-syscall", which
+   * is above 1 when the packets of a frame are sent together, and the
+   * #gboolean field "segmentation-offload", which is %TRUE if all the
+   * sockets send with UDP segmentation offload.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_STATISTICS,
+      g_param_spec_boxed ("statistics",
+          "Statistics",
+          "The number of packets and system calls of all the sockets",
+          GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE));
+
   transmitter_class->new_stream_transmitter =
     fs_multicast_transmitter_new_stream_transmitter;
   transmitter_class->get_stream_transmitter_type =
@@ -213,6 +299,9 @@ fs_multicast_transmitter_init (FsMulticastTransmitter *self)
   /* member init */
   self->priv = FS_MULTICAST_TRANSMITTER_GET_PRIVATE (self);
   self->priv->disposed = FALSE;
+  self->priv->multicast_loop = TRUE;
+  self->priv->batch_depth = DEFAULT_BATCH_DEPTH;
+  self->priv->mutex = g_mutex_new ();
 
   self->components = 2;
 }
@@ -232,7 +321,15 @@ fs_multicast_transmitter_constructed (GObject *object)
   /* We waste one space in order to have the index be the component_id */
   self->priv->udpsrc_funnels = g_new0 (GstElement *, self->components+1);
   self->priv->udpsink_tees = g_new0 (GstElement *, self->components+1);
-  self->priv->udpsocks = g_new0 (GList *, self->components+1);
+  self->priv->udpports = g_new0 (GHashTable *, self->components+1);
+  self->priv->udpsocks = g_new0 (GHashTable *, self->components+1);
+  for (c = 1; c <= self->components; c++)
+  {
+    self->priv->udpports[c] = g_hash_table_new (g_direct_hash,
+        g_direct_equal);
+    self->priv->udpsocks[c] = g_hash_table_new (_udpsock_hash,
+        _udpsock_equal);
+  }
 
   /* First we need the src elemnet */
 
@@ -395,6 +492,7 @@ static void
 fs_multicast_transmitter_finalize (GObject *object)
 {
   FsMulticastTransmitter *self = FS_MULTICAST_TRANSMITTER (object);
+  gint c;
 
   if (self->priv->udpsrc_funnels) {
     g_free (self->priv->udpsrc_funnels);
@@ -406,11 +504,24 @@ fs_multicast_transmitter_finalize (GObject *object)
     self->priv->udpsink_tees = NULL;
   }
 
+  if (self->priv->udpports) {
+    for (c = 1; c <= self->components; c++)
+      if (self->priv->udpports[c])
+        g_hash_table_destroy (self->priv->udpports[c]);
+    g_free (self->priv->udpports);
+    self->priv->udpports = NULL;
+  }
+
   if (self->priv->udpsocks) {
+    for (c = 1; c <= self->components; c++)
+      if (self->priv->udpsocks[c])
+        g_hash_table_destroy (self->priv->udpsocks[c]);
     g_free (self->priv->udpsocks);
     self->priv->udpsocks = NULL;
   }
 
+  g_mutex_free (self->priv->mutex);
+
   parent_class->finalize (object);
 }
 
@@ -432,12 +543,181 @@ fs_multicast_transmitter_get_property (GObject *object,
     case PROP_COMPONENTS:
       g_value_set_uint (value, self->components);
       break;
+    case PROP_MULTICAST_LOOP:
+      g_value_set_boolean (value, self->priv->multicast_loop);
+      break;
+    case PROP_DROP_OWN_PACKETS:
+      g_value_set_boolean (value, self->priv->drop_own_packets);
+      break;
+    case PROP_BATCH_DEPTH:
+      g_value_set_uint (value, self->priv->batch_depth);
+      break;
+    case PROP_STATISTICS:
+      g_value_take_boxed (value,
+          fs_multicast_transmitter_get_statistics (self));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+/*
+ * The UdpPort structure is a ref-counted pseudo-object used to represent
+ * the one socket of a component on a port, on which all the groups that use
+ * that port are joined. It includes a FsMulticastSrc that only pushes the
+ * packets sent to these groups and a FsMulticastSink that sends to them
+ * with the TTL of each destination, so the number of sockets and elements
+ * does not depend on the number of groups.
+ */
+
+typedef struct _UdpPort UdpPort;
+
+struct _UdpPort {
+  gint refcount;
+
+  GstElement *udpsrc;
+  GstPad *udpsrc_requested_pad;
+
+  GstElement *udpsink;
+  GstPad *udpsink_requested_pad;
+
+  guint16 port;
+
+  gint fd;
+
+  /* These are just convenience pointers to our parent transmitter */
+  GstElement *funnel;
+  GstElement *tee;
+
+  guint component_id;
+};
+
+static void
+_set_multicast_loop (FsMulticastTransmitter *self, UdpPort *udpport)
+{
+  guchar loop = self->priv->multicast_loop;
+
+  if (setsockopt (udpport->fd, IPPROTO_IP, IP_MULTICAST_LOOP,
+          (const void *)&loop, sizeof (loop)) < 0)
+    GST_WARNING ("Could not set the multicast loop on port %u: %s",
+        udpport->port, g_strerror (errno));
+}
+
+static void
+_set_drop_own_packets (FsMulticastTransmitter *self, UdpPort *udpport)
+{
+  g_object_set (udpport->udpsrc,
+      "drop-own-packets", self->priv->drop_own_packets,
+      NULL);
+}
+
+static void
+_set_batch_depth (FsMulticastTransmitter *self, UdpPort *udpport)
+{
+  g_object_set (udpport->udpsink,
+      "batch-depth", self->priv->batch_depth,
+      NULL);
+}
+
+typedef void (*UdpPortFunc) (FsMulticastTransmitter *self, UdpPort *udpport);
+
+struct ForeachUdpPortData {
+  FsMulticastTransmitter *self;
+  UdpPortFunc func;
+};
+
+static void
+_foreach_udpport_cb (gpointer key, gpointer value, gpointer user_data)
+{
+  struct ForeachUdpPortData *data = user_data;
+
+  data->func (data->self, value);
+}
+
+static void
+_foreach_udpport (FsMulticastTransmitter *self, UdpPortFunc func)
+{
+  struct ForeachUdpPortData data;
+  gint c;
+
+  /* The properties can be set before the transmitter is constructed */
+  if (!self->priv->udpports)
+    return;
+
+  data.self = self;
+  data.func = func;
+
+  g_mutex_lock (self->priv->mutex);
+  for (c = 1; c <= self->components; c++)
+    g_hash_table_foreach (self->priv->udpports[c], _foreach_udpport_cb,
+        &data);
+  g_mutex_unlock (self->priv->mutex);
+}
+
+typedef struct _UdpPortStatistics {
+  guint64 packets_sent;
+  guint64 send_syscalls;
+  guint64 packets_received;
+  guint64 packets_dropped;
+  guint n_udpports;
+  guint n_segmentation_offload;
+} UdpPortStatistics;
+
+static void
+_add_udpport_statistics (gpointer key, gpointer value, gpointer user_data)
+{
+  UdpPort *udpport = value;
+  UdpPortStatistics *stats = user_data;
+  guint64 packets, syscalls, dropped;
+  gboolean gso;
+
+  g_object_get (udpport->udpsink,
+      "packets", &packets,
+      "syscalls", &syscalls,
+      "segmentation-offload", &gso,
+      NULL);
+  stats->packets_sent += packets;
+  stats->send_syscalls += syscalls;
+  stats->n_udpports++;
+  if (gso)
+    stats->n_segmentation_offload++;
+
+  g_object_get (udpport->udpsrc,
+      "packets", &packets,
+      "dropped", &dropped,
+      NULL);
+  stats->packets_received += packets;
+  stats->packets_dropped += dropped;
+}
+
+static GstStructure *
+fs_multicast_transmitter_get_statistics (FsMulticastTransmitter *self)
+{
+  UdpPortStatistics stats = {0, 0, 0, 0, 0, 0};
+  gint c;
+
+  if (self->priv->udpports)
+  {
+    g_mutex_lock (self->priv->mutex);
+    for (c = 1; c <= self->components; c++)
+      g_hash_table_foreach (self->priv->udpports[c], _add_udpport_statistics,
+          &stats);
+    g_mutex_unlock (self->priv->mutex);
+  }
+
+  return gst_structure_new ("multicast-statistics",
+      "packets-sent", G_TYPE_UINT64, stats.packets_sent,
+      "send-syscalls", G_TYPE_UINT64, stats.send_syscalls,
+      "packets-per-send-syscall", G_TYPE_DOUBLE, stats.send_syscalls ?
+      (gdouble) stats.packets_sent / (gdouble) stats.send_syscalls : 0.0,
+      "segmentation-offload", G_TYPE_BOOLEAN, stats.n_udpports &&
+      stats.n_segmentation_offload == stats.n_udpports,
+      "packets-received", G_TYPE_UINT64, stats.packets_received,
+      "packets-dropped", G_TYPE_UINT64, stats.packets_dropped,
+      NULL);
+}
+
 static void
 fs_multicast_transmitter_set_property (GObject *object,
                                     guint prop_id,
@@ -450,6 +730,18 @@ fs_multicast_transmitter_set_property (GObject *object,
     case PROP_COMPONENTS:
       self->components = g_value_get_uint (value);
       break;
+    case PROP_MULTICAST_LOOP:
+      self->priv->multicast_loop = g_value_get_boolean (value);
+      _foreach_udpport (self, _set_multicast_loop);
+      break;
+    case PROP_DROP_OWN_PACKETS:
+      self->priv->drop_own_packets = g_value_get_boolean (value);
+      _foreach_udpport (self, _set_drop_own_packets);
+      break;
+    case PROP_BATCH_DEPTH:
+      self->priv->batch_depth = g_value_get_uint (value);
+      _foreach_udpport (self, _set_batch_depth);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -482,38 +774,64 @@ fs_multicast_transmitter_new_stream_transmitter (FsTransmitter *transmitter,
 
 
 /*
- * The UdpSock structure is a ref-counted pseudo-object use to represent
- * one local_ip:port:ttl:multicast_ip quatuor on which we listen and send,
- * so it includes a udpsrc and a multiudpsink. It represents one BSD socket.
- * If two UdpSock only differ by their TTL, only the first will have
+ * The UdpSock structure is a ref-counted pseudo-object used to represent
+ * one local_ip:multicast_ip:port triplet on which we listen and send, it
+ * is a group of the UdpPort of its port.
+ *
+ * The streams that receive from a UdpSock tell it which sources they want.
+ * As long as one of them wants any source, the socket is an any-source
+ * member of the group, otherwise it only joins the sources that are asked
+ * for. A socket can not be both at once for a group, so this is all done
+ * here.
  */
 
 struct _UdpSock {
+  /* Atomic, only dropped to 0 with the mutex of the transmitter held */
   gint refcount;
 
-  GstElement *udpsrc;
-  GstPad *udpsrc_requested_pad;
-
-  GstElement *udpsink;
-  GstPad *udpsink_requested_pad;
+  UdpPort *udpport;
 
   gchar *local_ip;
   gchar *multicast_ip;
+  /* multicast_ip in network order */
+  guint32 group;
   guint16 port;
-  guint8 ttl;
-
-  gint fd;
-
-  /* These are just convenience pointers to our parent transmitter */
-  GstElement *funnel;
-  GstElement *tee;
 
   guint component_id;
 
-  gboolean sendonly;
-  gint sendcount;
+  /* Protects sources and any_source_count */
+  GMutex *mutex;
+  /* gchar *source ip -> number of streams that want it */
+  GHashTable *sources;
+  /* Number of streams that want all the sources */
+  gint any_source_count;
 };
 
+static guint
+_udpsock_hash (gconstpointer key)
+{
+  const UdpSock *udpsock = key;
+
+  return (udpsock->local_ip ? g_str_hash (udpsock->local_ip) : 0) ^
+    udpsock->group ^ udpsock->port;
+}
+
+static gboolean
+_udpsock_equal (gconstpointer a, gconstpointer b)
+{
+  const UdpSock *udpsock_a = a;
+  const UdpSock *udpsock_b = b;
+
+  if (udpsock_a->port != udpsock_b->port ||
+      udpsock_a->group != udpsock_b->group)
+    return FALSE;
+
+  if (udpsock_a->local_ip == NULL || udpsock_b->local_ip == NULL)
+    return udpsock_a->local_ip == udpsock_b->local_ip;
+
+  return !strcmp (udpsock_a->local_ip, udpsock_b->local_ip);
+}
+
 static gboolean
 _ip_string_into_sockaddr_in (const gchar *ip_as_string,
     struct sockaddr_in *sockaddr_in, GError **error)
@@ -538,79 +856,38 @@ _ip_string_into_sockaddr_in (const gchar *ip_as_string,
   return TRUE;
 }
 
+/*
+ * The socket is bound to the wildcard address, as it receives for several
+ * groups, the FsMulticastSrc drops what was not sent to one of them
+ */
 static gint
 _bind_port (
-    const gchar *local_ip,
-    const gchar *multicast_ip,
     guint16 port,
-    guchar ttl,
+    gboolean multicast_loop,
     GError **error)
 {
   int sock = -1;
   struct sockaddr_in address;
   int retval;
-  guchar loop = 1;
+  guchar loop = multicast_loop;
   int reuseaddr = 1;
-#ifdef HAVE_IP_MREQN
-  struct ip_mreqn mreq;
-#else
-  struct ip_mreq mreq;
-#endif
 
+  memset (&address, 0, sizeof (address));
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
 
-  g_assert (multicast_ip);
-
-  if (!_ip_string_into_sockaddr_in (multicast_ip, &address, error))
-    goto error;
-  memcpy (&mreq.imr_multiaddr, &address.sin_addr,
-      sizeof (mreq.imr_multiaddr));
-
-  if (local_ip)
-  {
-    struct sockaddr_in tmpaddr;
-    if (!_ip_string_into_sockaddr_in (local_ip, &tmpaddr, error))
-      goto error;
-#ifdef HAVE_IP_MREQN
-    memcpy (&mreq.imr_address, &tmpaddr.sin_addr, sizeof (mreq.imr_address));
-#else
-    memcpy (&mreq.imr_interface, &tmpaddr.sin_addr, sizeof (mreq.imr_interface));
-#endif
-  }
-  else
-  {
-#ifdef HAVE_IP_MREQN
-    mreq.imr_address.s_addr = INADDR_ANY;
-#else
-    mreq.imr_interface.s_addr = INADDR_ANY;
-#endif
-  }
-
-#ifdef HAVE_IP_MREQN
-  mreq.imr_ifindex = 0;
-#endif
-
   if ((sock = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP)) <= 0) {
     g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
       "Error creating socket: %s", g_strerror (errno));
     goto error;
   }
 
-  if (setsockopt (sock, IPPROTO_IP, IP_MULTICAST_TTL, (const void *)&ttl,
-          sizeof (ttl)) < 0)
-  {
-    g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
-        "Error setting the multicast TTL: %s",
-        g_strerror (errno));
-    goto error;
-  }
-
   if (setsockopt (sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const void *)&loop,
           sizeof (loop)) < 0)
   {
     g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
-        "Error setting the multicast loop to FALSE: %s",
+        "Error setting the multicast loop to %s: %s",
+        multicast_loop ? "TRUE" : "FALSE",
         g_strerror (errno));
     goto error;
   }
@@ -635,15 +912,6 @@ _bind_port (
   }
 #endif
 
-  if (setsockopt (sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-          (const void *)&mreq, sizeof (mreq)) < 0)
-  {
-    g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
-        "Could not join the socket to the multicast group: %s",
-        g_strerror (errno));
-    goto error;
-  }
-
   address.sin_port = htons (port);
   retval = bind (sock, (struct sockaddr *) &address, sizeof (address));
   if (retval != 0)
@@ -661,8 +929,87 @@ _bind_port (
   return -1;
 }
 
+/*
+ * Joins or leaves the group of @udpsock for all the sources if @source_ip
+ * is NULL, or only for @source_ip
+ */
+static gboolean
+_set_membership (UdpSock *udpsock,
+    const gchar *source_ip,
+    gboolean join,
+    GError **error)
+{
+  struct sockaddr_in iface;
+  struct in_addr group;
+  int retval;
+
+  group.s_addr = udpsock->group;
+
+  iface.sin_addr.s_addr = INADDR_ANY;
+  if (udpsock->local_ip &&
+      !_ip_string_into_sockaddr_in (udpsock->local_ip, &iface, error))
+    return FALSE;
+
+  if (source_ip)
+  {
+#ifdef IP_ADD_SOURCE_MEMBERSHIP
+    struct sockaddr_in source;
+    struct ip_mreq_source mreq;
+
+    if (!_ip_string_into_sockaddr_in (source_ip, &source, error))
+      return FALSE;
+
+    /* The order of the fields is not the same everywhere */
+    memset (&mreq, 0, sizeof (mreq));
+    mreq.imr_multiaddr = group;
+    mreq.imr_interface = iface.sin_addr;
+    mreq.imr_sourceaddr = source.sin_addr;
+
+    retval = setsockopt (udpsock->udpport->fd, IPPROTO_IP,
+        join ? IP_ADD_SOURCE_MEMBERSHIP : IP_DROP_SOURCE_MEMBERSHIP,
+        (const void *)&mreq, sizeof (mreq));
+#else
+    g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+        "Source-specific multicast is not supported on this system");
+    return FALSE;
+#endif
+  }
+  else
+  {
+#ifdef HAVE_IP_MREQN
+    struct ip_mreqn mreq;
+#else
+    struct ip_mreq mreq;
+#endif
+
+    memcpy (&mreq.imr_multiaddr, &group, sizeof (mreq.imr_multiaddr));
+#ifdef HAVE_IP_MREQN
+    memcpy (&mreq.imr_address, &iface.sin_addr, sizeof (mreq.imr_address));
+    mreq.imr_ifindex = 0;
+#else
+    memcpy (&mreq.imr_interface, &iface.sin_addr,
+        sizeof (mreq.imr_interface));
+#endif
+
+    retval = setsockopt (udpsock->udpport->fd, IPPROTO_IP,
+        join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+        (const void *)&mreq, sizeof (mreq));
+  }
+
+  if (retval < 0)
+  {
+    g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+        "Could not %s the multicast group %s for %s: %s",
+        join ? "join" : "leave", udpsock->multicast_ip,
+        source_ip ? source_ip : "any source", g_strerror (errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 static GstElement *
-_create_sinksource (gchar *elementname, GstBin *bin,
+_create_sinksource (GType elementtype, GstBin *bin,
   GstElement *teefunnel, gint fd, GstPadDirection direction,
   GstPad **requested_pad, GError **error)
 {
@@ -670,24 +1017,15 @@ _create_sinksource (gchar *elementname, GstBin *bin,
   GstPadLinkReturn ret;
   GstPad *elempad = NULL;
   GstStateChangeReturn state_ret;
+  const gchar *elementname = g_type_name (elementtype);
 
   g_assert (direction == GST_PAD_SINK || direction == GST_PAD_SRC);
 
-  elem = gst_element_factory_make (elementname, NULL);
-  if (!elem) {
-    g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
-      "Could not create the %s element", elementname);
-    return NULL;
-  }
-
-  g_object_set (elem,
-    "closefd", FALSE,
+  /* Our elements are registered in the plugin module, not in a factory */
+  elem = g_object_new (elementtype,
     "sockfd", fd,
     NULL);
 
-  if (direction == GST_PAD_SINK)
-    g_object_set (elem, "auto-multicast", FALSE, NULL);
-
   if (!gst_bin_add (bin, elem)) {
     g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
       "Could not add the %s element to the gst %s bin", elementname,
@@ -752,19 +1090,155 @@ _create_sinksource (gchar *elementname, GstBin *bin,
   return NULL;
 }
 
+static void _udpport_destroy (FsMulticastTransmitter *trans,
+    UdpPort *udpport);
+
+/*
+ * Must be called with the mutex of the transmitter held
+ */
+static UdpPort *
+_get_udpport (FsMulticastTransmitter *trans,
+    guint component_id,
+    guint16 port,
+    GError **error)
+{
+  UdpPort *udpport;
+
+  udpport = g_hash_table_lookup (trans->priv->udpports[component_id],
+      GUINT_TO_POINTER (port));
+  if (udpport)
+  {
+    udpport->refcount++;
+    return udpport;
+  }
+
+  udpport = g_slice_new0 (UdpPort);
+
+  udpport->refcount = 1;
+  udpport->fd = -1;
+  udpport->component_id = component_id;
+  udpport->port = port;
+
+  udpport->fd = _bind_port (port, trans->priv->multicast_loop, error);
+  if (udpport->fd < 0)
+    goto error;
+
+  /* Now lets create the elements */
+
+  udpport->tee = trans->priv->udpsink_tees[component_id];
+  udpport->funnel = trans->priv->udpsrc_funnels[component_id];
+
+  udpport->udpsrc = _create_sinksource (FS_TYPE_MULTICAST_SRC,
+      GST_BIN (trans->priv->gst_src), udpport->funnel, udpport->fd,
+      GST_PAD_SRC, &udpport->udpsrc_requested_pad, error);
+  if (!udpport->udpsrc)
+    goto error;
+
+  _set_drop_own_packets (trans, udpport);
+
+  udpport->udpsink = _create_sinksource (FS_TYPE_MULTICAST_SINK,
+    GST_BIN (trans->priv->gst_sink), udpport->tee, udpport->fd, GST_PAD_SINK,
+    &udpport->udpsink_requested_pad, error);
+  if (!udpport->udpsink)
+    goto error;
+
+  _set_batch_depth (trans, udpport);
+
+  fs_multicast_src_set_sender (FS_MULTICAST_SRC (udpport->udpsrc),
+      udpport->udpsink);
+
+  g_hash_table_insert (trans->priv->udpports[component_id],
+      GUINT_TO_POINTER (port), udpport);
+
+  return udpport;
+
+ error:
+
+  _udpport_destroy (trans, udpport);
+
+  return NULL;
+}
+
+/*
+ * Must be called with the mutex of the transmitter held, returns %TRUE if
+ * that was the last reference, the caller must then call _udpport_destroy()
+ * once it has released the mutex
+ */
+static gboolean
+_put_udpport (FsMulticastTransmitter *trans,
+  UdpPort *udpport)
+{
+  if (udpport->refcount > 1) {
+    udpport->refcount--;
+    return FALSE;
+  }
+
+  g_hash_table_remove (trans->priv->udpports[udpport->component_id],
+      GUINT_TO_POINTER (udpport->port));
+
+  return TRUE;
+}
+
+static void
+_udpport_destroy (FsMulticastTransmitter *trans,
+    UdpPort *udpport)
+{
+  if (udpport->udpsrc)
+  {
+    GstStateChangeReturn ret;
+    gst_element_set_locked_state (udpport->udpsrc, TRUE);
+    ret = gst_element_set_state (udpport->udpsrc, GST_STATE_NULL);
+    if (ret != GST_STATE_CHANGE_SUCCESS)
+      GST_ERROR ("Error changing state of udpsrc: %s",
+          gst_element_state_change_return_get_name (ret));
+    if (!gst_bin_remove (GST_BIN (trans->priv->gst_src), udpport->udpsrc))
+      GST_ERROR ("Could not remove udpsrc element from transmitter source");
+  }
+
+  if (udpport->udpsrc_requested_pad)
+  {
+    gst_element_release_request_pad (udpport->funnel,
+      udpport->udpsrc_requested_pad);
+    gst_object_unref (udpport->udpsrc_requested_pad);
+  }
+
+  if (udpport->udpsink)
+  {
+    GstStateChangeReturn ret;
+    gst_element_set_locked_state (udpport->udpsink, TRUE);
+    ret = gst_element_set_state (udpport->udpsink, GST_STATE_NULL);
+    if (ret != GST_STATE_CHANGE_SUCCESS)
+      GST_ERROR ("Error changing state of udpsink: %s",
+          gst_element_state_change_return_get_name (ret));
+    if (!gst_bin_remove (GST_BIN (trans->priv->gst_sink), udpport->udpsink))
+      GST_ERROR ("Could not remove udpsink element from transmitter source");
+  }
+
+  if (udpport->udpsink_requested_pad)
+  {
+    gst_element_release_request_pad (udpport->tee,
+      udpport->udpsink_requested_pad);
+    gst_object_unref (udpport->udpsink_requested_pad);
+  }
+
+  if (udpport->fd >= 0)
+    close (udpport->fd);
+
+  g_slice_free (UdpPort, udpport);
+}
+
 UdpSock *
 fs_multicast_transmitter_get_udpsock (FsMulticastTransmitter *trans,
     guint component_id,
     const gchar *local_ip,
     const gchar *multicast_ip,
     guint16 port,
-    guint8 ttl,
-    gboolean recv,
     GError **error)
 {
   UdpSock *udpsock;
-  GList *udpsock_e;
-  gboolean sendonly = FALSE;
+  UdpSock key;
+  UdpPort *udpport;
+  struct sockaddr_in group;
 
   /* First lets check if we already have one */
   if (component_id > trans->components)
@@ -774,173 +1248,246 @@ fs_multicast_transmitter_get_udpsock (FsMulticastTransmitter *trans,
     return NULL;
   }
 
-  for (udpsock_e = g_list_first (trans->priv->udpsocks[component_id]);
-       udpsock_e;
-       udpsock_e = g_list_next (udpsock_e))
+  if (!_ip_string_into_sockaddr_in (multicast_ip, &group, error))
+    return NULL;
+
+  key.local_ip = (gchar *) local_ip;
+  key.group = group.sin_addr.s_addr;
+  key.port = port;
+
+  g_mutex_lock (trans->priv->mutex);
+
+  udpsock = g_hash_table_lookup (trans->priv->udpsocks[component_id], &key);
+  if (udpsock)
   {
-    udpsock = udpsock_e->data;
+    g_atomic_int_inc (&udpsock->refcount);
+    g_mutex_unlock (trans->priv->mutex);
+    return udpsock;
+  }
 
-    if (port == udpsock->port &&
-        !strcmp (multicast_ip, udpsock->multicast_ip) &&
-        ((local_ip == NULL && udpsock->local_ip == NULL) ||
-          !strcmp (local_ip, udpsock->local_ip)))
-    {
-      if (recv)
-      {
-        if (!udpsock->sendonly)
-        {
-          udpsock->refcount++;
-          return udpsock;
-        }
-      }
-      else /* recv */
-      {
-        if (ttl == udpsock->ttl)
-        {
-          udpsock->refcount++;
-          return udpsock;
-        }
-        sendonly = TRUE;
-      }
-    }
+  udpport = _get_udpport (trans, component_id, port, error);
+  if (!udpport)
+  {
+    g_mutex_unlock (trans->priv->mutex);
+    return NULL;
   }
 
   udpsock = g_slice_new0 (UdpSock);
 
   udpsock->refcount = 1;
+  udpsock->udpport = udpport;
   udpsock->local_ip = g_strdup (local_ip);
   udpsock->multicast_ip = g_strdup (multicast_ip);
-  udpsock->fd = -1;
+  udpsock->group = group.sin_addr.s_addr;
   udpsock->component_id = component_id;
   udpsock->port = port;
-  udpsock->ttl = ttl;
-  udpsock->sendonly = sendonly;
+  udpsock->mutex = g_mutex_new ();
+  udpsock->sources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      NULL);
 
-  /* Now lets bind both ports */
+  fs_multicast_src_add_group (FS_MULTICAST_SRC (udpport->udpsrc),
+      udpsock->group);
 
-  udpsock->fd = _bind_port (local_ip, multicast_ip, port, ttl, error);
-  if (udpsock->fd < 0)
-    goto error;
+  g_hash_table_insert (trans->priv->udpsocks[component_id], udpsock,
+      udpsock);
 
-  /* Now lets create the elements */
+  g_mutex_unlock (trans->priv->mutex);
 
-  udpsock->tee = trans->priv->udpsink_tees[component_id];
-  if (!udpsock->sendonly)
-    udpsock->funnel = trans->priv->udpsrc_funnels[component_id];
+  return udpsock;
+}
 
-  if (!udpsock->sendonly)
+void
+fs_multicast_transmitter_put_udpsock (FsMulticastTransmitter *trans,
+  UdpSock *udpsock)
+{
+  gboolean destroy_udpport;
+  gint refcount;
+
+  /* Dropping a reference that is not the last one does not need the lock,
+   * the last one is dropped with it held so that get_udpsock() can not
+   * find a UdpSock that is being destroyed */
+  for (;;)
   {
-    udpsock->udpsrc = _create_sinksource ("udpsrc",
-        GST_BIN (trans->priv->gst_src), udpsock->funnel, udpsock->fd,
-        GST_PAD_SRC, &udpsock->udpsrc_requested_pad, error);
-    if (!udpsock->udpsrc)
-      goto error;
-
-    g_object_set (udpsock->udpsrc,
-        "auto-multicast", FALSE,
-        NULL);
+    refcount = g_atomic_int_get (&udpsock->refcount);
+    if (refcount <= 1)
+      break;
+    if (g_atomic_int_compare_and_exchange (&udpsock->refcount, refcount,
+            refcount - 1))
+      return;
   }
 
-  udpsock->udpsink = _create_sinksource ("multiudpsink",
-    GST_BIN (trans->priv->gst_sink), udpsock->tee, udpsock->fd, GST_PAD_SINK,
-    &udpsock->udpsink_requested_pad, error);
-  if (!udpsock->udpsink)
-    goto error;
+  g_mutex_lock (trans->priv->mutex);
 
-  g_object_set (udpsock->udpsink,
-      "async", FALSE,
-      "sync", FALSE,
-      NULL);
+  if (!g_atomic_int_dec_and_test (&udpsock->refcount))
+  {
+    g_mutex_unlock (trans->priv->mutex);
+    return;
+  }
 
-  trans->priv->udpsocks[component_id] =
-    g_list_prepend (trans->priv->udpsocks[component_id], udpsock);
+  g_hash_table_remove (trans->priv->udpsocks[udpsock->component_id],
+      udpsock);
 
-  return udpsock;
+  fs_multicast_src_remove_group (FS_MULTICAST_SRC (udpsock->udpport->udpsrc),
+      udpsock->group);
+  destroy_udpport = _put_udpport (trans, udpsock->udpport);
 
- error:
+  g_mutex_unlock (trans->priv->mutex);
 
-  if (udpsock)
-    fs_multicast_transmitter_put_udpsock (trans, udpsock);
+  if (destroy_udpport)
+    _udpport_destroy (trans, udpsock->udpport);
 
-  return NULL;
+  g_hash_table_destroy (udpsock->sources);
+  g_mutex_free (udpsock->mutex);
+  g_free (udpsock->multicast_ip);
+  g_free (udpsock->local_ip);
+  g_slice_free (UdpSock, udpsock);
 }
 
-void
-fs_multicast_transmitter_put_udpsock (FsMulticastTransmitter *trans,
-  UdpSock *udpsock)
+static void
+_join_source (gpointer key, gpointer value, gpointer user_data)
 {
-  if (udpsock->refcount > 1) {
-    udpsock->refcount--;
-    return;
-  }
-
-  trans->priv->udpsocks[udpsock->component_id] =
-    g_list_remove (trans->priv->udpsocks[udpsock->component_id], udpsock);
+  GError *error = NULL;
 
-  if (udpsock->udpsrc)
+  if (!_set_membership (user_data, key, TRUE, &error))
   {
-    GstStateChangeReturn ret;
-    gst_element_set_locked_state (udpsock->udpsrc, TRUE);
-    ret = gst_element_set_state (udpsock->udpsrc, GST_STATE_NULL);
-    if (ret != GST_STATE_CHANGE_SUCCESS)
-      GST_ERROR ("Error changing state of udpsrc: %s",
-          gst_element_state_change_return_get_name (ret));
-    if (!gst_bin_remove (GST_BIN (trans->priv->gst_src), udpsock->udpsrc))
-      GST_ERROR ("Could not remove udpsrc element from transmitter source");
+    GST_WARNING ("%s", error->message);
+    g_clear_error (&error);
   }
+}
+
+static void
+_leave_source (gpointer key, gpointer value, gpointer user_data)
+{
+  GError *error = NULL;
 
-  if (udpsock->udpsrc_requested_pad)
+  if (!_set_membership (user_data, key, FALSE, &error))
   {
-    gst_element_release_request_pad (udpsock->funnel,
-      udpsock->udpsrc_requested_pad);
-    gst_object_unref (udpsock->udpsrc_requested_pad);
+    GST_WARNING ("%s", error->message);
+    g_clear_error (&error);
   }
+}
+
+/**
+ * fs_multicast_transmitter_udpsock_add_source:
+ * @udpsock: a #UdpSock that receives
+ * @source_ip: the only source to receive from, or NULL for any source
+ * @error: location of a #GError or NULL
+ *
+ * Asks @udpsock to receive from @source_ip, each call must be matched by a
+ * call to fs_multicast_transmitter_udpsock_remove_source().
+ *
+ * Returns: %TRUE if the group could be joined
+ */
 
-  if (udpsock->udpsink)
+gboolean
+fs_multicast_transmitter_udpsock_add_source (UdpSock *udpsock,
+    const gchar *source_ip,
+    GError **error)
+{
+  gboolean ret = TRUE;
+  guint count;
+
+  g_mutex_lock (udpsock->mutex);
+
+  if (!source_ip)
   {
-    GstStateChangeReturn ret;
-    gst_element_set_locked_state (udpsock->udpsink, TRUE);
-    ret = gst_element_set_state (udpsock->udpsink, GST_STATE_NULL);
-    if (ret != GST_STATE_CHANGE_SUCCESS)
-      GST_ERROR ("Error changing state of udpsink: %s",
-          gst_element_state_change_return_get_name (ret));
-    if (!gst_bin_remove (GST_BIN (trans->priv->gst_sink), udpsock->udpsink))
-      GST_ERROR ("Could not remove udpsink element from transmitter source");
+    if (udpsock->any_source_count == 0)
+    {
+      g_hash_table_foreach (udpsock->sources, _leave_source, udpsock);
+      if (!_set_membership (udpsock, NULL, TRUE, error))
+      {
+        g_hash_table_foreach (udpsock->sources, _join_source, udpsock);
+        ret = FALSE;
+        goto out;
+      }
+    }
+    udpsock->any_source_count++;
+    goto out;
   }
 
-  if (udpsock->udpsink_requested_pad)
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (udpsock->sources,
+          source_ip));
+
+  if (count == 0 && udpsock->any_source_count == 0 &&
+      !_set_membership (udpsock, source_ip, TRUE, error))
   {
-    gst_element_release_request_pad (udpsock->tee,
-      udpsock->udpsink_requested_pad);
-    gst_object_unref (udpsock->udpsink_requested_pad);
+    ret = FALSE;
+    goto out;
   }
 
-  if (udpsock->fd >= 0)
-    close (udpsock->fd);
+  g_hash_table_insert (udpsock->sources, g_strdup (source_ip),
+      GUINT_TO_POINTER (count + 1));
 
-  g_free (udpsock->multicast_ip);
-  g_free (udpsock->local_ip);
-  g_slice_free (UdpSock, udpsock);
+ out:
+  g_mutex_unlock (udpsock->mutex);
+
+  return ret;
 }
 
 void
-fs_multicast_transmitter_udpsock_inc_sending (UdpSock *udpsock)
+fs_multicast_transmitter_udpsock_remove_source (UdpSock *udpsock,
+    const gchar *source_ip)
 {
-  if (udpsock->sendcount == 0)
-    g_signal_emit_by_name (udpsock->udpsink, "add", udpsock->multicast_ip,
-        udpsock->port);
+  guint count;
+
+  g_mutex_lock (udpsock->mutex);
+
+  if (!source_ip)
+  {
+    if (udpsock->any_source_count <= 0)
+    {
+      g_warning ("Removing a source that was never added");
+      goto out;
+    }
+
+    udpsock->any_source_count--;
+    if (udpsock->any_source_count == 0)
+    {
+      _leave_source (NULL, NULL, udpsock);
+      g_hash_table_foreach (udpsock->sources, _join_source, udpsock);
+    }
+    goto out;
+  }
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (udpsock->sources,
+          source_ip));
+  if (count == 0)
+  {
+    g_warning ("Removing source %s that was never added", source_ip);
+    goto out;
+  }
+
+  if (count > 1)
+  {
+    g_hash_table_insert (udpsock->sources, g_strdup (source_ip),
+        GUINT_TO_POINTER (count - 1));
+    goto out;
+  }
+
+  if (udpsock->any_source_count == 0)
+    _leave_source ((gpointer) source_ip, NULL, udpsock);
+  g_hash_table_remove (udpsock->sources, source_ip);
 
-  udpsock->sendcount++;
+ out:
+  g_mutex_unlock (udpsock->mutex);
 }
 
+/*
+ * Every stream that sends to the group of @udpsock with the same TTL shares
+ * the same destination of the sink, so only one copy of each packet is sent
+ */
 void
-fs_multicast_transmitter_udpsock_dec_sending (UdpSock *udpsock)
+fs_multicast_transmitter_udpsock_inc_sending (UdpSock *udpsock, guint8 ttl)
 {
-  udpsock->sendcount--;
+  fs_multicast_sink_add (FS_MULTICAST_SINK (udpsock->udpport->udpsink),
+      udpsock->group, udpsock->port, ttl);
+}
 
-  if (udpsock->sendcount == 0)
-    g_signal_emit_by_name (udpsock->udpsink, "remove", udpsock->multicast_ip,
-        udpsock->port);
+void
+fs_multicast_transmitter_udpsock_dec_sending (UdpSock *udpsock, guint8 ttl)
+{
+  fs_multicast_sink_remove (FS_MULTICAST_SINK (udpsock->udpport->udpsink),
+      udpsock->group, udpsock->port, ttl);
 }
 
 static GType
@@ -91,15 +91,21 @@ UdpSock *fs_multicast_transmitter_get_udpsock (FsMulticastTransmitter *trans,
     const gchar *local_ip,
     const gchar *multicast_ip,
     guint16 port,
-    guint8 ttl,
-    gboolean recv,
     GError **error);
 
 void fs_multicast_transmitter_put_udpsock (FsMulticastTransmitter *trans,
     UdpSock *udpsock);
 
-void fs_multicast_transmitter_udpsock_inc_sending (UdpSock *udpsock);
-void fs_multicast_transmitter_udpsock_dec_sending (UdpSock *udpsock);
+gboolean fs_multicast_transmitter_udpsock_add_source (UdpSock *udpsock,
+    const gchar *source_ip,
+    GError **error);
+void fs_multicast_transmitter_udpsock_remove_source (UdpSock *udpsock,
+    const gchar *source_ip);
+
+void fs_multicast_transmitter_udpsock_inc_sending (UdpSock *udpsock,
+    guint8 ttl);
+void fs_multicast_transmitter_udpsock_dec_sending (UdpSock *udpsock,
+    guint8 ttl);
 
 
 G_END_DECLS
@@ -0,0 +1,202 @@
+/*
+ * Farsight2 - Farsight RAW UDP socket addresses
+ *
+ * fs-rawudp-address.c - IPv4 and IPv6 socket address helpers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs-rawudp-address.h"
+
+#include <string.h>
+
+#ifdef G_OS_WIN32
+# include <ws2tcpip.h>
+#else /*G_OS_WIN32*/
+# include <arpa/inet.h>
+#endif /*G_OS_WIN32*/
+
+socklen_t
+fs_rawudp_address_get_length (const FsRawUdpAddress *addr)
+{
+  if (addr->sa.sa_family == AF_INET6)
+    return sizeof (struct sockaddr_in6);
+  else
+    return sizeof (struct sockaddr_in);
+}
+
+/**
+ * fs_rawudp_address_set:
+ * @addr: the #FsRawUdpAddress to fill
+ * @ip: a numeric IPv4 or IPv6 address
+ * @port: the port in host order
+ *
+ * Does not do any name resolution.
+ *
+ * Returns: %FALSE if @ip is not a valid address
+ */
+
+gboolean
+fs_rawudp_address_set (FsRawUdpAddress *addr,
+    const gchar *ip,
+    guint16 port)
+{
+  memset (addr, 0, sizeof (FsRawUdpAddress));
+
+  if (inet_pton (AF_INET, ip, &addr->sin.sin_addr) > 0)
+  {
+    addr->sin.sin_family = AF_INET;
+    addr->sin.sin_port = htons (port);
+  }
+  else if (inet_pton (AF_INET6, ip, &addr->sin6.sin6_addr) > 0)
+  {
+    addr->sin6.sin6_family = AF_INET6;
+    addr->sin6.sin6_port = htons (port);
+    fs_rawudp_address_unmap (addr);
+  }
+  else
+  {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+guint16
+fs_rawudp_address_get_port (const FsRawUdpAddress *addr)
+{
+  if (addr->sa.sa_family == AF_INET6)
+    return ntohs (addr->sin6.sin6_port);
+  else
+    return ntohs (addr->sin.sin_port);
+}
+
+void
+fs_rawudp_address_set_port (FsRawUdpAddress *addr,
+    guint16 port)
+{
+  if (addr->sa.sa_family == AF_INET6)
+    addr->sin6.sin6_port = htons (port);
+  else
+    addr->sin.sin_port = htons (port);
+}
+
+/*
+ * Returns the ip without the port, to be freed with g_free()
+ */
+gchar *
+fs_rawudp_address_to_string (const FsRawUdpAddress *addr)
+{
+  gchar buf[INET6_ADDRSTRLEN];
+
+  if (addr->sa.sa_family == AF_INET6)
+  {
+    if (!inet_ntop (AF_INET6, &addr->sin6.sin6_addr, buf, sizeof (buf)))
+      return NULL;
+  }
+  else
+  {
+    if (!inet_ntop (AF_INET, &addr->sin.sin_addr, buf, sizeof (buf)))
+      return NULL;
+  }
+
+  return g_strdup (buf);
+}
+
+/*
+ * Turns an IPv4-mapped IPv6 address, as received on a dual-stack socket,
+ * back into a plain AF_INET address
+ */
+void
+fs_rawudp_address_unmap (FsRawUdpAddress *addr)
+{
+  struct sockaddr_in sin;
+
+  if (addr->sa.sa_family != AF_INET6 ||
+      !IN6_IS_ADDR_V4MAPPED (&addr->sin6.sin6_addr))
+    return;
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = addr->sin6.sin6_port;
+  memcpy (&sin.sin_addr, &addr->sin6.sin6_addr.s6_addr[12], 4);
+
+  memset (addr, 0, sizeof (FsRawUdpAddress));
+  addr->sin = sin;
+}
+
+/*
+ * Copies @addr into @mapped in a form that can be passed to a socket of
+ * @family, so an IPv4 address becomes IPv4-mapped for an AF_INET6 socket
+ */
+void
+fs_rawudp_address_map (const FsRawUdpAddress *addr,
+    gint family,
+    FsRawUdpAddress *mapped)
+{
+  if (family != AF_INET6 || addr->sa.sa_family != AF_INET)
+  {
+    *mapped = *addr;
+    return;
+  }
+
+  memset (mapped, 0, sizeof (FsRawUdpAddress));
+  mapped->sin6.sin6_family = AF_INET6;
+  mapped->sin6.sin6_port = addr->sin.sin_port;
+  mapped->sin6.sin6_addr.s6_addr[10] = 0xff;
+  mapped->sin6.sin6_addr.s6_addr[11] = 0xff;
+  memcpy (&mapped->sin6.sin6_addr.s6_addr[12], &addr->sin.sin_addr, 4);
+}
+
+guint
+fs_rawudp_address_hash (gconstpointer key)
+{
+  const FsRawUdpAddress *addr = key;
+
+  if (addr->sa.sa_family == AF_INET6)
+  {
+    guint32 words[4];
+
+    memcpy (words, &addr->sin6.sin6_addr, sizeof (words));
+    return words[0] ^ words[1] ^ words[2] ^ words[3] ^
+      (addr->sin6.sin6_port << 16);
+  }
+  else
+  {
+    return addr->sin.sin_addr.s_addr ^ (addr->sin.sin_port << 16);
+  }
+}
+
+gboolean
+fs_rawudp_address_equal (gconstpointer a, gconstpointer b)
+{
+  const FsRawUdpAddress *addr_a = a;
+  const FsRawUdpAddress *addr_b = b;
+
+  if (addr_a->sa.sa_family != addr_b->sa.sa_family)
+    return FALSE;
+
+  if (addr_a->sa.sa_family == AF_INET6)
+    return addr_a->sin6.sin6_port == addr_b->sin6.sin6_port &&
+      !memcmp (&addr_a->sin6.sin6_addr, &addr_b->sin6.sin6_addr,
+          sizeof (struct in6_addr));
+  else
+    return addr_a->sin.sin_addr.s_addr == addr_b->sin.sin_addr.s_addr &&
+      addr_a->sin.sin_port == addr_b->sin.sin_port;
+}
@@ -0,0 +1,74 @@
+/*
+ * Farsight2 - Farsight RAW UDP socket addresses
+ *
+ * fs-rawudp-address.h - IPv4 and IPv6 socket address helpers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_RAWUDP_ADDRESS_H__
+#define __FS_RAWUDP_ADDRESS_H__
+
+#include <glib.h>
+
+#include <sys/types.h>
+
+#ifdef G_OS_WIN32
+# include <winsock2.h>
+# include <ws2tcpip.h>
+#else /*G_OS_WIN32*/
+# include <sys/socket.h>
+# include <netinet/in.h>
+#endif /*G_OS_WIN32*/
+
+G_BEGIN_DECLS
+
+/*
+ * Big enough for any address the transmitter uses. Inside the transmitter
+ * IPv4 addresses are always stored as AF_INET, the IPv4-mapped IPv6 form is
+ * only used on the wire of dual-stack sockets.
+ */
+typedef union _FsRawUdpAddress {
+  struct sockaddr sa;
+  struct sockaddr_in sin;
+  struct sockaddr_in6 sin6;
+} FsRawUdpAddress;
+
+socklen_t fs_rawudp_address_get_length (const FsRawUdpAddress *addr);
+
+gboolean fs_rawudp_address_set (FsRawUdpAddress *addr,
+    const gchar *ip,
+    guint16 port);
+
+guint16 fs_rawudp_address_get_port (const FsRawUdpAddress *addr);
+
+void fs_rawudp_address_set_port (FsRawUdpAddress *addr,
+    guint16 port);
+
+gchar *fs_rawudp_address_to_string (const FsRawUdpAddress *addr);
+
+void fs_rawudp_address_unmap (FsRawUdpAddress *addr);
+
+void fs_rawudp_address_map (const FsRawUdpAddress *addr,
+    gint family,
+    FsRawUdpAddress *mapped);
+
+guint fs_rawudp_address_hash (gconstpointer key);
+
+gboolean fs_rawudp_address_equal (gconstpointer a, gconstpointer b);
+
+G_END_DECLS
+
+#endif /* __FS_RAWUDP_ADDRESS_H__ */
@@ -0,0 +1,629 @@
+/*
+ * Farsight2 - Farsight RAW UDP batched sink
+ *
+ * fs-rawudp-batch-sink.c - Sink sending several UDP packets per syscall
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:fs-rawudp-batch-sink
+ * @short_description: Sends UDP packets to many destinations in batches
+ *
+ * This sink replaces multiudpsink in the raw UDP transmitter. It sends every
+ * buffer to each of its destinations through an already bound socket that it
+ * does not own. Where sendmmsg() is available, the copies for up to
+ * #FsRawUdpBatchSink:batch-depth destinations go out with a single system
+ * call instead of one sendto() each.
+ *
+ * Destinations are added and removed with fs_rawudp_batch_sink_add() and
+ * fs_rawudp_batch_sink_remove(), they are refcounted the same way as the
+ * "add" and "remove" signals of multiudpsink. Both are direct calls that
+ * find the destination through a hash table, so their cost does not grow
+ * with the number of destinations.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "fs-rawudp-batch-sink.h"
+#include "fs-rawudp-address.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+#ifdef G_OS_WIN32
+# include <winsock2.h>
+# include <ws2tcpip.h>
+#else /*G_OS_WIN32*/
+# include <netdb.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif /*G_OS_WIN32*/
+
+GST_DEBUG_CATEGORY_EXTERN (fs_rawudp_transmitter_debug);
+#define GST_CAT_DEFAULT fs_rawudp_transmitter_debug
+
+#define DEFAULT_SOCKFD -1
+#define DEFAULT_BATCH_DEPTH 8
+#define MAX_BATCH_DEPTH 64
+
+/* props */
+enum
+{
+  PROP_0,
+  PROP_SOCKFD,
+  PROP_BATCH_DEPTH,
+  PROP_PACKETS,
+  PROP_SYSCALLS,
+  PROP_PACKETS_PER_SYSCALL
+};
+
+typedef struct _BatchClient {
+  FsRawUdpAddress addr;
+  /* addr in the form expected by the socket */
+  FsRawUdpAddress sendaddr;
+  gint refcount;
+  /* Packets the socket accepted for this destination */
+  guint sent;
+} BatchClient;
+
+static GstStaticPadTemplate fs_rawudp_batch_sink_template =
+  GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static GstBaseSinkClass *parent_class = NULL;
+
+static void fs_rawudp_batch_sink_base_init (gpointer g_class);
+static void fs_rawudp_batch_sink_class_init (FsRawUdpBatchSinkClass *klass);
+static void fs_rawudp_batch_sink_init (FsRawUdpBatchSink *self);
+static void fs_rawudp_batch_sink_finalize (GObject *object);
+
+static void fs_rawudp_batch_sink_set_property (GObject *object,
+    guint prop_id, const GValue *value, GParamSpec *pspec);
+static void fs_rawudp_batch_sink_get_property (GObject *object,
+    guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean fs_rawudp_batch_sink_start (GstBaseSink *bsink);
+static GstFlowReturn fs_rawudp_batch_sink_render (GstBaseSink *bsink,
+    GstBuffer *buffer);
+
+
+static GType type = 0;
+
+GType
+fs_rawudp_batch_sink_get_type (void)
+{
+  g_assert (type);
+  return type;
+}
+
+GType
+fs_rawudp_batch_sink_register_type (FsPlugin *module)
+{
+  static const GTypeInfo info = {
+    sizeof (FsRawUdpBatchSinkClass),
+    (GBaseInitFunc) fs_rawudp_batch_sink_base_init,
+    NULL,
+    (GClassInitFunc) fs_rawudp_batch_sink_class_init,
+    NULL,
+    NULL,
+    sizeof (FsRawUdpBatchSink),
+    0,
+    (GInstanceInitFunc) fs_rawudp_batch_sink_init
+  };
+
+  type = g_type_module_register_type (G_TYPE_MODULE (module),
+      GST_TYPE_BASE_SINK, "FsRawUdpBatchSink", &info, 0);
+
+  return type;
+}
+
+static void
+fs_rawudp_batch_sink_base_init (gpointer g_class)
+{
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "Farsight raw UDP batched sink",
+      "Sink/Network",
+      "Sends UDP packets to many destinations, several per system call",
+      "Farsight developers");
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&fs_rawudp_batch_sink_template));
+}
+
+static void
+fs_rawudp_batch_sink_class_init (FsRawUdpBatchSinkClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstBaseSinkClass *gstbasesink_class = GST_BASE_SINK_CLASS (klass);
+
+  parent_class = g_type_class_peek_parent (klass);
+
+  gobject_class->set_property = fs_rawudp_batch_sink_set_property;
+  gobject_class->get_property = fs_rawudp_batch_sink_get_property;
+  gobject_class->finalize = fs_rawudp_batch_sink_finalize;
+
+  gstbasesink_class->start = GST_DEBUG_FUNCPTR (fs_rawudp_batch_sink_start);
+  gstbasesink_class->render = GST_DEBUG_FUNCPTR (fs_rawudp_batch_sink_render);
+
+  g_object_class_install_property (gobject_class,
+      PROP_SOCKFD,
+      g_param_spec_int ("sockfd",
+          "Socket",
+          "The bound socket to send from, it is not closed by the element",
+          -1, G_MAXINT, DEFAULT_SOCKFD,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_BATCH_DEPTH,
+      g_param_spec_uint ("batch-depth",
+          "Batch depth",
+          "Maximum number of packets sent with one system call,"
+          " takes effect the next time the element is started",
+          1, MAX_BATCH_DEPTH, DEFAULT_BATCH_DEPTH,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PACKETS,
+      g_param_spec_uint64 ("packets",
+          "Packets",
+          "Number of packets sent since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_SYSCALLS,
+      g_param_spec_uint64 ("syscalls",
+          "System calls",
+          "Number of send system calls made since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PACKETS_PER_SYSCALL,
+      g_param_spec_double ("packets-per-syscall",
+          "Packets per system call",
+          "Average number of packets sent by each send system call",
+          0, G_MAXDOUBLE, 0,
+          G_PARAM_READABLE));
+}
+
+static void
+fs_rawudp_batch_sink_init (FsRawUdpBatchSink *self)
+{
+  self->sockfd = DEFAULT_SOCKFD;
+  self->batch_depth = DEFAULT_BATCH_DEPTH;
+
+  self->sockfamily = AF_INET;
+
+  self->client_links = g_hash_table_new (fs_rawudp_address_hash,
+      fs_rawudp_address_equal);
+
+  gst_base_sink_set_sync (GST_BASE_SINK (self), FALSE);
+  g_object_set (self, "async", FALSE, NULL);
+}
+
+static void
+fs_rawudp_batch_sink_finalize (GObject *object)
+{
+  FsRawUdpBatchSink *self = FS_RAWUDP_BATCH_SINK (object);
+  GList *item;
+
+  for (item = self->clients; item; item = g_list_next (item))
+    g_slice_free (BatchClient, item->data);
+  g_list_free (self->clients);
+  g_hash_table_destroy (self->client_links);
+
+  g_free (self->msgs);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+fs_rawudp_batch_sink_set_property (GObject *object,
+    guint prop_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  FsRawUdpBatchSink *self = FS_RAWUDP_BATCH_SINK (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+  {
+    case PROP_SOCKFD:
+      {
+        FsRawUdpAddress local;
+        socklen_t len = sizeof (local);
+        GList *item;
+
+        self->sockfd = g_value_get_int (value);
+
+        /* IPv4 destinations have to be mapped on an IPv6 socket */
+        if (self->sockfd >= 0 &&
+            getsockname (self->sockfd, &local.sa, &len) == 0)
+          self->sockfamily = local.sa.sa_family;
+        else
+          self->sockfamily = AF_INET;
+
+        for (item = self->clients; item; item = g_list_next (item))
+        {
+          BatchClient *client = item->data;
+
+          fs_rawudp_address_map (&client->addr, self->sockfamily,
+              &client->sendaddr);
+        }
+      }
+      break;
+    case PROP_BATCH_DEPTH:
+      self->batch_depth = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static void
+fs_rawudp_batch_sink_get_property (GObject *object,
+    guint prop_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  FsRawUdpBatchSink *self = FS_RAWUDP_BATCH_SINK (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+  {
+    case PROP_SOCKFD:
+      g_value_set_int (value, self->sockfd);
+      break;
+    case PROP_BATCH_DEPTH:
+      g_value_set_uint (value, self->batch_depth);
+      break;
+    case PROP_PACKETS:
+      g_value_set_uint64 (value, self->packets);
+      break;
+    case PROP_SYSCALLS:
+      g_value_set_uint64 (value, self->syscalls);
+      break;
+    case PROP_PACKETS_PER_SYSCALL:
+      if (self->syscalls)
+        g_value_set_double (value,
+            (gdouble) self->packets / (gdouble) self->syscalls);
+      else
+        g_value_set_double (value, 0);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static gboolean
+fs_rawudp_batch_sink_start (GstBaseSink *bsink)
+{
+  FsRawUdpBatchSink *self = FS_RAWUDP_BATCH_SINK (bsink);
+  guint depth;
+
+  if (self->sockfd < 0)
+  {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, (NULL),
+        ("No socket was set on the \"sockfd\" property"));
+    return FALSE;
+  }
+
+  GST_OBJECT_LOCK (self);
+  depth = self->batch_depth;
+  self->packets = 0;
+  self->syscalls = 0;
+
+#ifdef HAVE_SENDMMSG
+  if (depth != self->allocated_depth)
+  {
+    g_free (self->msgs);
+    self->msgs = g_new0 (struct mmsghdr, depth);
+    self->allocated_depth = depth;
+  }
+#else
+  depth = 1;
+  self->allocated_depth = 1;
+#endif
+  GST_OBJECT_UNLOCK (self);
+
+  GST_DEBUG_OBJECT (self, "Sending up to %u packets per system call", depth);
+
+  return TRUE;
+}
+
+#ifdef HAVE_SENDMMSG
+
+/*
+ * Sends the same data to @n_clients destinations with as few sendmmsg()
+ * calls as possible, must be called with the object lock held
+ */
+static void
+fs_rawudp_batch_sink_send_batch (FsRawUdpBatchSink *self,
+    struct iovec *iov,
+    BatchClient **clients,
+    guint n_clients)
+{
+  struct mmsghdr *msgs = self->msgs;
+  guint i;
+  gint ret;
+
+  for (i = 0; i < n_clients; i++)
+  {
+    memset (&msgs[i], 0, sizeof (struct mmsghdr));
+    msgs[i].msg_hdr.msg_name = &clients[i]->sendaddr;
+    msgs[i].msg_hdr.msg_namelen =
+      fs_rawudp_address_get_length (&clients[i]->sendaddr);
+    msgs[i].msg_hdr.msg_iov = iov;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  i = 0;
+  while (i < n_clients)
+  {
+    ret = sendmmsg (self->sockfd, msgs + i, n_clients - i, 0);
+    self->syscalls++;
+
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      /* The first message failed, skip it, like multiudpsink would */
+      GST_DEBUG_OBJECT (self, "Could not send packet: %s",
+          g_strerror (errno));
+      i++;
+    }
+    else
+    {
+      self->packets += ret;
+      for (; ret > 0; ret--, i++)
+        clients[i]->sent++;
+    }
+  }
+}
+
+#endif
+
+static GstFlowReturn
+fs_rawudp_batch_sink_render (GstBaseSink *bsink, GstBuffer *buffer)
+{
+  FsRawUdpBatchSink *self = FS_RAWUDP_BATCH_SINK (bsink);
+  GList *item;
+
+  GST_OBJECT_LOCK (self);
+
+#ifdef HAVE_SENDMMSG
+  {
+    BatchClient *batch[MAX_BATCH_DEPTH];
+    struct iovec iov;
+    guint n = 0;
+
+    iov.iov_base = GST_BUFFER_DATA (buffer);
+    iov.iov_len = GST_BUFFER_SIZE (buffer);
+
+    for (item = self->clients; item; item = g_list_next (item))
+    {
+      batch[n++] = item->data;
+      if (n == self->allocated_depth)
+      {
+        fs_rawudp_batch_sink_send_batch (self, &iov, batch, n);
+        n = 0;
+      }
+    }
+    if (n)
+      fs_rawudp_batch_sink_send_batch (self, &iov, batch, n);
+  }
+#else
+  for (item = self->clients; item; item = g_list_next (item))
+  {
+    BatchClient *client = item->data;
+    gssize ret;
+
+    do {
+      ret = sendto (self->sockfd, (const gchar *) GST_BUFFER_DATA (buffer),
+          GST_BUFFER_SIZE (buffer), 0,
+          &client->sendaddr.sa,
+          fs_rawudp_address_get_length (&client->sendaddr));
+      self->syscalls++;
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+    {
+      GST_DEBUG_OBJECT (self, "Could not send packet: %s",
+          g_strerror (errno));
+    }
+    else
+    {
+      self->packets++;
+      client->sent++;
+    }
+  }
+#endif
+
+  GST_OBJECT_UNLOCK (self);
+
+  return GST_FLOW_OK;
+}
+
+static gboolean
+_resolve (FsRawUdpBatchSink *self,
+    const gchar *ip,
+    gint port,
+    FsRawUdpAddress *addr)
+{
+  struct addrinfo hints;
+  struct addrinfo *result = NULL;
+  int retval;
+
+  /* Candidates nearly always carry numeric addresses */
+  if (fs_rawudp_address_set (addr, ip, port))
+    return TRUE;
+
+  memset (&hints, 0, sizeof (struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  /* Only return IPv6 addresses if the host has some */
+  hints.ai_flags = AI_ADDRCONFIG;
+  retval = getaddrinfo (ip, NULL, &hints, &result);
+  if (retval != 0)
+  {
+    GST_WARNING_OBJECT (self, "Could not resolve %s: %s", ip,
+        gai_strerror (retval));
+    return FALSE;
+  }
+
+  memset (addr, 0, sizeof (FsRawUdpAddress));
+  memcpy (addr, result->ai_addr,
+      MIN (result->ai_addrlen, sizeof (FsRawUdpAddress)));
+  fs_rawudp_address_set_port (addr, port);
+  fs_rawudp_address_unmap (addr);
+  freeaddrinfo (result);
+
+  return TRUE;
+}
+
+/**
+ * fs_rawudp_batch_sink_add:
+ * @self: a #FsRawUdpBatchSink
+ * @ip: the destination IP or host name
+ * @port: the destination port
+ *
+ * Adds a destination to which every buffer will be sent, adding the same
+ * destination again only increases its refcount.
+ *
+ * Returns: %TRUE if @ip could be resolved
+ */
+
+gboolean
+fs_rawudp_batch_sink_add (FsRawUdpBatchSink *self,
+    const gchar *ip,
+    gint port)
+{
+  FsRawUdpAddress addr;
+  GList *item;
+
+  if (!_resolve (self, ip, port, &addr))
+    return FALSE;
+
+  GST_OBJECT_LOCK (self);
+  item = g_hash_table_lookup (self->client_links, &addr);
+  if (item)
+  {
+    ((BatchClient *) item->data)->refcount++;
+  }
+  else
+  {
+    BatchClient *client = g_slice_new (BatchClient);
+
+    client->addr = addr;
+    fs_rawudp_address_map (&addr, self->sockfamily, &client->sendaddr);
+    client->refcount = 1;
+    client->sent = 0;
+    /* The order of the destinations does not matter */
+    self->clients = g_list_prepend (self->clients, client);
+    g_hash_table_insert (self->client_links, &client->addr, self->clients);
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  return TRUE;
+}
+
+/**
+ * fs_rawudp_batch_sink_remove:
+ * @self: a #FsRawUdpBatchSink
+ * @ip: the destination IP or host name
+ * @port: the destination port
+ *
+ * Drops a reference to a destination added with fs_rawudp_batch_sink_add(),
+ * nothing more is sent to it once the last reference is gone.
+ */
+
+void
+fs_rawudp_batch_sink_remove (FsRawUdpBatchSink *self,
+    const gchar *ip,
+    gint port)
+{
+  FsRawUdpAddress addr;
+  GList *item;
+
+  if (!_resolve (self, ip, port, &addr))
+    return;
+
+  GST_OBJECT_LOCK (self);
+  item = g_hash_table_lookup (self->client_links, &addr);
+  if (item)
+  {
+    BatchClient *client = item->data;
+
+    if (--client->refcount == 0)
+    {
+      g_hash_table_remove (self->client_links, &client->addr);
+      self->clients = g_list_delete_link (self->clients, item);
+      g_slice_free (BatchClient, client);
+    }
+  }
+  else
+  {
+    GST_WARNING_OBJECT (self, "Tried to remove unknown destination %s:%d",
+        ip, port);
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+/**
+ * fs_rawudp_batch_sink_get_sent:
+ * @self: a #FsRawUdpBatchSink
+ * @addr: the destination
+ *
+ * Returns the number of packets that were actually sent to @addr, it does
+ * not change while the destination is not sending, or is not in the sink at
+ * all, whatever is sent to the other destinations.
+ *
+ * Returns: the packet counter of @addr, 0 if it is not a destination
+ */
+
+guint
+fs_rawudp_batch_sink_get_sent (FsRawUdpBatchSink *self,
+    const FsRawUdpAddress *addr)
+{
+  GList *item;
+  guint sent = 0;
+
+  GST_OBJECT_LOCK (self);
+  item = g_hash_table_lookup (self->client_links, addr);
+  if (item)
+    sent = ((BatchClient *) item->data)->sent;
+  GST_OBJECT_UNLOCK (self);
+
+  return sent;
+}
@@ -0,0 +1,98 @@
+/*
+ * Farsight2 - Farsight RAW UDP batched sink
+ *
+ * fs-rawudp-batch-sink.h - Sink sending several UDP packets per syscall
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_RAWUDP_BATCH_SINK_H__
+#define __FS_RAWUDP_BATCH_SINK_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+
+#include <gst/farsight/fs-plugin.h>
+
+#include "fs-rawudp-address.h"
+
+G_BEGIN_DECLS
+
+#define FS_TYPE_RAWUDP_BATCH_SINK \
+  (fs_rawudp_batch_sink_get_type ())
+#define FS_RAWUDP_BATCH_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),FS_TYPE_RAWUDP_BATCH_SINK, \
+      FsRawUdpBatchSink))
+#define FS_RAWUDP_BATCH_SINK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),FS_TYPE_RAWUDP_BATCH_SINK, \
+      FsRawUdpBatchSinkClass))
+#define FS_IS_RAWUDP_BATCH_SINK(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),FS_TYPE_RAWUDP_BATCH_SINK))
+#define FS_IS_RAWUDP_BATCH_SINK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),FS_TYPE_RAWUDP_BATCH_SINK))
+
+typedef struct _FsRawUdpBatchSink          FsRawUdpBatchSink;
+typedef struct _FsRawUdpBatchSinkClass     FsRawUdpBatchSinkClass;
+
+/**
+ * FsRawUdpBatchSink:
+ *
+ * Opaque #FsRawUdpBatchSink data structure.
+ */
+struct _FsRawUdpBatchSink {
+  GstBaseSink     parent;
+
+  /*< private >*/
+  gint sockfd;
+  /* Address family of sockfd */
+  gint sockfamily;
+  guint batch_depth;
+
+  /* Protected by the object lock */
+  GList *clients;
+  /* FsRawUdpAddress * -> link of the client in the clients list */
+  GHashTable *client_links;
+
+  /* Array of struct mmsghdr, one per destination sent in a single call */
+  gpointer msgs;
+  guint allocated_depth;
+
+  /* Protected by the object lock */
+  guint64 packets;
+  guint64 syscalls;
+};
+
+struct _FsRawUdpBatchSinkClass {
+  GstBaseSinkClass parent_class;
+};
+
+GType   fs_rawudp_batch_sink_register_type (FsPlugin *module);
+
+GType   fs_rawudp_batch_sink_get_type      (void);
+
+gboolean fs_rawudp_batch_sink_add          (FsRawUdpBatchSink *self,
+                                            const gchar *ip,
+                                            gint port);
+
+void     fs_rawudp_batch_sink_remove       (FsRawUdpBatchSink *self,
+                                            const gchar *ip,
+                                            gint port);
+
+guint    fs_rawudp_batch_sink_get_sent     (FsRawUdpBatchSink *self,
+                                            const FsRawUdpAddress *addr);
+
+G_END_DECLS
+
+#endif /* __FS_RAWUDP_BATCH_SINK_H__ */
@@ -0,0 +1,595 @@
+/*
+ * Farsight2 - Farsight RAW UDP batched source
+ *
+ * fs-rawudp-batch-src.c - Source receiving several UDP packets per syscall
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:fs-rawudp-batch-src
+ * @short_description: Reads UDP packets from a socket in batches
+ *
+ * This source replaces udpsrc in the raw UDP transmitter. It reads from an
+ * already bound socket that it does not own and, where recvmmsg() is
+ * available, drains up to #FsRawUdpBatchSrc:batch-depth datagrams with a
+ * single system call. The packets of a batch are then pushed one buffer at a
+ * time, without going back to the kernel until the batch is exhausted.
+ *
+ * The #FsRawUdpBatchSrc:packets-per-syscall property tells how well the
+ * batching is working.
+ *
+ * The owner of the element can look at every packet and its source address
+ * before it is pushed, see fs_rawudp_batch_src_set_recv_func().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "fs-rawudp-batch-src.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#ifdef G_OS_WIN32
+# include <winsock2.h>
+# include <ws2tcpip.h>
+/* The socket is only read once poll() said it is readable */
+# define MSG_DONTWAIT 0
+#else /*G_OS_WIN32*/
+# include <sys/socket.h>
+# include <sys/uio.h>
+#endif /*G_OS_WIN32*/
+
+GST_DEBUG_CATEGORY_EXTERN (fs_rawudp_transmitter_debug);
+#define GST_CAT_DEFAULT fs_rawudp_transmitter_debug
+
+/* Larger than any UDP payload, so packets are never truncated */
+#define MAX_PACKET_SIZE 65536
+
+#define DEFAULT_SOCKFD -1
+#define DEFAULT_BATCH_DEPTH 8
+#define MAX_BATCH_DEPTH 64
+
+/* props */
+enum
+{
+  PROP_0,
+  PROP_SOCKFD,
+  PROP_BATCH_DEPTH,
+  PROP_PACKETS,
+  PROP_SYSCALLS,
+  PROP_PACKETS_PER_SYSCALL
+};
+
+static GstStaticPadTemplate fs_rawudp_batch_src_template =
+  GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static GstPushSrcClass *parent_class = NULL;
+
+static void fs_rawudp_batch_src_base_init (gpointer g_class);
+static void fs_rawudp_batch_src_class_init (FsRawUdpBatchSrcClass *klass);
+static void fs_rawudp_batch_src_init (FsRawUdpBatchSrc *self);
+static void fs_rawudp_batch_src_finalize (GObject *object);
+
+static void fs_rawudp_batch_src_set_property (GObject *object,
+    guint prop_id, const GValue *value, GParamSpec *pspec);
+static void fs_rawudp_batch_src_get_property (GObject *object,
+    guint prop_id, GValue *value, GParamSpec *pspec);
+
+static gboolean fs_rawudp_batch_src_start (GstBaseSrc *bsrc);
+static gboolean fs_rawudp_batch_src_stop (GstBaseSrc *bsrc);
+static gboolean fs_rawudp_batch_src_unlock (GstBaseSrc *bsrc);
+static gboolean fs_rawudp_batch_src_unlock_stop (GstBaseSrc *bsrc);
+static GstFlowReturn fs_rawudp_batch_src_create (GstPushSrc *psrc,
+    GstBuffer **outbuf);
+
+
+static GType type = 0;
+
+GType
+fs_rawudp_batch_src_get_type (void)
+{
+  g_assert (type);
+  return type;
+}
+
+GType
+fs_rawudp_batch_src_register_type (FsPlugin *module)
+{
+  static const GTypeInfo info = {
+    sizeof (FsRawUdpBatchSrcClass),
+    (GBaseInitFunc) fs_rawudp_batch_src_base_init,
+    NULL,
+    (GClassInitFunc) fs_rawudp_batch_src_class_init,
+    NULL,
+    NULL,
+    sizeof (FsRawUdpBatchSrc),
+    0,
+    (GInstanceInitFunc) fs_rawudp_batch_src_init
+  };
+
+  type = g_type_module_register_type (G_TYPE_MODULE (module),
+      GST_TYPE_PUSH_SRC, "FsRawUdpBatchSrc", &info, 0);
+
+  return type;
+}
+
+static void
+fs_rawudp_batch_src_base_init (gpointer g_class)
+{
+  GstElementClass *gstelement_class = GST_ELEMENT_CLASS (g_class);
+
+  gst_element_class_set_details_simple (gstelement_class,
+      "Farsight raw UDP batched source",
+      "Source/Network",
+      "Receives UDP packets from a socket, several per system call",
+      "Farsight developers");
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&fs_rawudp_batch_src_template));
+}
+
+static void
+fs_rawudp_batch_src_class_init (FsRawUdpBatchSrcClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstBaseSrcClass *gstbasesrc_class = GST_BASE_SRC_CLASS (klass);
+  GstPushSrcClass *gstpushsrc_class = GST_PUSH_SRC_CLASS (klass);
+
+  parent_class = g_type_class_peek_parent (klass);
+
+  gobject_class->set_property = fs_rawudp_batch_src_set_property;
+  gobject_class->get_property = fs_rawudp_batch_src_get_property;
+  gobject_class->finalize = fs_rawudp_batch_src_finalize;
+
+  gstbasesrc_class->start = GST_DEBUG_FUNCPTR (fs_rawudp_batch_src_start);
+  gstbasesrc_class->stop = GST_DEBUG_FUNCPTR (fs_rawudp_batch_src_stop);
+  gstbasesrc_class->unlock = GST_DEBUG_FUNCPTR (fs_rawudp_batch_src_unlock);
+  gstbasesrc_class->unlock_stop =
+    GST_DEBUG_FUNCPTR (fs_rawudp_batch_src_unlock_stop);
+
+  gstpushsrc_class->create = GST_DEBUG_FUNCPTR (fs_rawudp_batch_src_create);
+
+  g_object_class_install_property (gobject_class,
+      PROP_SOCKFD,
+      g_param_spec_int ("sockfd",
+          "Socket",
+          "The bound socket to receive from, it is not closed by the element",
+          -1, G_MAXINT, DEFAULT_SOCKFD,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_BATCH_DEPTH,
+      g_param_spec_uint ("batch-depth",
+          "Batch depth",
+          "Maximum number of packets received with one system call,"
+          " takes effect the next time the element is started",
+          1, MAX_BATCH_DEPTH, DEFAULT_BATCH_DEPTH,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PACKETS,
+      g_param_spec_uint64 ("packets",
+          "Packets",
+          "Number of packets received since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_SYSCALLS,
+      g_param_spec_uint64 ("syscalls",
+          "System calls",
+          "Number of receive system calls made since the element was started",
+          0, G_MAXUINT64, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PACKETS_PER_SYSCALL,
+      g_param_spec_double ("packets-per-syscall",
+          "Packets per system call",
+          "Average number of packets returned by each receive system call",
+          0, G_MAXDOUBLE, 0,
+          G_PARAM_READABLE));
+}
+
+static void
+fs_rawudp_batch_src_init (FsRawUdpBatchSrc *self)
+{
+  self->sockfd = DEFAULT_SOCKFD;
+  self->batch_depth = DEFAULT_BATCH_DEPTH;
+  self->control_sock[0] = -1;
+  self->control_sock[1] = -1;
+
+  gst_base_src_set_live (GST_BASE_SRC (self), TRUE);
+  gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
+  gst_base_src_set_do_timestamp (GST_BASE_SRC (self), TRUE);
+}
+
+static void
+fs_rawudp_batch_src_finalize (GObject *object)
+{
+  FsRawUdpBatchSrc *self = FS_RAWUDP_BATCH_SRC (object);
+
+  g_free (self->slots);
+  g_free (self->msgs);
+  g_free (self->iovecs);
+  g_free (self->addrs);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+fs_rawudp_batch_src_set_property (GObject *object,
+    guint prop_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  FsRawUdpBatchSrc *self = FS_RAWUDP_BATCH_SRC (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+  {
+    case PROP_SOCKFD:
+      self->sockfd = g_value_get_int (value);
+      break;
+    case PROP_BATCH_DEPTH:
+      self->batch_depth = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static void
+fs_rawudp_batch_src_get_property (GObject *object,
+    guint prop_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  FsRawUdpBatchSrc *self = FS_RAWUDP_BATCH_SRC (object);
+
+  GST_OBJECT_LOCK (self);
+  switch (prop_id)
+  {
+    case PROP_SOCKFD:
+      g_value_set_int (value, self->sockfd);
+      break;
+    case PROP_BATCH_DEPTH:
+      g_value_set_uint (value, self->batch_depth);
+      break;
+    case PROP_PACKETS:
+      g_value_set_uint64 (value, self->packets);
+      break;
+    case PROP_SYSCALLS:
+      g_value_set_uint64 (value, self->syscalls);
+      break;
+    case PROP_PACKETS_PER_SYSCALL:
+      if (self->syscalls)
+        g_value_set_double (value,
+            (gdouble) self->packets / (gdouble) self->syscalls);
+      else
+        g_value_set_double (value, 0);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+static gboolean
+fs_rawudp_batch_src_start (GstBaseSrc *bsrc)
+{
+  FsRawUdpBatchSrc *self = FS_RAWUDP_BATCH_SRC (bsrc);
+  guint depth;
+
+  if (self->sockfd < 0)
+  {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL),
+        ("No socket was set on the \"sockfd\" property"));
+    return FALSE;
+  }
+
+  if (pipe (self->control_sock) < 0)
+  {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL),
+        ("Could not create control pipe: %s", g_strerror (errno)));
+    return FALSE;
+  }
+  fcntl (self->control_sock[0], F_SETFL, O_NONBLOCK);
+  fcntl (self->control_sock[1], F_SETFL, O_NONBLOCK);
+
+  GST_OBJECT_LOCK (self);
+  depth = self->batch_depth;
+  self->packets = 0;
+  self->syscalls = 0;
+  GST_OBJECT_UNLOCK (self);
+
+#ifndef HAVE_RECVMMSG
+  /* Without recvmmsg() there is nothing to gain from more than one slot */
+  depth = 1;
+#endif
+
+  if (depth != self->allocated_depth)
+  {
+#ifdef HAVE_RECVMMSG
+    struct iovec *iov;
+    guint i;
+#endif
+
+    g_free (self->slots);
+    g_free (self->msgs);
+    g_free (self->iovecs);
+    g_free (self->addrs);
+
+    self->slots = g_malloc (depth * MAX_PACKET_SIZE);
+    self->addrs = g_new0 (FsRawUdpAddress, depth);
+#ifdef HAVE_RECVMMSG
+    self->iovecs = iov = g_new0 (struct iovec, depth);
+    self->msgs = g_new0 (struct mmsghdr, depth);
+
+    for (i = 0; i < depth; i++)
+    {
+      iov[i].iov_base = self->slots + i * MAX_PACKET_SIZE;
+      iov[i].iov_len = MAX_PACKET_SIZE;
+      ((struct mmsghdr *) self->msgs)[i].msg_hdr.msg_iov = &iov[i];
+      ((struct mmsghdr *) self->msgs)[i].msg_hdr.msg_iovlen = 1;
+      ((struct mmsghdr *) self->msgs)[i].msg_hdr.msg_name = &self->addrs[i];
+    }
+#else
+    self->iovecs = NULL;
+    self->msgs = NULL;
+#endif
+
+    self->allocated_depth = depth;
+  }
+
+  self->batch_pos = 0;
+  self->batch_filled = 0;
+
+  GST_DEBUG_OBJECT (self, "Receiving up to %u packets per system call",
+      depth);
+
+  return TRUE;
+}
+
+static gboolean
+fs_rawudp_batch_src_stop (GstBaseSrc *bsrc)
+{
+  FsRawUdpBatchSrc *self = FS_RAWUDP_BATCH_SRC (bsrc);
+
+  if (self->control_sock[0] >= 0)
+    close (self->control_sock[0]);
+  if (self->control_sock[1] >= 0)
+    close (self->control_sock[1]);
+  self->control_sock[0] = -1;
+  self->control_sock[1] = -1;
+
+  /* Whatever was left of the last batch is dropped */
+  self->batch_pos = 0;
+  self->batch_filled = 0;
+
+  return TRUE;
+}
+
+static gboolean
+fs_rawudp_batch_src_unlock (GstBaseSrc *bsrc)
+{
+  FsRawUdpBatchSrc *self = FS_RAWUDP_BATCH_SRC (bsrc);
+  const gchar c = 'x';
+
+  if (write (self->control_sock[1], &c, 1) < 0 && errno != EAGAIN)
+    GST_WARNING_OBJECT (self, "Could not wake up the streaming thread: %s",
+        g_strerror (errno));
+
+  return TRUE;
+}
+
+static gboolean
+fs_rawudp_batch_src_unlock_stop (GstBaseSrc *bsrc)
+{
+  FsRawUdpBatchSrc *self = FS_RAWUDP_BATCH_SRC (bsrc);
+  gchar buf[16];
+
+  while (read (self->control_sock[0], buf, sizeof (buf)) > 0);
+
+  return TRUE;
+}
+
+/*
+ * Waits for the socket to be readable and fills the slots with as many
+ * packets as are queued, up to the batch depth
+ */
+static GstFlowReturn
+fs_rawudp_batch_src_receive (FsRawUdpBatchSrc *self)
+{
+  struct pollfd fds[2];
+  gint ret;
+#ifdef HAVE_RECVMMSG
+  guint i;
+#else
+  socklen_t addrlen;
+#endif
+
+  fds[0].fd = self->sockfd;
+  fds[0].events = POLLIN;
+  fds[1].fd = self->control_sock[0];
+  fds[1].events = POLLIN;
+
+  for (;;)
+  {
+    do {
+      fds[0].revents = 0;
+      fds[1].revents = 0;
+      ret = poll (fds, 2, -1);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (ret < 0)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+          ("poll() failed: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+
+    if (fds[1].revents)
+    {
+      GST_DEBUG_OBJECT (self, "Unlocked");
+      return GST_FLOW_WRONG_STATE;
+    }
+
+#ifdef HAVE_RECVMMSG
+    /* The kernel overwrites the address lengths */
+    for (i = 0; i < self->allocated_depth; i++)
+      ((struct mmsghdr *) self->msgs)[i].msg_hdr.msg_namelen =
+        sizeof (FsRawUdpAddress);
+    ret = recvmmsg (self->sockfd, self->msgs, self->allocated_depth,
+        MSG_DONTWAIT, NULL);
+#else
+    addrlen = sizeof (FsRawUdpAddress);
+    ret = recvfrom (self->sockfd, (gchar *) self->slots, MAX_PACKET_SIZE,
+        MSG_DONTWAIT, (struct sockaddr *) &self->addrs[0], &addrlen);
+#endif
+
+    GST_OBJECT_LOCK (self);
+    self->syscalls++;
+    if (ret > 0)
+    {
+#ifdef HAVE_RECVMMSG
+      self->packets += ret;
+#else
+      self->packets++;
+#endif
+    }
+    GST_OBJECT_UNLOCK (self);
+
+    if (ret >= 0)
+      break;
+
+    /* ICMP errors from earlier sends are reported here, they are harmless */
+    if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != ECONNREFUSED)
+    {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+          ("Could not receive from the socket: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+  }
+
+  self->batch_pos = 0;
+#ifdef HAVE_RECVMMSG
+  self->batch_filled = ret;
+#else
+  self->slot_len = ret;
+  self->batch_filled = 1;
+#endif
+
+  GST_LOG_OBJECT (self, "Received %u packets", self->batch_filled);
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+fs_rawudp_batch_src_create (GstPushSrc *psrc, GstBuffer **outbuf)
+{
+  FsRawUdpBatchSrc *self = FS_RAWUDP_BATCH_SRC (psrc);
+  FsRawUdpBatchSrcRecvFunc recv_func;
+  gpointer recv_data;
+  GstBuffer *buf;
+  guint8 *data;
+  guint len;
+
+  GST_OBJECT_LOCK (self);
+  recv_func = self->recv_func;
+  recv_data = self->recv_data;
+  GST_OBJECT_UNLOCK (self);
+
+  for (;;)
+  {
+    guint i;
+
+    while (self->batch_pos >= self->batch_filled)
+    {
+      GstFlowReturn ret = fs_rawudp_batch_src_receive (self);
+
+      if (ret != GST_FLOW_OK)
+        return ret;
+    }
+
+    i = self->batch_pos++;
+    data = self->slots + i * MAX_PACKET_SIZE;
+#ifdef HAVE_RECVMMSG
+    len = ((struct mmsghdr *) self->msgs)[i].msg_len;
+#else
+    len = self->slot_len;
+#endif
+
+    /* Packets from IPv4 peers on a dual-stack socket */
+    fs_rawudp_address_unmap (&self->addrs[i]);
+
+    if (!recv_func || recv_func (data, len, &self->addrs[i], recv_data))
+      break;
+
+    GST_LOG_OBJECT (self, "Packet of %u bytes consumed by the receive"
+        " function", len);
+  }
+
+  /*
+   * The slots are reused by the next batch, so each packet is copied into a
+   * buffer of its own size, which also keeps the memory held downstream
+   * (for example by a jitterbuffer) proportional to the traffic
+   */
+  buf = gst_buffer_new_and_alloc (len);
+  memcpy (GST_BUFFER_DATA (buf), data, len);
+
+  *outbuf = buf;
+
+  return GST_FLOW_OK;
+}
+
+/**
+ * fs_rawudp_batch_src_set_recv_func:
+ * @self: a #FsRawUdpBatchSrc
+ * @func: the function called for every packet, or %NULL
+ * @user_data: data passed to @func
+ *
+ * Sets a function that sees every packet with its source address from the
+ * streaming thread and can consume it so that it is not pushed.
+ */
+
+void
+fs_rawudp_batch_src_set_recv_func (FsRawUdpBatchSrc *self,
+    FsRawUdpBatchSrcRecvFunc func,
+    gpointer user_data)
+{
+  GST_OBJECT_LOCK (self);
+  self->recv_func = func;
+  self->recv_data = user_data;
+  GST_OBJECT_UNLOCK (self);
+}
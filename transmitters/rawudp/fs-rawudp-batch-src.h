@@ -0,0 +1,110 @@
+/*
+ * Farsight2 - Farsight RAW UDP batched source
+ *
+ * fs-rawudp-batch-src.h - Source receiving several UDP packets per syscall
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_RAWUDP_BATCH_SRC_H__
+#define __FS_RAWUDP_BATCH_SRC_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstpushsrc.h>
+
+#include <gst/farsight/fs-plugin.h>
+
+#include "fs-rawudp-address.h"
+
+G_BEGIN_DECLS
+
+#define FS_TYPE_RAWUDP_BATCH_SRC \
+  (fs_rawudp_batch_src_get_type ())
+#define FS_RAWUDP_BATCH_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),FS_TYPE_RAWUDP_BATCH_SRC, \
+      FsRawUdpBatchSrc))
+#define FS_RAWUDP_BATCH_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),FS_TYPE_RAWUDP_BATCH_SRC, \
+      FsRawUdpBatchSrcClass))
+#define FS_IS_RAWUDP_BATCH_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),FS_TYPE_RAWUDP_BATCH_SRC))
+#define FS_IS_RAWUDP_BATCH_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),FS_TYPE_RAWUDP_BATCH_SRC))
+
+typedef struct _FsRawUdpBatchSrc          FsRawUdpBatchSrc;
+typedef struct _FsRawUdpBatchSrcClass     FsRawUdpBatchSrcClass;
+
+/*
+ * Called from the streaming thread for every packet received, before it is
+ * copied into a buffer, return FALSE to drop it.
+ */
+typedef gboolean (*FsRawUdpBatchSrcRecvFunc) (const guint8 *data,
+                                              guint len,
+                                              const FsRawUdpAddress *from,
+                                              gpointer user_data);
+
+/**
+ * FsRawUdpBatchSrc:
+ *
+ * Opaque #FsRawUdpBatchSrc data structure.
+ */
+struct _FsRawUdpBatchSrc {
+  GstPushSrc      parent;
+
+  /*< private >*/
+  gint sockfd;
+  guint batch_depth;
+
+  /* Used to interrupt poll() in unlock() */
+  gint control_sock[2];
+
+  /* One slot of the maximum datagram size per packet of a batch */
+  guint8 *slots;
+  /* Array of struct mmsghdr and struct iovec, one per slot, only used with
+   * recvmmsg() */
+  gpointer msgs;
+  gpointer iovecs;
+  FsRawUdpAddress *addrs;
+  guint allocated_depth;
+  /* Length of the packet in the only slot without recvmmsg() */
+  guint slot_len;
+
+  /* Packets of the last batch that have not been pushed yet */
+  guint batch_pos;
+  guint batch_filled;
+
+  /* Protected by the object lock */
+  guint64 packets;
+  guint64 syscalls;
+
+  FsRawUdpBatchSrcRecvFunc recv_func;
+  gpointer recv_data;
+};
+
+struct _FsRawUdpBatchSrcClass {
+  GstPushSrcClass parent_class;
+};
+
+GType   fs_rawudp_batch_src_register_type (FsPlugin *module);
+
+GType   fs_rawudp_batch_src_get_type      (void);
+
+void    fs_rawudp_batch_src_set_recv_func (FsRawUdpBatchSrc *self,
+                                           FsRawUdpBatchSrcRecvFunc func,
+                                           gpointer user_data);
+
+G_END_DECLS
+
+#endif /* __FS_RAWUDP_BATCH_SRC_H__ */
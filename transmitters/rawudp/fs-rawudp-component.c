@@ -31,11 +31,13 @@
 
 #include "fs-rawudp-marshal.h"
 
-#include "stun.h"
+#include "fs-rawudp-stun-agent.h"
+#include "fs-rawudp-keepalive.h"
 
 #include <gst/farsight/fs-conference-iface.h>
 #include <gst/farsight/fs-interfaces.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
@@ -100,8 +102,6 @@ struct _FsRawUdpComponentPrivate
 
   GMutex *mutex;
 
-  gchar stun_cookie[16];
-
   /* Above this line, its all set at construction time */
   /* This is protected by the mutex */
 
@@ -113,11 +113,11 @@ struct _FsRawUdpComponentPrivate
 
   gboolean gathered;
 
-  gulong stun_recv_id;
+  /* The running discovery of the FsRawUdpStunAgent */
+  gulong stun_id;
 
-  GstClockID stun_timeout_id;
-  GstClockTime next_stun_timeout;
-  GThread *stun_timeout_thread;
+  /* The entry of the active pair in the FsRawUdpKeepalive */
+  gulong keepalive_id;
 
   gboolean sending;
 };
@@ -168,12 +168,14 @@ fs_rawudp_component_maybe_new_active_candidate_pair (FsRawUdpComponent *self);
 static void
 fs_rawudp_component_emit_candidate (FsRawUdpComponent *self,
     FsCandidate *candidate);
+static void
+fs_rawudp_component_emit_stun_candidate (FsRawUdpComponent *self,
+    const FsRawUdpAddress *mapped);
 
-static gboolean
-stun_recv_cb (GstPad *pad, GstBuffer *buffer,
+static void
+stun_done_cb (const FsRawUdpAddress *mapped,
+    const GError *error,
     gpointer user_data);
-static gpointer
-stun_timeout_func (gpointer user_data);
 
 
 GType
@@ -237,7 +239,7 @@ fs_rawudp_component_class_init (FsRawUdpComponentClass *klass)
       PROP_IP,
       g_param_spec_string ("ip",
           "The local IP of this component",
-          "The IPv4 address as a x.x.x.x string",
+          "The IPv4 or IPv6 address as a string",
           NULL,
           G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE));
 
@@ -253,8 +255,10 @@ fs_rawudp_component_class_init (FsRawUdpComponentClass *klass)
   g_object_class_install_property (gobject_class,
       PROP_STUN_IP,
       g_param_spec_string ("stun-ip",
-          "The IP address of the STUN server",
-          "The IPv4 address of the STUN server as a x.x.x.x string",
+          "The IP addresses of the STUN servers",
+          "The IPv4 or IPv6 addresses of the STUN servers as a comma"
+          " separated list, with an optional port as in x.x.x.x:port or"
+          " [x::x]:port",
           NULL,
           G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE));
 
@@ -270,7 +274,7 @@ fs_rawudp_component_class_init (FsRawUdpComponentClass *klass)
       PROP_STUN_TIMEOUT,
       g_param_spec_uint ("stun-timeout",
           "The timeout for the STUN reply",
-          "How long to wait for for the STUN reply (in seconds) before giving up",
+          "How long to wait for for a STUN reply (in seconds) before giving up",
           1, G_MAXUINT, 30,
           G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE));
 
@@ -385,11 +389,6 @@ fs_rawudp_component_init (FsRawUdpComponent *self)
   self->priv->sending = TRUE;
   self->priv->port = 7078;
 
-  ((guint32*)self->priv->stun_cookie)[0] = g_random_int ();
-  ((guint32*)self->priv->stun_cookie)[1] = g_random_int ();
-  ((guint32*)self->priv->stun_cookie)[2] = g_random_int ();
-  ((guint32*)self->priv->stun_cookie)[3] = g_random_int ();
-
   self->priv->mutex = g_mutex_new ();
 }
 
@@ -428,6 +427,8 @@ fs_rawudp_component_dispose (GObject *object)
 {
   FsRawUdpComponent *self = FS_RAWUDP_COMPONENT (object);
   FsRawUdpTransmitter *ts = NULL;
+  gulong stun_id;
+  gulong keepalive_id;
 
   if (self->priv->disposed)
     /* If dispose did already run, return. */
@@ -438,17 +439,25 @@ fs_rawudp_component_dispose (GObject *object)
   /* Make sure dispose does not run twice. */
   self->priv->disposed = TRUE;
 
-  if (self->priv->stun_timeout_thread != NULL)
-  {
-    FS_RAWUDP_COMPONENT_UNLOCK (self);
-    g_thread_join (self->priv->stun_timeout_thread);
-    FS_RAWUDP_COMPONENT_LOCK (self);
-
-    self->priv->stun_timeout_thread = NULL;
-  }
+  stun_id = self->priv->stun_id;
+  self->priv->stun_id = 0;
+  keepalive_id = self->priv->keepalive_id;
+  self->priv->keepalive_id = 0;
 
   FS_RAWUDP_COMPONENT_UNLOCK (self);
 
+  if (keepalive_id)
+    fs_rawudp_keepalive_remove (
+        fs_rawudp_transmitter_get_keepalive (self->priv->transmitter),
+        keepalive_id);
+
+  /* Waits for the callback if it is running, the id is kept after the
+   * discovery is over and cancelling a finished one does nothing */
+  if (stun_id)
+    fs_rawudp_stun_agent_cancel (
+        fs_rawudp_transmitter_get_stun_agent (self->priv->transmitter),
+        stun_id);
+
   if (self->priv->remote_candidate &&
       self->priv->udpport &&
       self->priv->sending)
@@ -699,271 +708,223 @@ fs_rawudp_component_gather_local_candidates (FsRawUdpComponent *self,
     return fs_rawudp_component_emit_local_candidates (self, error);
 }
 
-gboolean
-fs_rawudp_component_start_stun (FsRawUdpComponent *self, GError **error)
-{
-  struct addrinfo hints;
-  struct addrinfo *result = NULL;
-  struct sockaddr_in address;
-  gchar *packed;
-  guint length;
-  int retval;
-  StunMessage *msg;
-  gboolean res = TRUE;
-  GstClock *sysclock = NULL;
-
-  sysclock = gst_system_clock_obtain ();
-  if (sysclock == NULL)
-  {
-    g_set_error (error, FS_ERROR, FS_ERROR_INTERNAL,
-        "Could not obtain gst system clock");
-    return FALSE;
-  }
-
-  memset (&hints, 0, sizeof (struct addrinfo));
-  hints.ai_family = AF_INET;
-  hints.ai_flags = AI_NUMERICHOST;
-  retval = getaddrinfo (self->priv->stun_ip, NULL, &hints, &result);
-  if (retval != 0)
-  {
-    g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
-        "Invalid IP address %s passed for STUN: %s",
-        self->priv->stun_ip, gai_strerror (retval));
-    return FALSE;
-  }
-  memcpy (&address, result->ai_addr, sizeof (struct sockaddr_in));
-  freeaddrinfo (result);
-
-  address.sin_family = AF_INET;
-  address.sin_port = htons (self->priv->stun_port);
+/*
+ * The stun-ip property is a comma separated list of servers, each one can
+ * have its own port after a colon, otherwise it uses stun-port. IPv6
+ * addresses must be between brackets to have a port.
+ */
 
-  FS_RAWUDP_COMPONENT_LOCK (self);
-  self->priv->stun_recv_id =
-    fs_rawudp_transmitter_udpport_connect_recv (
-        self->priv->udpport,
-        G_CALLBACK (stun_recv_cb), self);
-  FS_RAWUDP_COMPONENT_UNLOCK (self);
+static gboolean
+fs_rawudp_component_parse_stun_servers (FsRawUdpComponent *self,
+    FsRawUdpAddress **servers,
+    guint *n_servers,
+    GError **error)
+{
+  gchar **entries;
+  guint i;
 
-  msg = stun_message_new (STUN_MESSAGE_BINDING_REQUEST,
-      self->priv->stun_cookie, 0);
-  if (!msg)
-  {
-    g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
-        "Could not create a new STUN binding request");
-    return FALSE;
-  }
+  entries = g_strsplit_set (self->priv->stun_ip, ", ", -1);
 
-  length = stun_message_pack (msg, &packed);
+  *servers = g_new0 (FsRawUdpAddress, g_strv_length (entries));
+  *n_servers = 0;
 
-  if (!fs_rawudp_transmitter_udpport_sendto (self->priv->udpport,
-          packed, length, (const struct sockaddr *)&address, sizeof (address),
-          error))
+  for (i = 0; entries[i]; i++)
   {
-    g_free (packed);
-    stun_message_free (msg);
-    return FALSE;
-  }
-  g_free (packed);
-  stun_message_free (msg);
-
-  FS_RAWUDP_COMPONENT_LOCK (self);
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    FsRawUdpAddress *address = &(*servers)[*n_servers];
+    gchar *host = entries[i];
+    guint port = self->priv->stun_port;
+    gchar *colon;
+    int retval;
+
+    if (host[0] == '\0')
+      continue;
+
+    if (host[0] == '[')
+    {
+      gchar *bracket = strchr (host, ']');
 
-  self->priv->next_stun_timeout = gst_clock_get_time (sysclock) +
-    (self->priv->stun_timeout * GST_SECOND);
+      if (!bracket || (bracket[1] != '\0' && bracket[1] != ':'))
+      {
+        g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+            "Invalid STUN server %s", entries[i]);
+        goto error;
+      }
+      *bracket = '\0';
+      host++;
+      colon = (bracket[1] == ':') ? bracket + 1 : NULL;
+    }
+    else
+    {
+      /* A bare IPv6 address has more than one colon and no port */
+      colon = strchr (host, ':');
+      if (colon && strchr (colon + 1, ':'))
+        colon = NULL;
+    }
 
-  gst_object_unref (sysclock);
+    if (colon)
+    {
+      gchar *end = NULL;
 
-  if (self->priv->stun_timeout_thread == NULL) {
-    /* only create a new thread if the old one was stopped. Otherwise we can
-     * just reuse the currently running one. */
-    self->priv->stun_timeout_thread =
-      g_thread_create (stun_timeout_func, self, TRUE, error);
-  }
+      *colon = '\0';
+      port = strtoul (colon + 1, &end, 10);
+      if (*end || port == 0 || port > 65535)
+      {
+        g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+            "Invalid port %s passed for STUN server %s", colon + 1, host);
+        goto error;
+      }
+    }
 
-  res = (self->priv->stun_timeout_thread != NULL);
+    memset (&hints, 0, sizeof (struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_flags = AI_NUMERICHOST;
+    retval = getaddrinfo (host, NULL, &hints, &result);
+    if (retval != 0)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+          "Invalid IP address %s passed for STUN: %s",
+          host, gai_strerror (retval));
+      goto error;
+    }
+    memcpy (address, result->ai_addr,
+        MIN (result->ai_addrlen, sizeof (FsRawUdpAddress)));
+    freeaddrinfo (result);
 
-  g_assert (error == NULL || res || *error);
+    fs_rawudp_address_set_port (address, port);
+    fs_rawudp_address_unmap (address);
 
-  FS_RAWUDP_COMPONENT_UNLOCK (self);
+    /* A server of the other family can not be reached from our socket */
+    if (!fs_rawudp_transmitter_udpport_accepts_family (self->priv->udpport,
+            address->sa.sa_family))
+    {
+      GST_DEBUG ("Skipping STUN server %s, it is not reachable from the"
+          " socket of component %u", host, self->priv->component);
+      continue;
+    }
 
-  return res;
-}
+    (*n_servers)++;
+  }
 
-/*
- * This function MUST always be called wiuth the Component lock held
- */
+  g_strfreev (entries);
 
-static void
-fs_rawudp_component_stop_stun_locked (FsRawUdpComponent *self)
-{
-  if (self->priv->stun_recv_id)
+  if (*n_servers == 0)
   {
-    fs_rawudp_transmitter_udpport_disconnect_recv (
-        self->priv->udpport,
-        self->priv->stun_recv_id);
-    self->priv->stun_recv_id = 0;
+    g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+        "No STUN server in \"%s\"", self->priv->stun_ip);
+    g_free (*servers);
+    *servers = NULL;
+    return FALSE;
   }
 
-  self->priv->next_stun_timeout = 0;
-  if (self->priv->stun_timeout_id)
-    gst_clock_id_unschedule (self->priv->stun_timeout_id);
-}
-
+  return TRUE;
 
+ error:
+  g_strfreev (entries);
+  g_free (*servers);
+  *servers = NULL;
+  return FALSE;
+}
 
-static gboolean
-stun_recv_cb (GstPad *pad, GstBuffer *buffer,
-    gpointer user_data)
+gboolean
+fs_rawudp_component_start_stun (FsRawUdpComponent *self, GError **error)
 {
-  FsRawUdpComponent *self = FS_RAWUDP_COMPONENT (user_data);
-  FsCandidate *candidate = NULL;
-  StunMessage *msg;
-  StunAttribute **attr;
-
-  if (GST_BUFFER_SIZE (buffer) < 4)
-    /* Packet is too small to be STUN */
-    return TRUE;
-
-  if (GST_BUFFER_DATA (buffer)[0] >> 6)
-    /* Non stun packet */
-    return TRUE;
-
-
-  g_assert (fs_rawudp_transmitter_udpport_is_pad (self->priv->udpport, pad));
-
-  msg = stun_message_unpack (GST_BUFFER_SIZE (buffer),
-      (const gchar *) GST_BUFFER_DATA (buffer));
-  if (!msg)
-    /* invalid message */
-    return TRUE;
+  FsRawUdpStunAgent *agent =
+    fs_rawudp_transmitter_get_stun_agent (self->priv->transmitter);
+  FsRawUdpAddress *servers = NULL;
+  FsRawUdpAddress mapped;
+  guint n_servers;
+  gulong stun_id;
+
+  if (!fs_rawudp_component_parse_stun_servers (self, &servers, &n_servers,
+          error))
+    return FALSE;
 
-  if (memcmp (msg->transaction_id, self->priv->stun_cookie, 16) != 0)
+  /* Another stream may have done the same discovery moments ago */
+  if (fs_rawudp_stun_agent_lookup (agent, self->priv->udpport, servers,
+          n_servers, &mapped))
   {
-    /* not ours */
-    stun_message_free (msg);
+    g_free (servers);
+    GST_DEBUG ("Using the cached reflexive address for component %u",
+        self->priv->component);
+    fs_rawudp_component_emit_stun_candidate (self, &mapped);
     return TRUE;
   }
 
-  if (msg->type == STUN_MESSAGE_BINDING_ERROR_RESPONSE)
-  {
-    fs_rawudp_component_emit_error (FS_RAWUDP_COMPONENT (self),
-        FS_ERROR_NETWORK, "Got an error message from the STUN server",
-        "The STUN process produced an error");
-    stun_message_free (msg);
-    // fs_rawudp_component_stop_stun (self, component_id);
-    /* Lets not stop the STUN now and wait for the timeout
-     * in case the server answers with the right reply
-     */
-    return FALSE;
-  }
+  /* Hold the lock so the callback can not run before the id is stored */
+  FS_RAWUDP_COMPONENT_LOCK (self);
+  stun_id = self->priv->stun_id = fs_rawudp_stun_agent_discover (agent,
+      self->priv->udpport, servers, n_servers, self->priv->stun_timeout,
+      stun_done_cb, self, error);
+  FS_RAWUDP_COMPONENT_UNLOCK (self);
 
-  if (msg->type != STUN_MESSAGE_BINDING_RESPONSE)
-  {
-    stun_message_free (msg);
-    return TRUE;
-  }
+  g_free (servers);
 
+  return stun_id != 0;
+}
 
-  for (attr = msg->attributes; *attr; attr++)
-  {
-    if ((*attr)->type == STUN_ATTRIBUTE_MAPPED_ADDRESS)
-    {
-      // TODO
-      gchar *id = g_strdup_printf ("L1");
-      gchar *ip = g_strdup_printf ("%u.%u.%u.%u",
-          ((*attr)->address.ip & 0xff000000) >> 24,
-          ((*attr)->address.ip & 0x00ff0000) >> 16,
-          ((*attr)->address.ip & 0x0000ff00) >>  8,
-          ((*attr)->address.ip & 0x000000ff));
-
-      candidate = fs_candidate_new (id,
-          self->priv->component,
-          FS_CANDIDATE_TYPE_SRFLX,
-          FS_NETWORK_PROTOCOL_UDP,
-          ip,
-          (*attr)->address.port);
-      g_free (id);
-      g_free (ip);
-
-      GST_DEBUG ("Stun server says we are %u.%u.%u.%u %u\n",
-          ((*attr)->address.ip & 0xff000000) >> 24,
-          ((*attr)->address.ip & 0x00ff0000) >> 16,
-          ((*attr)->address.ip & 0x0000ff00) >>  8,
-          ((*attr)->address.ip & 0x000000ff),(*attr)->address.port);
-      break;
-    }
-  }
+static void
+fs_rawudp_component_emit_stun_candidate (FsRawUdpComponent *self,
+    const FsRawUdpAddress *mapped)
+{
+  FsCandidate *candidate = NULL;
+  // TODO
+  gchar *id = g_strdup_printf ("L1");
+  gchar *ipstr = fs_rawudp_address_to_string (mapped);
+
+  candidate = fs_candidate_new (id,
+      self->priv->component,
+      FS_CANDIDATE_TYPE_SRFLX,
+      FS_NETWORK_PROTOCOL_UDP,
+      ipstr,
+      fs_rawudp_address_get_port (mapped));
+  g_free (id);
+
+  GST_DEBUG ("Stun server says we are %s %u\n", ipstr,
+      fs_rawudp_address_get_port (mapped));
+  g_free (ipstr);
 
   FS_RAWUDP_COMPONENT_LOCK(self);
-  fs_rawudp_component_stop_stun_locked (self);
-
   self->priv->local_active_candidate = fs_candidate_copy (candidate);
   FS_RAWUDP_COMPONENT_UNLOCK(self);
 
   fs_rawudp_component_emit_candidate (self, candidate);
 
   fs_candidate_destroy (candidate);
-
-  /* It was a stun packet, lets drop it */
-  stun_message_free (msg);
-  return FALSE;
 }
 
-static gpointer
-stun_timeout_func (gpointer user_data)
+static void
+stun_done_cb (const FsRawUdpAddress *mapped,
+    const GError *error,
+    gpointer user_data)
 {
   FsRawUdpComponent *self = FS_RAWUDP_COMPONENT (user_data);
-  GstClock *sysclock = NULL;
-  GstClockID id;
-  gboolean emit = TRUE;
+  GError *local_error = NULL;
 
-  sysclock = gst_system_clock_obtain ();
-  if (sysclock == NULL)
+  /* stun_id is left set so that dispose can wait for this callback */
+
+  if (mapped)
   {
-    fs_rawudp_component_emit_error (self, FS_ERROR_INTERNAL,
-        "Could not obtain gst system clock", NULL);
-    emit = FALSE;
-    FS_RAWUDP_COMPONENT_LOCK(self);
-    goto error;
+    fs_rawudp_component_emit_stun_candidate (self, mapped);
+    return;
   }
 
-  FS_RAWUDP_COMPONENT_LOCK(self);
-  id = self->priv->stun_timeout_id = gst_clock_new_single_shot_id (sysclock,
-      self->priv->next_stun_timeout);
-
-  FS_RAWUDP_COMPONENT_UNLOCK(self);
-  gst_clock_id_wait (id, NULL);
-  FS_RAWUDP_COMPONENT_LOCK(self);
-
-  gst_clock_id_unref (id);
-  self->priv->stun_timeout_id = NULL;
-
-  if (self->priv->next_stun_timeout == 0)
-    emit = FALSE;
-
- error:
-  fs_rawudp_component_stop_stun_locked (self);
-
-  FS_RAWUDP_COMPONENT_UNLOCK(self);
-
-  gst_object_unref (sysclock);
+  if (error)
+    fs_rawudp_component_emit_error (self, error->code, error->message,
+        "The STUN process produced an error");
 
-  if (emit)
+  /* No server answered, fall back to the local addresses */
+  if (!fs_rawudp_component_emit_local_candidates (self, &local_error))
   {
-    GError *error = NULL;
-    if (!fs_rawudp_component_emit_local_candidates (self, &error))
-    {
-      if (error->domain == FS_ERROR)
-        fs_rawudp_component_emit_error (self, error->code,
-            error->message, error->message);
-      else
-        fs_rawudp_component_emit_error (self, FS_ERROR_INTERNAL,
-            "Error emitting local errors", NULL);
-    }
-    g_clear_error (&error);
+    if (local_error->domain == FS_ERROR)
+      fs_rawudp_component_emit_error (self, local_error->code,
+          local_error->message, local_error->message);
+    else
+      fs_rawudp_component_emit_error (self, FS_ERROR_INTERNAL,
+          "Error emitting local errors", NULL);
   }
-
-  return NULL;
+  g_clear_error (&local_error);
 }
 
 
@@ -978,6 +939,33 @@ fs_rawudp_component_emit_error (FsRawUdpComponent *self,
 }
 
 
+/*
+ * Replaces the keepalive of the previous pair, if any
+ */
+static void
+fs_rawudp_component_start_keepalive (FsRawUdpComponent *self,
+    FsCandidate *remote)
+{
+  FsRawUdpKeepalive *keepalive =
+    fs_rawudp_transmitter_get_keepalive (self->priv->transmitter);
+  FsRawUdpAddress dest;
+  gulong id = 0;
+  gulong old_id;
+
+  if (fs_rawudp_address_set (&dest, remote->ip, remote->port))
+    id = fs_rawudp_keepalive_add (keepalive, self->priv->udpport, &dest);
+  else
+    GST_DEBUG ("No keepalive for non-numeric address %s", remote->ip);
+
+  FS_RAWUDP_COMPONENT_LOCK (self);
+  old_id = self->priv->keepalive_id;
+  self->priv->keepalive_id = id;
+  FS_RAWUDP_COMPONENT_UNLOCK (self);
+
+  if (old_id)
+    fs_rawudp_keepalive_remove (keepalive, old_id);
+}
+
 static void
 fs_rawudp_component_maybe_new_active_candidate_pair (FsRawUdpComponent *self)
 {
@@ -993,6 +981,8 @@ fs_rawudp_component_maybe_new_active_candidate_pair (FsRawUdpComponent *self)
     g_signal_emit (self, signals[NEW_ACTIVE_CANDIDATE_PAIR], 0,
         self->priv->local_active_candidate, remote);
 
+    fs_rawudp_component_start_keepalive (self, remote);
+
     fs_candidate_destroy (remote);
   }
   else
@@ -1008,8 +998,10 @@ fs_rawudp_component_emit_local_candidates (FsRawUdpComponent *self,
     GError **error)
 {
   GList *ips = NULL;
+  GList *candidates = NULL;
   GList *current;
   guint port;
+  guint i = 0;
 
   FS_RAWUDP_COMPONENT_LOCK (self);
   if (self->priv->local_forced_candidate)
@@ -1025,30 +1017,59 @@ fs_rawudp_component_emit_local_candidates (FsRawUdpComponent *self,
 
   port = fs_rawudp_transmitter_udpport_get_port (self->priv->udpport);
 
-  ips = fs_interfaces_get_local_ips (TRUE);
-
+  /* IPv6 addresses first, if the socket can use them */
+  if (fs_rawudp_transmitter_udpport_accepts_family (self->priv->udpport,
+          AF_INET6))
+    ips = fs_interfaces_get_local_ips6 (FALSE);
+  if (fs_rawudp_transmitter_udpport_accepts_family (self->priv->udpport,
+          AF_INET))
+    ips = g_list_concat (ips, fs_interfaces_get_local_ips (FALSE));
+
+  /* The loopback is only used when there is nothing else */
+  if (!ips && fs_rawudp_transmitter_udpport_accepts_family (
+          self->priv->udpport, AF_INET))
+    ips = fs_interfaces_get_local_ips (TRUE);
+  if (!ips && fs_rawudp_transmitter_udpport_accepts_family (
+          self->priv->udpport, AF_INET6))
+    ips = fs_interfaces_get_local_ips6 (TRUE);
+
+  /* Every address is a host candidate of its own */
   for (current = g_list_first (ips);
        current;
        current = g_list_next (current))
   {
-    self->priv->local_active_candidate = fs_candidate_new ("L1",
+    gchar *id = g_strdup_printf ("L%u", ++i);
+    FsCandidate *candidate = fs_candidate_new (id,
         self->priv->component,
         FS_CANDIDATE_TYPE_HOST,
         FS_NETWORK_PROTOCOL_UDP,
         current->data,
-        port);    /* FIXME: Emit only the first candidate ?? */
-    break;
+        port);
+
+    g_free (id);
+    candidates = g_list_append (candidates, candidate);
   }
 
+  /* The first address is the active one, so IPv6 is preferred */
+  if (!self->priv->local_active_candidate && candidates)
+    self->priv->local_active_candidate = fs_candidate_copy (candidates->data);
+
   /* free list of ips */
   g_list_foreach (ips, (GFunc) g_free, NULL);
   g_list_free (ips);
 
-  if (self->priv->local_active_candidate)
+  if (candidates)
   {
     FS_RAWUDP_COMPONENT_UNLOCK (self);
-    fs_rawudp_component_emit_candidate (self,
-        self->priv->local_active_candidate);
+
+    for (current = candidates; current; current = g_list_next (current))
+      g_signal_emit (self, signals[NEW_LOCAL_CANDIDATE], 0, current->data);
+    g_signal_emit (self, signals[LOCAL_CANDIDATES_PREPARED], 0);
+
+    fs_rawudp_component_maybe_new_active_candidate_pair (self);
+
+    g_list_foreach (candidates, (GFunc) fs_candidate_destroy, NULL);
+    g_list_free (candidates);
   }
   else
   {
@@ -0,0 +1,370 @@
+/*
+ * Farsight2 - Farsight RAW UDP keepalive scheduler
+ *
+ * fs-rawudp-keepalive.c - Keeps the NAT bindings of idle components open
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The entries are kept in a hashed timer wheel of N_SLOTS slots of one
+ * second, an entry further away than the size of the wheel also counts the
+ * number of turns it has to wait. A single thread advances the wheel, so
+ * each tick only looks at the entries that are due, whatever their number.
+ *
+ * When an entry is due, it compares the number of packets the sink of its
+ * UdpPort sent to its remote candidate with the value it saw last time. If
+ * nothing was sent to that candidate during the interval, because the
+ * stream is idle, not sending or only receiving, it sends a STUN binding
+ * indication, which needs no answer. What the UdpPort sends to the other
+ * destinations it shares its socket with does not count. A binding is thus never left idle for more than two
+ * intervals.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs-rawudp-keepalive.h"
+
+#include "stun.h"
+
+#include <string.h>
+
+#define GST_CAT_DEFAULT fs_rawudp_transmitter_debug
+
+#define TICK_MS 1000
+#define N_SLOTS 64
+
+typedef struct _KeepaliveEntry {
+  gulong id;
+
+  UdpPort *udpport;
+  FsRawUdpAddress dest;
+
+  guint last_sent;
+
+  /* Turns of the wheel left before it is due */
+  guint rounds;
+  guint slot;
+  GList *link;
+} KeepaliveEntry;
+
+struct _FsRawUdpKeepalive {
+  GMutex *mutex;
+  GCond *cond;
+
+  GThread *thread;
+  gboolean stop;
+
+  /* In seconds, 0 disables the keepalives */
+  guint interval;
+
+  /* GList of KeepaliveEntry */
+  GList *slots[N_SLOTS];
+  guint current;
+  guint64 next_tick;
+
+  /* gulong id -> KeepaliveEntry */
+  GHashTable *entries;
+  gulong next_id;
+};
+
+static guint64
+_now_ms (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (guint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+FsRawUdpKeepalive *
+fs_rawudp_keepalive_new (guint interval)
+{
+  FsRawUdpKeepalive *keepalive = g_slice_new0 (FsRawUdpKeepalive);
+
+  keepalive->mutex = g_mutex_new ();
+  keepalive->cond = g_cond_new ();
+  keepalive->interval = interval;
+  keepalive->entries = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  return keepalive;
+}
+
+/*
+ * All the entries must have been removed
+ */
+void
+fs_rawudp_keepalive_free (FsRawUdpKeepalive *keepalive)
+{
+  guint i;
+
+  g_mutex_lock (keepalive->mutex);
+  keepalive->stop = TRUE;
+  g_cond_broadcast (keepalive->cond);
+  g_mutex_unlock (keepalive->mutex);
+
+  if (keepalive->thread)
+    g_thread_join (keepalive->thread);
+
+  if (g_hash_table_size (keepalive->entries))
+    g_warning ("Freed the keepalive scheduler with %u entries left",
+        g_hash_table_size (keepalive->entries));
+
+  for (i = 0; i < N_SLOTS; i++)
+  {
+    GList *item;
+
+    for (item = keepalive->slots[i]; item; item = g_list_next (item))
+      g_slice_free (KeepaliveEntry, item->data);
+    g_list_free (keepalive->slots[i]);
+  }
+
+  g_hash_table_destroy (keepalive->entries);
+  g_cond_free (keepalive->cond);
+  g_mutex_free (keepalive->mutex);
+  g_slice_free (FsRawUdpKeepalive, keepalive);
+}
+
+/*
+ * Only affects the entries added after the call
+ */
+void
+fs_rawudp_keepalive_set_interval (FsRawUdpKeepalive *keepalive,
+    guint interval)
+{
+  g_mutex_lock (keepalive->mutex);
+  keepalive->interval = interval;
+  g_mutex_unlock (keepalive->mutex);
+}
+
+guint
+fs_rawudp_keepalive_get_interval (FsRawUdpKeepalive *keepalive)
+{
+  guint interval;
+
+  g_mutex_lock (keepalive->mutex);
+  interval = keepalive->interval;
+  g_mutex_unlock (keepalive->mutex);
+
+  return interval;
+}
+
+static void
+_schedule_locked (FsRawUdpKeepalive *keepalive,
+    KeepaliveEntry *entry,
+    guint ticks)
+{
+  entry->slot = (keepalive->current + ticks) % N_SLOTS;
+  entry->rounds = (ticks - 1) / N_SLOTS;
+  keepalive->slots[entry->slot] = g_list_prepend (
+      keepalive->slots[entry->slot], entry);
+  entry->link = keepalive->slots[entry->slot];
+}
+
+static void
+_send_indication (KeepaliveEntry *entry)
+{
+  gchar packed[STUN_HEADER_LENGTH];
+  gchar id[16];
+  guint length;
+  guint i;
+  GError *error = NULL;
+
+  ((guint32 *) id)[0] = g_htonl (STUN_MAGIC_COOKIE);
+  for (i = 1; i < 4; i++)
+    ((guint32 *) id)[i] = g_random_int ();
+
+  length = stun_message_write (packed, sizeof (packed),
+      STUN_MESSAGE_BINDING_INDICATION, id);
+
+  if (!fs_rawudp_transmitter_udpport_sendto (entry->udpport, packed, length,
+          &entry->dest, &error))
+  {
+    GST_DEBUG ("Could not send keepalive: %s", error->message);
+    g_clear_error (&error);
+  }
+}
+
+static void
+_tick_locked (FsRawUdpKeepalive *keepalive)
+{
+  GList *due, *item;
+
+  keepalive->current = (keepalive->current + 1) % N_SLOTS;
+
+  /* Entries are put back in the wheel as they are processed, possibly in
+   * this same slot */
+  due = keepalive->slots[keepalive->current];
+  keepalive->slots[keepalive->current] = NULL;
+
+  for (item = due; item; item = g_list_next (item))
+  {
+    KeepaliveEntry *entry = item->data;
+    guint sent;
+
+    if (entry->rounds)
+    {
+      entry->rounds--;
+      keepalive->slots[entry->slot] = g_list_prepend (
+          keepalive->slots[entry->slot], entry);
+      entry->link = keepalive->slots[entry->slot];
+      continue;
+    }
+
+    sent = fs_rawudp_transmitter_udpport_get_sent (entry->udpport,
+        &entry->dest);
+    if (sent == entry->last_sent)
+      _send_indication (entry);
+    entry->last_sent = sent;
+
+    _schedule_locked (keepalive, entry,
+        MAX (1, keepalive->interval * 1000 / TICK_MS));
+  }
+
+  g_list_free (due);
+}
+
+static gpointer
+_timer_thread (gpointer user_data)
+{
+  FsRawUdpKeepalive *keepalive = user_data;
+
+  g_mutex_lock (keepalive->mutex);
+
+  while (!keepalive->stop)
+  {
+    guint64 now;
+
+    if (!g_hash_table_size (keepalive->entries))
+    {
+      g_cond_wait (keepalive->cond, keepalive->mutex);
+      continue;
+    }
+
+    now = _now_ms ();
+    if (now < keepalive->next_tick)
+    {
+      GTimeVal abstime;
+
+      abstime.tv_sec = keepalive->next_tick / 1000;
+      abstime.tv_usec = (keepalive->next_tick % 1000) * 1000;
+      g_cond_timed_wait (keepalive->cond, keepalive->mutex, &abstime);
+      continue;
+    }
+
+    _tick_locked (keepalive);
+
+    /* Do not try to catch up after the clock jumped */
+    keepalive->next_tick += TICK_MS;
+    if (keepalive->next_tick <= now)
+      keepalive->next_tick = now + TICK_MS;
+  }
+
+  g_mutex_unlock (keepalive->mutex);
+
+  return NULL;
+}
+
+/**
+ * fs_rawudp_keepalive_add:
+ * @keepalive: a #FsRawUdpKeepalive
+ * @udpport: the #UdpPort to keep alive
+ * @dest: the remote address the binding is for
+ *
+ * Starts sending keepalives from @udpport to @dest when it is idle.
+ *
+ * Returns: the id of the entry, or 0 if the keepalives are disabled
+ */
+
+gulong
+fs_rawudp_keepalive_add (FsRawUdpKeepalive *keepalive,
+    UdpPort *udpport,
+    const FsRawUdpAddress *dest)
+{
+  KeepaliveEntry *entry;
+  gulong id;
+
+  g_mutex_lock (keepalive->mutex);
+
+  if (!keepalive->interval)
+  {
+    g_mutex_unlock (keepalive->mutex);
+    return 0;
+  }
+
+  if (!keepalive->thread)
+  {
+    GError *error = NULL;
+
+    keepalive->thread = g_thread_create (_timer_thread, keepalive, TRUE,
+        &error);
+    if (!keepalive->thread)
+    {
+      g_mutex_unlock (keepalive->mutex);
+      GST_WARNING ("Could not start the keepalive thread: %s",
+          error->message);
+      g_clear_error (&error);
+      return 0;
+    }
+  }
+
+  if (!g_hash_table_size (keepalive->entries))
+    keepalive->next_tick = _now_ms () + TICK_MS;
+
+  entry = g_slice_new0 (KeepaliveEntry);
+  entry->udpport = udpport;
+  entry->dest = *dest;
+  entry->last_sent = fs_rawudp_transmitter_udpport_get_sent (udpport, dest);
+
+  /* 0 is the error value */
+  if (++keepalive->next_id == 0)
+    keepalive->next_id++;
+  id = entry->id = keepalive->next_id;
+
+  _schedule_locked (keepalive, entry,
+      MAX (1, keepalive->interval * 1000 / TICK_MS));
+  g_hash_table_insert (keepalive->entries, GUINT_TO_POINTER (id), entry);
+  g_cond_broadcast (keepalive->cond);
+
+  g_mutex_unlock (keepalive->mutex);
+
+  return id;
+}
+
+/*
+ * Once this returns, nothing will be sent from the UdpPort of the entry
+ */
+void
+fs_rawudp_keepalive_remove (FsRawUdpKeepalive *keepalive,
+    gulong id)
+{
+  KeepaliveEntry *entry;
+
+  g_mutex_lock (keepalive->mutex);
+
+  entry = g_hash_table_lookup (keepalive->entries, GUINT_TO_POINTER (id));
+  if (entry)
+  {
+    g_hash_table_remove (keepalive->entries, GUINT_TO_POINTER (id));
+    keepalive->slots[entry->slot] = g_list_delete_link (
+        keepalive->slots[entry->slot], entry->link);
+    g_slice_free (KeepaliveEntry, entry);
+  }
+
+  g_mutex_unlock (keepalive->mutex);
+}
@@ -0,0 +1,56 @@
+/*
+ * Farsight2 - Farsight RAW UDP keepalive scheduler
+ *
+ * fs-rawudp-keepalive.h - Keeps the NAT bindings of idle components open
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_RAWUDP_KEEPALIVE_H__
+#define __FS_RAWUDP_KEEPALIVE_H__
+
+#include "fs-rawudp-transmitter.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Private declaration */
+typedef struct _FsRawUdpKeepalive FsRawUdpKeepalive;
+
+FsRawUdpKeepalive *fs_rawudp_keepalive_new (guint interval);
+
+void fs_rawudp_keepalive_free (FsRawUdpKeepalive *keepalive);
+
+void fs_rawudp_keepalive_set_interval (FsRawUdpKeepalive *keepalive,
+    guint interval);
+
+guint fs_rawudp_keepalive_get_interval (FsRawUdpKeepalive *keepalive);
+
+gulong fs_rawudp_keepalive_add (FsRawUdpKeepalive *keepalive,
+    UdpPort *udpport,
+    const FsRawUdpAddress *dest);
+
+void fs_rawudp_keepalive_remove (FsRawUdpKeepalive *keepalive,
+    gulong id);
+
+/* Implemented in fs-rawudp-transmitter.c, the scheduler shared by its
+ * streams */
+FsRawUdpKeepalive *fs_rawudp_transmitter_get_keepalive (
+    FsRawUdpTransmitter *trans);
+
+G_END_DECLS
+
+#endif /* __FS_RAWUDP_KEEPALIVE_H__ */
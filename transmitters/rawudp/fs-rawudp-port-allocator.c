@@ -0,0 +1,393 @@
+/*
+ * Farsight2 - Farsight RAW UDP port allocator
+ *
+ * fs-rawudp-port-allocator.c - Reserves local ports from a range
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The allocator keeps one bit per port, split in two bitmaps by parity so
+ * that the ports of the same parity as the requested one, which is what the
+ * RTP/RTCP numbering needs, are contiguous bits. Finding a free port is a
+ * scan over whole words from the requested port, it never tries to bind().
+ *
+ * An even port is reserved together with the odd port that follows it, so
+ * that the RTCP component can get the port right after the RTP one even if
+ * another stream is reserving ports at the same time. That odd port is held
+ * until it is claimed, and is given back with the even port if nobody did.
+ *
+ * There is only one set of ports for all the local addresses: a port
+ * reserved for a socket bound to one address is not handed out for another
+ * address. A socket bound to the unspecified address, which is what the
+ * streams get by default, conflicts with every other address anyway.
+ *
+ * Released ports, and ports that some other process turned out to be using,
+ * stay reserved for the quarantine period so that late packets of an old
+ * call are not delivered to a new one, and so that a busy port is not
+ * retried at every allocation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs-rawudp-port-allocator.h"
+
+#include <string.h>
+
+#define N_PORTS 65536
+#define BITS_PER_WORD (sizeof (gulong) * 8)
+#define N_WORDS (N_PORTS / 2 / BITS_PER_WORD)
+
+typedef struct _QuarantinedPort {
+  guint port;
+  guint64 expiry;
+} QuarantinedPort;
+
+struct _FsRawUdpPortAllocator {
+  GMutex *mutex;
+
+  guint min_port;
+  guint max_port;
+  guint quarantine;
+
+  /* Indexed by port / 2, a set bit is a port we can not use */
+  gulong bitmap[2][N_WORDS];
+  /* Indexed by port / 2, the odd ports reserved with their even port that
+   * have not been claimed yet */
+  gulong held[N_WORDS];
+
+  /* Ports of the range that are reserved, quarantined ones included */
+  guint n_reserved;
+
+  /* QuarantinedPort, in order of expiry */
+  GQueue quarantined;
+};
+
+static guint64
+_now_ms (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (guint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static gboolean
+_is_set (FsRawUdpPortAllocator *allocator, guint port)
+{
+  guint i = port / 2;
+
+  return (allocator->bitmap[port & 1][i / BITS_PER_WORD] &
+      (1UL << (i % BITS_PER_WORD))) != 0;
+}
+
+static void
+_set_bit (gulong *bitmap, guint port, gboolean value)
+{
+  guint i = port / 2;
+
+  if (value)
+    bitmap[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+  else
+    bitmap[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+}
+
+static void
+_set (FsRawUdpPortAllocator *allocator, guint port, gboolean value)
+{
+  _set_bit (allocator->bitmap[port & 1], port, value);
+}
+
+static gboolean
+_is_held (FsRawUdpPortAllocator *allocator, guint port)
+{
+  guint i = port / 2;
+
+  return (port & 1) && (allocator->held[i / BITS_PER_WORD] &
+      (1UL << (i % BITS_PER_WORD))) != 0;
+}
+
+FsRawUdpPortAllocator *
+fs_rawudp_port_allocator_new (guint min_port,
+    guint max_port,
+    guint quarantine)
+{
+  FsRawUdpPortAllocator *allocator;
+  guint port;
+
+  g_return_val_if_fail (min_port > 0 && min_port <= max_port &&
+      max_port < N_PORTS, NULL);
+
+  allocator = g_slice_new0 (FsRawUdpPortAllocator);
+  allocator->mutex = g_mutex_new ();
+  allocator->min_port = min_port;
+  allocator->max_port = max_port;
+  allocator->quarantine = quarantine;
+  g_queue_init (&allocator->quarantined);
+
+  /* Ports outside of the range are permanently taken */
+  for (port = 0; port < min_port; port++)
+    _set (allocator, port, TRUE);
+  for (port = max_port + 1; port < N_PORTS; port++)
+    _set (allocator, port, TRUE);
+
+  return allocator;
+}
+
+void
+fs_rawudp_port_allocator_free (FsRawUdpPortAllocator *allocator)
+{
+  QuarantinedPort *qport;
+
+  while ((qport = g_queue_pop_head (&allocator->quarantined)))
+    g_slice_free (QuarantinedPort, qport);
+
+  g_mutex_free (allocator->mutex);
+  g_slice_free (FsRawUdpPortAllocator, allocator);
+}
+
+/*
+ * Only affects the ports released after the call
+ */
+void
+fs_rawudp_port_allocator_set_quarantine (FsRawUdpPortAllocator *allocator,
+    guint quarantine)
+{
+  g_mutex_lock (allocator->mutex);
+  allocator->quarantine = quarantine;
+  g_mutex_unlock (allocator->mutex);
+}
+
+static void
+_expire_quarantine_locked (FsRawUdpPortAllocator *allocator)
+{
+  QuarantinedPort *qport;
+  guint64 now;
+
+  if (g_queue_is_empty (&allocator->quarantined))
+    return;
+
+  now = _now_ms ();
+  while ((qport = g_queue_peek_head (&allocator->quarantined)) &&
+      qport->expiry <= now)
+  {
+    g_queue_pop_head (&allocator->quarantined);
+    _set (allocator, qport->port, FALSE);
+    allocator->n_reserved--;
+    g_slice_free (QuarantinedPort, qport);
+  }
+}
+
+/**
+ * fs_rawudp_port_allocator_reserve:
+ * @allocator: a #FsRawUdpPortAllocator
+ * @from_port: the preferred port
+ *
+ * Reserves the first free port of the same parity as @from_port, starting
+ * at @from_port. If it is even, the following odd port is reserved with it
+ * and held until fs_rawudp_port_allocator_claim() is called for it.
+ *
+ * Returns: the reserved port or 0 if the range has no free port left
+ */
+
+guint
+fs_rawudp_port_allocator_reserve (FsRawUdpPortAllocator *allocator,
+    guint from_port)
+{
+  guint parity = from_port & 1;
+  guint i = from_port / 2;
+  guint w;
+  guint port = 0;
+
+  if (from_port >= N_PORTS)
+    return 0;
+
+  g_mutex_lock (allocator->mutex);
+
+  _expire_quarantine_locked (allocator);
+
+  for (w = i / BITS_PER_WORD; w < N_WORDS; w++)
+  {
+    gulong taken = allocator->bitmap[parity][w];
+
+    if (parity == 0)
+      taken |= allocator->bitmap[1][w];
+
+    /* Ignore the ports below the requested one in the first word */
+    if (w == i / BITS_PER_WORD && i % BITS_PER_WORD)
+      taken |= (1UL << (i % BITS_PER_WORD)) - 1;
+
+    if (taken != ~0UL)
+    {
+      gint bit = g_bit_nth_lsf (~taken, -1);
+
+      port = (w * BITS_PER_WORD + bit) * 2 + parity;
+      break;
+    }
+  }
+
+  if (port)
+  {
+    _set (allocator, port, TRUE);
+    allocator->n_reserved++;
+
+    if (parity == 0)
+    {
+      _set (allocator, port + 1, TRUE);
+      _set_bit (allocator->held, port + 1, TRUE);
+      allocator->n_reserved++;
+    }
+  }
+
+  g_mutex_unlock (allocator->mutex);
+
+  return port;
+}
+
+/**
+ * fs_rawudp_port_allocator_claim:
+ * @allocator: a #FsRawUdpPortAllocator
+ * @port: an odd port
+ *
+ * Takes the odd port that was reserved with the even port before it, it is
+ * then released like any other reserved port.
+ *
+ * Returns: %FALSE if @port was not held for its even port
+ */
+
+gboolean
+fs_rawudp_port_allocator_claim (FsRawUdpPortAllocator *allocator,
+    guint port)
+{
+  gboolean held;
+
+  if (port >= N_PORTS)
+    return FALSE;
+
+  g_mutex_lock (allocator->mutex);
+  held = _is_held (allocator, port);
+  if (held)
+    _set_bit (allocator->held, port, FALSE);
+  g_mutex_unlock (allocator->mutex);
+
+  return held;
+}
+
+static void
+_release_locked (FsRawUdpPortAllocator *allocator,
+    guint port,
+    gboolean quarantine)
+{
+  QuarantinedPort *qport;
+
+  if (!quarantine || allocator->quarantine == 0)
+  {
+    _set (allocator, port, FALSE);
+    allocator->n_reserved--;
+  }
+  else
+  {
+    qport = g_slice_new (QuarantinedPort);
+    qport->port = port;
+    qport->expiry = _now_ms () + allocator->quarantine;
+    g_queue_push_tail (&allocator->quarantined, qport);
+  }
+}
+
+static void
+_release (FsRawUdpPortAllocator *allocator,
+    guint port,
+    gboolean quarantine)
+{
+  g_return_if_fail (port < N_PORTS);
+
+  g_mutex_lock (allocator->mutex);
+
+  if (!_is_set (allocator, port) || _is_held (allocator, port) ||
+      port < allocator->min_port || port > allocator->max_port)
+  {
+    g_mutex_unlock (allocator->mutex);
+    g_warning ("Released port %u which was not reserved", port);
+    return;
+  }
+
+  _release_locked (allocator, port, quarantine);
+
+  /* Nobody used the RTCP port of the pair, it can be reused at once */
+  if ((port & 1) == 0 && _is_held (allocator, port + 1))
+  {
+    _set_bit (allocator->held, port + 1, FALSE);
+    _release_locked (allocator, port + 1, FALSE);
+  }
+
+  g_mutex_unlock (allocator->mutex);
+}
+
+/**
+ * fs_rawudp_port_allocator_release:
+ * @allocator: a #FsRawUdpPortAllocator
+ * @port: a port returned by fs_rawudp_port_allocator_reserve()
+ *
+ * Gives a port back, it can be reserved again once the quarantine period is
+ * over. This is also how a port that someone else is using is reported.
+ * For an even port, the odd port reserved with it is given back too if it
+ * was never claimed.
+ */
+
+void
+fs_rawudp_port_allocator_release (FsRawUdpPortAllocator *allocator,
+    guint port)
+{
+  _release (allocator, port, TRUE);
+}
+
+/**
+ * fs_rawudp_port_allocator_unreserve:
+ * @allocator: a #FsRawUdpPortAllocator
+ * @port: a port returned by fs_rawudp_port_allocator_reserve()
+ *
+ * Gives back a port that was never used, it can be reserved again at once.
+ */
+
+void
+fs_rawudp_port_allocator_unreserve (FsRawUdpPortAllocator *allocator,
+    guint port)
+{
+  _release (allocator, port, FALSE);
+}
+
+/**
+ * fs_rawudp_port_allocator_get_usage:
+ * @allocator: a #FsRawUdpPortAllocator
+ *
+ * Returns: the fraction of the range that is reserved or in quarantine
+ */
+
+gdouble
+fs_rawudp_port_allocator_get_usage (FsRawUdpPortAllocator *allocator)
+{
+  gdouble usage;
+
+  g_mutex_lock (allocator->mutex);
+  _expire_quarantine_locked (allocator);
+  usage = (gdouble) allocator->n_reserved /
+    (allocator->max_port - allocator->min_port + 1);
+  g_mutex_unlock (allocator->mutex);
+
+  return usage;
+}
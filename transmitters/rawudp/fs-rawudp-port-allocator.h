@@ -0,0 +1,56 @@
+/*
+ * Farsight2 - Farsight RAW UDP port allocator
+ *
+ * fs-rawudp-port-allocator.h - Reserves local ports from a range
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_RAWUDP_PORT_ALLOCATOR_H__
+#define __FS_RAWUDP_PORT_ALLOCATOR_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Private declaration */
+typedef struct _FsRawUdpPortAllocator FsRawUdpPortAllocator;
+
+FsRawUdpPortAllocator *fs_rawudp_port_allocator_new (guint min_port,
+    guint max_port,
+    guint quarantine);
+
+void fs_rawudp_port_allocator_free (FsRawUdpPortAllocator *allocator);
+
+void fs_rawudp_port_allocator_set_quarantine (FsRawUdpPortAllocator *allocator,
+    guint quarantine);
+
+guint fs_rawudp_port_allocator_reserve (FsRawUdpPortAllocator *allocator,
+    guint from_port);
+
+gboolean fs_rawudp_port_allocator_claim (FsRawUdpPortAllocator *allocator,
+    guint port);
+
+void fs_rawudp_port_allocator_release (FsRawUdpPortAllocator *allocator,
+    guint port);
+
+void fs_rawudp_port_allocator_unreserve (FsRawUdpPortAllocator *allocator,
+    guint port);
+
+gdouble fs_rawudp_port_allocator_get_usage (FsRawUdpPortAllocator *allocator);
+
+G_END_DECLS
+
+#endif /* __FS_RAWUDP_PORT_ALLOCATOR_H__ */
@@ -36,13 +36,24 @@
  * <para>
  * It will detect its own address using a STUN request if the
  * #FsRawUdpStreamTransmitter:stun-ip and #FsRawUdpStreamTransmitter:stun-port
- * properties are set. If the STUN request does not get a reply
+ * properties are set. #FsRawUdpStreamTransmitter:stun-ip can be a comma
+ * separated list of servers, optionally with their own port as in
+ * "x.x.x.x:port" or "[x::x]:port", they are all queried at once and the
+ * first answer is used.
+ * If the STUN request does not get a reply
  * or no STUN is requested. It will return the IP address of all the local
  * network interfaces, listing link-local addresses after other addresses
  * and the loopback interface last.
  * </para>
  *
  * <para>
+ * Unless a local address is requested, each component gets a dual-stack
+ * IPv6 socket when the system supports it, so it can talk to IPv4 and IPv6
+ * candidates alike, and its IPv6 host address is offered before the IPv4
+ * one.
+ * </para>
+ *
+ * <para>
  * You can configure the address and port it will listen on by setting the
  * "preferred-local-candidates" property. This property will contain a #GList
  * of #FsCandidate. These #FsCandidate must be for #FS_NETWORK_PROTOCOL_UDP.
@@ -233,8 +244,10 @@ fs_rawudp_stream_transmitter_class_init (FsRawUdpStreamTransmitterClass *klass)
   g_object_class_install_property (gobject_class,
       PROP_STUN_IP,
       g_param_spec_string ("stun-ip",
-          "The IP address of the STUN server",
-          "The IPv4 address of the STUN server as a x.x.x.x string",
+          "The IP addresses of the STUN servers",
+          "The IPv4 or IPv6 addresses of the STUN servers as a comma"
+          " separated list, with an optional port as in x.x.x.x:port or"
+          " [x::x]:port",
           NULL,
           G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE));
 
@@ -250,7 +263,7 @@ fs_rawudp_stream_transmitter_class_init (FsRawUdpStreamTransmitterClass *klass)
       PROP_STUN_TIMEOUT,
       g_param_spec_uint ("stun-timeout",
           "The timeout for the STUN reply",
-          "How long to wait for for the STUN reply (in seconds) before giving up",
+          "How long to wait for for a STUN reply (in seconds) before giving up",
           1, G_MAXUINT, 30,
           G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE));
 
@@ -406,6 +419,7 @@ fs_rawudp_stream_transmitter_build (FsRawUdpStreamTransmitter *self,
   GList *item;
   gint c;
   guint16 next_port;
+  gboolean shared_socket;
 
   self->priv->component = g_new0 (FsRawUdpComponent *,
       self->priv->transmitter->components + 1);
@@ -463,6 +477,11 @@ fs_rawudp_stream_transmitter_build (FsRawUdpStreamTransmitter *self,
   if (ports[1] == 0)
     ports[1] = 7078;
 
+  /* With a shared socket, every stream gets the ports bound by the first one
+   * whatever it requests */
+  g_object_get (self->priv->transmitter, "shared-socket", &shared_socket,
+      NULL);
+
   next_port = ports[1];
 
   for (c = 1; c <= self->priv->transmitter->components; c++)
@@ -498,9 +517,11 @@ fs_rawudp_stream_transmitter_build (FsRawUdpStreamTransmitter *self,
     /* If we dont get the requested port and it wasnt a forced port,
      * then we rewind up to the last forced port and jump to the next
      * package of components, all non-forced ports must be consecutive!
+     * A shared socket would be found again whatever we request, so the
+     * rewind could never end.
      */
 
-    if (used_port != requested_port  &&  !ports[c])
+    if (used_port != requested_port  &&  !ports[c]  &&  !shared_socket)
     {
       do {
         g_object_unref (self->priv->component[c]);
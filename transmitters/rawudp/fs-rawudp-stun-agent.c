@@ -0,0 +1,837 @@
+/*
+ * Farsight2 - Farsight RAW UDP STUN agent
+ *
+ * fs-rawudp-stun-agent.c - Runs the STUN binding requests of all components
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * A discovery sends a binding request to every server it is given at once,
+ * each one is its own transaction with its own transaction id. The first
+ * server to answer wins and the other transactions are dropped. The
+ * transactions of all components are in a single table, so a response is
+ * matched by its transaction id whatever UdpPort it arrived on.
+ *
+ * Requests are retransmitted as in RFC 5389 section 7.2.1: the first RTO is
+ * 500ms and doubles at each retransmission, Rc requests are sent in total and
+ * the transaction fails Rm times the initial RTO after the last one. The
+ * discovery also fails when its own timeout expires first. A single thread
+ * does the retransmissions of all the transactions.
+ *
+ * The transaction ids start with the RFC 5389 magic cookie, so that newer
+ * servers answer with a XOR-MAPPED-ADDRESS, which is preferred when both are
+ * present since some NATs rewrite the addresses they find in packets.
+ *
+ * The answers are cached for a while, keyed by the local address of the
+ * UdpPort and the server, so that a stream that binds the same address, in
+ * the shared-socket mode or when a port is reused by the next call, does
+ * not need to ask again. The whole cache is dropped when the set of local
+ * addresses changes, since the NAT in front of us may have changed too.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "fs-rawudp-stun-agent.h"
+
+#include "stun.h"
+
+#include <gst/farsight/fs-conference-iface.h>
+#include <gst/farsight/fs-interfaces.h>
+
+#include <string.h>
+
+#define GST_CAT_DEFAULT fs_rawudp_transmitter_debug
+
+#define STUN_RTO_INITIAL 500
+#define STUN_RC 7
+#define STUN_RM 16
+
+#define DEFAULT_CACHE_TTL 60
+
+typedef struct _StunRequest StunRequest;
+
+typedef struct _StunTransaction {
+  gchar id[16];
+  StunRequest *request;
+
+  FsRawUdpAddress server;
+  gulong recv_id;
+
+  /* The binding request, it has no attribute */
+  gchar packed[STUN_HEADER_LENGTH];
+  guint length;
+
+  /* Number of requests sent so far */
+  guint sent;
+  guint rto;
+  /* Time of the next retransmission or of the failure, 0 once it is over */
+  guint64 next;
+} StunTransaction;
+
+struct _StunRequest {
+  gulong id;
+  UdpPort *udpport;
+
+  /* The address the UdpPort is bound to, the family is 0 if it is unknown */
+  FsRawUdpAddress local;
+
+  StunTransaction *transactions;
+  guint n_transactions;
+  guint n_pending;
+
+  guint64 deadline;
+  gboolean got_error;
+
+  /* Set once it is out of the transactions table, it is only freed once its
+   * callback has returned */
+  gboolean completed;
+  GThread *dispatch_thread;
+
+  FsRawUdpStunFunc func;
+  gpointer user_data;
+};
+
+struct _FsRawUdpStunAgent {
+  GMutex *mutex;
+  /* Signalled when the timer thread must wake up and when a callback
+   * returns */
+  GCond *cond;
+
+  GThread *thread;
+  gboolean stop;
+
+  /* gulong id -> StunRequest */
+  GHashTable *requests;
+  /* gchar[16] transaction id -> StunTransaction */
+  GHashTable *transactions;
+
+  gulong next_id;
+
+  /* StunCacheEntry -> itself */
+  GHashTable *cache;
+  /* In seconds, 0 disables the cache */
+  guint cache_ttl;
+  /* The local addresses the cache is valid for */
+  gchar *interfaces;
+};
+
+typedef struct _StunCacheEntry {
+  FsRawUdpAddress local;
+  FsRawUdpAddress server;
+  FsRawUdpAddress mapped;
+  guint64 expiry;
+} StunCacheEntry;
+
+static guint64
+_now_ms (void)
+{
+  GTimeVal tv;
+
+  g_get_current_time (&tv);
+
+  return (guint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static guint
+_transaction_id_hash (gconstpointer key)
+{
+  guint32 hash;
+
+  /* The ids are random after the magic cookie */
+  memcpy (&hash, (const gchar *) key + 4, sizeof (hash));
+
+  return hash;
+}
+
+static gboolean
+_transaction_id_equal (gconstpointer a, gconstpointer b)
+{
+  return !memcmp (a, b, 16);
+}
+
+static guint
+_cache_entry_hash (gconstpointer key)
+{
+  const StunCacheEntry *entry = key;
+
+  return fs_rawudp_address_hash (&entry->local) ^
+    fs_rawudp_address_hash (&entry->server);
+}
+
+static gboolean
+_cache_entry_equal (gconstpointer a, gconstpointer b)
+{
+  const StunCacheEntry *entry_a = a;
+  const StunCacheEntry *entry_b = b;
+
+  return fs_rawudp_address_equal (&entry_a->local, &entry_b->local) &&
+    fs_rawudp_address_equal (&entry_a->server, &entry_b->server);
+}
+
+static void
+_cache_entry_free (gpointer data)
+{
+  g_slice_free (StunCacheEntry, data);
+}
+
+FsRawUdpStunAgent *
+fs_rawudp_stun_agent_new (void)
+{
+  FsRawUdpStunAgent *agent = g_slice_new0 (FsRawUdpStunAgent);
+
+  agent->mutex = g_mutex_new ();
+  agent->cond = g_cond_new ();
+  agent->requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+  agent->transactions = g_hash_table_new (_transaction_id_hash,
+      _transaction_id_equal);
+  agent->cache = g_hash_table_new_full (_cache_entry_hash, _cache_entry_equal,
+      _cache_entry_free, NULL);
+  agent->cache_ttl = DEFAULT_CACHE_TTL;
+
+  return agent;
+}
+
+/*
+ * All the discoveries must have been cancelled or be over
+ */
+void
+fs_rawudp_stun_agent_free (FsRawUdpStunAgent *agent)
+{
+  g_mutex_lock (agent->mutex);
+  agent->stop = TRUE;
+  g_cond_broadcast (agent->cond);
+  g_mutex_unlock (agent->mutex);
+
+  if (agent->thread)
+    g_thread_join (agent->thread);
+
+  if (g_hash_table_size (agent->requests))
+    g_warning ("Freed the STUN agent with %u discoveries running",
+        g_hash_table_size (agent->requests));
+
+  g_hash_table_destroy (agent->requests);
+  g_hash_table_destroy (agent->transactions);
+  g_hash_table_destroy (agent->cache);
+  g_free (agent->interfaces);
+  g_cond_free (agent->cond);
+  g_mutex_free (agent->mutex);
+  g_slice_free (FsRawUdpStunAgent, agent);
+}
+
+static void
+_request_free (StunRequest *request)
+{
+  g_free (request->transactions);
+  g_slice_free (StunRequest, request);
+}
+
+static void
+_remove_transactions_locked (FsRawUdpStunAgent *agent,
+    StunRequest *request)
+{
+  guint i;
+
+  for (i = 0; i < request->n_transactions; i++)
+    g_hash_table_remove (agent->transactions, request->transactions[i].id);
+}
+
+static void
+_disconnect_transactions (StunRequest *request)
+{
+  guint i;
+
+  for (i = 0; i < request->n_transactions; i++)
+    if (request->transactions[i].recv_id)
+      fs_rawudp_transmitter_udpport_disconnect_recv (request->udpport,
+          request->transactions[i].recv_id);
+}
+
+/*
+ * Called with the lock held, it is released while the callback runs
+ */
+static void
+_complete_locked (FsRawUdpStunAgent *agent,
+    StunRequest *request,
+    const FsRawUdpAddress *mapped)
+{
+  GError *error = NULL;
+
+  request->completed = TRUE;
+  request->dispatch_thread = g_thread_self ();
+  _remove_transactions_locked (agent, request);
+  g_mutex_unlock (agent->mutex);
+
+  _disconnect_transactions (request);
+
+  if (!mapped && request->got_error)
+    error = g_error_new (FS_ERROR, FS_ERROR_NETWORK,
+        "Got an error message from the STUN server");
+
+  request->func (mapped, error, request->user_data);
+  g_clear_error (&error);
+
+  g_mutex_lock (agent->mutex);
+  g_hash_table_remove (agent->requests, GUINT_TO_POINTER (request->id));
+  _request_free (request);
+  g_cond_broadcast (agent->cond);
+}
+
+static void
+_transaction_over_locked (StunTransaction *trans)
+{
+  trans->next = 0;
+  trans->request->n_pending--;
+}
+
+static gboolean
+_cache_entry_expired (gpointer key, gpointer value, gpointer user_data)
+{
+  return ((StunCacheEntry *) key)->expiry <= *(guint64 *) user_data;
+}
+
+static void
+_cache_store_locked (FsRawUdpStunAgent *agent,
+    StunRequest *request,
+    const FsRawUdpAddress *server,
+    const FsRawUdpAddress *mapped)
+{
+  StunCacheEntry *entry;
+  guint64 now;
+
+  if (!agent->cache_ttl || !request->local.sa.sa_family)
+    return;
+
+  now = _now_ms ();
+  g_hash_table_foreach_remove (agent->cache, _cache_entry_expired, &now);
+
+  entry = g_slice_new (StunCacheEntry);
+  entry->local = request->local;
+  entry->server = *server;
+  entry->mapped = *mapped;
+  entry->expiry = now + (guint64) agent->cache_ttl * 1000;
+  g_hash_table_replace (agent->cache, entry, entry);
+}
+
+static gchar *
+_get_local_ips (void)
+{
+  GList *ips, *item;
+  GString *str = g_string_new (NULL);
+
+  ips = g_list_concat (fs_interfaces_get_local_ips6 (TRUE),
+      fs_interfaces_get_local_ips (TRUE));
+  for (item = ips; item; item = g_list_next (item))
+  {
+    g_string_append (str, item->data);
+    g_string_append_c (str, ' ');
+    g_free (item->data);
+  }
+  g_list_free (ips);
+
+  return g_string_free (str, FALSE);
+}
+
+/**
+ * fs_rawudp_stun_agent_lookup:
+ * @agent: a #FsRawUdpStunAgent
+ * @udpport: the #UdpPort to find the reflexive address of
+ * @servers: the STUN servers that would be queried
+ * @n_servers: the number of servers in @servers
+ * @mapped: location for the reflexive address
+ *
+ * Looks for an answer that one of @servers gave recently for the address
+ * @udpport is bound to. This should be done before a discovery, it is also
+ * where a change of the local addresses is noticed.
+ *
+ * Returns: %TRUE if @mapped was set from the cache
+ */
+
+gboolean
+fs_rawudp_stun_agent_lookup (FsRawUdpStunAgent *agent,
+    UdpPort *udpport,
+    const FsRawUdpAddress *servers,
+    guint n_servers,
+    FsRawUdpAddress *mapped)
+{
+  StunCacheEntry key;
+  StunCacheEntry *entry = NULL;
+  gchar *ips;
+  guint64 now;
+  guint i;
+
+  if (!fs_rawudp_transmitter_udpport_get_local_address (udpport, &key.local))
+    return FALSE;
+
+  ips = _get_local_ips ();
+
+  g_mutex_lock (agent->mutex);
+
+  if (!agent->interfaces || strcmp (agent->interfaces, ips))
+  {
+    if (agent->interfaces && g_hash_table_size (agent->cache))
+    {
+      GST_DEBUG ("The local addresses changed, dropping the STUN cache");
+      g_hash_table_remove_all (agent->cache);
+    }
+    g_free (agent->interfaces);
+    agent->interfaces = ips;
+  }
+  else
+  {
+    g_free (ips);
+  }
+
+  now = _now_ms ();
+  for (i = 0; i < n_servers && !entry; i++)
+  {
+    key.server = servers[i];
+    entry = g_hash_table_lookup (agent->cache, &key);
+    if (entry && entry->expiry <= now)
+    {
+      g_hash_table_remove (agent->cache, entry);
+      entry = NULL;
+    }
+  }
+
+  if (entry)
+    *mapped = entry->mapped;
+
+  g_mutex_unlock (agent->mutex);
+
+  return entry != NULL;
+}
+
+/*
+ * In seconds, 0 disables the cache and drops its content
+ */
+void
+fs_rawudp_stun_agent_set_cache_ttl (FsRawUdpStunAgent *agent,
+    guint ttl)
+{
+  g_mutex_lock (agent->mutex);
+  agent->cache_ttl = ttl;
+  if (!ttl)
+    g_hash_table_remove_all (agent->cache);
+  g_mutex_unlock (agent->mutex);
+}
+
+guint
+fs_rawudp_stun_agent_get_cache_ttl (FsRawUdpStunAgent *agent)
+{
+  guint ttl;
+
+  g_mutex_lock (agent->mutex);
+  ttl = agent->cache_ttl;
+  g_mutex_unlock (agent->mutex);
+
+  return ttl;
+}
+
+static gboolean
+_stun_recv (UdpPort *udpport,
+    const gchar *data,
+    guint len,
+    const FsRawUdpAddress *from,
+    gpointer user_data)
+{
+  FsRawUdpStunAgent *agent = user_data;
+  StunTransaction *trans;
+  StunRequest *request;
+  StunMessageView msg;
+  guint16 type;
+  FsRawUdpAddress mapped;
+  gboolean found = FALSE;
+  gchar *from_str;
+
+  /* Non stun or invalid packet, the message is parsed in place */
+  if (!stun_message_parse (&msg, len, data))
+    return TRUE;
+
+  type = stun_message_view_get_type (&msg);
+  if (type != STUN_MESSAGE_BINDING_RESPONSE &&
+      type != STUN_MESSAGE_BINDING_ERROR_RESPONSE)
+    return TRUE;
+
+  g_mutex_lock (agent->mutex);
+
+  trans = g_hash_table_lookup (agent->transactions,
+      stun_message_view_get_transaction_id (&msg));
+  if (!trans || trans->request->udpport != udpport ||
+      !fs_rawudp_address_equal (&trans->server, from))
+  {
+    /* not ours */
+    g_mutex_unlock (agent->mutex);
+    return TRUE;
+  }
+
+  request = trans->request;
+
+  /* Its callback is already queued or running */
+  if (request->completed)
+  {
+    g_mutex_unlock (agent->mutex);
+    return FALSE;
+  }
+
+  if (type == STUN_MESSAGE_BINDING_RESPONSE)
+  {
+    StunAttributeIter iter;
+    guint16 attr_type, attr_length;
+    const gchar *value;
+    guint family;
+    guint8 ip[16];
+    guint16 port;
+
+    stun_attribute_iter_init (&iter, &msg);
+    while (stun_attribute_iter_next (&iter, &attr_type, &attr_length, &value))
+    {
+      gboolean xor = (attr_type != STUN_ATTRIBUTE_MAPPED_ADDRESS);
+
+      /* A MAPPED-ADDRESS does not replace a XOR one */
+      if ((found && !xor) ||
+          !stun_attribute_read_mapped_address (&msg, attr_type, attr_length,
+              value, &family, ip, &port))
+        continue;
+
+      memset (&mapped, 0, sizeof (mapped));
+      if (family == STUN_ADDRESS_FAMILY_IPV6)
+      {
+        mapped.sin6.sin6_family = AF_INET6;
+        memcpy (&mapped.sin6.sin6_addr, ip, 16);
+        mapped.sin6.sin6_port = htons (port);
+        fs_rawudp_address_unmap (&mapped);
+      }
+      else
+      {
+        mapped.sin.sin_family = AF_INET;
+        memcpy (&mapped.sin.sin_addr, ip, 4);
+        mapped.sin.sin_port = htons (port);
+      }
+      found = TRUE;
+
+      if (xor)
+        break;
+    }
+  }
+
+  from_str = fs_rawudp_address_to_string (from);
+
+  if (found)
+  {
+    _cache_store_locked (agent, request, &trans->server, &mapped);
+    GST_DEBUG ("Stun server %s:%u answered discovery %lu", from_str,
+        fs_rawudp_address_get_port (from), request->id);
+    _complete_locked (agent, request, &mapped);
+  }
+  else
+  {
+    /* Lets wait for the other servers */
+    GST_DEBUG ("Stun server %s:%u replied with an error", from_str,
+        fs_rawudp_address_get_port (from));
+    request->got_error = TRUE;
+    if (trans->next)
+      _transaction_over_locked (trans);
+    if (request->n_pending == 0)
+      _complete_locked (agent, request, NULL);
+  }
+
+  g_mutex_unlock (agent->mutex);
+
+  g_free (from_str);
+
+  /* It was a stun packet, lets drop it */
+  return FALSE;
+}
+
+typedef struct _TimerData {
+  FsRawUdpStunAgent *agent;
+  guint64 now;
+  guint64 next;
+  GList *expired;
+} TimerData;
+
+static void
+_process_request_locked (gpointer key, gpointer value, gpointer user_data)
+{
+  StunRequest *request = value;
+  TimerData *data = user_data;
+  guint i;
+
+  if (request->completed)
+    return;
+
+  for (i = 0; i < request->n_transactions; i++)
+  {
+    StunTransaction *trans = &request->transactions[i];
+
+    if (!trans->next)
+      continue;
+
+    if (trans->next <= data->now)
+    {
+      if (trans->sent < STUN_RC)
+      {
+        GError *error = NULL;
+
+        if (!fs_rawudp_transmitter_udpport_sendto (request->udpport,
+                trans->packed, trans->length, &trans->server, &error))
+        {
+          GST_DEBUG ("Could not retransmit STUN request: %s", error->message);
+          g_clear_error (&error);
+        }
+
+        trans->sent++;
+        trans->rto *= 2;
+        if (trans->sent < STUN_RC)
+          trans->next = data->now + trans->rto;
+        else
+          trans->next = data->now + STUN_RM * STUN_RTO_INITIAL;
+      }
+      else
+      {
+        gchar *server_str = fs_rawudp_address_to_string (&trans->server);
+
+        GST_DEBUG ("STUN server %s:%u did not answer", server_str,
+            fs_rawudp_address_get_port (&trans->server));
+        g_free (server_str);
+        _transaction_over_locked (trans);
+        continue;
+      }
+    }
+
+    if (!data->next || trans->next < data->next)
+      data->next = trans->next;
+  }
+
+  if (request->n_pending == 0 || request->deadline <= data->now)
+  {
+    /* No answer can complete it anymore once it is queued */
+    request->completed = TRUE;
+    _remove_transactions_locked (data->agent, request);
+    data->expired = g_list_prepend (data->expired, request);
+  }
+  else if (!data->next || request->deadline < data->next)
+  {
+    data->next = request->deadline;
+  }
+}
+
+static gpointer
+_timer_thread (gpointer user_data)
+{
+  FsRawUdpStunAgent *agent = user_data;
+
+  g_mutex_lock (agent->mutex);
+
+  while (!agent->stop)
+  {
+    TimerData data = { NULL, 0, 0, NULL };
+    GList *item;
+
+    data.agent = agent;
+    data.now = _now_ms ();
+    g_hash_table_foreach (agent->requests, _process_request_locked, &data);
+
+    if (data.expired)
+    {
+      for (item = data.expired; item; item = g_list_next (item))
+        _complete_locked (agent, item->data, NULL);
+      g_list_free (data.expired);
+      /* The lock was released, so things may have changed */
+      continue;
+    }
+
+    if (data.next)
+    {
+      GTimeVal abstime;
+
+      abstime.tv_sec = data.next / 1000;
+      abstime.tv_usec = (data.next % 1000) * 1000;
+      g_cond_timed_wait (agent->cond, agent->mutex, &abstime);
+    }
+    else
+    {
+      g_cond_wait (agent->cond, agent->mutex);
+    }
+  }
+
+  g_mutex_unlock (agent->mutex);
+
+  return NULL;
+}
+
+/**
+ * fs_rawudp_stun_agent_discover:
+ * @agent: a #FsRawUdpStunAgent
+ * @udpport: the #UdpPort to discover the reflexive address of
+ * @servers: the STUN servers to query
+ * @n_servers: the number of servers in @servers
+ * @timeout: the maximum time to wait for an answer, in seconds
+ * @func: the function to call with the result
+ * @user_data: data for @func
+ * @error: location of a #GError or NULL
+ *
+ * Sends a binding request to all @servers, @func is called once with the
+ * first answer or when they have all failed, unless the discovery is
+ * cancelled first.
+ *
+ * Returns: the id of the discovery or 0 if no request could be sent
+ */
+
+gulong
+fs_rawudp_stun_agent_discover (FsRawUdpStunAgent *agent,
+    UdpPort *udpport,
+    const FsRawUdpAddress *servers,
+    guint n_servers,
+    guint timeout,
+    FsRawUdpStunFunc func,
+    gpointer user_data,
+    GError **error)
+{
+  StunRequest *request;
+  GError *send_error = NULL;
+  guint64 now;
+  guint i;
+  gulong id;
+
+  g_return_val_if_fail (n_servers > 0, 0);
+
+  request = g_slice_new0 (StunRequest);
+  request->udpport = udpport;
+  request->func = func;
+  request->user_data = user_data;
+  request->transactions = g_new0 (StunTransaction, n_servers);
+  request->n_transactions = n_servers;
+  if (!fs_rawudp_transmitter_udpport_get_local_address (udpport,
+          &request->local))
+    request->local.sa.sa_family = 0;
+
+  g_mutex_lock (agent->mutex);
+
+  now = _now_ms ();
+  request->deadline = now + (guint64) timeout * 1000;
+
+  for (i = 0; i < n_servers; i++)
+  {
+    StunTransaction *trans = &request->transactions[i];
+    guint j;
+
+    do {
+      ((guint32 *) trans->id)[0] = g_htonl (STUN_MAGIC_COOKIE);
+      for (j = 1; j < 4; j++)
+        ((guint32 *) trans->id)[j] = g_random_int ();
+    } while (g_hash_table_lookup (agent->transactions, trans->id));
+
+    trans->length = stun_message_write (trans->packed, sizeof (trans->packed),
+        STUN_MESSAGE_BINDING_REQUEST, trans->id);
+
+    trans->request = request;
+    trans->server = servers[i];
+    trans->rto = STUN_RTO_INITIAL;
+
+    trans->recv_id = fs_rawudp_transmitter_udpport_connect_recv (udpport,
+        &trans->server, _stun_recv, agent);
+
+    g_clear_error (&send_error);
+    if (!fs_rawudp_transmitter_udpport_sendto (udpport, trans->packed,
+            trans->length, &trans->server, &send_error))
+      continue;
+
+    g_hash_table_insert (agent->transactions, trans->id, trans);
+    trans->sent = 1;
+    trans->next = now + trans->rto;
+    request->n_pending++;
+  }
+
+  if (request->n_pending == 0)
+    goto error;
+
+  if (!agent->thread)
+  {
+    agent->thread = g_thread_create (_timer_thread, agent, TRUE, &send_error);
+    if (!agent->thread)
+      goto error;
+  }
+
+  g_clear_error (&send_error);
+
+  /* 0 is the error value */
+  if (++agent->next_id == 0)
+    agent->next_id++;
+  id = request->id = agent->next_id;
+  g_hash_table_insert (agent->requests, GUINT_TO_POINTER (id), request);
+  g_cond_broadcast (agent->cond);
+
+  g_mutex_unlock (agent->mutex);
+
+  return id;
+
+ error:
+  _remove_transactions_locked (agent, request);
+  g_mutex_unlock (agent->mutex);
+
+  _disconnect_transactions (request);
+  _request_free (request);
+
+  g_propagate_error (error, send_error);
+
+  return 0;
+}
+
+/**
+ * fs_rawudp_stun_agent_cancel:
+ * @agent: a #FsRawUdpStunAgent
+ * @id: the id returned by fs_rawudp_stun_agent_discover()
+ *
+ * Stops a discovery. Once this returns, its callback is not running and will
+ * not be called, unless it is called from that callback.
+ */
+
+void
+fs_rawudp_stun_agent_cancel (FsRawUdpStunAgent *agent,
+    gulong id)
+{
+  StunRequest *request;
+
+  g_mutex_lock (agent->mutex);
+
+  request = g_hash_table_lookup (agent->requests, GUINT_TO_POINTER (id));
+  if (!request)
+  {
+    g_mutex_unlock (agent->mutex);
+    return;
+  }
+
+  if (request->completed)
+  {
+    /* Its callback is running, wait for it unless we are inside it */
+    if (request->dispatch_thread != g_thread_self ())
+      while (g_hash_table_lookup (agent->requests, GUINT_TO_POINTER (id)))
+        g_cond_wait (agent->cond, agent->mutex);
+    g_mutex_unlock (agent->mutex);
+    return;
+  }
+
+  request->completed = TRUE;
+  _remove_transactions_locked (agent, request);
+  g_hash_table_remove (agent->requests, GUINT_TO_POINTER (id));
+  g_mutex_unlock (agent->mutex);
+
+  _disconnect_transactions (request);
+  _request_free (request);
+}
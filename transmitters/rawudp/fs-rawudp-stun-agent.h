@@ -0,0 +1,75 @@
+/*
+ * Farsight2 - Farsight RAW UDP STUN agent
+ *
+ * fs-rawudp-stun-agent.h - Runs the STUN binding requests of all components
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FS_RAWUDP_STUN_AGENT_H__
+#define __FS_RAWUDP_STUN_AGENT_H__
+
+#include "fs-rawudp-transmitter.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Private declaration */
+typedef struct _FsRawUdpStunAgent FsRawUdpStunAgent;
+
+/*
+ * Called once per discovery, from the streaming thread or from the agent
+ * thread. @mapped is the reflexive address (in network order) or NULL if no
+ * server answered, @error is set if some server replied with an error.
+ */
+typedef void (*FsRawUdpStunFunc) (const FsRawUdpAddress *mapped,
+    const GError *error,
+    gpointer user_data);
+
+FsRawUdpStunAgent *fs_rawudp_stun_agent_new (void);
+
+void fs_rawudp_stun_agent_free (FsRawUdpStunAgent *agent);
+
+gulong fs_rawudp_stun_agent_discover (FsRawUdpStunAgent *agent,
+    UdpPort *udpport,
+    const FsRawUdpAddress *servers,
+    guint n_servers,
+    guint timeout,
+    FsRawUdpStunFunc func,
+    gpointer user_data,
+    GError **error);
+
+void fs_rawudp_stun_agent_cancel (FsRawUdpStunAgent *agent,
+    gulong id);
+
+gboolean fs_rawudp_stun_agent_lookup (FsRawUdpStunAgent *agent,
+    UdpPort *udpport,
+    const FsRawUdpAddress *servers,
+    guint n_servers,
+    FsRawUdpAddress *mapped);
+
+void fs_rawudp_stun_agent_set_cache_ttl (FsRawUdpStunAgent *agent,
+    guint ttl);
+
+guint fs_rawudp_stun_agent_get_cache_ttl (FsRawUdpStunAgent *agent);
+
+/* Implemented in fs-rawudp-transmitter.c, the agent shared by its streams */
+FsRawUdpStunAgent *fs_rawudp_transmitter_get_stun_agent (
+    FsRawUdpTransmitter *trans);
+
+G_END_DECLS
+
+#endif /* __FS_RAWUDP_STUN_AGENT_H__ */
@@ -36,10 +36,17 @@
 
 #include "fs-rawudp-transmitter.h"
 #include "fs-rawudp-stream-transmitter.h"
+#include "fs-rawudp-batch-src.h"
+#include "fs-rawudp-batch-sink.h"
+#include "fs-rawudp-port-allocator.h"
+#include "fs-rawudp-stun-agent.h"
+#include "fs-rawudp-keepalive.h"
+#include "stun.h"
 
 #include <gst/farsight/fs-conference-iface.h>
 #include <gst/farsight/fs-plugin.h>
 
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 
@@ -72,9 +79,26 @@ enum
   PROP_0,
   PROP_GST_SINK,
   PROP_GST_SRC,
-  PROP_COMPONENTS
+  PROP_COMPONENTS,
+  PROP_BATCH_DEPTH,
+  PROP_SHARED_SOCKET,
+  PROP_PORT_RANGE_MIN,
+  PROP_PORT_RANGE_MAX,
+  PROP_PORT_QUARANTINE,
+  PROP_PORT_RANGE_USAGE,
+  PROP_STUN_CACHE_TTL,
+  PROP_KEEPALIVE_INTERVAL,
+  PROP_STATISTICS
 };
 
+#define DEFAULT_BATCH_DEPTH 8
+#define DEFAULT_SHARED_SOCKET FALSE
+#define DEFAULT_PORT_RANGE_MIN 1024
+#define DEFAULT_PORT_RANGE_MAX 65535
+#define DEFAULT_PORT_QUARANTINE 2000
+#define DEFAULT_STUN_CACHE_TTL 60
+#define DEFAULT_KEEPALIVE_INTERVAL 0
+
 struct _FsRawUdpTransmitterPrivate
 {
   /* We hold references to this element */
@@ -87,7 +111,26 @@ struct _FsRawUdpTransmitterPrivate
   GstElement **udpsrc_funnels;
   GstElement **udpsink_tees;
 
-  GList **udpports;
+  /* UdpPorts indexed by requested ip and port, one table per component */
+  GHashTable **udpports;
+
+  /* Packets per recvmmsg()/sendmmsg() for the ports created from now on */
+  guint batch_depth;
+
+  /* If TRUE, each component has a single UdpPort used by all streams */
+  gboolean shared_socket;
+
+  /* Created with the first UdpPort, from then on the range is fixed */
+  FsRawUdpPortAllocator *port_allocator;
+  guint port_range_min;
+  guint port_range_max;
+  guint port_quarantine;
+
+  /* Runs the STUN discoveries of all the components */
+  FsRawUdpStunAgent *stun_agent;
+
+  /* Sends the keepalives of all the components */
+  FsRawUdpKeepalive *keepalive;
 
   gboolean disposed;
 };
@@ -122,6 +165,13 @@ static GType fs_rawudp_transmitter_get_stream_transmitter_type (
     GError **error);
 
 
+static GstStructure *fs_rawudp_transmitter_get_statistics (
+    FsRawUdpTransmitter *self);
+
+static guint _udpport_hash (gconstpointer key);
+static gboolean _udpport_equal (gconstpointer a, gconstpointer b);
+
+
 static GObjectClass *parent_class = NULL;
 //static guint signals[LAST_SIGNAL] = { 0 };
 
@@ -160,6 +210,8 @@ fs_rawudp_transmitter_register_type (FsPlugin *module)
         "Farsight raw UDP transmitter");
 
   fs_rawudp_stream_transmitter_register_type (module);
+  fs_rawudp_batch_src_register_type (module);
+  fs_rawudp_batch_sink_register_type (module);
 
   type = g_type_module_register_type (G_TYPE_MODULE (module),
       FS_TYPE_TRANSMITTER, "FsRawUdpTransmitter", &info, 0);
@@ -198,6 +250,101 @@ fs_rawudp_transmitter_class_init (FsRawUdpTransmitterClass *klass)
   g_object_class_override_property (gobject_class, PROP_COMPONENTS,
       "components");
 
+  g_object_class_install_property (gobject_class,
+      PROP_BATCH_DEPTH,
+      g_param_spec_uint ("batch-depth",
+          "Batch depth",
+          "The maximum number of packets sent or received with one system"
+          " call by the sockets created after it is set",
+          1, 64, DEFAULT_BATCH_DEPTH,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_SHARED_SOCKET,
+      g_param_spec_boolean ("shared-socket",
+          "Shared socket",
+          "All the streams of a component use the same socket, bound to the"
+          " ip and port requested by the first one, instead of one socket"
+          " per requested ip and port",
+          DEFAULT_SHARED_SOCKET,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PORT_RANGE_MIN,
+      g_param_spec_uint ("port-range-min",
+          "Lowest local port",
+          "The lowest port that can be bound, changing it after the first"
+          " port has been bound has no effect",
+          1, 65535, DEFAULT_PORT_RANGE_MIN,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PORT_RANGE_MAX,
+      g_param_spec_uint ("port-range-max",
+          "Highest local port",
+          "The highest port that can be bound, changing it after the first"
+          " port has been bound has no effect",
+          1, 65535, DEFAULT_PORT_RANGE_MAX,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PORT_QUARANTINE,
+      g_param_spec_uint ("port-quarantine",
+          "Port quarantine",
+          "How long a released port, or a port found to be used by someone"
+          " else, is kept out of the range (in milliseconds)",
+          0, G_MAXUINT, DEFAULT_PORT_QUARANTINE,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_PORT_RANGE_USAGE,
+      g_param_spec_double ("port-range-usage",
+          "Port range usage",
+          "The fraction of the port range that is bound or in quarantine",
+          0, 1, 0,
+          G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_STUN_CACHE_TTL,
+      g_param_spec_uint ("stun-cache-ttl",
+          "STUN cache lifetime",
+          "How long the reflexive address found for a local address is"
+          " reused by the other streams (in seconds), 0 disables the cache",
+          0, G_MAXUINT, DEFAULT_STUN_CACHE_TTL,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+      PROP_KEEPALIVE_INTERVAL,
+      g_param_spec_uint ("keepalive-interval",
+          "Keepalive interval",
+          "How long a component can stay without sending anything before a"
+          " STUN binding indication is sent to keep its NAT binding open"
+          " (in seconds), 0 disables the keepalives. Only affects the"
+          " candidate pairs established afterwards",
+          0, G_MAXUINT, DEFAULT_KEEPALIVE_INTERVAL,
+          G_PARAM_READWRITE));
+
+  /**
+   * FsRawUdpTransmitter:statistics:
+   *
+   * The packet counters of the sockets that are currently open, added over
+   * all the components. The structure is named "rawudp-statistics" and
+   * contains the #guint64 fields "packets-sent", "send-syscalls",
+   * "packets-received" and "receive-syscalls" and the #gdouble fields
+   * "packets-per-send-syscall" and "packets-per-receive-syscall", which are
+   * above 1 when sendmmsg() and recvmmsg() batch packets.
+   *
+   * It reads the same #GHashTable of sockets as the stream transmitters, so
+   * it must be read from the thread that creates and destroys them.
+   */
+  g_object_class_install_property (gobject_class,
+      PROP_STATISTICS,
+      g_param_spec_boxed ("statistics",
+          "Statistics",
+          "The number of packets and system calls of all the sockets",
+          GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE));
+
   transmitter_class->new_stream_transmitter =
     fs_rawudp_transmitter_new_stream_transmitter;
   transmitter_class->get_stream_transmitter_type =
@@ -216,6 +363,13 @@ fs_rawudp_transmitter_init (FsRawUdpTransmitter *self)
   /* member init */
   self->priv = FS_RAWUDP_TRANSMITTER_GET_PRIVATE (self);
   self->priv->disposed = FALSE;
+  self->priv->batch_depth = DEFAULT_BATCH_DEPTH;
+  self->priv->shared_socket = DEFAULT_SHARED_SOCKET;
+  self->priv->port_range_min = DEFAULT_PORT_RANGE_MIN;
+  self->priv->port_range_max = DEFAULT_PORT_RANGE_MAX;
+  self->priv->port_quarantine = DEFAULT_PORT_QUARANTINE;
+  self->priv->stun_agent = fs_rawudp_stun_agent_new ();
+  self->priv->keepalive = fs_rawudp_keepalive_new (DEFAULT_KEEPALIVE_INTERVAL);
 
   self->components = 2;
 }
@@ -235,7 +389,10 @@ fs_rawudp_transmitter_constructed (GObject *object)
   /* We waste one space in order to have the index be the component_id */
   self->priv->udpsrc_funnels = g_new0 (GstElement *, self->components+1);
   self->priv->udpsink_tees = g_new0 (GstElement *, self->components+1);
-  self->priv->udpports = g_new0 (GList *, self->components+1);
+  self->priv->udpports = g_new0 (GHashTable *, self->components+1);
+  for (c = 1; c <= self->components; c++)
+    self->priv->udpports[c] = g_hash_table_new (_udpport_hash,
+        _udpport_equal);
 
   /* First we need the src elemnet */
 
@@ -423,10 +580,33 @@ fs_rawudp_transmitter_finalize (GObject *object)
 
   if (self->priv->udpports)
   {
+    int c;
+
+    for (c = 1; c <= self->components; c++)
+      if (self->priv->udpports[c])
+        g_hash_table_destroy (self->priv->udpports[c]);
     g_free (self->priv->udpports);
     self->priv->udpports = NULL;
   }
 
+  if (self->priv->port_allocator)
+  {
+    fs_rawudp_port_allocator_free (self->priv->port_allocator);
+    self->priv->port_allocator = NULL;
+  }
+
+  if (self->priv->stun_agent)
+  {
+    fs_rawudp_stun_agent_free (self->priv->stun_agent);
+    self->priv->stun_agent = NULL;
+  }
+
+  if (self->priv->keepalive)
+  {
+    fs_rawudp_keepalive_free (self->priv->keepalive);
+    self->priv->keepalive = NULL;
+  }
+
   parent_class->finalize (object);
 }
 
@@ -449,6 +629,39 @@ fs_rawudp_transmitter_get_property (GObject *object,
     case PROP_COMPONENTS:
       g_value_set_uint (value, self->components);
       break;
+    case PROP_BATCH_DEPTH:
+      g_value_set_uint (value, self->priv->batch_depth);
+      break;
+    case PROP_SHARED_SOCKET:
+      g_value_set_boolean (value, self->priv->shared_socket);
+      break;
+    case PROP_PORT_RANGE_MIN:
+      g_value_set_uint (value, self->priv->port_range_min);
+      break;
+    case PROP_PORT_RANGE_MAX:
+      g_value_set_uint (value, self->priv->port_range_max);
+      break;
+    case PROP_PORT_QUARANTINE:
+      g_value_set_uint (value, self->priv->port_quarantine);
+      break;
+    case PROP_PORT_RANGE_USAGE:
+      if (self->priv->port_allocator)
+        g_value_set_double (value,
+            fs_rawudp_port_allocator_get_usage (self->priv->port_allocator));
+      else
+        g_value_set_double (value, 0);
+      break;
+    case PROP_STUN_CACHE_TTL:
+      g_value_set_uint (value,
+          fs_rawudp_stun_agent_get_cache_ttl (self->priv->stun_agent));
+      break;
+    case PROP_KEEPALIVE_INTERVAL:
+      g_value_set_uint (value,
+          fs_rawudp_keepalive_get_interval (self->priv->keepalive));
+      break;
+    case PROP_STATISTICS:
+      g_value_take_boxed (value, fs_rawudp_transmitter_get_statistics (self));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -468,6 +681,32 @@ fs_rawudp_transmitter_set_property (GObject *object,
     case PROP_COMPONENTS:
       self->components = g_value_get_uint (value);
       break;
+    case PROP_BATCH_DEPTH:
+      self->priv->batch_depth = g_value_get_uint (value);
+      break;
+    case PROP_SHARED_SOCKET:
+      self->priv->shared_socket = g_value_get_boolean (value);
+      break;
+    case PROP_PORT_RANGE_MIN:
+      self->priv->port_range_min = g_value_get_uint (value);
+      break;
+    case PROP_PORT_RANGE_MAX:
+      self->priv->port_range_max = g_value_get_uint (value);
+      break;
+    case PROP_PORT_QUARANTINE:
+      self->priv->port_quarantine = g_value_get_uint (value);
+      if (self->priv->port_allocator)
+        fs_rawudp_port_allocator_set_quarantine (self->priv->port_allocator,
+            self->priv->port_quarantine);
+      break;
+    case PROP_STUN_CACHE_TTL:
+      fs_rawudp_stun_agent_set_cache_ttl (self->priv->stun_agent,
+          g_value_get_uint (value));
+      break;
+    case PROP_KEEPALIVE_INTERVAL:
+      fs_rawudp_keepalive_set_interval (self->priv->keepalive,
+          g_value_get_uint (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -503,8 +742,11 @@ fs_rawudp_transmitter_new_stream_transmitter (FsTransmitter *transmitter,
 
 /*
  * The UdpPort structure is a ref-counted pseudo-object use to represent
- * one ip:port combo on which we listen and send, so it includes  a udpsrc
- * and a multiudpsink
+ * one ip:port combo on which we listen and send, so it includes  a
+ * FsRawUdpBatchSrc and a FsRawUdpBatchSink
+ *
+ * Packets are handed to the receivers connected for their source address,
+ * found with a single hash lookup however many streams share the port
  */
 
 struct _UdpPort {
@@ -522,27 +764,201 @@ struct _UdpPort {
   guint port;
 
   gint fd;
+  /* Address family of the socket, an AF_INET6 socket bound to the
+   * unspecified address is dual-stack and also carries IPv4 */
+  gint family;
+  gboolean dual_stack;
 
   /* These are just convenience pointers to our parent transmitter */
   GstElement *funnel;
   GstElement *tee;
 
   guint component_id;
+
+  /* Protects the receivers */
+  GMutex *mutex;
+  /* FsRawUdpAddress * -> GList of UdpPortReceiver */
+  GHashTable *receivers;
+  gulong next_receiver_id;
+  /* Changed with the mutex held, but read atomically without it */
+  gint n_receivers;
 };
 
+static guint
+_udpport_hash (gconstpointer key)
+{
+  const UdpPort *udpport = key;
+
+  return (udpport->requested_ip ? g_str_hash (udpport->requested_ip) : 0) ^
+    udpport->requested_port;
+}
+
+static gboolean
+_udpport_equal (gconstpointer a, gconstpointer b)
+{
+  const UdpPort *udpport_a = a;
+  const UdpPort *udpport_b = b;
+
+  if (udpport_a->requested_port != udpport_b->requested_port)
+    return FALSE;
+
+  if (udpport_a->requested_ip == NULL || udpport_b->requested_ip == NULL)
+    return udpport_a->requested_ip == udpport_b->requested_ip;
+
+  return !strcmp (udpport_a->requested_ip, udpport_b->requested_ip);
+}
+
+static gboolean
+_any_udpport (gpointer key, gpointer value, gpointer user_data)
+{
+  return TRUE;
+}
+
+typedef struct {
+  guint64 packets_sent;
+  guint64 send_syscalls;
+  guint64 packets_received;
+  guint64 receive_syscalls;
+} UdpPortStatistics;
+
+static void
+_add_udpport_statistics (gpointer key, gpointer value, gpointer user_data)
+{
+  UdpPort *udpport = value;
+  UdpPortStatistics *stats = user_data;
+  guint64 packets, syscalls;
+
+  g_object_get (udpport->udpsink,
+      "packets", &packets,
+      "syscalls", &syscalls,
+      NULL);
+  stats->packets_sent += packets;
+  stats->send_syscalls += syscalls;
+
+  g_object_get (udpport->udpsrc,
+      "packets", &packets,
+      "syscalls", &syscalls,
+      NULL);
+  stats->packets_received += packets;
+  stats->receive_syscalls += syscalls;
+}
+
+static GstStructure *
+fs_rawudp_transmitter_get_statistics (FsRawUdpTransmitter *self)
+{
+  UdpPortStatistics stats = {0, 0, 0, 0};
+  gint c;
+
+  if (self->priv->udpports)
+    for (c = 1; c <= self->components; c++)
+      g_hash_table_foreach (self->priv->udpports[c], _add_udpport_statistics,
+          &stats);
+
+  return gst_structure_new ("rawudp-statistics",
+      "packets-sent", G_TYPE_UINT64, stats.packets_sent,
+      "send-syscalls", G_TYPE_UINT64, stats.send_syscalls,
+      "packets-per-send-syscall", G_TYPE_DOUBLE, stats.send_syscalls ?
+      (gdouble) stats.packets_sent / (gdouble) stats.send_syscalls : 0.0,
+      "packets-received", G_TYPE_UINT64, stats.packets_received,
+      "receive-syscalls", G_TYPE_UINT64, stats.receive_syscalls,
+      "packets-per-receive-syscall", G_TYPE_DOUBLE, stats.receive_syscalls ?
+      (gdouble) stats.packets_received / (gdouble) stats.receive_syscalls :
+      0.0,
+      NULL);
+}
+
+typedef struct _UdpPortReceiver {
+  gulong id;
+  FsRawUdpAddress from;
+  UdpPortRecvFunc func;
+  gpointer user_data;
+} UdpPortReceiver;
+
+/*
+ * Called from the streaming thread of the FsRawUdpBatchSrc for every packet,
+ * returns FALSE if it was dropped or a receiver consumed it
+ */
+static gboolean
+_udpport_recv (const guint8 *data,
+    guint len,
+    const FsRawUdpAddress *from,
+    gpointer user_data)
+{
+  UdpPort *udpport = user_data;
+  UdpPortReceiver *receivers;
+  GList *item;
+  guint n, i;
+  gboolean keep = TRUE;
+
+  /* Only STUN goes to the receivers. Media goes through without taking any
+   * lock: RTP and RTCP fail the header check on their first byte, and there
+   * is usually no receiver once the candidates are gathered */
+  if (!stun_message_is_stun (len, (const gchar *) data))
+    return TRUE;
+
+  /* Binding indications are keepalives that nobody answers, they must never
+   * reach the funnel as if they were media */
+  if (GST_READ_UINT16_BE (data) == STUN_MESSAGE_BINDING_INDICATION)
+    return FALSE;
+
+  if (!g_atomic_int_get (&udpport->n_receivers))
+    return TRUE;
+
+  g_mutex_lock (udpport->mutex);
+  item = g_hash_table_lookup (udpport->receivers, from);
+  if (!item)
+  {
+    g_mutex_unlock (udpport->mutex);
+    return TRUE;
+  }
+
+  /* Call them unlocked, receivers may disconnect from their callback */
+  n = g_list_length (item);
+  receivers = g_new (UdpPortReceiver, n);
+  for (i = 0; item; item = g_list_next (item), i++)
+    receivers[i] = *(UdpPortReceiver *) item->data;
+  g_mutex_unlock (udpport->mutex);
+
+  for (i = 0; i < n && keep; i++)
+    keep = receivers[i].func (udpport, (const gchar *) data, len, from,
+        receivers[i].user_data);
+
+  g_free (receivers);
+
+  return keep;
+}
+
+static void
+_free_receivers (gpointer key, gpointer value, gpointer user_data)
+{
+  GList *item;
+
+  for (item = value; item; item = g_list_next (item))
+    g_slice_free (UdpPortReceiver, item->data);
+  g_list_free (value);
+}
+
+/*
+ * Without an ip, tries to get a dual-stack IPv6 socket and falls back to an
+ * IPv4 one on hosts without IPv6
+ */
 static gint
 _bind_port (
+    FsRawUdpPortAllocator *allocator,
     const gchar *ip,
     guint port,
     guint *used_port,
+    gint *family,
+    gboolean *dual_stack,
     GError **error)
 {
   int sock;
-  struct sockaddr_in address;
+  FsRawUdpAddress address;
   int retval;
+  gboolean claimed;
 
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = INADDR_ANY;
+  memset (&address, 0, sizeof (FsRawUdpAddress));
+  *dual_stack = FALSE;
 
   if (ip)
   {
@@ -550,7 +966,7 @@ _bind_port (
     struct addrinfo *result = NULL;
 
     memset (&hints, 0, sizeof (struct addrinfo));
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_flags = AI_NUMERICHOST;
     retval = getaddrinfo (ip, NULL, &hints, &result);
     if (retval != 0)
@@ -559,33 +975,92 @@ _bind_port (
           "Invalid IP address %s passed: %s", ip, gai_strerror (retval));
       return -1;
     }
-    memcpy (&address, result->ai_addr, sizeof (struct sockaddr_in));
+    memcpy (&address, result->ai_addr,
+        MIN (result->ai_addrlen, sizeof (FsRawUdpAddress)));
     freeaddrinfo (result);
+    fs_rawudp_address_unmap (&address);
+  }
+  else
+  {
+    address.sin6.sin6_family = AF_INET6;
+    address.sin6.sin6_addr = in6addr_any;
+  }
+
+  sock = socket (address.sa.sa_family, SOCK_DGRAM, 0);
+
+  if (sock > 0 && address.sa.sa_family == AF_INET6)
+  {
+    /* Only a socket on the unspecified address can also carry IPv4 */
+    int v6only = !IN6_IS_ADDR_UNSPECIFIED (&address.sin6.sin6_addr);
+
+    if (setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only,
+            sizeof (v6only)) == 0)
+    {
+      *dual_stack = !v6only;
+    }
+    else if (!ip)
+    {
+      close (sock);
+      sock = -1;
+    }
+  }
+
+  if (sock <= 0 && !ip)
+  {
+    GST_DEBUG ("Could not get a dual-stack socket, using IPv4 only");
+    memset (&address, 0, sizeof (FsRawUdpAddress));
+    address.sin.sin_family = AF_INET;
+    address.sin.sin_addr.s_addr = INADDR_ANY;
+    sock = socket (AF_INET, SOCK_DGRAM, 0);
   }
 
-  if ((sock = socket (AF_INET, SOCK_DGRAM, 0)) <= 0)
+  if (sock <= 0)
   {
     g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
         "Error creating socket: %s", g_strerror (errno));
     return -1;
   }
 
-  do {
-    address.sin_port = htons (port);
-    retval = bind (sock, (struct sockaddr *) &address, sizeof (address));
-    if (retval != 0)
+  *family = address.sa.sa_family;
+
+  /* An RTCP port was reserved with the RTP port before it */
+  claimed = fs_rawudp_port_allocator_claim (allocator, port);
+
+  /* The allocator skips the ports we already use without calling bind() */
+  for (;;)
+  {
+    if (!claimed)
+      port = fs_rawudp_port_allocator_reserve (allocator, port);
+    claimed = FALSE;
+    if (!port)
     {
-      GST_INFO ("could not bind port %d", port);
-      port += 2;
-      if (port > 65535)
-      {
-        g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
-            "Could not bind the socket to a port");
-        close (sock);
-        return -1;
-      }
+      g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
+          "Could not bind the socket to a port, the port range is full");
+      close (sock);
+      return -1;
     }
-  } while (retval != 0);
+
+    fs_rawudp_address_set_port (&address, port);
+    retval = bind (sock, &address.sa, fs_rawudp_address_get_length (&address));
+    if (retval == 0)
+      break;
+
+    if (errno != EADDRINUSE && errno != EACCES)
+    {
+      /* Another port would not do any better */
+      g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
+          "Could not bind the socket to %s:%u: %s", ip ? ip : "any address",
+          port, g_strerror (errno));
+      fs_rawudp_port_allocator_unreserve (allocator, port);
+      close (sock);
+      return -1;
+    }
+
+    GST_INFO ("could not bind port %d", port);
+    /* Someone else uses it, keep it out of the way for a while */
+    fs_rawudp_port_allocator_release (allocator, port);
+    port += 2;
+  }
 
   *used_port = port;
 
@@ -594,10 +1069,11 @@ _bind_port (
 
 static GstElement *
 _create_sinksource (
-    gchar *elementname,
+    GType elementtype,
     GstBin *bin,
     GstElement *teefunnel,
     gint fd,
+    guint batch_depth,
     GstPadDirection direction,
     GstPad **requested_pad,
     GError **error)
@@ -606,20 +1082,14 @@ _create_sinksource (
   GstPadLinkReturn ret;
   GstPad *elempad = NULL;
   GstStateChangeReturn state_ret;
+  const gchar *elementname = g_type_name (elementtype);
 
   g_assert (direction == GST_PAD_SINK || direction == GST_PAD_SRC);
 
-  elem = gst_element_factory_make (elementname, NULL);
-  if (!elem)
-  {
-    g_set_error (error, FS_ERROR, FS_ERROR_CONSTRUCTION,
-        "Could not create the %s element", elementname);
-    return NULL;
-  }
-
-  g_object_set (elem,
-      "closefd", FALSE,
+  /* Our elements are registered in the plugin module, not in a factory */
+  elem = g_object_new (elementtype,
       "sockfd", fd,
+      "batch-depth", batch_depth,
       NULL);
 
   if (!gst_bin_add (bin, elem))
@@ -699,30 +1169,36 @@ fs_rawudp_transmitter_get_udpport (FsRawUdpTransmitter *trans,
     GError **error)
 {
   UdpPort *udpport;
-  GList *udpport_e;
+  UdpPort key;
 
   /* First lets check if we already have one */
-  if (component_id > trans->components)
+  if (component_id == 0 || component_id > trans->components)
   {
     g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
-        "Invalid component %d > %d", component_id, trans->components);
+        "Invalid component %d, there are %d", component_id,
+        trans->components);
     return NULL;
   }
 
-  for (udpport_e = g_list_first (trans->priv->udpports[component_id]);
-       udpport_e;
-       udpport_e = g_list_next (udpport_e))
+  if (trans->priv->shared_socket)
   {
-    udpport = udpport_e->data;
-    if (requested_port == udpport->requested_port &&
-        ((requested_ip == NULL && udpport->requested_ip == NULL) ||
-            !strcmp (requested_ip, udpport->requested_ip)))
-    {
-      GST_LOG ("Got port refcount %d->%d", udpport->refcount,
-          udpport->refcount+1);
-      udpport->refcount++;
-      return udpport;
-    }
+    /* There is at most one port per component in that mode */
+    udpport = g_hash_table_find (trans->priv->udpports[component_id],
+        _any_udpport, NULL);
+  }
+  else
+  {
+    key.requested_ip = (gchar *) requested_ip;
+    key.requested_port = requested_port;
+    udpport = g_hash_table_lookup (trans->priv->udpports[component_id], &key);
+  }
+
+  if (udpport)
+  {
+    GST_LOG ("Got port refcount %d->%d", udpport->refcount,
+        udpport->refcount+1);
+    udpport->refcount++;
+    return udpport;
   }
 
   GST_DEBUG ("Make new UdpPort for component %u requesting %s:%u", component_id,
@@ -735,10 +1211,28 @@ fs_rawudp_transmitter_get_udpport (FsRawUdpTransmitter *trans,
   udpport->requested_port = requested_port;
   udpport->fd = -1;
   udpport->component_id = component_id;
+  udpport->mutex = g_mutex_new ();
+  udpport->receivers = g_hash_table_new (fs_rawudp_address_hash,
+      fs_rawudp_address_equal);
 
   /* Now lets bind both ports */
 
-  udpport->fd = _bind_port (requested_ip, requested_port, &udpport->port,
+  if (!trans->priv->port_allocator)
+  {
+    if (trans->priv->port_range_min > trans->priv->port_range_max)
+    {
+      g_set_error (error, FS_ERROR, FS_ERROR_INVALID_ARGUMENTS,
+          "The port range %u-%u is empty", trans->priv->port_range_min,
+          trans->priv->port_range_max);
+      goto error;
+    }
+    trans->priv->port_allocator = fs_rawudp_port_allocator_new (
+        trans->priv->port_range_min, trans->priv->port_range_max,
+        trans->priv->port_quarantine);
+  }
+
+  udpport->fd = _bind_port (trans->priv->port_allocator, requested_ip,
+      requested_port, &udpport->port, &udpport->family, &udpport->dual_stack,
       error);
   if (udpport->fd < 0)
     goto error;
@@ -748,29 +1242,24 @@ fs_rawudp_transmitter_get_udpport (FsRawUdpTransmitter *trans,
   udpport->tee = trans->priv->udpsink_tees[component_id];
   udpport->funnel = trans->priv->udpsrc_funnels[component_id];
 
-  udpport->udpsrc = _create_sinksource ("udpsrc",
-      GST_BIN (trans->priv->gst_src), udpport->funnel, udpport->fd, GST_PAD_SRC,
+  udpport->udpsrc = _create_sinksource (FS_TYPE_RAWUDP_BATCH_SRC,
+      GST_BIN (trans->priv->gst_src), udpport->funnel, udpport->fd,
+      trans->priv->batch_depth, GST_PAD_SRC,
       &udpport->udpsrc_requested_pad, error);
   if (!udpport->udpsrc)
     goto error;
 
-  udpport->udpsink = _create_sinksource ("multiudpsink",
-      GST_BIN (trans->priv->gst_sink), udpport->tee, udpport->fd, GST_PAD_SINK,
+  fs_rawudp_batch_src_set_recv_func (FS_RAWUDP_BATCH_SRC (udpport->udpsrc),
+      _udpport_recv, udpport);
+
+  udpport->udpsink = _create_sinksource (FS_TYPE_RAWUDP_BATCH_SINK,
+      GST_BIN (trans->priv->gst_sink), udpport->tee, udpport->fd,
+      trans->priv->batch_depth, GST_PAD_SINK,
       &udpport->udpsink_requested_pad, error);
   if (!udpport->udpsink)
     goto error;
 
-  g_object_set (udpport->udpsink,
-      "async", FALSE,
-      "sync", FALSE,
-      NULL);
-
-  g_object_set (udpport->udpsrc,
-      "auto-multicast", FALSE,
-      NULL);
-
-  trans->priv->udpports[component_id] =
-    g_list_prepend (trans->priv->udpports[component_id], udpport);
+  g_hash_table_insert (trans->priv->udpports[component_id], udpport, udpport);
 
   return udpport;
 
@@ -792,8 +1281,11 @@ fs_rawudp_transmitter_put_udpport (FsRawUdpTransmitter *trans,
     return;
   }
 
-  trans->priv->udpports[udpport->component_id] =
-    g_list_remove (trans->priv->udpports[udpport->component_id], udpport);
+  /* Ports that failed half-way through creation were never inserted */
+  if (g_hash_table_lookup (trans->priv->udpports[udpport->component_id],
+          udpport) == udpport)
+    g_hash_table_remove (trans->priv->udpports[udpport->component_id],
+        udpport);
 
   if (udpport->udpsrc)
   {
@@ -834,7 +1326,15 @@ fs_rawudp_transmitter_put_udpport (FsRawUdpTransmitter *trans,
   }
 
   if (udpport->fd >= 0)
+  {
     close (udpport->fd);
+    fs_rawudp_port_allocator_release (trans->priv->port_allocator,
+        udpport->port);
+  }
+
+  g_hash_table_foreach (udpport->receivers, _free_receivers, NULL);
+  g_hash_table_destroy (udpport->receivers);
+  g_mutex_free (udpport->mutex);
 
   g_free (udpport->requested_ip);
   g_slice_free (UdpPort, udpport);
@@ -846,7 +1346,7 @@ fs_rawudp_transmitter_udpport_add_dest (UdpPort *udpport,
     gint port)
 {
   GST_DEBUG ("Adding dest %s:%d", ip, port);
-  g_signal_emit_by_name (udpport->udpsink, "add", ip, port);
+  fs_rawudp_batch_sink_add (FS_RAWUDP_BATCH_SINK (udpport->udpsink), ip, port);
 }
 
 
@@ -855,18 +1355,23 @@ fs_rawudp_transmitter_udpport_remove_dest (UdpPort *udpport,
   const gchar *ip,
     gint port)
 {
-  g_signal_emit_by_name (udpport->udpsink, "remove", ip, port);
+  fs_rawudp_batch_sink_remove (FS_RAWUDP_BATCH_SINK (udpport->udpsink), ip,
+      port);
 }
 
 gboolean
 fs_rawudp_transmitter_udpport_sendto (UdpPort *udpport,
     gchar *msg,
     size_t len,
-    const struct sockaddr *to,
-    socklen_t tolen,
+    const FsRawUdpAddress *to,
     GError **error)
 {
-  if (sendto (udpport->fd, msg, len, 0, to, tolen) != len)
+  FsRawUdpAddress mapped;
+
+  fs_rawudp_address_map (to, udpport->family, &mapped);
+
+  if (sendto (udpport->fd, msg, len, 0, &mapped.sa,
+          fs_rawudp_address_get_length (&mapped)) != len)
   {
     g_set_error (error, FS_ERROR, FS_ERROR_NETWORK,
         "Could not send STUN request: %s", g_strerror (errno));
@@ -876,56 +1381,135 @@ fs_rawudp_transmitter_udpport_sendto (UdpPort *udpport,
   return TRUE;
 }
 
+/*
+ * Connects a function that is called from the streaming thread for each
+ * STUN packet received from @from, it can return FALSE to consume the packet
+ */
 gulong
 fs_rawudp_transmitter_udpport_connect_recv (UdpPort *udpport,
-    GCallback callback,
+    const FsRawUdpAddress *from,
+    UdpPortRecvFunc func,
     gpointer user_data)
 {
-  GstPad *pad;
+  UdpPortReceiver *receiver = g_slice_new (UdpPortReceiver);
+  GList *list;
   gulong id;
 
-  pad = gst_element_get_static_pad (udpport->udpsrc, "src");
+  receiver->from = *from;
+  receiver->func = func;
+  receiver->user_data = user_data;
 
-  id = gst_pad_add_buffer_probe (pad, callback, user_data);
-
-  gst_object_unref (pad);
+  g_mutex_lock (udpport->mutex);
+  id = receiver->id = ++udpport->next_receiver_id;
+  list = g_hash_table_lookup (udpport->receivers, from);
+  list = g_list_append (list, receiver);
+  /* The key is owned by the first receiver of the list */
+  g_hash_table_replace (udpport->receivers,
+      &((UdpPortReceiver *) list->data)->from, list);
+  g_atomic_int_inc (&udpport->n_receivers);
+  g_mutex_unlock (udpport->mutex);
 
   return id;
 }
 
+static gboolean
+_find_receiver (gpointer key, gpointer value, gpointer user_data)
+{
+  GList *item;
+
+  for (item = value; item; item = g_list_next (item))
+    if (((UdpPortReceiver *) item->data)->id == *(gulong *) user_data)
+      return TRUE;
+
+  return FALSE;
+}
 
 void
 fs_rawudp_transmitter_udpport_disconnect_recv (UdpPort *udpport,
     gulong id)
 {
-  GstPad *pad = gst_element_get_static_pad (udpport->udpsrc, "src");
+  UdpPortReceiver *receiver = NULL;
+  GList *list, *item;
 
-  gst_pad_remove_buffer_probe (pad, id);
+  g_mutex_lock (udpport->mutex);
+  list = g_hash_table_find (udpport->receivers, _find_receiver, &id);
+  for (item = list; item; item = g_list_next (item))
+  {
+    if (((UdpPortReceiver *) item->data)->id == id)
+    {
+      receiver = item->data;
+      break;
+    }
+  }
 
-  gst_object_unref (pad);
+  if (receiver)
+  {
+    g_hash_table_remove (udpport->receivers, &receiver->from);
+    list = g_list_delete_link (list, item);
+    if (list)
+      g_hash_table_insert (udpport->receivers,
+          &((UdpPortReceiver *) list->data)->from, list);
+    g_slice_free (UdpPortReceiver, receiver);
+    g_atomic_int_add (&udpport->n_receivers, -1);
+  }
+  g_mutex_unlock (udpport->mutex);
+}
+
+
+gint
+fs_rawudp_transmitter_udpport_get_port (UdpPort *udpport)
+{
+  return udpport->port;
 }
 
 gboolean
-fs_rawudp_transmitter_udpport_is_pad (UdpPort *udpport,
-    GstPad *pad)
+fs_rawudp_transmitter_udpport_get_local_address (UdpPort *udpport,
+    FsRawUdpAddress *address)
 {
-  GstPad *mypad;
-  gboolean res;
+  socklen_t len = sizeof (FsRawUdpAddress);
 
-  mypad =  gst_element_get_static_pad (udpport->udpsrc, "src");
+  if (getsockname (udpport->fd, &address->sa, &len) != 0)
+    return FALSE;
 
-  res = (mypad == pad);
+  fs_rawudp_address_unmap (address);
 
-  gst_object_unref (mypad);
+  return address->sa.sa_family == AF_INET ||
+    address->sa.sa_family == AF_INET6;
+}
 
-  return res;
+/*
+ * Tells if addresses of @family can be reached from this port
+ */
+gboolean
+fs_rawudp_transmitter_udpport_accepts_family (UdpPort *udpport,
+    gint family)
+{
+  return udpport->family == family ||
+    (family == AF_INET && udpport->dual_stack);
 }
 
+FsRawUdpStunAgent *
+fs_rawudp_transmitter_get_stun_agent (FsRawUdpTransmitter *trans)
+{
+  return trans->priv->stun_agent;
+}
 
-gint
-fs_rawudp_transmitter_udpport_get_port (UdpPort *udpport)
+/*
+ * Changes every time something from the pipeline is sent to @dest, can be
+ * called from any thread
+ */
+guint
+fs_rawudp_transmitter_udpport_get_sent (UdpPort *udpport,
+    const FsRawUdpAddress *dest)
 {
-  return udpport->port;
+  return fs_rawudp_batch_sink_get_sent (
+      FS_RAWUDP_BATCH_SINK (udpport->udpsink), dest);
+}
+
+FsRawUdpKeepalive *
+fs_rawudp_transmitter_get_keepalive (FsRawUdpTransmitter *trans)
+{
+  return trans->priv->keepalive;
 }
 
 
@@ -27,6 +27,8 @@
 
 #include <gst/farsight/fs-transmitter.h>
 
+#include "fs-rawudp-address.h"
+
 #include <gst/gst.h>
 
 #ifdef G_OS_WIN32
@@ -90,6 +92,16 @@ struct _FsRawUdpTransmitter
 /* Private declaration */
 typedef struct _UdpPort UdpPort;
 
+/*
+ * Called from the streaming thread with a STUN packet received from the
+ * address it was connected for, return FALSE to drop the packet
+ */
+typedef gboolean (*UdpPortRecvFunc) (UdpPort *udpport,
+    const gchar *data,
+    guint len,
+    const FsRawUdpAddress *from,
+    gpointer user_data);
+
 GType fs_rawudp_transmitter_get_type (void);
 
 GST_DEBUG_CATEGORY_EXTERN (fs_rawudp_transmitter_debug);
@@ -113,21 +125,27 @@ void fs_rawudp_transmitter_udpport_remove_dest (UdpPort *udpport,
 gboolean fs_rawudp_transmitter_udpport_sendto (UdpPort *udpport,
     gchar *msg,
     size_t len,
-    const struct sockaddr *to,
-    socklen_t tolen,
+    const FsRawUdpAddress *to,
     GError **error);
 
 gulong fs_rawudp_transmitter_udpport_connect_recv (UdpPort *udpport,
-    GCallback callback,
+    const FsRawUdpAddress *from,
+    UdpPortRecvFunc func,
     gpointer user_data);
 void fs_rawudp_transmitter_udpport_disconnect_recv (UdpPort *udpport,
     gulong id);
 
-gboolean fs_rawudp_transmitter_udpport_is_pad (UdpPort *udpport,
-    GstPad *pad);
-
 gint fs_rawudp_transmitter_udpport_get_port (UdpPort *udpport);
 
+gboolean fs_rawudp_transmitter_udpport_get_local_address (UdpPort *udpport,
+    FsRawUdpAddress *address);
+
+gboolean fs_rawudp_transmitter_udpport_accepts_family (UdpPort *udpport,
+    gint family);
+
+guint fs_rawudp_transmitter_udpport_get_sent (UdpPort *udpport,
+    const FsRawUdpAddress *dest);
+
 
 
 G_END_DECLS
@@ -2,12 +2,6 @@
 
 #include <string.h>
 
-#ifndef G_OS_WIN32
-#include <arpa/inet.h>
-#else
-#include <winsock2.h>
-#endif
-
 /* round up to multiple of 4 */
 G_GNUC_CONST
 static guint
@@ -19,325 +13,162 @@ ceil4 (guint n)
     return n + 4 - (n % 4);
 }
 
-G_GNUC_WARN_UNUSED_RESULT
-static StunAttribute *
-stun_attribute_new (guint type)
+static guint16
+read16 (const gchar *s)
 {
-  StunAttribute *attr = g_slice_new0 (StunAttribute);
-
-  attr->type = type;
-  return attr;
+  return ((guint8) s[0] << 8) | (guint8) s[1];
 }
 
-StunAttribute *
-stun_attribute_mapped_address_new (guint32 ip, guint16 port)
+static void
+write16 (gchar *s, guint16 value)
 {
-  StunAttribute *attr = stun_attribute_new (STUN_ATTRIBUTE_MAPPED_ADDRESS);
-
-  attr->length = 8;
-  attr->address.padding = 0;
-  attr->address.af = 1;
-  attr->address.ip = ip;
-  attr->address.port = port;
-  return attr;
+  s[0] = value >> 8;
+  s[1] = value & 0xff;
 }
 
-StunAttribute *
-stun_attribute_username_new (const gchar *username)
+/*
+ * Only looks at the header, this is enough to tell STUN apart from RTP and
+ * RTCP, whose first two bits are the version
+ */
+gboolean
+stun_message_is_stun (guint length, const gchar *s)
 {
-  StunAttribute *attr;
+  guint msg_length;
 
-  attr = stun_attribute_new (STUN_ATTRIBUTE_USERNAME);
-  g_assert (strlen (username) < sizeof (attr->username));
-  attr->length = strlen (username);
-  strcpy (attr->username, username);
-  return attr;
-}
+  if (length < STUN_HEADER_LENGTH || ((guint8) s[0]) >> 6)
+    return FALSE;
 
-void
-stun_attribute_free (StunAttribute *attr)
-{
-  g_slice_free (StunAttribute, attr);
+  msg_length = read16 (s + 2);
+
+  return msg_length % 4 == 0 && msg_length <= length - STUN_HEADER_LENGTH;
 }
 
-G_GNUC_WARN_UNUSED_RESULT
-static gboolean
-_stun_attribute_unpack (StunAttribute *attr, guint length, const gchar *s)
+gboolean
+stun_message_parse (StunMessageView *msg, guint length, const gchar *s)
 {
-  guint type;
+  const gchar *pos;
+  const gchar *end;
 
-  if (length < 4)
-    /* must start with 16 bit type, 16 bit length */
+  if (!stun_message_is_stun (length, s))
     return FALSE;
 
-  type = ntohs (*(guint16 *) s);
+  end = s + STUN_HEADER_LENGTH + read16 (s + 2);
 
-  switch (type)
+  /* every attribute must fit in the message */
+  for (pos = s + STUN_HEADER_LENGTH; pos < end;
+       pos += ceil4 (4 + read16 (pos + 2)))
     {
-      case STUN_ATTRIBUTE_MAPPED_ADDRESS:
-        if (length != 12)
-          return FALSE;
-
-        attr->address.af = (guint8) s[5];
-        g_assert (attr->address.af == 1);
-        attr->address.port = ntohs (*(guint16 *)(s + 6));
-        attr->address.ip = ntohl (*(guint32 *)(s + 8));
-        break;
-
-      case STUN_ATTRIBUTE_USERNAME:
-      case STUN_ATTRIBUTE_PASSWORD:
-        if (length - 4 > sizeof (attr->username) / sizeof (gchar))
-          return FALSE;
-
-        attr->length = length - 4;
-
-        if (type == STUN_ATTRIBUTE_USERNAME)
-          memcpy (attr->username, s + 4, attr->length);
-        else
-          memcpy (attr->password, s + 4, attr->length);
-        break;
-
-      default:
-        /* unknown attribute; we can only unpack the type */
-        break;
+      if ((guint) (end - pos) < 4 ||
+          (guint) (end - pos) < ceil4 (4 + read16 (pos + 2)))
+        return FALSE;
     }
 
-  attr->type = type;
+  msg->data = s;
+  msg->length = end - s;
   return TRUE;
 }
 
-StunAttribute *
-stun_attribute_unpack (guint length, const gchar *s)
-{
-  StunAttribute *attr;
-
-  attr = stun_attribute_new (0);
-
-  if (_stun_attribute_unpack (attr, length, s))
-    return attr;
-
-  stun_attribute_free (attr);
-  return NULL;
-}
-
-guint
-stun_attribute_pack (StunAttribute *attr, gchar **packed)
+guint16
+stun_message_view_get_type (const StunMessageView *msg)
 {
-  switch (attr->type)
-    {
-      case STUN_ATTRIBUTE_MAPPED_ADDRESS:
-        {
-          if (packed != NULL)
-            {
-              StunAttribute *ret = g_malloc0 (sizeof (StunAttribute));
-
-              ret->type = htons (attr->type);
-              ret->length = htons (8);
-              ret->address.af = attr->address.af;
-              ret->address.port = htons (attr->address.port);
-              ret->address.ip = htonl (attr->address.ip);
-              *packed = (gchar *) ret;
-            }
-
-          return 12;
-        }
-
-      case STUN_ATTRIBUTE_USERNAME:
-        {
-          if (packed != NULL)
-            {
-              StunAttribute *ret = g_malloc0 (sizeof (StunAttribute));
-
-              ret->type = htons (attr->type);
-              ret->length = htons (attr->length);
-              memcpy (ret->username, attr->username, attr->length);
-              *packed = (gchar *) ret;
-            }
-
-          return ceil4 (4 + attr->length);
-        }
-
-      default:
-        return 0;
-  }
+  return read16 (msg->data);
 }
 
-gchar *
-stun_attribute_dump (StunAttribute *attr)
+const gchar *
+stun_message_view_get_transaction_id (const StunMessageView *msg)
 {
-  switch (attr->type)
-    {
-      case STUN_ATTRIBUTE_MAPPED_ADDRESS:
-        return g_strdup_printf (
-          "MAPPED-ADDRESS %d.%d.%d.%d:%d",
-            (attr->address.ip & 0xff000000) >> 24,
-            (attr->address.ip & 0x00ff0000) >> 16,
-            (attr->address.ip & 0x0000ff00) >>  8,
-            (attr->address.ip & 0x000000ff) >>  0,
-            attr->address.port);
-      case STUN_ATTRIBUTE_USERNAME:
-        return g_strdup_printf (
-          "USERNAME \"%*s\"", attr->length, attr->username);
-      default:
-        return g_strdup_printf ("UNKNOWN (%d)", attr->type);
-    }
+  return msg->data + 4;
 }
 
 void
-stun_message_init (StunMessage *msg, guint type, const gchar *id)
+stun_attribute_iter_init (StunAttributeIter *iter, const StunMessageView *msg)
 {
-  msg->type = type;
-
-  if (id != NULL)
-    memcpy (msg->transaction_id, id, 16);
-}
-
-StunMessage *
-stun_message_new (guint type, const gchar *id, guint n_attributes)
-{
-  StunMessage *msg = g_slice_new0 (StunMessage);
-
-  stun_message_init (msg, type, id);
-
-  if (n_attributes != 0)
-    msg->attributes = g_malloc0 (
-        (n_attributes + 1) * sizeof (StunAttribute *));
-
-  return msg;
+  iter->pos = msg->data + STUN_HEADER_LENGTH;
+  iter->end = msg->data + msg->length;
 }
 
-void
-stun_message_free (StunMessage *msg)
+/*
+ * Returns FALSE when there are no attributes left, @value points to the
+ * @length bytes of the attribute, after its header
+ */
+gboolean
+stun_attribute_iter_next (StunAttributeIter *iter, guint16 *type,
+    guint16 *length, const gchar **value)
 {
-  StunAttribute **attr;
+  if (iter->pos >= iter->end)
+    return FALSE;
 
-  if (msg->attributes)
-    {
-      for (attr = msg->attributes; *attr; attr++)
-        stun_attribute_free (*attr);
+  *type = read16 (iter->pos);
+  *length = read16 (iter->pos + 2);
+  *value = iter->pos + 4;
 
-      g_free (msg->attributes);
-    }
-
-  g_slice_free (StunMessage, msg);
+  iter->pos += ceil4 (4 + *length);
+  return TRUE;
 }
 
-StunMessage *
-stun_message_unpack (guint length, const gchar *s)
+/*
+ * Reads a MAPPED-ADDRESS or XOR-MAPPED-ADDRESS attribute of either family.
+ * @ip must have room for 16 bytes, it gets the address in network order,
+ * 4 bytes for STUN_ADDRESS_FAMILY_IPV4 and 16 for STUN_ADDRESS_FAMILY_IPV6.
+ * The XOR variants are undone with the header of @msg.
+ */
+gboolean
+stun_attribute_read_mapped_address (const StunMessageView *msg, guint16 type,
+    guint16 length, const gchar *value, guint *family, guint8 *ip,
+    guint16 *port)
 {
-  guint attr_length;
-  guint n_attributes = 0;
+  gboolean xor;
+  guint addr_length;
   guint i;
-  guint offset;
-  StunAttribute *attr;
-  StunMessage *msg;
-
-  /* message header is 20 bytes */
-
-  if (length < 20)
-    return NULL;
 
-  /* count the number of attributes */
+  if (type == STUN_ATTRIBUTE_MAPPED_ADDRESS)
+    xor = FALSE;
+  else if (type == STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS ||
+      type == STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS_RFC5389)
+    xor = TRUE;
+  else
+    return FALSE;
 
-  for (offset = 20; offset < length; offset += attr_length)
-    {
-      attr_length = ceil4 (4 + ntohs (*(guint16 *)(s + offset + 2)));
-      n_attributes++;
-    }
+  if (length < 4)
+    return FALSE;
 
-  /* create message structure */
+  if (value[1] == STUN_ADDRESS_FAMILY_IPV4)
+    addr_length = 4;
+  else if (value[1] == STUN_ADDRESS_FAMILY_IPV6)
+    addr_length = 16;
+  else
+    return FALSE;
 
-  msg = stun_message_new (ntohs (*(guint16 *) s), s + 4, n_attributes);
+  if (length < 4 + addr_length)
+    return FALSE;
 
-  /* unpack attributes */
+  *family = value[1];
+  *port = read16 (value + 2);
+  memcpy (ip, value + 4, addr_length);
 
-  for (i = 0, offset = 20; i < n_attributes; i++, offset += attr_length)
+  if (xor)
     {
-      attr_length = 4 + ntohs (*(guint16 *)(s + offset + 2));
-      attr = msg->attributes[i] = stun_attribute_unpack (attr_length,
-          s + offset);
-      attr_length = ceil4 (attr_length);
+      /* the cookie then the rest of the transaction id */
+      *port ^= STUN_MAGIC_COOKIE >> 16;
+      for (i = 0; i < addr_length; i++)
+        ip[i] ^= msg->data[4 + i];
     }
 
-  return msg;
+  return TRUE;
 }
 
+/*
+ * Writes a message without attributes in @buf, returns its length or 0 if
+ * @size is too small
+ */
 guint
-stun_message_pack (StunMessage *msg, gchar **packed)
-{
-  gchar *tmp;
-  guint length = 0;
-
-  if (msg->attributes)
-    {
-      StunAttribute **attr;
-
-      for (attr = msg->attributes; *attr; attr++)
-        length += stun_attribute_pack (*attr, NULL);
-    }
-
-  g_assert (length % 4 == 0);
-  tmp = g_malloc0 (length + 20);
-  *(guint16 *) (tmp + 0) = htons (msg->type);
-  *(guint16 *) (tmp + 2) = htons (length);
-  memcpy (tmp + 4, msg->transaction_id, 16);
-
-  if (msg->attributes)
-    {
-      StunAttribute **attr;
-      gchar *pos = tmp + 20;
-
-      for (attr = msg->attributes; *attr; attr++)
-        {
-          gchar *attr_packed;
-          guint attr_length = stun_attribute_pack (*attr, &attr_packed);
-          memcpy (pos, attr_packed, attr_length);
-          g_free (attr_packed);
-          pos += attr_length;
-        }
-    }
-
-  *packed = tmp;
-  return length + 20;
-}
-
-gchar *
-stun_message_dump (StunMessage *msg)
+stun_message_write (gchar *buf, guint size, guint type, const gchar *id)
 {
-  StunAttribute **attr;
-  GString *tmp = g_string_new ("");
-  const gchar *name;
+  if (size < STUN_HEADER_LENGTH)
+    return 0;
 
-  switch (msg->type) {
-    case STUN_MESSAGE_BINDING_REQUEST:
-      name = "BINDING-REQUEST";
-      break;
-    case STUN_MESSAGE_BINDING_RESPONSE:
-      name = "BINDING-RESPONSE";
-      break;
-    case STUN_MESSAGE_BINDING_ERROR_RESPONSE:
-      name = "BINDING-ERROR-RESPONSE";
-      break;
-    default:
-      name = "(UNKNOWN)";
-  }
-
-  g_string_printf (tmp,
-    "%s %08x:%08x:%08x:%08x\n",
-      name,
-      ntohl (*(guint32 *)(msg->transaction_id)),
-      ntohl (*(guint32 *)(msg->transaction_id + 4)),
-      ntohl (*(guint32 *)(msg->transaction_id + 8)),
-      ntohl (*(guint32 *)(msg->transaction_id + 12)));
-
-  if (msg->attributes)
-    for (attr = msg->attributes; *attr; attr++)
-      {
-          gchar *dump = stun_attribute_dump (*attr);
-          g_string_append_printf (tmp, "  %s\n", dump);
-          g_free (dump);
-      }
-
-  return g_string_free (tmp, FALSE);
+  write16 (buf, type);
+  write16 (buf + 2, 0);
+  memcpy (buf + 4, id, 16);
+  return STUN_HEADER_LENGTH;
 }
-
@@ -9,6 +9,7 @@ G_BEGIN_DECLS
 typedef enum
 {
   STUN_MESSAGE_BINDING_REQUEST              = 0x001,
+  STUN_MESSAGE_BINDING_INDICATION           = 0x011,
   STUN_MESSAGE_BINDING_RESPONSE             = 0x101,
   STUN_MESSAGE_BINDING_ERROR_RESPONSE       = 0x111,
   STUN_MESSAGE_SHARED_SECRET_REQUEST        = 0x002,
@@ -46,6 +47,7 @@ typedef enum
   STUN_ATTRIBUTE_REQUESTED_TRANSPORT  = 0x0019, //   c
   STUN_ATTRIBUTE_REQUESTED_IP         = 0x0022, //   c
   STUN_ATTRIBUTE_TIMER_VAL            = 0x0021, //   c
+  STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS_RFC5389 = 0x0020, // RFC 5389
   // optional parameters (> 0x7fff)
   STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS   = 0x8020, //  b
   STUN_ATTRIBUTE_FINGERPRINT          = 0x8023, //  b
@@ -54,74 +56,62 @@ typedef enum
   STUN_ATTRIBUTE_REFRESH_INTERVAL     = 0x8024, //  b
 } StunAttributeType;
 
-typedef struct _StunAttribute StunAttribute;
-
-struct _StunAttribute {
-  guint16 type;
-  guint16 length;
-  union {
-    struct {
-      guint8 padding;
-      guint8 af;
-      guint16 port;
-      guint32 ip;
-    } address;
-    gchar username[128];
-    gchar password[128];
-  };
-};
+/* The codec works directly on the packet and never allocates, the
+ * StunMessageView and the iterator point into the buffer and are valid as
+ * long as it is */
 
-typedef struct _StunMessage StunMessage;
+#define STUN_HEADER_LENGTH 20
 
-struct _StunMessage {
-  guint16 type;
-  gchar transaction_id[16];
-  StunAttribute **attributes;
-};
+/* RFC 5389 puts it in the first 4 bytes of the transaction id, it is also
+ * what the XOR-MAPPED-ADDRESS attributes are xored with */
+#define STUN_MAGIC_COOKIE 0x2112A442
 
-G_GNUC_WARN_UNUSED_RESULT
-StunAttribute *
-stun_attribute_mapped_address_new (guint32 ip_address, guint16 port);
+#define STUN_ADDRESS_FAMILY_IPV4 1
+#define STUN_ADDRESS_FAMILY_IPV6 2
 
-StunAttribute *
-stun_attribute_username_new (const gchar *username);
+typedef struct _StunMessageView StunMessageView;
 
-void
-stun_attribute_free (StunAttribute *attr);
+struct _StunMessageView {
+  const gchar *data;
+  /* The header and the attributes, may be less than the packet */
+  guint length;
+};
 
-G_GNUC_WARN_UNUSED_RESULT
-guint
-stun_attribute_pack (StunAttribute *attr, gchar **ret);
+typedef struct _StunAttributeIter StunAttributeIter;
 
-G_GNUC_WARN_UNUSED_RESULT
-gchar *
-stun_attribute_dump (StunAttribute *attr);
+struct _StunAttributeIter {
+  const gchar *pos;
+  const gchar *end;
+};
+
+gboolean
+stun_message_is_stun (guint length, const gchar *s);
 
 G_GNUC_WARN_UNUSED_RESULT
-StunAttribute *
-stun_attribute_unpack (guint length, const gchar *s);
+gboolean
+stun_message_parse (StunMessageView *msg, guint length, const gchar *s);
 
-void
-stun_message_init (StunMessage *msg, guint type, const gchar *id);
+guint16
+stun_message_view_get_type (const StunMessageView *msg);
 
-G_GNUC_WARN_UNUSED_RESULT
-StunMessage *
-stun_message_new (guint type, const gchar *id, guint n_attributes);
+const gchar *
+stun_message_view_get_transaction_id (const StunMessageView *msg);
 
 void
-stun_message_free (StunMessage *msg);
-G_GNUC_WARN_UNUSED_RESULT
+stun_attribute_iter_init (StunAttributeIter *iter, const StunMessageView *msg);
 
-guint
-stun_message_pack (StunMessage *msg, gchar **packed);
-G_GNUC_WARN_UNUSED_RESULT
+gboolean
+stun_attribute_iter_next (StunAttributeIter *iter, guint16 *type,
+    guint16 *length, const gchar **value);
 
-gchar *
-stun_message_dump (StunMessage *msg);
 G_GNUC_WARN_UNUSED_RESULT
+gboolean
+stun_attribute_read_mapped_address (const StunMessageView *msg, guint16 type,
+    guint16 length, const gchar *value, guint *family, guint8 *ip,
+    guint16 *port);
 
-StunMessage *
-stun_message_unpack (guint length, const gchar *s);
+guint
+stun_message_write (gchar *buf, guint size, guint type, const gchar *id);
 
 G_END_DECLS
 